@@ -311,6 +311,38 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Lend the caller the block cache page that holds byte req->req_offset
+// of req->req_fileid, read-only, so that it can pass the data on (to
+// the network server, for sendfile) without copying it.  Returns the
+// number of bytes of the file in that block, or 0 past the end, and
+// the page to share in *pg_store and *perm_store.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	off_t start;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		return 0;
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	// Fault the block in, since IPC only passes mapped pages.
+	(void) *(volatile char *) blk;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	start = ROUNDDOWN(req->req_offset, BLKSIZE);
+	return MIN(BLKSIZE, o->o_file->f_size - start);
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -349,6 +381,8 @@ serve(void)
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
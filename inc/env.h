@@ -45,6 +45,18 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Scheduling classes (env_sched_class)
+enum {
+	SCHED_FAIR = 0,		// Share of CPU time weighted by nice value
+	SCHED_RT,		// Fixed priority, ahead of all SCHED_FAIR envs
+};
+
+// Ranges of env_priority for each scheduling class
+#define ENV_NICE_MIN		-20	// SCHED_FAIR: lower gets more CPU
+#define ENV_NICE_MAX		19
+#define ENV_RT_PRIO_MIN		1	// SCHED_RT: higher runs first
+#define ENV_RT_PRIO_MAX		99
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -55,11 +67,24 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
-	// Address space
+	// Scheduling (kern/sched.c)
+	int env_sched_class;		// SCHED_FAIR or SCHED_RT
+	int env_priority;		// Nice value or real-time priority
+	uint64_t env_vruntime;		// Weighted CPU time (SCHED_FAIR)
+	uint64_t env_cputime;		// CPU time used, in TSC cycles
+	uint32_t env_cpumask;		// CPUs it may run on (bit i: cpus[i])
+	uint32_t env_migrations;	// Runs started on a different CPU
+	struct Env *env_rq_next;	// Next env on the same run queue
+	struct Env **env_rq_pprev;	// Link to us; null if not queued
+	int env_rq_cpu;			// Index of the CPU whose queue we're on
+
+	// Address space; shared by all threads of an environment
+	// (the page directory's pp_ref counts them)
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -67,6 +92,19 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Timer wheel (kern/time.c)
+	unsigned int env_timer_expire;	// Tick at which to wake the env
+	struct Env *env_timer_next;	// Next env in the same wheel slot
+	struct Env **env_timer_pprev;	// Link to us; null if no timer armed
+
+	// Network card queue pair for the sys_net_* calls (kern/e1000.c)
+	int env_net_queue;
+
+	// Console output budget for sys_cputs (kern/syscall.c)
+	uint32_t env_cons_budget;	// Bytes it may print right now
+	uint32_t env_cons_msec;		// When the budget was last topped up
+	uint32_t env_cons_dropped;	// Bytes dropped since it last printed
 };
 
 #endif // !JOS_INC_ENV_H
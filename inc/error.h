@@ -15,6 +15,7 @@ enum {
 	E_FAULT		,	// Memory fault
 
 	E_IPC_NOT_RECV	,	// Attempt to send to env that is not recving
+	E_TIMEOUT	,	// Deadline passed before the wait completed
 	E_EOF		,	// Unexpected end of file
 
 	// File system error codes -- only seen in user-level
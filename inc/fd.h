@@ -21,14 +21,48 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Which of the POLL* 'events' fd is ready for, plus POLLHUP or
+	// POLLERR.  Devices without it are always ready.
+	int (*dev_poll)(struct Fd *fd, int events);
+	// If 'flags' is non-null, ask for a doorbell (see sys_ipc_wait)
+	// when fd may become ready for 'events': store the flags to wait
+	// on in flags, at most DEV_NOTIFY_MAX of them, and return how
+	// many, or -1 if the device can't ring.  If 'flags' is null,
+	// cancel that.  A flag found already clear rang or was dropped;
+	// either way it only means fd should be checked again.
+	int (*dev_notify)(struct Fd *fd, int events, volatile uint32_t **flags);
 };
 
+#define DEV_NOTIFY_MAX	2
+
+// Readiness of one file descriptor, for poll().
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
+};
+
+#define POLLIN		0x01	// A read won't block
+#define POLLOUT		0x04	// A write won't block
+#define POLLERR		0x08	// Error (revents only)
+#define POLLHUP		0x10	// Peer has closed (revents only)
+#define POLLNVAL	0x20	// fd is not open (revents only)
+
 struct FdFile {
 	int id;
 };
 
+#define FDSOCK_MAXINST	4
+
 struct FdSock {
 	int sockid;
+	int has_ring;	// Data page is a struct Nssock shared with ns
+	// A listening socket's sockets on the other network server
+	// instances, and what it was bound to (see listen)
+	int ls_ids[FDSOCK_MAXINST];
+	int ls_n;
+	uint8_t bound[16];
+	int boundlen;
 };
 
 struct Fd {
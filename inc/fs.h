@@ -70,7 +70,9 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns a read-only block cache page, like Open's Fd page
+	FSREQ_MAP
 };
 
 union Fsipc {
@@ -108,6 +110,10 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -30,10 +30,24 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// The kernel loads %gs with a segment covering the running environment's
+// own struct Env (see env_pop_tf), so thisenv is a per-environment register
+// lookup rather than a global.  Environments that share their data pages
+// (sfork) therefore each still see their own struct Env.
+static __inline const volatile struct Env *
+getthisenv(void)
+{
+	envid_t envid;
+	__asm __volatile("movl %%gs:%c1,%0"
+		: "=r" (envid)
+		: "i" (offsetof(struct Env, env_id)));
+	return &envs[ENVX(envid)];
+}
+#define thisenv (getthisenv())
+
 // exit.c
 void	exit(void);
 
@@ -62,6 +76,22 @@ int	sys_ipc_recv(void *rcv_pg);
 unsigned int sys_time_msec(void);
 int sys_net_try_send(char *data, int len);
 int sys_net_try_recv(char *data, int *len);
+int	sys_net_wait_recv(void);
+int	sys_net_send_frags(const struct net_frag *frags, int nfrags, int *ndone);
+int	sys_net_recv_batch(void *va, int npages);
+int	sys_net_stats(struct net_hwstats *st);
+int	sys_net_set_queue(int q);
+int	sys_net_bypass(int qn, struct net_bypass *nb);
+int	sys_net_wait_send(void);
+envid_t	sys_thread_create(void *eip, void *esp, void *xstacktop);
+uint64_t sys_time_nsec(void);
+int	sys_env_set_priority(envid_t env, int sched_class, int priority);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
+int	sys_ncpu(void);
+int	sys_sleep_until(unsigned int msec);
+int	sys_ipc_recv_until(void *rcv_pg, unsigned int msec);
+int	sys_ipc_wait(volatile uint32_t *const *flags, int nflags, int timeout);
+int	sys_ipc_ring(envid_t to_env, volatile uint32_t *flag);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -79,18 +109,41 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+		       unsigned int msec);
 envid_t	ipc_find_env(enum EnvType type);
 
+// netbypass.c
+int	netbypass_attach(int qn);
+bool	netbypass_attached(void);
+struct jif_pkt *netbypass_recv(void);
+void	netbypass_recv_done(void);
+void	*netbypass_tx_buf(void);
+void	netbypass_send(int len);
+void	netbypass_flush(void);
+
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void);
+
+// sthread.c
+struct smutex {
+	volatile uint32_t sm_locked;
+};
+int	sthread_create(envid_t *tid, void *(*fn)(void *), void *arg);
+int	sthread_join(envid_t tid, void **retval);
+void	sthread_exit(void *retval) __attribute__((noreturn));
+void	*sthread_pftemp(void);
+void	smutex_lock(struct smutex *m);
+void	smutex_unlock(struct smutex *m);
 
 // fd.c
 int	close(int fd);
 ssize_t	read(int fd, void *buf, size_t nbytes);
 ssize_t	write(int fd, const void *buf, size_t nbytes);
 int	seek(int fd, off_t offset);
+int	poll(struct pollfd *fds, int nfds, int timeout);
 void	close_all(void);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
@@ -102,6 +155,7 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	file_map_page(int fd, off_t offset, void *dstva);
 
 // pageref.c
 int	pageref(void *addr);
@@ -113,6 +167,7 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+ssize_t sendfile(int sockfd, int filefd, off_t offset, size_t len);
 
 // nsipc.c
 int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
@@ -123,7 +178,12 @@ int     nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
-int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_socket(int inst, int domain, int type, int protocol);
+int     nsipc_ninst(void);
+int     nsipc_ring(int s, struct Nssock *ring);
+void    nsipc_kick(int s);
+int     nsipc_sendpage(int s, struct Nssock *ring, void *pg, int off, int len);
+int     nsipc_stats(int skip, union Nsipc *ret);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
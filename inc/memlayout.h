@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_UENV0  0x68     // Per-env user segment for CPU 0 (after NCPU TSSs)
 
 /*
  * Virtual memory map:                                Permissions
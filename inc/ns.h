@@ -5,6 +5,7 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
 #include <lwip/sockets.h>
 
 struct jif_pkt {
@@ -12,6 +13,179 @@ struct jif_pkt {
 	char jp_data[0];
 };
 
+// Several frames can share one page, such as an NSREQ_INPUT or
+// NSREQ_OUTPUT page: each struct jif_pkt is followed by the next at a
+// 4-byte boundary, up to a zero jp_len or the end of the page.
+#define JIF_PKT_SPACE(len)	ROUNDUP(sizeof(struct jif_pkt) + (len), 4)
+
+// Return the frame after 'pkt' in the page at 'pg', or null if none.
+static __inline struct jif_pkt *
+jif_pkt_next(void *pg, struct jif_pkt *pkt)
+{
+	uintptr_t next = (uintptr_t) pkt + JIF_PKT_SPACE(pkt->jp_len);
+	uintptr_t end = (uintptr_t) pg + PGSIZE;
+
+	pkt = (struct jif_pkt *) next;
+	if (next + sizeof(*pkt) > end || pkt->jp_len <= 0
+	    || next + JIF_PKT_SPACE(pkt->jp_len) > end)
+		return 0;
+	return pkt;
+}
+
+// A piece of an outgoing frame, for sys_net_send_frags.  A batch may
+// have up to NET_BATCH_FRAGS pieces, and each frame in it up to
+// NET_MAX_FRAGS.
+struct net_frag {
+	const void *nf_data;
+	int nf_len;
+	int nf_flags;
+};
+
+#define NET_FRAG_EOP	0x1	// Last piece of a frame
+
+// Offloads, set in the flags of a frame's first piece, which must hold
+// all of its headers.  For checksum offload of an IPv4 frame, the card
+// fills in the IP header checksum and, for TCP or UDP, the transport
+// checksum, which the sender must seed with the pseudo-header sum.
+// For segmentation, the card splits a TCP frame of up to NET_TSO_MAX
+// bytes into segments of NET_FRAG_MSS bytes of payload, each with
+// fixed-up headers and checksums; the seed then leaves out the length.
+#define NET_FRAG_CSUM	0x2	// Fill in checksums
+#define NET_FRAG_TSO	0x4	// Segment TCP (implies NET_FRAG_CSUM)
+#define NET_FRAG_MSS(mss)	((mss) << 16)
+
+#define NET_TSO_MAX	16384	// Longest frame with NET_FRAG_TSO
+
+#define NET_MAX_FRAGS	16
+#define NET_BATCH_FRAGS	64
+
+// Most transmit/receive queue pairs a card has (sys_net_set_queue).
+#define NET_MAXQUEUES	2
+
+// With several queue pairs, the card hashes each received TCP/IPv4
+// frame's addresses and ports with this key (Microsoft's sample RSS
+// key, as the 82574L's datasheet suggests) and the hash picks the pair,
+// as net_rss_queue says.  Everything else arrives on pair 0.  Written
+// as the card's key registers take it: byte 0 is the low byte of the
+// first word.
+#define NET_RSS_KEY { \
+	0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0, \
+	0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe, \
+}
+
+// The hash the card computes for a TCP/IPv4 frame from saddr:sport to
+// daddr:dport (all in network byte order).
+static __inline uint32_t
+net_rss_hash(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport)
+{
+	static const uint32_t key[10] = NET_RSS_KEY;
+	struct {
+		uint32_t saddr, daddr;
+		uint16_t sport, dport;
+	} __attribute__((packed)) t = { saddr, daddr, sport, dport };
+	const uint8_t *in = (const uint8_t *) &t;
+	uint32_t hash = 0, window;
+	int i, bit, next = 4;
+
+	// The 32 key bits lined up with each input bit, in a window
+	// that slides along the key a bit at a time.
+	for (window = 0, i = 0; i < 4; i++)
+		window = (window << 8) | ((key[i / 4] >> (i % 4 * 8)) & 0xff);
+	for (i = 0; i < 12; i++, next++) {
+		uint8_t kb = (key[next / 4] >> (next % 4 * 8)) & 0xff;
+
+		for (bit = 7; bit >= 0; bit--) {
+			if (in[i] & (1 << bit))
+				hash ^= window;
+			window = (window << 1) | ((kb >> bit) & 1);
+		}
+	}
+	return hash;
+}
+
+// The queue pair a frame with RSS hash 'hash' goes to, on a card with
+// nqueues pairs: the card's redirection table deals its 128 entries out
+// to the pairs in turn.
+static __inline int
+net_rss_queue(uint32_t hash, int nqueues)
+{
+	return (hash & 127) % nqueues;
+}
+
+// A queue pair handed to a user-level driver with sys_net_bypass.  The
+// rings share one page, transmit ring first; the driver's buffers are
+// its own pages, which stay pinned while the card may use them.
+#define NET_BYPASS_TXDESC	128
+#define NET_BYPASS_RXDESC	128
+#define NET_BYPASS_NBUFS	(NET_BYPASS_RXDESC + NET_BYPASS_TXDESC / 2)
+#define NET_BYPASS_TXBUF	2048	// Largest frame netbypass_send takes
+
+// The card's legacy transmit descriptor.
+struct net_txdesc {
+	uint64_t td_addr;
+	uint32_t td_cmd;	// Length, and NET_TXD_* command bits
+	uint32_t td_status;	// NET_TXD_DD once sent
+};
+
+#define NET_TXD_EOP	0x01000000	// End of packet
+#define NET_TXD_RS	0x08000000	// Report status
+#define NET_TXD_DD	0x00000001	// Descriptor done
+
+// A receive descriptor as the driver fills it in (rd_addr, rest zero)
+// and, after the card writes it back, in the legacy layout or, where
+// nb_rx_extended is set, the extended one.
+union net_rxdesc {
+	struct {
+		uint64_t rd_addr;
+		uint64_t rd_zero;
+	} rd;
+	struct {
+		uint64_t rl_addr;
+		uint16_t rl_len;
+		uint16_t rl_csum;
+		uint8_t rl_status;	// NET_RXD_*
+		uint8_t rl_errors;
+		uint16_t rl_special;
+	} rl;
+	struct {
+		uint32_t rx_mrq;
+		uint32_t rx_rss;	// RSS hash
+		uint32_t rx_status;	// NET_RXD_*, and errors
+		uint16_t rx_len;
+		uint16_t rx_vlan;
+	} rx;
+};
+
+#define NET_RXD_DD	0x01	// Descriptor done
+#define NET_RXD_EOP	0x02	// End of packet
+
+struct net_bypass {
+	// Set by the caller: where to map the pair's tail registers
+	// (two pages) and its rings (one page), and NET_BYPASS_NBUFS
+	// pages the caller has mapped to pin as buffers.
+	void *nb_regs;
+	void *nb_ring;
+	void *nb_bufs;
+	// Set by the kernel.
+	volatile uint32_t *nb_rdt, *nb_tdt;	// In nb_regs
+	struct net_txdesc *nb_tx;		// In nb_ring
+	union net_rxdesc *nb_rx;
+	int nb_rx_extended;
+	uint32_t nb_pa[NET_BYPASS_NBUFS];	// Physical address of each buffer
+};
+
+// The card's statistics since boot (sys_net_stats).
+struct net_hwstats {
+	uint64_t hw_rx_packets;	// Good packets received (GPRC)
+	uint64_t hw_tx_packets;	// Good packets sent (GPTC)
+	uint64_t hw_rx_octets;	// ... and their bytes (GORC, GOTC)
+	uint64_t hw_tx_octets;
+	uint64_t hw_rx_missed;	// Dropped with the receive FIFO full (MPC)
+	uint64_t hw_rx_nobuf;	// Found no free receive descriptor (RNBC)
+	uint64_t hw_rx_crcerr;	// Bad CRC (CRCERRS)
+	uint64_t hw_rx_errors;	// Any receive error (RXERRC)
+};
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -27,16 +201,161 @@ enum {
 	NSREQ_SEND,
 	NSREQ_SOCKET,
 
+	// Ring passes the socket's struct Nssock page instead, for the
+	// server to map.
+	NSREQ_RING,
+	// Sendpage passes a page of data to send on a socket with a ring,
+	// without copying it; see NSREQ_SENDPAGE_ON.
+	NSREQ_SENDPAGE,
+	// Stats returns a Nsret_stats on the request page.
+	NSREQ_STATS,
+
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
 	// network server, to the output environment
 	NSREQ_OUTPUT,
 
-	// The following message passes no page
+	// The following messages pass no page
 	NSREQ_TIMER,
+	// A client has written to a socket ring, or made room in one, that
+	// the server was waiting on (see NSREQ_KICK_ON), or (NS_BYPASS) the
+	// card has received frames for the server to poll.  There is no
+	// reply.
+	NSREQ_KICK,
+};
+
+// One direction of a connected socket's shared data path.  The writer
+// copies data in at nr_wpos and the reader out at nr_rpos, each
+// advancing only its own position after the copy; the ring is empty when
+// they are equal.  A side that runs out of data or room sets its wait
+// flag and blocks; the other side, after making progress, takes the
+// flag with xchg and rings the doorbell: an NSREQ_KICK_ON the socket to
+// the server.  The server rings nr_waiter's with sys_ipc_ring instead,
+// which the client waits for with sys_ipc_wait, so that the server never
+// blocks on a client.
+#define NSRING_BUFSIZ	2008
+
+struct nsring {
+	volatile uint32_t nr_rpos;	// Next byte to read
+	volatile uint32_t nr_wpos;	// Next byte to write
+	volatile uint32_t nr_rwait;	// Reader waits for data
+	volatile uint32_t nr_wwait;	// Writer waits for room
+	volatile envid_t nr_waiter;	// The client that is waiting
+	volatile int32_t nr_done;	// Server saw EOF or an error
+	volatile int32_t nr_err;	// ... and this result (0 for EOF)
+	uint8_t nr_buf[NSRING_BUFSIZ];
 };
 
+// The data page of a connected socket's file descriptor, shared with
+// the network server (see NSREQ_RING).  The client writes ns_tx and
+// reads ns_rx; the server does the opposite.  A listening socket has
+// one too, without data, shared with each server instance it listens
+// on: the instance driving queue pair q sets ns_acceptable[q] when
+// accept there won't block, and rings ns_rx's reader.
+struct Nssock {
+	int ns_sockid;
+	int ns_listen;		// Set by the client for a listening socket
+	volatile uint32_t ns_acceptable[NET_MAXQUEUES];
+	int ns_sp_off;		// Where in the NSREQ_SENDPAGE page to send
+	int ns_sp_len;		// ... and how many bytes
+	struct nsring ns_tx;
+	struct nsring ns_rx;
+};
+
+// A client's socket id names the network server instance that has the
+// socket (by the queue pair it drives) as well as its number there.
+#define NSSOCK(inst, s)		(((inst) << 16) | (s))
+#define NSSOCK_INST(id)		((id) >> 16)
+#define NSSOCK_NUM(id)		((id) & 0xffff)
+
+// The IPC value of an NSREQ_SENDPAGE for socket s, whose struct Nssock
+// holds the rest of the request.
+#define NSREQ_SENDPAGE_ON(s)	(NSREQ_SENDPAGE | ((s) << 8))
+// The IPC value of an NSREQ_KICK for the ring of socket s; a bare
+// NSREQ_KICK names no socket.
+#define NSREQ_KICK_ON(s)	(NSREQ_KICK | (((s) + 1) << 8))
+#define NSREQ_TYPE(req)		((req) & 0xff)
+
+// Bytes waiting in ring r.
+static __inline uint32_t
+nsring_used(struct nsring *r)
+{
+	return (r->nr_wpos + NSRING_BUFSIZ - r->nr_rpos) % NSRING_BUFSIZ;
+}
+
+// Bytes that can be read from r in one piece, starting at nr_rpos.
+static __inline uint32_t
+nsring_rspan(struct nsring *r)
+{
+	uint32_t rpos = r->nr_rpos, wpos = r->nr_wpos;
+
+	return wpos >= rpos ? wpos - rpos : NSRING_BUFSIZ - rpos;
+}
+
+// Bytes that can be written to r in one piece, starting at nr_wpos.
+// One byte stays free, so that a full ring isn't taken for empty.
+static __inline uint32_t
+nsring_wspan(struct nsring *r)
+{
+	uint32_t rpos = r->nr_rpos, wpos = r->nr_wpos;
+
+	if (rpos > wpos)
+		return rpos - wpos - 1;
+	return NSRING_BUFSIZ - wpos - (rpos == 0);
+}
+
+// NSREQ_STATS: counters of the network server, of lwIP and of the
+// card, and the TCP connections from req_skip on, as many as fit.
+struct Nsstat_proto {
+	uint32_t ps_xmit, ps_recv, ps_drop;
+	uint32_t ps_chkerr, ps_lenerr, ps_memerr, ps_rterr, ps_proterr, ps_err;
+};
+
+struct Nsstat_pool {
+	char np_name[16];
+	uint32_t np_avail;	// Size of the pool
+	uint32_t np_used, np_max;
+	uint32_t np_err;	// Allocations that failed
+};
+
+struct Nsstat_conn {
+	uint32_t nc_laddr, nc_raddr;	// Network byte order
+	uint16_t nc_lport, nc_rport;
+	uint8_t nc_state;		// lwIP's enum tcp_state
+	uint8_t nc_pad;
+	uint16_t nc_snd_queuelen;	// pbufs queued to send
+	uint32_t nc_unacked;		// Bytes in flight
+	uint32_t nc_ooseq;		// Segments held out of order
+	uint32_t nc_snd_wnd, nc_rcv_wnd, nc_cwnd, nc_ssthresh;
+	uint32_t nc_srtt_ms, nc_rto_ms;
+	// Zero unless lwIP has TCP_PCB_STATS
+	uint32_t nc_segs_in, nc_segs_out, nc_bytes_in, nc_bytes_acked;
+	uint32_t nc_rexmit, nc_rto, nc_fast_rexmit, nc_dupacks, nc_ooseq_in;
+};
+
+#define NSSTAT_PROTOS	6	// Link, ARP, IP, ICMP, UDP, TCP
+#define NSSTAT_POOLS	16
+
+struct Nsret_stats {
+	// The server
+	uint32_t ret_requests;		// Requests taken
+	uint32_t ret_shed;		// ... turned away for lack of buffers
+	uint32_t ret_queued, ret_queued_max;	// Waiting for a worker
+	uint32_t ret_workers;
+	struct net_hwstats ret_hw;
+	struct Nsstat_proto ret_proto[NSSTAT_PROTOS];
+	uint32_t ret_heap_used, ret_heap_max, ret_heap_err;
+	int ret_npools;
+	struct Nsstat_pool ret_pool[NSSTAT_POOLS];
+	int ret_nconn;			// Connections in all
+	int ret_nfilled;		// ... in ret_conn
+	struct Nsstat_conn ret_conn[0];
+};
+
+#define NSSTAT_MAXCONN \
+	((PGSIZE - sizeof(struct Nsret_stats)) / sizeof(struct Nsstat_conn))
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -97,6 +416,12 @@ union Nsipc {
 		int req_protocol;
 	} socket;
 
+	struct Nsreq_stats {
+		int req_skip;
+	} stats;
+
+	struct Nsret_stats statsRet;
+
 	struct jif_pkt pkt;
 
 	// Ensure Nsipc is one page
@@ -20,6 +20,22 @@ enum {
 	SYS_time_msec,
 	SYS_net_try_send,
 	SYS_net_try_recv,
+	SYS_thread_create,
+	SYS_sleep_until,
+	SYS_ipc_recv_until,
+	SYS_time_nsec,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_net_wait_recv,
+	SYS_net_send_frags,
+	SYS_net_wait_send,
+	SYS_net_recv_batch,
+	SYS_net_stats,
+	SYS_net_set_queue,
+	SYS_net_bypass,
+	SYS_ipc_wait,
+	SYS_ipc_ring,
+	SYS_ncpu,
 	NSYSCALLS
 };
 
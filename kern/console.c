@@ -8,9 +8,12 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
+static void cons_drain(bool wait);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -32,8 +35,13 @@ delay(void)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define   COM_IIR_FIFO	0xC0	//   FIFOs enabled
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE 0x01	//   Enable the FIFOs
+#define   COM_FCR_CLEAR	0x06	//   Clear both FIFOs
+#define COM_FIFOSIZE	16	// Characters a 16550's transmit FIFO holds
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -47,6 +55,8 @@ delay(void)
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
 static bool serial_exists;
+static int serial_txfifo;	// Characters the UART takes once idle
+static bool serial_txi;		// Transmitter interrupt enabled
 
 static int
 serial_proc_data(void)
@@ -56,11 +66,15 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Receive what has arrived, and send what the console rings hold
+// now that the UART has room.
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	if (serial_exists) {
 		cons_intr(serial_proc_data);
+		cons_drain(0);
+	}
 }
 
 static void
@@ -76,11 +90,24 @@ serial_putc(int c)
 	outb(COM1 + COM_TX, c);
 }
 
+// Interrupt when the UART can take more output, or stop.
+static void
+serial_set_txi(bool on)
+{
+	if (serial_txi != on) {
+		serial_txi = on;
+		outb(COM1+COM_IER, COM_IER_RDI | (on ? COM_IER_TXI : 0));
+	}
+}
+
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on the FIFOs, so each transmitter interrupt can send a
+	// burst; an old 8250 has none.
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_CLEAR);
+	serial_txfifo = (inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO
+		? COM_FIFOSIZE : 1;
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -440,6 +467,155 @@ cons_putc(int c)
 	cga_putc(c);
 }
 
+
+/***** Console output buffering *****/
+// cputchar doesn't wait for the devices.  Each CPU appends to its own
+// ring, which only that CPU writes, and whoever holds cons_lock moves
+// characters from the rings to the devices as fast as the UART takes
+// them: the CPU that printed, if the UART is idle, and otherwise the
+// serial interrupt once the UART has room.  A CPU that fills its ring
+// waits for the devices itself.  Lines from different CPUs are kept
+// whole where they can be.
+//
+// Everything that reaches the devices is also kept in cons_log, for
+// the monitor's dmesg.  After a panic, output is synchronous again.
+
+#define CONS_RINGSIZE	4096	// Per CPU; a power of two
+#define CONS_LOGSIZE	16384	// A power of two
+
+// Order the ring's contents and its positions.
+#define barrier()	asm volatile("" : : : "memory")
+
+struct cons_ring {
+	uint8_t buf[CONS_RINGSIZE];
+	volatile uint32_t rpos;		// Advanced by the drainer
+	volatile uint32_t wpos;		// Advanced by the CPU
+};
+
+static struct cons_ring cons_rings[NCPU];
+static int cons_cur;			// Ring being drained
+static bool cons_sync;			// Bypass the rings (after a panic)
+
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock"
+#endif
+};
+
+static struct {
+	uint8_t buf[CONS_LOGSIZE];
+	uint32_t pos;			// Characters ever logged
+} cons_log;
+
+// Send one character to the devices and the log.
+static void
+cons_out(int c, bool wait)
+{
+	cons_log.buf[cons_log.pos++ % CONS_LOGSIZE] = c;
+	if (wait || !serial_exists)
+		serial_putc(c);
+	else
+		outb(COM1 + COM_TX, c);
+	lpt_putc(c);
+	cga_putc(c);
+}
+
+// Take the next character to output from the rings, or return -1.
+static int
+cons_next(void)
+{
+	struct cons_ring *r;
+	int i, c;
+
+	for (i = 0; i < NCPU; i++) {
+		r = &cons_rings[cons_cur];
+		if (r->rpos != r->wpos) {
+			barrier();
+			c = r->buf[r->rpos % CONS_RINGSIZE];
+			barrier();
+			r->rpos++;
+			// Move on after a whole line, so no CPU hogs the
+			// console.
+			if (c == '\n')
+				cons_cur = (cons_cur + 1) % NCPU;
+			return c;
+		}
+		cons_cur = (cons_cur + 1) % NCPU;
+	}
+	return -1;
+}
+
+// Move characters from the rings to the devices: as many as the UART
+// takes without waiting, or with 'wait', all of them.  The caller
+// holds cons_lock.
+static void
+cons_drain_locked(bool wait)
+{
+	int c = 0, n;
+
+	do {
+		if (!wait && serial_exists
+		    && !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY))
+			break;
+		// An idle UART takes a FIFO's worth.
+		for (n = 0; n < serial_txfifo || !serial_exists; n++) {
+			if ((c = cons_next()) < 0)
+				break;
+			cons_out(c, wait);
+		}
+	} while (c >= 0);
+
+	// Have the UART interrupt when it can take the rest.
+	if (serial_exists)
+		serial_set_txi(c >= 0);
+}
+
+static void
+cons_drain(bool wait)
+{
+	if (cons_sync)
+		return;
+	spin_lock(&cons_lock);
+	cons_drain_locked(wait);
+	spin_unlock(&cons_lock);
+}
+
+// Write out everything buffered and print synchronously from now on,
+// without cons_lock: a panicking CPU can't count on the rest.
+void
+cons_panic(void)
+{
+	if (!cons_sync) {
+		cons_drain_locked(1);
+		cons_sync = 1;
+	}
+}
+
+// Write out everything buffered, waiting for the devices.
+void
+cons_flush(void)
+{
+	cons_drain(1);
+}
+
+// Write the last n characters the console printed (all it kept, if n
+// is 0 or more than that) to the devices again, without logging them
+// twice.
+void
+cons_dmesg(uint32_t n)
+{
+	uint32_t pos, i;
+
+	cons_flush();
+	spin_lock(&cons_lock);
+	pos = cons_log.pos;
+	if (n == 0 || n > MIN(pos, CONS_LOGSIZE))
+		n = MIN(pos, CONS_LOGSIZE);
+	for (i = pos - n; i != pos; i++)
+		cons_putc(cons_log.buf[i % CONS_LOGSIZE]);
+	spin_unlock(&cons_lock);
+}
+
 // initialize the console devices
 void
 cons_init(void)
@@ -458,7 +634,23 @@ cons_init(void)
 void
 cputchar(int c)
 {
-	cons_putc(c);
+	struct cons_ring *r = &cons_rings[cpunum()];
+
+	while (!cons_sync && r->wpos - r->rpos == CONS_RINGSIZE)
+		cons_drain(1);
+	if (cons_sync) {
+		cons_log.buf[cons_log.pos++ % CONS_LOGSIZE] = c;
+		cons_putc(c);
+		return;
+	}
+
+	r->buf[r->wpos % CONS_RINGSIZE] = c;
+	barrier();
+	r->wpos++;
+	// Once the UART interrupts for more, the serial interrupt will
+	// get to this; until then, send it now.
+	if (!serial_txi)
+		cons_drain(0);
 }
 
 int
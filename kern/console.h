@@ -17,8 +17,15 @@
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
+// Each environment's console output budget (sys_cputs)
+#define CONS_BURST	(64 * 1024)	// Bytes it may print at once
+#define CONS_RATE	16		// Bytes a millisecond after that
+
 void cons_init(void);
 int cons_getc(void);
+void cons_flush(void);
+void cons_panic(void);
+void cons_dmesg(uint32_t n);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
@@ -23,6 +23,12 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	volatile uint32_t cpu_in_user;  // Running user code (between iret and trap)
+	volatile uint32_t cpu_tlb_stale;// Must flush TLB before running user code
+	uint64_t cpu_tsc_start;         // When cpu_env was last charged CPU time
+	struct Env *cpu_runq;           // Runnable envs waiting for this CPU
+	struct Env **cpu_runq_tail;     // Last link in cpu_runq
+	int cpu_nrunnable;              // Length of cpu_runq
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +48,7 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_set(uint64_t nsec);
 
 #endif
@@ -1,14 +1,78 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/picirq.h>
+#include <kern/pcireg.h>
 #include <inc/string.h>
 #include <inc/error.h>
 #include <netif/etharp.h>
 
-struct e1000_tx_desc tx_desc_array[E1000_TXDESC] __attribute__ ((aligned (16)));
-struct tx_pkt tx_pkt_bufs[E1000_TXDESC];
+// The card's transmit and receive rings, in queue pairs.  The 82540EM
+// has one pair; the 82574L has E1000_NQUEUES, and spreads received
+// flows across them by RSS hash, so that a network stack on each CPU
+// can own a pair.  Environments use the pair they are bound to (see
+// sys_net_set_queue), pair 0 by default.
+//
+// Transmit descriptors [tx_clean, TDT) belong to the card.  Each one
+// points either at its tx_pkt_bufs slot (e1000_transmit copies the
+// frame there) or into a user page pinned in tx_pages until the card
+// writes the descriptor back.  A zero-copy frame's last descriptor
+// records the sending environment in tx_owner, so e1000_tx_done can
+// tell it when the frame is gone.
+//
+// Receive buffers are whole pages, laid out as a struct jif_pkt so a
+// filled page can be handed to the network server as is: the card
+// writes the frame at jp_data and e1000_recv_page fills in jp_len.
+struct e1000_queue {
+	struct e1000_tx_desc tx_desc[E1000_TXDESC] __attribute__ ((aligned (16)));
+	struct e1000_rx_desc rx_desc[E1000_RXDESC] __attribute__ ((aligned (16)));
+	struct tx_pkt tx_pkt_bufs[E1000_TXDESC];
+	struct PageInfo *tx_pages[E1000_TXDESC];
+	envid_t tx_owner[E1000_TXDESC];
+	uint32_t tx_clean;
+	// The offload context last loaded into this queue.
+	struct e1000_context_desc tx_ctx;
+	struct PageInfo *rx_pages[E1000_RXDESC];
+	// The environments (if any) blocked in e1000_rx_wait and
+	// e1000_tx_wait on this pair.
+	envid_t rx_waiter;
+	envid_t tx_waiter;
+	// The receive ring the card is using: rx_desc, or a user-level
+	// driver's (see e1000_bypass).
+	struct e1000_rx_desc *rx_ring;
+	// The user-level driver's environment, if it has the pair; the
+	// page holding its rings, and its buffer pages, pinned.
+	envid_t bp_owner;
+	struct PageInfo *bp_ring;
+	struct PageInfo *bp_bufs[NET_BYPASS_NBUFS];
+	uintptr_t bp_regs;		// Where its registers are mapped
+};
+
+static struct e1000_queue queues[E1000_NQUEUES];
+int e1000_nqueues;
+
+// The 82574L's RSS needs extended receive descriptors, which the card
+// writes back in a different layout.
+static bool rx_extended;
+
+// The most descriptors a frame can need: one per page of each fragment
+// (so at most NET_TSO_MAX / PGSIZE more than there are fragments),
+// plus a context descriptor.
+#define TX_WAIT_AVAIL	(2 * NET_MAX_FRAGS + NET_TSO_MAX / PGSIZE + 1)
+
+// Per-environment counts of completed zero-copy frames, valid for
+// tx_done_env[ENVX(envid)] only.
+static envid_t tx_done_env[NENV];
+static int tx_done[NENV];
+
+#define RX_DATA_OFFSET	offsetof(struct jif_pkt, jp_data)
+
+// IRQ line the E1000 interrupts on, and where its registers are.
+uint8_t e1000_irq;
+static physaddr_t e1000_pa;
 
-struct e1000_rx_desc rx_desc_array[E1000_RXDESC] __attribute__ ((aligned (16)));
-struct rx_pkt rx_pkt_bufs[E1000_RXDESC];
+static const uint32_t rss_key[10] = NET_RSS_KEY;
 
 static void hexdump(const char *prefix, const void *data, int len);
 
@@ -25,53 +89,142 @@ enum {
 	defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
 	defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
 	defreg(VET),    defreg(RDTR),   defreg(RADV),   defreg(TADV),
-	defreg(ITR),    defreg(TIPG),   defreg(RXERRC),
+	defreg(ITR),    defreg(TIPG),   defreg(RXERRC),	defreg(RNBC),
+	defreg(GORCL),	defreg(GORCH),	defreg(GOTCL),	defreg(GOTCH),
+	defreg(RXCSUM),	defreg(RFCTL),	defreg(MRQC),	defreg(RETA),
+	defreg(RSSRK),
 };
 
+// Queue qn's copy of a per-queue register (RDBAL ... TDT): each pair's
+// registers sit 0x100 bytes after the previous pair's.
+#define QREG(r, qn)	((r) + (qn) * (0x100 >> 2))
 
 
-// LAB 6: Your driver code here
-int
-e1000_attach(struct pci_func *pcif)
+
+// Point queue pair qn's registers at the rings at physical addresses
+// tx and rx, of txlen and rxlen bytes, with the rings empty.  The
+// receive ring is empty with its tail at rdt.
+static void
+queue_program(int qn, physaddr_t tx, uint32_t txlen, physaddr_t rx,
+	      uint32_t rxlen, uint32_t rdt)
 {
-	uint32_t i;
+	// Program the Transmit Descriptor Base Address Registers
+	e1000[QREG(TDBAL, qn)] = tx;
+	e1000[QREG(TDBAH, qn)] = 0x0;
 
-	// Enable PCI device
-	pci_func_enable(pcif);
+	// Set the Transmit Descriptor Length Register
+	e1000[QREG(TDLEN, qn)] = txlen;
 
-	// Memory map I/O for PCI device
-	e1000 = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+	// Set the Transmit Descriptor Head and Tail Registers
+	e1000[QREG(TDH, qn)] = 0x0;
+	e1000[QREG(TDT, qn)] = 0x0;
+
+	// Program the Receive Descriptor Base Address Registers
+	e1000[QREG(RDBAL, qn)] = rx;
+	e1000[QREG(RDBAH, qn)] = 0x0;
+
+	// Set the Receive Descriptor Length Register
+	e1000[QREG(RDLEN, qn)] = rxlen;
+
+	// Set the Receive Descriptor Head and Tail Registers
+	e1000[QREG(RDH, qn)] = 0x0;
+	e1000[QREG(RDT, qn)] = rdt;
+}
 
-	assert(e1000[STATUS] == 0x80080783);
-	cprintf("E1000 status: %08x You should get 0x80080783\n", e1000[STATUS]);
+// (Re)initialize queue pair qn's rings, with the receive buffers it
+// already has, and point the card at them.
+static void
+queue_reset(int qn)
+{
+	struct e1000_queue *q = &queues[qn];
+	uint32_t i;
 
 	// Initialize tx buffer array
-	memset(tx_desc_array, 0x0, sizeof(struct e1000_tx_desc) * E1000_TXDESC);
-	memset(tx_pkt_bufs, 0x0, sizeof(struct tx_pkt) * E1000_TXDESC);
-	for (i = 0; i < E1000_TXDESC; i++) {
-		tx_desc_array[i].buffer_addr = PADDR(tx_pkt_bufs[i].buf);
-		tx_desc_array[i].upper.data |= E1000_TXD_STAT_DD;
-	}
+	memset(q->tx_desc, 0x0, sizeof(q->tx_desc));
+	for (i = 0; i < E1000_TXDESC; i++)
+		q->tx_desc[i].buffer_addr = PADDR(q->tx_pkt_bufs[i].buf);
+	q->tx_clean = 0;
+	memset(&q->tx_ctx, 0, sizeof(q->tx_ctx));
 
 	// Initialize rcv desc buffer array
-	memset(rx_desc_array, 0x0, sizeof(struct e1000_rx_desc) * E1000_RXDESC);
-	memset(rx_pkt_bufs, 0x0, sizeof(struct rx_pkt) * E1000_RXDESC);
+	memset(q->rx_desc, 0x0, sizeof(q->rx_desc));
+	for (i = 0; i < E1000_RXDESC; i++)
+		q->rx_desc[i].buffer_addr =
+			page2pa(q->rx_pages[i]) + RX_DATA_OFFSET;
+	q->rx_ring = q->rx_desc;
+
+	queue_program(qn, PADDR(q->tx_desc), sizeof(q->tx_desc),
+		      PADDR(q->rx_desc), sizeof(q->rx_desc), E1000_RXDESC - 1);
+}
+
+// Set up queue pair qn's rings and point the card at them.  The
+// receive ring holds a reference to each of its pages.
+static void
+queue_init(int qn)
+{
+	struct e1000_queue *q = &queues[qn];
+	uint32_t i;
+
 	for (i = 0; i < E1000_RXDESC; i++) {
-		rx_desc_array[i].buffer_addr = PADDR(rx_pkt_bufs[i].buf);
+		if (!(q->rx_pages[i] = page_alloc(ALLOC_ZERO)))
+			panic("e1000_attach: out of memory");
+		q->rx_pages[i]->pp_ref++;
 	}
+	queue_reset(qn);
+}
 
-	/* Transmit initialization */
-	// Program the Transmit Descriptor Base Address Registers
-	e1000[TDBAL] = PADDR(tx_desc_array);
-	e1000[TDBAH] = 0x0;
+// Have the 82574L hash each received TCP/IPv4 frame and pick its queue
+// from the redirection table, as net_rss_queue says.  Other frames (ARP,
+// UDP, ICMP) all go to queue 0, so the network server instance there
+// can own them.  The card only reports RSS with extended descriptors
+// and with the packet checksum turned off.
+static void
+rss_init(void)
+{
+	uint32_t i, j, reta;
+
+	for (i = 0; i < 10; i++)
+		e1000[RSSRK + i] = rss_key[i];
+	for (i = 0; i < 32; i++) {
+		reta = 0;
+		for (j = 0; j < 4; j++)
+			if (net_rss_queue(i * 4 + j, e1000_nqueues))
+				reta |= E1000_RETA_QUEUE1 << (j * 8);
+		e1000[RETA + i] = reta;
+	}
+	e1000[RXCSUM] = E1000_RXCSUM_PCSD;
+	e1000[RFCTL] |= E1000_RFCTL_EXTEN;
+	e1000[MRQC] = E1000_MRQC_ENABLE_RSS_2Q | E1000_MRQC_RSS_FIELD_IPV4_TCP;
+	rx_extended = 1;
+}
 
-	// Set the Transmit Descriptor Length Register
-	e1000[TDLEN] = sizeof(struct e1000_tx_desc) * E1000_TXDESC;
+// LAB 6: Your driver code here
+int
+e1000_attach(struct pci_func *pcif)
+{
+	int i;
 
-	// Set the Transmit Descriptor Head and Tail Registers
-	e1000[TDH] = 0x0;
-	e1000[TDT] = 0x0;
+	// Enable PCI device
+	pci_func_enable(pcif);
+
+	// Memory map I/O for PCI device
+	e1000 = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+	e1000_pa = pcif->reg_base[0];
+
+	if (PCI_PRODUCT(pcif->dev_id) == E1000_DEV_ID_82574L) {
+		e1000_nqueues = E1000_NQUEUES;
+		e1000[CTRL] |= E1000_CTRL_SLU;
+		cprintf("E1000: 82574L, %d queues\n", e1000_nqueues);
+	} else {
+		e1000_nqueues = 1;
+		assert(e1000[STATUS] == 0x80080783);
+		cprintf("E1000 status: %08x You should get 0x80080783\n", e1000[STATUS]);
+	}
+
+	for (i = 0; i < e1000_nqueues; i++)
+		queue_init(i);
 
+	/* Transmit initialization */
 	// Initialize the Transmit Control Register 
 	e1000[TCTL] |= E1000_TCTL_EN;
 	e1000[TCTL] |= E1000_TCTL_PSP;
@@ -91,25 +244,32 @@ e1000_attach(struct pci_func *pcif)
 	
 	e1000[RA] = 0x12005452;
 	e1000[RA+1] = (e1000[RA+1] & 0xffff0000) | 0x5634;
-
-	// Program the Receive Descriptor Base Address Registers
-	e1000[RDBAL] = PADDR(rx_desc_array);
-    e1000[RDBAH] = 0x0;
-
-	// Set the Receive Descriptor Length Register
-	e1000[RDLEN] = sizeof(struct e1000_rx_desc) * E1000_RXDESC;
-
-    // Set the Receive Descriptor Head and Tail Registers
-	e1000[RDH] = 0x0;
-	e1000[RDT] = E1000_RXDESC - 1;
 	e1000[MTA] = 0x0;
 
+	if (e1000_nqueues > 1)
+		rss_init();
+
 	// Initialize the Receive Control Register
 	e1000[RCTL] = E1000_RCTL_BAM | 
 		E1000_RCTL_SZ_2048 | 
 		E1000_RCTL_SECRC | 
 		E1000_RCTL_EN;
 
+	// Interrupt on received packets, but let a burst collect first:
+	// RXT0 fires once the link has been quiet for RDTR (or RADV after
+	// the first packet, whichever is sooner), and ITR caps the rate.
+	// RXDMT0 and RXO get the ring drained before it overflows.
+	// Every queue shares the one interrupt.
+	e1000[RDTR] = E1000_RDTR_USEC * 1000 / 1024;
+	e1000[RADV] = E1000_RADV_USEC * 1000 / 1024;
+	e1000[ITR] = E1000_ITR_USEC * 1000 / 256;
+	e1000[IMC] = ~0;
+	(void) e1000[ICR];
+	e1000[IMS] = E1000_IMS_RXT0 | E1000_IMS_RXDMT0 | E1000_IMS_RXO;
+
+	e1000_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+
 	return 0;
 }
 
@@ -135,26 +295,67 @@ hexdump(const char *prefix, const void *data, int len)
 	}
 }
 
+// Reclaim queue qn's descriptors the card has finished with, unpinning
+// their pages and crediting completed zero-copy frames to their senders.
+static void
+tx_reclaim(int qn)
+{
+	struct e1000_queue *q = &queues[qn];
+	struct e1000_tx_desc *d;
+	envid_t owner;
+
+	while (q->tx_clean != e1000[QREG(TDT, qn)]) {
+		d = &q->tx_desc[q->tx_clean];
+		if (!(d->upper.data & E1000_TXD_STAT_DD))
+			break;
+		if (q->tx_pages[q->tx_clean]) {
+			page_decref(q->tx_pages[q->tx_clean]);
+			q->tx_pages[q->tx_clean] = NULL;
+		}
+		if ((owner = q->tx_owner[q->tx_clean])) {
+			if (tx_done_env[ENVX(owner)] != owner) {
+				tx_done_env[ENVX(owner)] = owner;
+				tx_done[ENVX(owner)] = 0;
+			}
+			tx_done[ENVX(owner)]++;
+			q->tx_owner[q->tx_clean] = 0;
+		}
+		d->upper.data = 0;
+		q->tx_clean = (q->tx_clean + 1) % E1000_TXDESC;
+	}
+}
+
+// Number of free transmit descriptors in queue qn.  One always stays
+// unused so that a full ring is distinguishable from an empty one.
+static uint32_t
+tx_avail(int qn)
+{
+	tx_reclaim(qn);
+	return (queues[qn].tx_clean + E1000_TXDESC - e1000[QREG(TDT, qn)] - 1)
+		% E1000_TXDESC;
+}
+
 int
-e1000_transmit(char *data, int len)
+e1000_transmit(int qn, char *data, int len)
 {
+	struct e1000_queue *q = &queues[qn];
+
 	if (len > TX_PKT_SIZE) {
 		return -E_PKT_TOO_LONG;
 	}
 
-	uint32_t tdt = e1000[TDT];
+	uint32_t tdt = e1000[QREG(TDT, qn)];
 
 	// Check if next tx desc is free
-	if (tx_desc_array[tdt].upper.data & E1000_TXD_STAT_DD) {
-		memmove(tx_pkt_bufs[tdt].buf, data, len);
-		tx_desc_array[tdt].lower.flags.length = len;
-
-		tx_desc_array[tdt].upper.data &= ~E1000_TXD_STAT_DD;
-		tx_desc_array[tdt].lower.data |= E1000_TXD_CMD_EOP;
-		tx_desc_array[tdt].lower.data |= E1000_TXD_CMD_RS;
+	if (tx_avail(qn) > 0) {
+		memmove(q->tx_pkt_bufs[tdt].buf, data, len);
+		q->tx_desc[tdt].buffer_addr = PADDR(q->tx_pkt_bufs[tdt].buf);
+		q->tx_desc[tdt].lower.data =
+			len | E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+		q->tx_desc[tdt].upper.data = 0;
 
 		//hexdump("tx dump:", data, len);
-		e1000[TDT] = (tdt + 1) % E1000_TXDESC;
+		e1000[QREG(TDT, qn)] = (tdt + 1) % E1000_TXDESC;
 	}
 	else { // tx queue is full!
 		return -E_TX_FULL;
@@ -163,27 +364,569 @@ e1000_transmit(char *data, int len)
 	return 0;
 }
 
+// Work out the offload context for a frame with offload flags 'flags'
+// and total length 'len', whose headers are in 'f'.  Fills in *ctx (less
+// the RS bit) and the POPTS bits and extra command bits for the frame's
+// data descriptors.  Returns 0, or -E_INVAL if the headers aren't all in
+// 'f' or the frame isn't one the card can offload.
+static int
+tx_offload(const struct net_frag *f, int flags, uint32_t len,
+	   struct e1000_context_desc *ctx, uint32_t *popts, uint32_t *dcmd)
+{
+	const uint8_t *h = f->nf_data;
+	uint32_t ihl, thl, cmd, mss;
+
+	// Only IPv4 over Ethernet.
+	if (f->nf_len < ETH_HLEN + 20 || h[12] != 0x08 || h[13] != 0x00)
+		return -E_INVAL;
+	ihl = (h[ETH_HLEN] & 0xf) * 4;
+	if (ihl < 20 || ETH_HLEN + ihl > f->nf_len)
+		return -E_INVAL;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->lower_setup.ip_fields.ipcss = ETH_HLEN;
+	ctx->lower_setup.ip_fields.ipcso = ETH_HLEN + 10;
+	ctx->lower_setup.ip_fields.ipcse = ETH_HLEN + ihl - 1;
+	cmd = E1000_TXD_CMD_IP;
+	*popts = E1000_TXD_POPTS_IXSM;
+	*dcmd = 0;
+
+	// Fragments have no transport checksum the card could compute.
+	thl = 0;
+	if ((h[ETH_HLEN + 6] & 0x3f) || h[ETH_HLEN + 7])
+		goto done;
+	switch (h[ETH_HLEN + 9]) {
+	case 6:		// TCP
+		if (ETH_HLEN + ihl + 20 > f->nf_len)
+			return -E_INVAL;
+		thl = (h[ETH_HLEN + ihl + 12] >> 4) * 4;
+		ctx->upper_setup.tcp_fields.tucss = ETH_HLEN + ihl;
+		ctx->upper_setup.tcp_fields.tucso = ETH_HLEN + ihl + 16;
+		cmd |= E1000_TXD_CMD_TCP;
+		*popts |= E1000_TXD_POPTS_TXSM;
+		break;
+	case 17:	// UDP
+		ctx->upper_setup.tcp_fields.tucss = ETH_HLEN + ihl;
+		ctx->upper_setup.tcp_fields.tucso = ETH_HLEN + ihl + 6;
+		*popts |= E1000_TXD_POPTS_TXSM;
+		break;
+	}
+
+done:
+	if (flags & NET_FRAG_TSO) {
+		mss = flags >> 16;
+		if (!thl || ETH_HLEN + ihl + thl > f->nf_len || mss == 0)
+			return -E_INVAL;
+		ctx->tcp_seg_setup.fields.hdr_len = ETH_HLEN + ihl + thl;
+		ctx->tcp_seg_setup.fields.mss = mss;
+		cmd |= E1000_TXD_CMD_TSE | (len - (ETH_HLEN + ihl + thl));
+		*dcmd = E1000_TXD_CMD_TSE;
+	}
+	ctx->cmd_and_length = E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_C | cmd;
+	return 0;
+}
+
+// Zero-copy transmit of one frame gathered from 'nfrags' pieces of
+// environment e's memory, one descriptor per piece per page, on queue
+// qn.  The pages stay pinned until the card is done with them.  The
+// caller must have checked that e may read the fragments, and e must
+// be the current environment.
+// The first piece's flags may ask for checksum offload and TCP
+// segmentation (see inc/ns.h); the headers must then be in that piece.
+// This takes an offload context descriptor, unless the queue already
+// has the right one loaded.
+// Returns 0 on success, -E_PKT_TOO_LONG, -E_INVAL if the frame is
+// empty or can't be offloaded as asked, or -E_TX_FULL if the ring
+// hasn't room for the whole frame.
 int
-e1000_receive(char *data)
+e1000_transmit_frags(int qn, struct Env *e, const struct net_frag *frags,
+		     int nfrags)
 {
-	uint32_t rdt, len;
-	rdt = (e1000[RDT] + 1) % E1000_RXDESC;
-	
-	if (rx_desc_array[rdt].status & E1000_RXD_STAT_DD) {
-		if (!(rx_desc_array[rdt].status & E1000_RXD_STAT_EOP)) {
+	struct e1000_queue *q = &queues[qn];
+	uintptr_t va, end;
+	uint32_t tdt, n, len, popts = 0, dcmd = 0;
+	struct e1000_context_desc ctx;
+	struct PageInfo *pp;
+	int i, offload, r;
+
+	// Count the descriptors first so that we fail before queuing
+	// any part of the frame.
+	len = n = 0;
+	for (i = 0; i < nfrags; i++) {
+		if (frags[i].nf_len <= 0)
+			continue;
+		va = (uintptr_t) frags[i].nf_data;
+		n += (ROUNDUP(va + frags[i].nf_len, PGSIZE) - ROUNDDOWN(va, PGSIZE))
+			/ PGSIZE;
+		len += frags[i].nf_len;
+	}
+	offload = frags[0].nf_flags & (NET_FRAG_CSUM | NET_FRAG_TSO);
+	if (len > ((offload & NET_FRAG_TSO) ? NET_TSO_MAX : TX_PKT_SIZE))
+		return -E_PKT_TOO_LONG;
+	if (n == 0)
+		return -E_INVAL;
+	if (offload) {
+		if ((r = tx_offload(&frags[0], frags[0].nf_flags, len,
+				    &ctx, &popts, &dcmd)) < 0)
+			return r;
+		if (memcmp(&ctx, &q->tx_ctx, sizeof(ctx)) != 0)
+			n++;
+	}
+	if (tx_avail(qn) < n)
+		return -E_TX_FULL;
+
+	tdt = e1000[QREG(TDT, qn)];
+	if (offload && memcmp(&ctx, &q->tx_ctx, sizeof(ctx)) != 0) {
+		q->tx_ctx = ctx;
+		ctx.cmd_and_length |= E1000_TXD_CMD_RS;
+		memmove(&q->tx_desc[tdt], &ctx, sizeof(ctx));
+		q->tx_pages[tdt] = NULL;
+		q->tx_owner[tdt] = 0;
+		tdt = (tdt + 1) % E1000_TXDESC;
+	}
+	for (i = 0; i < nfrags; i++) {
+		va = (uintptr_t) frags[i].nf_data;
+		end = va + (frags[i].nf_len > 0 ? frags[i].nf_len : 0);
+		for (; va < end; va = ROUNDDOWN(va + PGSIZE, PGSIZE)) {
+			if (!(pp = page_lookup(e->env_pgdir, (void *) va, NULL)))
+				panic("e1000_transmit_frags: %08x not mapped", va);
+			pp->pp_ref++;
+			q->tx_pages[tdt] = pp;
+			q->tx_owner[tdt] = 0;
+			q->tx_desc[tdt].buffer_addr = page2pa(pp) + PGOFF(va);
+			q->tx_desc[tdt].lower.data =
+				MIN(end, ROUNDDOWN(va + PGSIZE, PGSIZE)) - va;
+			q->tx_desc[tdt].lower.data |= E1000_TXD_CMD_RS;
+			q->tx_desc[tdt].upper.data = 0;
+			if (offload) {
+				q->tx_desc[tdt].lower.data |= E1000_TXD_CMD_DEXT
+					| E1000_TXD_DTYP_D | dcmd;
+				q->tx_desc[tdt].upper.data = popts << 8;
+			}
+			tdt = (tdt + 1) % E1000_TXDESC;
+		}
+	}
+	// Only the last descriptor ends the frame.
+	tdt = (tdt + E1000_TXDESC - 1) % E1000_TXDESC;
+	q->tx_desc[tdt].lower.data |= E1000_TXD_CMD_EOP;
+	q->tx_owner[tdt] = e->env_id;
+
+	e1000[QREG(TDT, qn)] = (tdt + 1) % E1000_TXDESC;
+	return 0;
+}
+
+// Return, and forget, the number of envid's zero-copy frames that
+// have finished transmitting on any queue since the last call.
+int
+e1000_tx_done(envid_t envid)
+{
+	int i, n;
+
+	for (i = 0; i < e1000_nqueues; i++)
+		if (!queues[i].bp_owner)
+			tx_reclaim(i);
+	if (tx_done_env[ENVX(envid)] != envid)
+		return 0;
+	n = tx_done[ENVX(envid)];
+	tx_done[ENVX(envid)] = 0;
+	return n;
+}
+
+// The length of the frame in queue qn's next receive descriptor, or -1
+// if the card hasn't filled it yet.  Sets *rdt to the descriptor.
+static int
+rx_next(int qn, uint32_t *rdt)
+{
+	struct e1000_rx_desc *d;
+	union e1000_rx_desc_extended *x;
+
+	*rdt = (e1000[QREG(RDT, qn)] + 1) % E1000_RXDESC;
+	d = &queues[qn].rx_ring[*rdt];
+	if (rx_extended) {
+		x = (union e1000_rx_desc_extended *) d;
+		if (!(x->wb.upper.status_error & E1000_RXD_STAT_DD))
+			return -1;
+		if (!(x->wb.upper.status_error & E1000_RXD_STAT_EOP))
 			panic("Don't allow jumbo frames!\n");
+		return x->wb.upper.length;
+	}
+	if (!(d->status & E1000_RXD_STAT_DD))
+		return -1;
+	if (!(d->status & E1000_RXD_STAT_EOP))
+		panic("Don't allow jumbo frames!\n");
+	return d->length;
+}
+
+// Give queue qn's descriptor rdt back to the card with a fresh buffer
+// (write-back overwrites an extended descriptor's address).
+static void
+rx_refill(int qn, uint32_t rdt)
+{
+	struct e1000_queue *q = &queues[qn];
+
+	q->rx_desc[rdt].buffer_addr = page2pa(q->rx_pages[rdt]) + RX_DATA_OFFSET;
+	((union e1000_rx_desc_extended *) &q->rx_desc[rdt])->read.reserved = 0;
+	e1000[QREG(RDT, qn)] = rdt;
+}
+
+int
+e1000_receive(int qn, char *data)
+{
+	uint32_t rdt;
+	int len;
+
+	if ((len = rx_next(qn, &rdt)) < 0)
+		return -E_RCV_EMPTY;
+	memmove(data, (char *) page2kva(queues[qn].rx_pages[rdt]) + RX_DATA_OFFSET,
+		len);
+	//hexdump("rx dump:", data, len);
+	rx_refill(qn, rdt);
+	return len;
+}
+
+// Zero-copy receive: swap queue qn's next filled ring page with 'pp',
+// the caller's fresh page, which goes on the ring in its place.
+// Returns the filled page (with the caller's reference to 'pp'
+// transferred to it) and its frame length in *len, or NULL if the ring
+// is empty.  The frame is the page's only one (see jif_pkt_next).
+struct PageInfo *
+e1000_recv_page(int qn, struct PageInfo *pp, int *len)
+{
+	struct e1000_queue *q = &queues[qn];
+	struct PageInfo *full;
+	struct jif_pkt *pkt;
+	uint32_t rdt;
+
+	if ((*len = rx_next(qn, &rdt)) < 0)
+		return NULL;
+
+	full = q->rx_pages[rdt];
+	pkt = page2kva(full);
+	pkt->jp_len = *len;
+	if (JIF_PKT_SPACE(*len) + sizeof(pkt->jp_len) <= PGSIZE)
+		((struct jif_pkt *) ((char *) pkt + JIF_PKT_SPACE(*len)))->jp_len = 0;
+
+	q->rx_pages[rdt] = pp;
+	rx_refill(qn, rdt);
+	return full;
+}
+
+static bool
+rx_ready(int qn)
+{
+	uint32_t rdt;
+
+	return rx_next(qn, &rdt) >= 0;
+}
+
+// Make the environment in *waiter (if still there) runnable again.
+static void
+wake(envid_t *waiter)
+{
+	struct Env *e;
+
+	if (*waiter && envid2env(*waiter, &e, 0) == 0
+	    && e->env_status == ENV_NOT_RUNNABLE)
+		sched_set_status(e, ENV_RUNNABLE);
+	*waiter = 0;
+}
+
+// Record envid in *waiter, unless another live environment is there.
+static int
+add_waiter(envid_t *waiter, envid_t envid)
+{
+	struct Env *e;
+
+	if (*waiter && *waiter != envid && envid2env(*waiter, &e, 0) == 0)
+		return -E_INVAL;
+	*waiter = envid;
+	return 1;
+}
+
+// Register envid to be woken by the next receive interrupt for queue
+// qn.  Returns 0 if a packet is already waiting (so the caller should
+// not block), 1 if envid is now registered, or -E_INVAL if another
+// live environment is already waiting on the queue.
+int
+e1000_rx_wait(int qn, envid_t envid)
+{
+	if (rx_ready(qn))
+		return 0;
+	return add_waiter(&queues[qn].rx_waiter, envid);
+}
+
+// Register envid to be woken once queue qn's transmit ring has room
+// for any frame (TX_WAIT_AVAIL descriptors).  Returns like
+// e1000_rx_wait.
+int
+e1000_tx_wait(int qn, envid_t envid)
+{
+	int r;
+
+	if (tx_avail(qn) >= TX_WAIT_AVAIL)
+		return 0;
+	if ((r = add_waiter(&queues[qn].tx_waiter, envid)) > 0)
+		e1000[IMS] = E1000_IMS_TXDW;
+	return r;
+}
+
+// Handle an E1000 interrupt: acknowledge it and wake each queue's
+// receiver and, once there is room, its transmitter.  The queues share
+// the interrupt, so each one's rings are checked.
+void
+e1000_intr(void)
+{
+	struct e1000_queue *q;
+	uint32_t icr;
+	bool txwait = 0;
+	int i;
+
+	// Reading ICR clears the causes and deasserts the line.
+	icr = e1000[ICR];
+	irq_eoi();
+
+	for (i = 0; i < e1000_nqueues; i++) {
+		q = &queues[i];
+		if (q->rx_waiter
+		    && ((icr & (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO))
+			|| rx_ready(i)))
+			wake(&q->rx_waiter);
+		if (q->tx_waiter && tx_avail(i) >= TX_WAIT_AVAIL)
+			wake(&q->tx_waiter);
+		txwait |= q->tx_waiter != 0;
+	}
+	if (!txwait)
+		e1000[IMC] = E1000_IMC_TXDW;
+}
+
+/*
+ * Kernel bypass.  The network server can take a queue pair over and
+ * drive it from user level: e1000_bypass maps the pair's tail
+ * registers and a fresh page of rings into it, pins its buffer pages
+ * and tells it their physical addresses, so it can poll and refill the
+ * rings without system calls.  The two register pages hold more than
+ * the pair's tail registers: all queue pairs' receive (or transmit)
+ * registers, ring bases included, and RDTR and RADV (or TIDV and
+ * TXDCTL).  Between that and filling in descriptors, the driver can
+ * make the card read and write any memory, so only ENV_TYPE_NS may do
+ * this.  The kernel takes the pair back when its owner goes away.
+ */
+
+#define BP_RX_OFFSET	(NET_BYPASS_TXDESC * sizeof(struct net_txdesc))
+
+// Spin until the card has sent everything on queue qn's transmit ring,
+// or give up after a while (the frames are then lost).
+static void
+tx_drain(int qn)
+{
+	int i;
+
+	for (i = 0; i < 1000000; i++)
+		if (e1000[QREG(TDH, qn)] == e1000[QREG(TDT, qn)])
+			break;
+}
+
+// The physical address of the register page holding register r of
+// queue qn.
+static physaddr_t
+regs_page(int r, int qn)
+{
+	return e1000_pa + ROUNDDOWN(QREG(r, qn) * 4, PGSIZE);
+}
+
+// Map the register page holding register r of queue qn at va in e's
+// address space, uncached.  Device memory has no PageInfo, so this
+// sets the PTE directly (see page_lookup).
+static int
+bypass_map_regs(struct Env *e, int r, int qn, uintptr_t va)
+{
+	pte_t *pte;
+
+	page_remove(e->env_pgdir, (void *) va);
+	if (!(pte = pgdir_walk(e->env_pgdir, (void *) va, 1)))
+		return -E_NO_MEM;
+	*pte = regs_page(r, qn) | PTE_P | PTE_U | PTE_W | PTE_PCD | PTE_PWT;
+	tlb_invalidate(e->env_pgdir, (void *) va);
+	return 0;
+}
+
+// Undo bypass_map_regs, if va still maps that register page.
+// page_remove can't, as there's no PageInfo.
+static void
+bypass_unmap_regs(pde_t *pgdir, int r, int qn, uintptr_t va)
+{
+	pte_t *pte;
+
+	if ((pte = pgdir_walk(pgdir, (void *) va, 0))
+	    && (*pte & PTE_P) && PTE_ADDR(*pte) == regs_page(r, qn)) {
+		*pte = 0;
+		tlb_invalidate(pgdir, (void *) va);
+	}
+}
+
+// Whether the len-byte ranges at a and b overlap.
+static bool
+overlaps(uintptr_t a, size_t alen, uintptr_t b, size_t blen)
+{
+	return a < b + blen && b < a + alen;
+}
+
+// Hand queue pair qn to environment e, as described by *nb (see
+// inc/ns.h), which must be in the kernel.  The caller has checked
+// that e may have it.
+// Returns 0, or -E_INVAL if qn is out of range or already taken, or
+// nb's addresses aren't page-aligned and below UTOP or overlap, or a
+// buffer page isn't mapped writable; or -E_NO_MEM.
+int
+e1000_bypass(int qn, struct Env *e, struct net_bypass *nb)
+{
+	struct e1000_queue *q = &queues[qn];
+	uintptr_t regs = (uintptr_t) nb->nb_regs;
+	uintptr_t ring = (uintptr_t) nb->nb_ring;
+	uintptr_t bufs = (uintptr_t) nb->nb_bufs;
+	size_t bufslen = NET_BYPASS_NBUFS * PGSIZE;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int i, r;
+
+	// rx_next and rx_ready assume the kernel's ring size.
+	static_assert(NET_BYPASS_RXDESC == E1000_RXDESC);
+	static_assert(BP_RX_OFFSET + NET_BYPASS_RXDESC * sizeof(union net_rxdesc)
+		      <= PGSIZE);
+	if (qn < 0 || qn >= e1000_nqueues || q->bp_owner)
+		return -E_INVAL;
+	if (PGOFF(regs) || regs + 2 * PGSIZE > UTOP || regs + 2 * PGSIZE < regs
+	    || PGOFF(ring) || ring >= UTOP
+	    || PGOFF(bufs) || bufs + bufslen > UTOP || bufs + bufslen < bufs
+	    || overlaps(regs, 2 * PGSIZE, ring, PGSIZE)
+	    || overlaps(regs, 2 * PGSIZE, bufs, bufslen)
+	    || overlaps(ring, PGSIZE, bufs, bufslen))
+		return -E_INVAL;
+	for (i = 0; i < NET_BYPASS_NBUFS; i++)
+		if (!(pp = page_lookup(e->env_pgdir, (void *) (bufs + i * PGSIZE),
+				       &pte))
+		    || !(*pte & PTE_W))
+			return -E_INVAL;
+	if (!(q->bp_ring = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	q->bp_ring->pp_ref++;
+
+	// Pin the buffers before mapping anything: they stay the card's
+	// to write even if the driver unmaps them.
+	for (i = 0; i < NET_BYPASS_NBUFS; i++) {
+		pp = page_lookup(e->env_pgdir, (void *) (bufs + i * PGSIZE), NULL);
+		pp->pp_ref++;
+		q->bp_bufs[i] = pp;
+		nb->nb_pa[i] = page2pa(pp);
+	}
+
+	if ((r = page_insert(e->env_pgdir, q->bp_ring, (void *) ring,
+			     PTE_P | PTE_U | PTE_W)) < 0
+	    || (r = bypass_map_regs(e, RDT, qn, regs)) < 0
+	    || (r = bypass_map_regs(e, TDT, qn, regs + PGSIZE)) < 0) {
+		bypass_unmap_regs(e->env_pgdir, RDT, qn, regs);
+		if (page_lookup(e->env_pgdir, (void *) ring, NULL) == q->bp_ring)
+			page_remove(e->env_pgdir, (void *) ring);
+		for (i = 0; i < NET_BYPASS_NBUFS; i++) {
+			page_decref(q->bp_bufs[i]);
+			q->bp_bufs[i] = NULL;
 		}
-		len = rx_desc_array[rdt].length;
-		
-		memmove(data, rx_pkt_bufs[rdt].buf, len);
-		//hexdump("rx dump:", data, len);
+		page_decref(q->bp_ring);
+		q->bp_ring = NULL;
+		return r;
+	}
 
-		rx_desc_array[rdt].status &= ~E1000_RXD_STAT_DD;
-		rx_desc_array[rdt].status &= ~E1000_RXD_STAT_EOP;
-		e1000[RDT] = rdt;
+	// Let the kernel's frames go out, then switch the card over.
+	tx_drain(qn);
+	tx_reclaim(qn);
+	q->bp_owner = e->env_id;
+	q->bp_regs = regs;
+	q->rx_ring = (struct e1000_rx_desc *) (page2kva(q->bp_ring) + BP_RX_OFFSET);
+	queue_program(qn, page2pa(q->bp_ring),
+		      NET_BYPASS_TXDESC * sizeof(struct net_txdesc),
+		      page2pa(q->bp_ring) + BP_RX_OFFSET,
+		      NET_BYPASS_RXDESC * sizeof(union net_rxdesc), 0);
+
+	nb->nb_rdt = (volatile uint32_t *) (regs + PGOFF(QREG(RDT, qn) * 4));
+	nb->nb_tdt = (volatile uint32_t *) (regs + PGSIZE + PGOFF(QREG(TDT, qn) * 4));
+	nb->nb_tx = (struct net_txdesc *) nb->nb_ring;
+	nb->nb_rx = (union net_rxdesc *) ((char *) nb->nb_ring + BP_RX_OFFSET);
+	nb->nb_rx_extended = rx_extended;
+	return 0;
+}
+
+// Take queue pair qn back from its user-level driver, whose address
+// space is pgdir.
+static void
+bypass_release(int qn, pde_t *pgdir)
+{
+	struct e1000_queue *q = &queues[qn];
+	int i;
 
-		return len;
+	// Stop the card using the driver's memory before unpinning it.
+	tx_drain(qn);
+	queue_reset(qn);
+	for (i = 0; i < NET_BYPASS_NBUFS; i++) {
+		page_decref(q->bp_bufs[i]);
+		q->bp_bufs[i] = NULL;
 	}
+	page_decref(q->bp_ring);
+	q->bp_ring = NULL;
+
+	bypass_unmap_regs(pgdir, RDT, qn, q->bp_regs);
+	bypass_unmap_regs(pgdir, TDT, qn, q->bp_regs + PGSIZE);
+	q->bp_owner = 0;
+	q->bp_regs = 0;
+}
+
+// Give queue pair qn, which environment e drives from user level,
+// back to the kernel.  Returns 0, or -E_INVAL if e doesn't have it.
+int
+e1000_unbypass(int qn, struct Env *e)
+{
+	if (qn < 0 || qn >= e1000_nqueues || queues[qn].bp_owner != e->env_id)
+		return -E_INVAL;
+	bypass_release(qn, e->env_pgdir);
+	return 0;
+}
+
+// Whether a user-level driver has taken queue pair qn.
+bool
+e1000_bypassed(int qn)
+{
+	return queues[qn].bp_owner != 0;
+}
+
+// Take back whatever queue pairs e drives, as e is freed.
+void
+e1000_env_free(struct Env *e)
+{
+	int i;
+
+	for (i = 0; i < e1000_nqueues; i++)
+		e1000_unbypass(i, e);
+}
 
-	return -E_RCV_EMPTY;
+// The card's statistics registers clear when read and stick at their
+// maximum rather than wrap, so they are folded into 64-bit totals here
+// each time anyone asks; the network server asks every second.
+static struct net_hwstats hwstats;
+
+void
+e1000_stats(struct net_hwstats *st)
+{
+	if (e1000) {
+		hwstats.hw_rx_packets += e1000[GPRC];
+		hwstats.hw_tx_packets += e1000[GPTC];
+		// Reading the high half clears the pair.
+		hwstats.hw_rx_octets += e1000[GORCL];
+		hwstats.hw_rx_octets += (uint64_t) e1000[GORCH] << 32;
+		hwstats.hw_tx_octets += e1000[GOTCL];
+		hwstats.hw_tx_octets += (uint64_t) e1000[GOTCH] << 32;
+		hwstats.hw_rx_missed += e1000[MPC];
+		hwstats.hw_rx_nobuf += e1000[RNBC];
+		hwstats.hw_rx_crcerr += e1000[CRCERRS];
+		hwstats.hw_rx_errors += e1000[RXERRC];
+	}
+	*st = hwstats;
 }
@@ -1,6 +1,9 @@
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
 
+#include <inc/env.h>
+#include <inc/ns.h>
+#include <inc/memlayout.h>
 #include <kern/pci.h>
 #include <kern/e1000_regs.h>
 
@@ -9,7 +12,15 @@ volatile uint32_t *e1000; // MMIO address to access E1000 BAR
 #define E1000_TXDESC 64
 #define E1000_RXDESC 128
 #define TX_PKT_SIZE 1518
+#define ETH_HLEN 14
 #define RX_PKT_SIZE 2048
+#define E1000_NQUEUES NET_MAXQUEUES	// Queue pairs on the 82574L
+
+// Receive interrupt moderation.  The RX delay timer (RDTR, RADV) counts
+// in units of 1.024 usec, the throttle (ITR) in units of 256 nsec.
+#define E1000_RDTR_USEC		32	// Quiet time before RXT0 fires
+#define E1000_RADV_USEC		128	// Upper bound on that delay
+#define E1000_ITR_USEC		50	// At most 20000 interrupts per second
 
 #define E1000_EERD_START 0x01
 #define E1000_EERD_DONE  0x10
@@ -19,14 +30,24 @@ struct tx_pkt
 	uint8_t buf[TX_PKT_SIZE];
 } __attribute__((packed));
 
-struct rx_pkt
-{
-	uint8_t buf[RX_PKT_SIZE];
-} __attribute__((packed));
-
 
 int e1000_attach(struct pci_func *pcif);
-int e1000_transmit(char *data, int len);
-int e1000_receive(char *data);
+int e1000_transmit(int qn, char *data, int len);
+int e1000_receive(int qn, char *data);
+struct PageInfo *e1000_recv_page(int qn, struct PageInfo *pp, int *len);
+int e1000_transmit_frags(int qn, struct Env *e, const struct net_frag *frags,
+			 int nfrags);
+int e1000_tx_done(envid_t envid);
+int e1000_tx_wait(int qn, envid_t envid);
+int e1000_rx_wait(int qn, envid_t envid);
+void e1000_intr(void);
+void e1000_stats(struct net_hwstats *st);
+int e1000_bypass(int qn, struct Env *e, struct net_bypass *nb);
+int e1000_unbypass(int qn, struct Env *e);
+bool e1000_bypassed(int qn);
+void e1000_env_free(struct Env *e);
+
+extern uint8_t e1000_irq;
+extern int e1000_nqueues;
 
 #endif	// JOS_KERN_E1000_H
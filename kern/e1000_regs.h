@@ -85,6 +85,7 @@
 #define E1000_DEV_ID_82573E              0x108B
 #define E1000_DEV_ID_82573E_IAMT         0x108C
 #define E1000_DEV_ID_82573L              0x109A
+#define E1000_DEV_ID_82574L              0x10D3
 #define E1000_DEV_ID_82546GB_QUAD_COPPER_KSP3 0x10B5
 #define E1000_DEV_ID_80003ES2LAN_COPPER_DPT     0x1096
 #define E1000_DEV_ID_80003ES2LAN_SERDES_DPT     0x1098
@@ -317,6 +318,21 @@
 #define E1000_RSSIM     0x05864 /* RSS Interrupt Mask */
 #define E1000_RSSIR     0x05868 /* RSS Interrupt Request */
 
+/* Multiple Receive Queues Control */
+#define E1000_MRQC_ENABLE_RSS_2Q        0x00000001
+#define E1000_MRQC_RSS_FIELD_IPV4_TCP   0x00010000
+#define E1000_MRQC_RSS_FIELD_IPV4       0x00020000
+
+#define E1000_RETA_QUEUE1               0x80 /* Per entry: queue 1, else 0 */
+
+/* Receive Checksum Control */
+#define E1000_RXCSUM_IPOFL     0x00000100   /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL     0x00000200   /* TCP / UDP checksum offload */
+#define E1000_RXCSUM_PCSD      0x00002000   /* packet checksum disabled */
+
+/* Receive Filter Control */
+#define E1000_RFCTL_EXTEN      0x00008000   /* Extended descriptors */
+
 /* PHY 1000 MII Register/Bit Definitions */
 /* PHY Registers defined by IEEE */
 #define PHY_CTRL         0x00 /* Control Register */
@@ -798,6 +814,25 @@ struct e1000_rx_desc {
 #define E1000_RXDPS_HDRSTAT_HDRSP        0x00008000
 #define E1000_RXDPS_HDRSTAT_HDRLEN_MASK  0x000003FF
 
+/* Receive Descriptor - Extended (82574) */
+union e1000_rx_desc_extended {
+    struct {
+        uint64_t buffer_addr;
+        uint64_t reserved;
+    } read;
+    struct {
+        struct {
+            uint32_t mrq;           /* Multiple Rx Queues */
+            uint32_t rss;           /* RSS Hash */
+        } lower;
+        struct {
+            uint32_t status_error;  /* ext status/error */
+            uint16_t length;
+            uint16_t vlan;          /* VLAN tag */
+        } upper;
+    } wb;  /* writeback */
+};
+
 /* Receive Address */
 #define E1000_RAH_AV  0x80000000        /* Receive descriptor valid */
 
@@ -14,13 +14,21 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/console.h>
+#include <kern/e1000.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+static int env_alloc_common(struct Env **newenv_store, envid_t parent_id,
+			    pde_t *pgdir);
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+#define ENV_RT_PRIO_SERVER	50	// Real-time priority of fs and ns
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -36,7 +44,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +63,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU user env segments (starting from GD_UENV0) are
+	// initialized in env_pop_tf()
+	[GD_UENV0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -137,7 +149,8 @@ env_init_percpu(void)
 {
 	lgdt(&gdt_pd);
 	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
+	// the user data segment.  (env_pop_tf later points GS at the
+	// running environment's struct Env.)
 	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
@@ -203,6 +216,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// It is ENV_NOT_RUNNABLE; the caller makes it runnable (with
+// sched_set_status) once it is set up.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -210,6 +225,31 @@ env_setup_vm(struct Env *e)
 //
 int
 env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	return env_alloc_common(newenv_store, parent_id, NULL);
+}
+
+//
+// Allocates a new thread of environment 'e': a new environment that
+// shares e's address space instead of getting its own.
+// The shared page directory's pp_ref counts the environments using it;
+// env_free only tears the address space down when the last one goes.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NENVS environments are allocated
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *e)
+{
+	return env_alloc_common(newenv_store, e->env_id, e->env_pgdir);
+}
+
+//
+// Common code for env_alloc and env_alloc_thread.  If pgdir is NULL,
+// sets up a fresh address space, otherwise shares pgdir.
+//
+static int
+env_alloc_common(struct Env **newenv_store, envid_t parent_id, pde_t *pgdir)
 {
 	int32_t generation;
 	int r;
@@ -218,8 +258,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	if (!(e = env_free_list))
 		return -E_NO_FREE_ENV;
 
-	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	// Allocate and set up the page directory for this environment,
+	// or take another reference to the shared one.
+	if (pgdir) {
+		pa2page(PADDR(pgdir))->pp_ref++;
+		e->env_pgdir = pgdir;
+	} else if ((r = env_setup_vm(e)) < 0)
 		return r;
 
 	// Generate an env_id for this environment.
@@ -231,8 +275,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_sched_class = SCHED_FAIR;
+	e->env_priority = 0;
+	e->env_vruntime = 0;
+	e->env_cputime = 0;
+	e->env_cpumask = ~0;
+	e->env_migrations = 0;
+	e->env_rq_pprev = NULL;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -261,10 +312,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// No timer armed yet.
+	e->env_timer_pprev = NULL;
+
+	// Use the card's first queue pair until told otherwise.
+	e->env_net_queue = 0;
+
+	// Start with a full console budget.
+	e->env_cons_budget = CONS_BURST;
+	e->env_cons_msec = time_msec();
+	e->env_cons_dropped = 0;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -393,8 +456,9 @@ load_icode(struct Env *e, uint8_t *binary)
 // This function is ONLY called during kernel initialization,
 // before running the first user-mode environment.
 // The new env's parent ID is set to 0.
+// Returns the new env.
 //
-void
+struct Env *
 env_create(uint8_t *binary, enum EnvType type)
 {
 	// LAB 3: Your code here.
@@ -413,6 +477,16 @@ env_create(uint8_t *binary, enum EnvType type)
 		ep->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
 
+	// The file system and network servers run in the real-time class,
+	// so their clients don't wait behind CPU-bound environments.
+	// (Environments they fork start out in SCHED_FAIR again.)
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS) {
+		ep->env_sched_class = SCHED_RT;
+		ep->env_priority = ENV_RT_PRIO_SERVER;
+	}
+
+	sched_set_status(ep, ENV_RUNNABLE);
+	return ep;
 }
 
 //
@@ -424,6 +498,7 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct PageInfo *pgdir_page;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -431,9 +506,24 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// A sleeping environment may still be on the timer wheel.
+	timer_cancel(e);
+
+	// Take back any network queue pair it drove from user level.
+	e1000_env_free(e);
+
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// If other threads still share the address space, just drop our
+	// reference to it; the last one out frees it below.
+	pgdir_page = pa2page(PADDR(e->env_pgdir));
+	if (pgdir_page->pp_ref > 1) {
+		page_decref(pgdir_page);
+		e->env_pgdir = 0;
+		goto free_env;
+	}
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -462,8 +552,9 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+free_env:
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
@@ -504,7 +595,34 @@ env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
+
+	// Point this CPU's user env segment at curenv's read-only struct Env
+	// in UENVS and load it into %gs.  This is how user code finds its
+	// own environment (see thisenv in inc/lib.h) without a global
+	// variable, so environments that share memory still see their own.
+	gdt[(GD_UENV0 >> 3) + cpunum()] =
+		SEG16(0, UENVS + ENVX(curenv->env_id) * sizeof(struct Env),
+		      sizeof(struct Env) - 1, 3);
+	asm volatile("movw %%ax,%%gs" :: "a" ((GD_UENV0 + 8 * cpunum()) | 3));
+
+	// Catch up on a TLB shootdown that was sent while we were in the
+	// kernel (see tlb_shootdown).
+	if (xchg(&thiscpu->cpu_tlb_stale, 0))
+		lcr3(rcr3());
+
 	unlock_kernel();
+	xchg(&thiscpu->cpu_in_user, 1);
+	trapframe_pop(tf);
+}
+
+//
+// Pop tf with 'iret', without touching the kernel lock or curenv.
+//
+// This function does not return.
+//
+void
+trapframe_pop(struct Trapframe *tf)
+{
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -545,12 +663,20 @@ env_run(struct Env *e)
 	//cprintf("\n");
 	if (curenv != e) {
 		if (curenv && curenv->env_status == ENV_RUNNING)
-			curenv->env_status = ENV_RUNNABLE;
+			sched_set_status(curenv, ENV_RUNNABLE);
 		curenv = e;
-		e->env_status = ENV_RUNNING;
+		if (e->env_runs && e->env_cpunum != cpunum())
+			e->env_migrations++;
 		e->env_runs++;
-		lcr3(PADDR(e->env_pgdir));
+		// Start charging e for CPU time (see sched_yield).
+		thiscpu->cpu_tsc_start = read_tsc();
+		// Switching between threads of one environment keeps the TLB.
+		if (rcr3() != PADDR(e->env_pgdir))
+			lcr3(PADDR(e->env_pgdir));
 	}
+	// (Also when curenv == e: it may have been made runnable and queued
+	// again without ever leaving this CPU.)
+	sched_set_status(e, ENV_RUNNING);
 	env_pop_tf(&e->env_tf);
 	//cprintf("%s %d\n", __FILE__, __LINE__);
 	//panic("env_run not yet implemented");
@@ -16,6 +16,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/e1000.h>
 
 static void boot_aps(void);
 
@@ -35,6 +36,7 @@ void
 i386_init(void)
 {
 	extern char edata[], end[];
+	int i;
 
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
@@ -79,8 +81,10 @@ i386_init(void)
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
 #if !defined(TEST_NO_NS)
-	// Start ns.
-	ENV_CREATE(net_ns, ENV_TYPE_NS);
+	// Start ns: an instance per queue pair of the network card, each
+	// with its own TCP/IP stack driving that pair (see net/serv.c).
+	for (i = 0; i < MAX(e1000_nqueues, 1); i++)
+		ENV_CREATE(net_ns, ENV_TYPE_NS)->env_net_queue = i;
 #endif
 
 #if defined(TEST)
@@ -180,6 +184,8 @@ _panic(const char *file, int line, const char *fmt,...)
 
 	// Be extra sure that the machine is in as reasonable state
 	__asm __volatile("cli; cld");
+	// Get out what was printed before, and print the rest directly.
+	cons_panic();
 
 	va_start(ap, fmt);
 	cprintf("kernel panic on CPU %d at %s:%d: ", cpunum(), file, line);
@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -42,9 +43,21 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// The 8253 PIT's channel 2, gated through the keyboard controller's
+// port B, gives a known interval to calibrate the timer against.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_PORTB	0x61
+	#define PIT_GATE2	0x01	// Channel 2 gate
+	#define PIT_SPKR	0x02	// Speaker enable
+	#define PIT_OUT2	0x20	// Channel 2 output
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+static uint32_t lapic_timer_hz;	// Timer count rate; the same on every CPU
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +65,48 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the LAPIC timer and TSC rates over 10 ms of PIT time.
+static void
+lapic_calibrate(void)
+{
+	uint32_t latch = PIT_HZ / 100, count;
+	uint64_t tsc;
+
+	outb(PIT_PORTB, (inb(PIT_PORTB) & ~PIT_SPKR) | PIT_GATE2);
+	outb(PIT_MODE, 0xB0);	// Channel 2, lobyte/hibyte, mode 0
+	outb(PIT_CH2, latch & 0xFF);
+	outb(PIT_CH2, latch >> 8);
+	lapicw(TICR, 0xFFFFFFFF);
+	tsc = read_tsc();
+	while (!(inb(PIT_PORTB) & PIT_OUT2))
+		;
+	tsc = read_tsc() - tsc;
+	count = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	tsc_hz = tsc * 100;
+	lapic_timer_hz = count * 100;
+}
+
+// Interrupt this CPU once, nsec nanoseconds from now.
+// nsec == 0 stops the timer.
+void
+lapic_timer_set(uint64_t nsec)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	if (nsec > 4000000000ULL)
+		nsec = 4000000000ULL;	// Fire early; the caller re-arms
+	count = nsec * lapic_timer_hz / 1000000000;
+	if (count > 0xFFFFFFFF)
+		count = 0xFFFFFFFF;
+	if (nsec && !count)
+		count = 1;
+	lapicw(TICR, count);
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +120,17 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  kern/time.c reprograms it for
+	// each event (the end of a time slice, or the earliest timer
+	// deadline), so idle CPUs are not interrupted needlessly.
+	// Calibrate it, and the TSC, against the PIT on the boot CPU.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	if (thiscpu == bootcpu)
+		lapic_calibrate();
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapic_timer_set(TIME_SLICE_NSEC);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -180,3 +239,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an IPI to the single CPU whose local APIC ID is apicid.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
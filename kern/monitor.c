@@ -29,6 +29,7 @@ static struct Command commands[] = {
 	{ "showmappings", "display the physical page mappings and corresponding permission bits", mon_showmappings },
 	{ "mset", "set or clear a flag in a specific page", mon_mset },
 	{ "mdump", "dump memory", mon_mdump },
+	{ "dmesg", "print the console's recent output again", mon_dmesg },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -187,6 +188,17 @@ mon_mdump(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2) {
+		cprintf("usage: dmesg [nbytes]\n");
+		return 0;
+	}
+	cons_dmesg(argc == 2 ? strtol(argv[1], NULL, 0) : 0);
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
@@ -237,6 +249,7 @@ monitor(struct Trapframe *tf)
 {
 	char *buf;
 
+	cons_flush();
 	cprintf("Welcome to the JOS kernel monitor!\n");
 	cprintf("Type 'help' for a list of commands.\n");
 
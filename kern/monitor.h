@@ -18,4 +18,5 @@ int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_mset(int argc, char **argv, struct Trapframe *tf);
 int mon_mdump(int argc, char **argv, struct Trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct Trapframe *tf);
 #endif	// !JOS_KERN_MONITOR_H
@@ -32,6 +32,7 @@ struct pci_driver pci_attach_class[] = {
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
 	{PCI_VENDOR_ID_INTEL, E1000_DEV_ID_82540EM, &e1000_attach},
+	{PCI_VENDOR_ID_INTEL, E1000_DEV_ID_82574L, &e1000_attach},
 	{ 0, 0, 0 },
 };
 
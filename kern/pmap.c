@@ -67,6 +67,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void tlb_shootdown(pde_t *pgdir);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -542,6 +543,10 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	pte = pgdir_walk(pgdir, va, 0);
 	if (!pte || !(*pte & PTE_P))
 		return NULL;
+	// Device memory mapped to user space (sys_net_bypass) has no
+	// PageInfo.
+	if (PGNUM(PTE_ADDR(*pte)) >= npages)
+		return NULL;
 	if(pte_store)
 		*pte_store = pte;
 	return pa2page(PTE_ADDR(*pte));
@@ -589,6 +594,35 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	// Threads sharing pgdir may be running on other CPUs.
+	if (pgdir != kern_pgdir && pa2page(PADDR(pgdir))->pp_ref > 1)
+		tlb_shootdown(pgdir);
+}
+
+//
+// Make other CPUs drop stale TLB entries for pgdir.
+// Every CPU whose current environment uses pgdir is marked stale and
+// sent a T_TLBFLUSH IPI.  We wait for those running user code to flush;
+// those that have trapped into the kernel are waiting for the big
+// kernel lock, which we hold, and flush in trap as soon as they get it,
+// before they touch user memory.  One on its way back out flushes in
+// env_pop_tf, or takes the IPI as soon as it irets.
+//
+static void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || !c->cpu_env || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		xchg(&c->cpu_tlb_stale, 1);
+		lapic_ipi_cpu(c->cpu_id, T_TLBFLUSH);
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_stale && c->cpu_in_user)
+			asm volatile("pause");
 }
 
 //
@@ -4,55 +4,330 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
 
-// Choose a user environment to run and run it.
+// Two scheduling classes:
+//
+// SCHED_RT environments (the fs and ns servers) run ahead of everything
+// else, highest env_priority first, round-robin among equals.  They are
+// expected to block rather than spin.
+//
+// SCHED_FAIR environments share the remaining CPU time in proportion to
+// the weight of their nice value.  Each accumulates virtual runtime --
+// CPU time scaled by NICE_0_WEIGHT / weight -- and the one furthest
+// behind runs next.  An environment that slept is brought forward to
+// within one time slice of min_vruntime when it is next considered, so
+// it cannot bank CPU time while blocked.
+//
+// CPU time is charged in TSC cycles whenever the scheduler runs.
+//
+// Each CPU has its own run queue of ENV_RUNNABLE environments, and
+// only picks from that (plus curenv).  An environment is queued on the
+// CPU it last ran on, whose caches and TLB are still warm, or on the
+// least loaded CPU if it hasn't run yet; either way only on a CPU in
+// its env_cpumask (sys_env_set_affinity).  A CPU whose queue runs dry
+// steals from the busiest peer before halting, and a halted CPU is
+// woken by IPI when there is work for it.  The big kernel lock
+// protects the queues.
+
+#define NICE_0_WEIGHT	1024
+
+// Weight of each nice value from ENV_NICE_MIN to ENV_NICE_MAX.
+// Neighbouring values differ by about 25%, i.e. about 10% of the CPU.
+static const uint32_t nice_weight[ENV_NICE_MAX - ENV_NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	 9548,  7620,  6100,  4904,  3906,
+	 3121,  2501,  1991,  1586,  1277,
+	 1024,   820,   655,   526,   423,
+	  335,   272,   215,   172,   137,
+	  110,    87,    70,    56,    45,
+	   36,    29,    23,    18,    15,
+};
+
+static uint64_t min_vruntime;	// Virtual runtime of the fair env last picked
+
+// Charge the current environment for the CPU time since it was last
+// charged (env_run starts the clock).
+static void
+sched_account(void)
+{
+	uint64_t now, delta;
+
+	if (!curenv)
+		return;
+	now = read_tsc();
+	delta = now - thiscpu->cpu_tsc_start;
+	thiscpu->cpu_tsc_start = now;
+	curenv->env_cputime += delta;
+	if (curenv->env_sched_class == SCHED_FAIR)
+		curenv->env_vruntime += delta * NICE_0_WEIGHT
+			/ nice_weight[curenv->env_priority - ENV_NICE_MIN];
+}
+
+// Time slice length in TSC cycles.
+static uint64_t
+slice_cycles(void)
+{
+	return tsc_hz * TIME_SLICE_NSEC / 1000000000;
+}
+
+// The lowest virtual runtime a fair env may compete with.
+static uint64_t
+vruntime_floor(void)
+{
+	uint64_t slice = slice_cycles();
+
+	return min_vruntime > slice ? min_vruntime - slice : 0;
+}
+
+// Virtual runtime handicap for running a fair env away from the CPU
+// whose caches it last warmed (after a steal): half a time slice.
+#define MIGRATE_COST	(slice_cycles() / 2)
+
+// May e run on CPU c?
+static bool
+allowed_on(struct Env *e, struct CpuInfo *c)
+{
+	return e->env_cpumask & (1 << (c - cpus));
+}
+
+// Did e last run on this CPU?
+static bool
+cache_hot(struct Env *e)
+{
+	return e->env_runs == 0 || e->env_cpunum == cpunum();
+}
+
+// Number of environments waiting for or running on CPU c.
+static int
+cpu_load(struct CpuInfo *c)
+{
+	return c->cpu_nrunnable + (c->cpu_env != NULL);
+}
+
+static void
+runq_insert(struct CpuInfo *c, struct Env *e)
+{
+	e->env_rq_next = NULL;
+	e->env_rq_pprev = c->cpu_runq ? c->cpu_runq_tail : &c->cpu_runq;
+	*e->env_rq_pprev = e;
+	c->cpu_runq_tail = &e->env_rq_next;
+	e->env_rq_cpu = c - cpus;
+	c->cpu_nrunnable++;
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct CpuInfo *c = &cpus[e->env_rq_cpu];
+
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_pprev = e->env_rq_pprev;
+	else
+		c->cpu_runq_tail = e->env_rq_pprev;
+	*e->env_rq_pprev = e->env_rq_next;
+	e->env_rq_pprev = NULL;
+	c->cpu_nrunnable--;
+}
+
+// Wake halted CPU c, which takes the IPI like an early timer tick.
+static void
+cpu_kick(struct CpuInfo *c)
+{
+	lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TIMER);
+}
+
+// Queue runnable environment e on a CPU and make sure some CPU will
+// get to it.
+static void
+sched_enqueue(struct Env *e)
+{
+	struct CpuInfo *c, *target = NULL;
+
+	// Soft affinity: the CPU e last ran on, if it still may.
+	if (e->env_runs && allowed_on(e, &cpus[e->env_cpunum]))
+		target = &cpus[e->env_cpunum];
+	else
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (allowed_on(e, c)
+			    && (!target || cpu_load(c) < cpu_load(target)))
+				target = c;
+	runq_insert(target, e);
+
+	if (target != thiscpu && target->cpu_status == CPU_HALTED) {
+		cpu_kick(target);
+		return;
+	}
+	// e has to wait on a busy CPU: get a halted one to steal it.
+	if (cpu_load(target) > 1)
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c != thiscpu && c->cpu_status == CPU_HALTED
+			    && allowed_on(e, c)) {
+				cpu_kick(c);
+				return;
+			}
+}
+
+// Change e's status, keeping the run queues in step: an environment is
+// on exactly one run queue, on a CPU it may use, while ENV_RUNNABLE.
 void
-sched_yield(void)
+sched_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_rq_pprev && (status != ENV_RUNNABLE
+				|| !allowed_on(e, &cpus[e->env_rq_cpu])))
+		runq_remove(e);
+	e->env_status = status;
+	if (status == ENV_RUNNABLE && !e->env_rq_pprev)
+		sched_enqueue(e);
+}
+
+// This CPU has nothing to run: pull environments it may run from the
+// peer with the longest run queue, up to half of them, so that the two
+// share the backlog.  Only that one peer is examined, which bounds the
+// time spent here with the kernel lock held.
+static void
+sched_steal(void)
+{
+	struct CpuInfo *c, *victim = NULL;
+	struct Env *e, *next;
+	int n;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_nrunnable > 0
+		    && (!victim || c->cpu_nrunnable > victim->cpu_nrunnable))
+			victim = c;
+	if (!victim)
+		return;
+	n = (victim->cpu_nrunnable + 1) / 2;
+	for (e = victim->cpu_runq; e && n > 0; e = next) {
+		next = e->env_rq_next;
+		if (!allowed_on(e, thiscpu))
+			continue;
+		runq_remove(e);
+		runq_insert(thiscpu, e);
+		n--;
+	}
+}
+
+// Running choice of the best environment among candidates.
+struct pick {
+	struct Env *rt;		// Highest-priority real-time env so far
+	struct Env *fair;	// Fair env furthest behind so far
+	uint64_t fair_v;	// Its virtual runtime, brought up to floor
+	uint64_t fair_key;	// fair_v plus any migration cost
+	uint64_t floor;		// vruntime_floor()
+};
+
+static void
+pick_consider(struct pick *p, struct Env *e)
 {
-	struct Env *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	struct Env *e, *runenv = NULL;
-	int i, cur=0;
-	if (curenv) cur=ENVX(curenv->env_id);
-		else cur = 0;
-	// cprintf("cur: %x, thiscpu: %x\n", cur, thiscpu->cpu_id);
-	for (i = 0; i < NENV; ++i) {
-		int j = (cur+i) % NENV;
-		//if (j < 2) cprintf("envs[%x].env_status: %x\n", j, envs[j].env_status);
-		if (envs[j].env_status == ENV_RUNNABLE) {
-			//if (j == 1) cprintf("\n");
-			env_run(envs + j);
+	uint64_t v, key;
+
+	if (e->env_sched_class == SCHED_RT) {
+		if (!p->rt || e->env_priority > p->rt->env_priority)
+			p->rt = e;
+	} else if (!p->rt) {
+		v = MAX(e->env_vruntime, p->floor);
+		key = cache_hot(e) ? v : v + MIGRATE_COST;
+		if (!p->fair || key < p->fair_key) {
+			p->fair = e;
+			p->fair_v = v;
+			p->fair_key = key;
 		}
 	}
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
+}
+
+// Choose the best environment on this CPU's run queue, or curenv if it
+// is still running here, never choosing skip.  Returns NULL if there
+// are none.
+static struct Env *
+runq_pick(struct Env *skip)
+{
+	struct pick p = { NULL, NULL, 0, 0, vruntime_floor() };
+	struct Env *e;
+
+	// Queue order first, then curenv, so that ties go round-robin.
+	for (e = thiscpu->cpu_runq; e; e = e->env_rq_next)
+		if (e != skip)
+			pick_consider(&p, e);
+	if (curenv && curenv != skip && curenv->env_status == ENV_RUNNING
+	    && allowed_on(curenv, thiscpu))
+		pick_consider(&p, curenv);
+
+	if (p.rt)
+		return p.rt;
+	if (p.fair) {
+		p.fair->env_vruntime = p.fair_v;
+		min_vruntime = MAX(min_vruntime, p.fair_v);
+	}
+	return p.fair;
+}
 
+// Choose the environment to run next on this CPU, stealing work from
+// another CPU if there is none here.
+static struct Env *
+sched_pick(struct Env *skip)
+{
+	struct Env *e;
+
+	if ((e = runq_pick(skip)) == NULL) {
+		sched_steal();
+		e = runq_pick(skip);
+	}
+	return e;
+}
+
+// If curenv may no longer run on this CPU (its affinity changed),
+// hand it back to the scheduler for a CPU it may run on.
+static void
+sched_evict(void)
+{
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && !allowed_on(curenv, thiscpu))
+		sched_set_status(curenv, ENV_RUNNABLE);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *e;
+
+	sched_account();
+	sched_evict();
+	if ((e = sched_pick(NULL)) != NULL)
+		env_run(e);
 
-	//cprintf("runenv: %x\n", runenv);
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// The current environment gave up the CPU (sys_yield): run anything
+// else that is runnable first, whatever its class, and only then the
+// current environment again.  Environments spin on sys_yield waiting
+// for one another, so a real-time waiter must not shut out the fair
+// environment it is waiting for.
+void
+sched_relinquish(void)
+{
+	struct Env *e;
+
+	sched_account();
+	sched_evict();
+	if ((e = sched_pick(curenv)) != NULL)
+		env_run(e);
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
+	sched_halt();
+}
+
+// Halt this CPU when there is nothing to do. Wait until a timer
+// deadline or another CPU's IPI wakes it up. This function never returns.
 //
 void
 sched_halt(void)
@@ -61,10 +336,12 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// An environment with an armed timer will become runnable later.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		     envs[i].env_status == ENV_DYING ||
+		     envs[i].env_timer_pprev))
 			break;
 	}
 	if (i == NENV) {
@@ -77,6 +354,9 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// No time slice to end; only wake for the next timer deadline.
+	time_program(1);
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
@@ -96,5 +376,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	__builtin_unreachable();
 }
 
@@ -19,6 +19,9 @@ sys_getenvid(void);
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
+// An environment may print CONS_BURST bytes at once and CONS_RATE
+// bytes a millisecond after that.  A string over its budget is
+// dropped whole, and the next one it gets to print says how much was.
 // Destroys the environment on memory errors.
 static void
 sys_cputs(const char *s, size_t len)
@@ -28,10 +31,27 @@ sys_cputs(const char *s, size_t len)
 
 	// LAB 3: Your code here.
 	struct Env *e;
+	uint32_t now, n;
+
 	envid2env(sys_getenvid(), &e, 1);
 	user_mem_assert(e, s, len, PTE_U);
 	//user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
+	now = time_msec();
+	n = MIN(now - e->env_cons_msec, CONS_BURST / CONS_RATE) * CONS_RATE;
+	e->env_cons_budget = MIN(e->env_cons_budget + n, CONS_BURST);
+	e->env_cons_msec = now;
+	if (len > e->env_cons_budget) {
+		e->env_cons_dropped += len;
+		return;
+	}
+	e->env_cons_budget -= len;
+	if (e->env_cons_dropped) {
+		cprintf("[%08x] %u bytes of console output dropped\n",
+			e->env_id, e->env_cons_dropped);
+		e->env_cons_dropped = 0;
+	}
+
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
 }
@@ -72,7 +92,7 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
-	sched_yield();
+	sched_relinquish();
 }
 
 // Allocate a new environment.
@@ -94,7 +114,7 @@ sys_exofork(void)
 	int ret = env_alloc(&e, curenv->env_id);
 	if (ret) return ret;
 	e->env_tf = curenv->env_tf;
-	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_cpumask = curenv->env_cpumask;
 	e->env_tf.tf_regs.reg_eax = 0;
 	// cprintf("e pgdir: %x\n", e, e->env_pgdir);
 
@@ -102,6 +122,42 @@ sys_exofork(void)
 	//panic("sys_exofork not implemented");
 }
 
+// Create a new thread of the current environment: a new environment
+// that shares curenv's address space rather than getting its own.
+// The thread starts running at 'eip' with stack pointer 'esp', and takes
+// page faults on the exception stack whose top is 'xstacktop' (threads
+// cannot share one).  Its other registers, page fault upcall and type
+// are copied from the current environment; the upcall then stays the
+// same across all the threads (see sys_env_set_pgfault_upcall).  It is
+// created runnable.
+//
+// Returns envid of new thread, or < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or xstacktop is above UTOP.
+//	-E_NO_FREE_ENV if no free environment is available.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	struct Env *e;
+	int r;
+
+	if (eip >= UTOP || esp > UTOP || xstacktop > UTOP)
+		return -E_INVAL;
+
+	if ((r = env_alloc_thread(&e, curenv)) < 0)
+		return r;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_uxstacktop = xstacktop;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_type = curenv->env_type;
+	e->env_sched_class = curenv->env_sched_class;
+	e->env_priority = curenv->env_priority;
+	e->env_cpumask = curenv->env_cpumask;
+	sched_set_status(e, ENV_RUNNABLE);
+	return e->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -123,11 +179,87 @@ sys_env_set_status(envid_t envid, int status)
 	struct Env *e; 
 	int ret = envid2env(envid, &e, 1);
 	if (ret) return ret;	//bad_env
-	e->env_status = status;
+	sched_set_status(e, status);
 	return 0;
 	//panic("sys_env_set_status not implemented");
 }
 
+// Set envid's scheduling class and priority (see inc/env.h):
+// a nice value for SCHED_FAIR, a real-time priority for SCHED_RT.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if sched_class is not a scheduling class, or priority is
+//		out of range for it.
+//	-E_INVAL if sched_class is SCHED_RT but the caller is not itself
+//		real-time (only the servers may hand out real-time priority).
+//	-E_INVAL if a caller that is not real-time asks for a negative
+//		nice value below envid's current one, or for envid to
+//		leave SCHED_RT with one; a negative nice value takes CPU
+//		from every other fair-share environment.
+static int
+sys_env_set_priority(envid_t envid, int sched_class, int priority)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (sched_class == SCHED_FAIR) {
+		if (priority < ENV_NICE_MIN || priority > ENV_NICE_MAX)
+			return -E_INVAL;
+		if (priority < 0 && curenv->env_sched_class != SCHED_RT
+		    && (e->env_sched_class != SCHED_FAIR
+			|| priority < e->env_priority))
+			return -E_INVAL;
+	} else if (sched_class == SCHED_RT) {
+		if (priority < ENV_RT_PRIO_MIN || priority > ENV_RT_PRIO_MAX
+		    || curenv->env_sched_class != SCHED_RT)
+			return -E_INVAL;
+	} else
+		return -E_INVAL;
+	e->env_sched_class = sched_class;
+	e->env_priority = priority;
+	return 0;
+}
+
+// Returns the number of CPUs, which are cpus[0] through cpus[ncpu - 1].
+static int
+sys_ncpu(void)
+{
+	return ncpu;
+}
+
+// Allow envid to run only on the CPUs in 'mask' (bit i is cpus[i]).
+// Bits for CPUs that don't exist are ignored.  If the caller can no
+// longer run on its current CPU, it moves right away.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask contains no existing CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (ncpu < 32)
+		mask &= (1 << ncpu) - 1;
+	if (!mask)
+		return -E_INVAL;
+	e->env_cpumask = mask;
+	if (e->env_status == ENV_RUNNABLE)
+		// Move it to a queue for a CPU it may use.
+		sched_set_status(e, ENV_RUNNABLE);
+	else if (e == curenv && !(mask & (1 << cpunum())))
+		sched_set_status(e, ENV_RUNNABLE);
+	return 0;
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -155,7 +287,8 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
-// 'func'.
+// 'func'.  The upcall belongs to the address space, so it is set for every
+// thread sharing envid's page directory (see sys_thread_create).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -165,9 +298,13 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
 	struct Env *e; 
+	int i;
 	int ret = envid2env(envid, &e, 1);
 	if (ret) return ret;	//bad_env
-	e->env_pgfault_upcall = func;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE
+		    && envs[i].env_pgdir == e->env_pgdir)
+			envs[i].env_pgfault_upcall = func;
 	return 0;
 	//panic("sys_env_set_pgfault_upcall not implemented");
 }
@@ -393,10 +530,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		}
 	}
 	e->env_ipc_recving = 0;
+	timer_cancel(e);
 	e->env_ipc_from = curenv->env_id;
 	e->env_ipc_value = value; 
-	e->env_status = ENV_RUNNABLE;
 	e->env_tf.tf_regs.reg_eax = 0;
+	sched_set_status(e, ENV_RUNNABLE);
 	return 0;
 	//panic("sys_ipc_try_send not implemented");
 }
@@ -421,12 +559,111 @@ sys_ipc_recv(void *dstva)
 		return -E_INVAL;
 
 	curenv->env_ipc_recving = 1;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
 	curenv->env_ipc_dstva = dstva;
 	return 0;
 	//panic("sys_ipc_recv not implemented");
 }
 
+// Like sys_ipc_recv, but give up at time 'msec' (as returned by
+// sys_time_msec).  The environment blocks on the timer wheel with
+// no busy-waiting.
+//
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if the deadline passes before a value arrives
+//		(immediately, if it has already passed).
+static int
+sys_ipc_recv_until(void *dstva, unsigned int msec)
+{
+	int r;
+
+	if ((int) (time_msec() - msec) >= 0)
+		return -E_TIMEOUT;
+	if ((r = sys_ipc_recv(dstva)) < 0)
+		return r;
+	timer_set(curenv, msec);
+	return 0;
+}
+
+// A doorbell for one waiter, in a flag word of user memory: the waiter
+// sets *flag, checks whether it still has to wait, and if so calls
+// sys_ipc_wait with it; whoever it waits on clears the flag with
+// sys_ipc_ring.  Both check the flag under the kernel lock, so the ring
+// is never lost and never turns into a stray IPC for a later receive.
+
+// Block as sys_ipc_recv(UTOP) does, for at most 'timeout' msec (forever
+// if negative), unless one of the 'nflags' doorbells in 'flags' is
+// already clear because it rang first.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if nflags is negative or the array is over a page.
+//	-E_TIMEOUT if the timeout passes before a doorbell rings
+//		(immediately, if it is 0).
+// Destroys the environment if the array or a flag is not a user
+// address, or a flag is read-only.
+static int
+sys_ipc_wait(volatile uint32_t *const *flags, int nflags, int timeout)
+{
+	int i;
+
+	if (nflags < 0 || nflags > PGSIZE / sizeof(*flags))
+		return -E_INVAL;
+	user_mem_assert(curenv, flags, nflags * sizeof(*flags), PTE_U);
+	for (i = 0; i < nflags; i++) {
+		user_mem_assert(curenv, (void *) flags[i], sizeof(*flags[i]),
+				PTE_U | PTE_W);
+		if (!*flags[i])
+			return 0;
+	}
+	if (timeout < 0)
+		return sys_ipc_recv((void *) UTOP);
+	return sys_ipc_recv_until((void *) UTOP, time_msec() + timeout);
+}
+
+// Ring the doorbell *flag of envid without blocking: clear the flag, and
+// if it was set and envid is in sys_ipc_wait, wake it with an IPC of 0.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_IPC_NOT_RECV if envid isn't waiting yet; the ring is dropped,
+//		and its sys_ipc_wait returns at once.
+// Destroys the environment if flag is not a writable user address.
+static int
+sys_ipc_ring(envid_t envid, volatile uint32_t *flag)
+{
+	struct Env *e;
+	int r;
+
+	user_mem_assert(curenv, (void *) flag, sizeof(*flag), PTE_U | PTE_W);
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (!xchg(flag, 0))
+		return 0;
+	return sys_ipc_try_send(envid, 0, (void *) UTOP, 0);
+}
+
+// Block until time 'msec' (as returned by sys_time_msec).
+// Returns 0, immediately if that time has already passed.
+static int
+sys_sleep_until(unsigned int msec)
+{
+	if ((int) (time_msec() - msec) >= 0)
+		return 0;
+	timer_set(curenv, msec);
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Store the time in nanoseconds since boot in *nsec.
+// Returns 0 on success.  Destroys the environment if nsec is not a
+// writable user address.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+	user_mem_assert(curenv, nsec, sizeof(*nsec), PTE_U | PTE_W);
+	*nsec = time_nsec();
+	return 0;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -436,28 +673,230 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Whether the caller's queue pair has been handed to a user-level
+// driver (sys_net_bypass), so the other sys_net_* calls can't use it.
+static bool
+net_bypassed(void)
+{
+	return e1000_bypassed(curenv->env_net_queue);
+}
+
 static int
 sys_net_try_send(char *data, int len)
 {
-	if ((uintptr_t) data >= UTOP)
+	if ((uintptr_t) data >= UTOP || net_bypassed())
 		return -E_INVAL;
 
-	return e1000_transmit(data, len);
+	return e1000_transmit(curenv->env_net_queue, data, len);
 }
 
 static int
 sys_net_try_recv(char *data, int *len)
 {
 	int ret;
-	if ((uintptr_t) data >= UTOP)
+	if ((uintptr_t) data >= UTOP || net_bypassed())
 		return -E_INVAL;
 
-	 if((ret = e1000_receive(data))<0)
+	 if((ret = e1000_receive(curenv->env_net_queue, data))<0)
 		return ret;
 	 *len = ret;
 	 return 0;
 }
 
+// Zero-copy transmit of a batch of frames made of the 'nfrags'
+// pieces in 'frags' (0 <= nfrags <= NET_BATCH_FRAGS).  A piece with
+// NET_FRAG_EOP set ends a frame, as does the last piece; a frame may
+// have up to NET_MAX_FRAGS pieces.  The pages holding them are pinned
+// until the card has sent the frame, but the caller must not modify
+// the data until then.  A frame's first piece may also ask for
+// checksum offload or TCP segmentation (NET_FRAG_CSUM, NET_FRAG_TSO).
+// Frames are queued in order until the ring is full.  If 'ndone' is
+// not null, stores in *ndone the number of the caller's earlier frames
+// that have been sent since the last time (so their buffers may be
+// reused).
+// Returns the number of frames queued, or < 0 if none were.  Errors are:
+//	-E_INVAL if nfrags is out of range, or the first frame is
+//		empty or has too many pieces.
+//	-E_INVAL if the first frame asks for offload the card can't do.
+//	-E_PKT_TOO_LONG if the first frame is longer than TX_PKT_SIZE
+//		(NET_TSO_MAX with NET_FRAG_TSO).
+//	-E_TX_FULL if the ring is full; try again after sys_net_wait_send.
+// Destroys the environment if 'frags', any piece, or 'ndone' is not
+// accessible.
+static int
+sys_net_send_frags(const struct net_frag *frags, int nfrags, int *ndone)
+{
+	struct net_frag kfrags[NET_BATCH_FRAGS];
+	int i, start, nsent, r;
+
+	if (nfrags < 0 || nfrags > NET_BATCH_FRAGS || net_bypassed())
+		return -E_INVAL;
+	if (ndone)
+		user_mem_assert(curenv, ndone, sizeof(*ndone), PTE_U | PTE_W);
+	// Copy the list so a sibling thread can't change it under us.
+	user_mem_assert(curenv, frags, nfrags * sizeof(*frags), PTE_U);
+	memmove(kfrags, frags, nfrags * sizeof(*frags));
+	for (i = 0; i < nfrags; i++)
+		if (kfrags[i].nf_len > 0)
+			user_mem_assert(curenv, kfrags[i].nf_data,
+					kfrags[i].nf_len, PTE_U);
+
+	r = nsent = 0;
+	for (start = i = 0; i < nfrags; i++) {
+		if (!(kfrags[i].nf_flags & NET_FRAG_EOP) && i < nfrags - 1)
+			continue;
+		if (i + 1 - start > NET_MAX_FRAGS)
+			r = -E_INVAL;
+		else
+			r = e1000_transmit_frags(curenv->env_net_queue, curenv,
+						 &kfrags[start], i + 1 - start);
+		if (r < 0)
+			break;
+		nsent++;
+		start = i + 1;
+	}
+	if (nsent == 0 && r < 0)
+		return r;
+	if (ndone)
+		*ndone = e1000_tx_done(curenv->env_id);
+	return nsent;
+}
+
+// Zero-copy receive of up to 'npages' frames (1 <= npages <=
+// E1000_RXDESC).  The caller donates the pages mapped at va, va +
+// PGSIZE, and so on, which become receive buffers: each is swapped in
+// turn for a page holding the next received frame, mapped in its place
+// with PTE_U|PTE_P|PTE_W and laid out as a struct jif_pkt followed by
+// a zero jp_len.  Stops early when the ring runs dry or at a page that
+// can't be donated; the rest stay the caller's.
+// Returns the number of pages swapped, or < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP or is not page-aligned, npages is out of
+//		range, or the first page isn't a writable page mapped
+//		only there (the card would write into it elsewhere).
+//	-E_RCV_EMPTY if no frame has arrived.  The pages stay mapped.
+static int
+sys_net_recv_batch(void *va, int npages)
+{
+	struct PageInfo *pp, *full;
+	char *pg = va;
+	pte_t *pte;
+	int i, len, r;
+
+	if ((uintptr_t) va >= UTOP || PGOFF(va) || npages < 1
+	    || npages > E1000_RXDESC || (uintptr_t) va + npages * PGSIZE > UTOP
+	    || net_bypassed())
+		return -E_INVAL;
+	for (i = 0; i < npages; i++, pg += PGSIZE) {
+		if (!(pp = page_lookup(curenv->env_pgdir, pg, &pte))
+		    || !(*pte & PTE_W) || pp->pp_ref != 1)
+			return i ? i : -E_INVAL;
+		// Our reference keeps pp alive across the page_insert
+		// below; e1000_recv_page hands it on to the ring.
+		pp->pp_ref++;
+		if (!(full = e1000_recv_page(curenv->env_net_queue, pp, &len))) {
+			page_decref(pp);
+			break;
+		}
+		if ((r = page_insert(curenv->env_pgdir, full, pg,
+				     PTE_U | PTE_P | PTE_W)) < 0)
+			panic("sys_net_recv_batch: %e", r);
+		page_decref(full);	// Drop the ring's reference
+	}
+	return i ? i : -E_RCV_EMPTY;
+}
+
+// Block until the network card's transmit ring has room for a frame.
+// Returns 0 when there may be room, or
+//	-E_INVAL if another environment is already waiting.
+static int
+sys_net_wait_send(void)
+{
+	int r;
+
+	if (net_bypassed())
+		return -E_INVAL;
+	if ((r = e1000_tx_wait(curenv->env_net_queue, curenv->env_id)) <= 0)
+		return r;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Block until the network card has a received packet waiting.
+// Returns 0 when there may be a packet (callers should then
+// sys_net_try_recv, which can still find the ring empty), or
+//	-E_INVAL if another environment is already waiting.
+// This also works on a queue pair a user-level driver has taken, to
+// sleep until its ring has a packet rather than poll.
+static int
+sys_net_wait_recv(void)
+{
+	int r;
+
+	if ((r = e1000_rx_wait(curenv->env_net_queue, curenv->env_id)) <= 0)
+		return r;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Bind the calling environment to the network card's queue pair q:
+// its later sys_net_* calls receive from and transmit on that pair's
+// rings, and wait for that pair.  Where the card spreads received
+// flows over several pairs (RSS), each pair needs a receiver.
+// Returns the number of queue pairs the card has, or
+//	-E_INVAL if q is out of range or there is no card.
+static int
+sys_net_set_queue(int q)
+{
+	if (q < 0 || q >= e1000_nqueues)
+		return -E_INVAL;
+	curenv->env_net_queue = q;
+	return e1000_nqueues;
+}
+
+// Hand the caller's queue pair qn straight to it, so it can drive the
+// card from user level without system calls, or with nb null, take
+// qn back.  The caller fills in nb's addresses: two pages for qn's
+// receive and transmit tail registers, a page for the descriptor
+// rings and NET_BYPASS_NBUFS mapped, writable pages that become packet
+// buffers; the pages stay pinned until qn is given back or the caller
+// exits.  The rest of *nb is filled in with the registers' and rings'
+// layout and each buffer's physical address, to put in descriptors.
+// The rings start empty.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller isn't the network server (ENV_TYPE_NS).
+//	-E_INVAL if qn is out of range, already taken (or with nb null,
+//		not the caller's), or an address in nb is bad or
+//		unmapped.
+//	-E_NO_MEM if there's no memory for the rings.
+// Destroys the environment if nb is not writable.
+static int
+sys_net_bypass(int qn, struct net_bypass *nb)
+{
+	struct net_bypass knb;
+	int r;
+
+	if (curenv->env_type != ENV_TYPE_NS)
+		return -E_BAD_ENV;
+	if (!nb)
+		return e1000_unbypass(qn, curenv);
+	user_mem_assert(curenv, nb, sizeof(*nb), PTE_U | PTE_W);
+	memmove(&knb, nb, sizeof(knb));
+	if ((r = e1000_bypass(qn, curenv, &knb)) < 0)
+		return r;
+	memmove(nb, &knb, sizeof(knb));
+	return 0;
+}
+
+// Store the network card's statistics since boot in *st.
+// Returns 0.  Destroys the environment if st is not writable.
+static int
+sys_net_stats(struct net_hwstats *st)
+{
+	user_mem_assert(curenv, st, sizeof(*st), PTE_U | PTE_W);
+	e1000_stats(st);
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -499,10 +938,43 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_env_set_trapframe(a1, (struct Trapframe *)a2);
 	case SYS_time_msec:
 		return sys_time_msec();
+	case SYS_env_set_priority:
+		return sys_env_set_priority(a1, a2, a3);
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity(a1, a2);
+	case SYS_ncpu:
+		return sys_ncpu();
+	case SYS_time_nsec:
+		return sys_time_nsec((uint64_t *) a1);
+	case SYS_sleep_until:
+		return sys_sleep_until(a1);
+	case SYS_ipc_recv_until:
+		return sys_ipc_recv_until((void*)a1, a2);
+	case SYS_ipc_wait:
+		return sys_ipc_wait((volatile uint32_t *const *) a1, a2, a3);
+	case SYS_ipc_ring:
+		return sys_ipc_ring(a1, (volatile uint32_t *) a2);
 	case SYS_net_try_send:
 		return sys_net_try_send((char *) a1, (int) a2);
 	case SYS_net_try_recv:
 		return sys_net_try_recv((char *) a1, (int *) a2);
+	case SYS_net_wait_recv:
+		return sys_net_wait_recv();
+	case SYS_net_send_frags:
+		return sys_net_send_frags((const struct net_frag *) a1, a2,
+					  (int *) a3);
+	case SYS_net_recv_batch:
+		return sys_net_recv_batch((void *) a1, a2);
+	case SYS_net_stats:
+		return sys_net_stats((struct net_hwstats *) a1);
+	case SYS_net_set_queue:
+		return sys_net_set_queue(a1);
+	case SYS_net_bypass:
+		return sys_net_bypass(a1, (struct net_bypass *) a2);
+	case SYS_net_wait_send:
+		return sys_net_wait_send();
+	case SYS_thread_create:
+		return sys_thread_create(a1, a2, a3);
 	default:
 		return -E_INVAL;
 	}
@@ -1,26 +1,256 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/sched.h>
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// Time is read from the TSC, calibrated against the PIT in lapic_init.
+// There is no periodic tick: each CPU's LAPIC timer is programmed as a
+// one-shot for that CPU's next event (see time_program).
+uint64_t tsc_hz;
+static uint64_t tsc_base;	// TSC at time_init
+
+static unsigned int ticks;	// Timer wheel ticks (TICK_NSEC) since boot
+
+// Timer wheel.
+//
+// Environments blocked with a deadline (sys_sleep_until,
+// sys_ipc_recv_until) sit on a hierarchical timer wheel, so waking
+// them costs O(1) per tick no matter how many are asleep.  Ticks only
+// happen when some CPU's timer fires, so the wheel catches up on the
+// ticks since it last ran, skipping straight over long stretches in
+// which no timer expires (see wheel_jump).  Level 0 has
+// one slot per tick; each slot of level L covers TW_SIZE^L ticks.  A
+// timer goes in the lowest level whose range still reaches its expiry
+// tick; when a lower level wraps around, the next level's current slot
+// is cascaded down.  Deadlines beyond the top level are parked in the
+// top level and re-inserted when they come around.
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+
+static struct Env *wheel[TW_LEVELS][TW_SIZE];
+static unsigned int wheel_next;	// Next tick the wheel will process
+
+// Earliest expiry among armed timers (~0 if none).  Only lowered as
+// timers are armed; when the earliest one goes, it is recomputed the
+// next time somebody asks.
+static unsigned int earliest_tick;
+static bool earliest_stale;
 
 void
 time_init(void)
 {
+	tsc_base = read_tsc();
 	ticks = 0;
+	wheel_next = 1;
+	earliest_tick = ~0U;
+}
+
+// Nanoseconds since time_init.
+uint64_t
+time_nsec(void)
+{
+	uint64_t tsc = read_tsc() - tsc_base;
+
+	if (!tsc_hz)
+		return 0;
+	return tsc / tsc_hz * 1000000000 + tsc % tsc_hz * 1000000000 / tsc_hz;
+}
+
+static void
+wheel_insert(struct Env *e)
+{
+	unsigned int expire = e->env_timer_expire, delta;
+	struct Env **slot;
+	int lvl;
+
+	if ((int) (expire - wheel_next) < 0)
+		expire = wheel_next;
+	delta = expire - wheel_next;
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++)
+		if (delta < (1U << (TW_BITS * (lvl + 1))))
+			break;
+	if (lvl == TW_LEVELS - 1 && delta >= (1U << (TW_BITS * TW_LEVELS)))
+		expire = wheel_next + (1U << (TW_BITS * TW_LEVELS)) - 1;
+
+	slot = &wheel[lvl][(expire >> (TW_BITS * lvl)) & TW_MASK];
+	e->env_timer_next = *slot;
+	if (*slot)
+		(*slot)->env_timer_pprev = &e->env_timer_next;
+	*slot = e;
+	e->env_timer_pprev = slot;
+}
+
+static void
+wheel_remove(struct Env *e)
+{
+	if (e->env_timer_next)
+		e->env_timer_next->env_timer_pprev = e->env_timer_pprev;
+	*e->env_timer_pprev = e->env_timer_next;
+	e->env_timer_pprev = NULL;
+	if (e->env_timer_expire == earliest_tick)
+		earliest_stale = 1;
+}
+
+static unsigned int
+timer_earliest(void)
+{
+	int i;
+
+	if (earliest_stale) {
+		earliest_tick = ~0U;
+		for (i = 0; i < NENV; i++)
+			if (envs[i].env_timer_pprev
+			    && envs[i].env_timer_expire < earliest_tick)
+				earliest_tick = envs[i].env_timer_expire;
+		earliest_stale = 0;
+	}
+	return earliest_tick;
+}
+
+// The deadline of e has passed: make it runnable again.
+// An interrupted sys_ipc_recv_until returns -E_TIMEOUT;
+// sys_sleep_until already set its return value.
+static void
+timer_fire(struct Env *e)
+{
+	if (e->env_timer_expire == earliest_tick)
+		earliest_stale = 1;
+	if (e->env_status != ENV_NOT_RUNNABLE)
+		return;
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	sched_set_status(e, ENV_RUNNABLE);
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// Process tick wheel_next: cascade any higher-level slots that are due,
+// then fire everything in the current level-0 slot.
+static void
+wheel_advance(void)
+{
+	unsigned int t = wheel_next;
+	struct Env *e, *list;
+	int lvl;
+
+	for (lvl = 1; lvl < TW_LEVELS; lvl++) {
+		if ((t >> (TW_BITS * (lvl - 1))) & TW_MASK)
+			break;
+		list = wheel[lvl][(t >> (TW_BITS * lvl)) & TW_MASK];
+		wheel[lvl][(t >> (TW_BITS * lvl)) & TW_MASK] = NULL;
+		while ((e = list) != NULL) {
+			list = e->env_timer_next;
+			wheel_insert(e);
+		}
+	}
+
+	list = wheel[0][t & TW_MASK];
+	wheel[0][t & TW_MASK] = NULL;
+	wheel_next = t + 1;
+	while ((e = list) != NULL) {
+		list = e->env_timer_next;
+		e->env_timer_pprev = NULL;
+		if ((int) (e->env_timer_expire - t) > 0)
+			// Parked beyond the wheel's range; go around again.
+			wheel_insert(e);
+		else
+			timer_fire(e);
+	}
+}
+
+// Move the wheel straight to tick t, before which no armed timer
+// expires, by taking every timer out and inserting it again relative
+// to t.  This costs one pass over the wheel instead of a wheel_advance
+// for every tick skipped.
+static void
+wheel_jump(unsigned int t)
+{
+	struct Env *e, *list = NULL;
+	int lvl, i;
+
+	for (lvl = 0; lvl < TW_LEVELS; lvl++)
+		for (i = 0; i < TW_SIZE; i++)
+			while ((e = wheel[lvl][i]) != NULL) {
+				wheel[lvl][i] = e->env_timer_next;
+				e->env_timer_next = list;
+				list = e;
+			}
+	wheel_next = t;
+	while ((e = list) != NULL) {
+		list = e->env_timer_next;
+		wheel_insert(e);
+	}
+}
+
+// This should be called on each timer interrupt, on any CPU.
+// Brings the timer wheel up to date, waking environments whose
+// deadlines have passed.
 void
 time_tick(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	unsigned int earliest, skip_to;
+
+	ticks = time_nsec() / TICK_NSEC;
+	// Nothing fires before the earliest deadline, so don't step
+	// through every tick of a long idle on the way there.
+	earliest = timer_earliest();
+	skip_to = (int) (earliest - (ticks + 1)) < 0 ? earliest : ticks + 1;
+	if (earliest == ~0U)
+		wheel_next = ticks + 1;
+	else if ((int) (skip_to - wheel_next) > TW_SIZE)
+		wheel_jump(skip_to);
+	while ((int) (ticks - wheel_next) >= 0)
+		wheel_advance();
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
+}
+
+// Program this CPU's LAPIC timer for its next event: the end of the
+// time slice, unless the CPU is idle, or the earliest timer deadline,
+// if that comes first.  An idle CPU with no timers armed gets no
+// timer interrupts at all.
+void
+time_program(bool idle)
+{
+	uint64_t now = time_nsec(), next = ~0ULL;
+	unsigned int tick = timer_earliest();
+
+	if (!idle)
+		next = now + TIME_SLICE_NSEC;
+	if (tick != ~0U && (uint64_t) tick * TICK_NSEC < next)
+		next = (uint64_t) tick * TICK_NSEC;
+	if (next == ~0ULL)
+		lapic_timer_set(0);
+	else
+		lapic_timer_set(next > now ? next - now : 1);
+}
+
+// Arm e's timer to wake it at time msec (as returned by time_msec),
+// replacing any timer already armed.  The caller blocks e; if e is
+// still not runnable when the deadline passes, it is made runnable.
+void
+timer_set(struct Env *e, unsigned int msec)
+{
+	timer_cancel(e);
+	e->env_timer_expire = msec / TICK_MSEC + (msec % TICK_MSEC != 0);
+	wheel_insert(e);
+	if (!earliest_stale && e->env_timer_expire < earliest_tick)
+		earliest_tick = e->env_timer_expire;
+}
+
+// Disarm e's timer, if any.
+void
+timer_cancel(struct Env *e)
+{
+	if (e->env_timer_pprev)
+		wheel_remove(e);
 }
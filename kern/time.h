@@ -4,8 +4,21 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
+#define TICK_MSEC		1		// Timer wheel granularity
+#define TICK_NSEC		(TICK_MSEC * 1000000)
+#define TIME_SLICE_NSEC		10000000	// Scheduler time slice (10 ms)
+
+extern uint64_t tsc_hz;		// TSC frequency, calibrated in lapic_init
+
 void time_init(void);
 void time_tick(void);
+void time_program(bool idle);
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
 
+void timer_set(struct Env *e, unsigned int msec);
+void timer_cancel(struct Env *e);
+
 #endif /* JOS_KERN_TIME_H */
@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
 
 static struct Taskstate ts;
 
@@ -117,6 +118,7 @@ trap_init(void)
 			SETGATE(idt[i], 0, GD_KT, funs[i], 0);
 		}
 	SETGATE(idt[48], 0, GD_KT, funs[48], 3);
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, funs[T_TLBFLUSH], 0);
 
 	for (i = 0; i < 16; ++i)
 		SETGATE(idt[IRQ_OFFSET+i], 0, GD_KT, funs[IRQ_OFFSET+i], 0);
@@ -256,6 +258,7 @@ trap_dispatch(struct Trapframe *tf)
 		// cprintf("Timer\n");
 		time_tick();
 		lapic_eoi();
+		time_program(0);
 		sched_yield();
 		return;
 	}
@@ -285,6 +288,12 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Network card receive interrupts.
+	if (e1000 && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr();
+		return;
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -307,10 +316,24 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// A TLB shootdown can only interrupt user code (see tlb_shootdown).
+	// The sender holds the big kernel lock and is waiting for us, so
+	// flush and go straight back to user mode without taking the lock.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lcr3(rcr3());
+		xchg(&thiscpu->cpu_tlb_stale, 0);
+		lapic_eoi();
+		trapframe_pop(tf);
+	}
+	xchg(&thiscpu->cpu_in_user, 0);
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
 		lock_kernel();
+		// No longer idle: bring back the time slice.
+		time_program(0);
+	}
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -322,6 +345,10 @@ trap(struct Trapframe *tf)
 		// serious kernel work.
 		// LAB 4: Your code here.
 		lock_kernel();
+		// We may touch user memory below, so drop what a TLB
+		// shootdown told us to while we waited for the lock.
+		if (xchg(&thiscpu->cpu_tlb_stale, 0))
+			lcr3(rcr3());
 
 		assert(curenv);
 
@@ -403,13 +430,16 @@ page_fault_handler(struct Trapframe *tf)
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
 	// LAB 4: Your code here.
+	// Threads each have their own exception stack, so its top comes
+	// from the Env rather than UXSTACKTOP.
 	if (curenv->env_pgfault_upcall) {
 		struct UTrapframe *utf;
 		uintptr_t utf_addr;
-		if (UXSTACKTOP-PGSIZE<=tf->tf_esp && tf->tf_esp<=UXSTACKTOP-1)
+		uintptr_t xstacktop = curenv->env_uxstacktop;
+		if (xstacktop-PGSIZE<=tf->tf_esp && tf->tf_esp<=xstacktop-1)
 			utf_addr = tf->tf_esp - sizeof(struct UTrapframe) - 4;
 		else 
-			utf_addr = UXSTACKTOP - sizeof(struct UTrapframe);
+			utf_addr = xstacktop - sizeof(struct UTrapframe);
 		user_mem_assert(curenv, (void*)utf_addr, sizeof(struct UTrapframe), PTE_W);//1 is enough
 		utf = (struct UTrapframe *) utf_addr;
 
@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*, int);
 
 struct Dev devcons =
 {
@@ -46,9 +47,13 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
+// A character devcons_poll has taken from the console, or 0.
+static int cons_pending;
+
 int
 iscons(int fdnum)
 {
@@ -83,8 +88,11 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	if ((c = cons_pending) != 0)
+		cons_pending = 0;
+	else
+		while ((c = sys_cgetc()) == 0)
+			sys_yield();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -111,6 +119,15 @@ devcons_write(struct Fd *fd, const void *vbuf, size_t n)
 	return tot;
 }
 
+// The console can't ring a doorbell, so poll rechecks it now and then.
+static int
+devcons_poll(struct Fd *fd, int events)
+{
+	if ((events & POLLIN) && !cons_pending)
+		cons_pending = sys_cgetc();
+	return POLLOUT | (cons_pending ? POLLIN : 0);
+}
+
 static int
 devcons_close(struct Fd *fd)
 {
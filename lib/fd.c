@@ -319,3 +319,111 @@ stat(const char *path, struct Stat *stat)
 	return r;
 }
 
+
+// --------------------------------------------------------------
+// Waiting on several file descriptors
+// --------------------------------------------------------------
+
+// How often poll rechecks devices that can't ring a doorbell, in msec.
+#define POLL_RECHECK	10
+
+// Set each entry's revents; return how many are nonzero.
+static int
+poll_scan(struct pollfd *fds, int nfds)
+{
+	struct Dev *dev;
+	struct Fd *fd;
+	int i, n = 0;
+
+	for (i = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+			continue;
+		if (fd_lookup(fds[i].fd, &fd) < 0
+		    || dev_lookup(fd->fd_dev_id, &dev) < 0)
+			fds[i].revents = POLLNVAL;
+		else if (dev->dev_poll)
+			fds[i].revents = (*dev->dev_poll)(fd, fds[i].events)
+				& (fds[i].events | POLLERR | POLLHUP);
+		else
+			fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+		if (fds[i].revents)
+			n++;
+	}
+	return n;
+}
+
+// Doorbell flags poll can wait on at once.
+#define POLL_MAXFLAGS	(MAXFD * DEV_NOTIFY_MAX)
+
+// Ask for doorbells from every device, storing the flags to wait on in
+// 'flags' (POLL_MAXFLAGS of them at most), or cancel them if 'flags' is
+// null.  Asking returns the number of flags, or -1 if some device can't
+// ring, or there are too many to wait on.
+static int
+poll_notify(struct pollfd *fds, int nfds, volatile uint32_t **flags)
+{
+	volatile uint32_t *devflags[DEV_NOTIFY_MAX];
+	struct Dev *dev;
+	struct Fd *fd;
+	int i, k, n = 0, all = 1;
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd < 0 || fd_lookup(fds[i].fd, &fd) < 0
+		    || dev_lookup(fd->fd_dev_id, &dev) < 0)
+			continue;
+		if (!dev->dev_notify)
+			all = 0;
+		else if (!flags)
+			(*dev->dev_notify)(fd, fds[i].events, NULL);
+		else if ((k = (*dev->dev_notify)(fd, fds[i].events,
+						 devflags)) < 0)
+			all = 0;
+		else
+			while (k-- > 0)
+				if (n < POLL_MAXFLAGS)
+					flags[n++] = devflags[k];
+				else
+					all = 0;
+	}
+	return all ? n : -1;
+}
+
+// Wait until one of the 'nfds' file descriptors in 'fds' is ready for
+// its 'events', or for 'timeout' msec (forever if negative).  Sets each
+// entry's revents.  Sockets wake us with a doorbell from the network
+// server (see sys_ipc_wait); other devices are rechecked every
+// POLL_RECHECK msec.  An open socket may appear only once.
+// Returns the number of ready entries, 0 on timeout.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	volatile uint32_t *flags[POLL_MAXFLAGS];
+	unsigned int deadline = sys_time_msec() + timeout;
+	int n, nflags, wait, left;
+
+	while (1) {
+		if ((n = poll_scan(fds, nfds)) > 0 || timeout == 0)
+			return n;
+
+		// Recheck after asking: a device may have become ready
+		// before it saw the request.  A doorbell that rings from
+		// now on clears its flag, so sys_ipc_wait won't block.
+		nflags = poll_notify(fds, nfds, flags);
+		if ((n = poll_scan(fds, nfds)) == 0) {
+			wait = nflags < 0 ? POLL_RECHECK : -1;
+			if (timeout >= 0) {
+				left = MAX((int) (deadline - sys_time_msec()), 0);
+				if (wait < 0 || wait > left)
+					wait = left;
+			}
+			sys_ipc_wait(flags, MAX(nflags, 0), wait);
+		}
+		poll_notify(fds, nfds, NULL);
+
+		if (n > 0 || (n = poll_scan(fds, nfds)) > 0)
+			return n;
+		if (timeout > 0 && (int) (sys_time_msec() - deadline) >= 0)
+			return 0;
+	}
+}
@@ -176,6 +176,25 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Map the file server's cache page that holds byte 'offset' of file
+// fdnum at 'dstva', read-only.
+// Returns the number of bytes of the file in that page, from its start,
+// 0 if offset is at or past the end, or < 0 on error.
+int
+file_map_page(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, dstva);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
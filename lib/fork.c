@@ -18,6 +18,7 @@ pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t err = utf->utf_err;
+	void *tmp = sthread_pftemp();
 	int r;
 
 	// Check that the faulting access was (1) a write, and (2) to a
@@ -32,20 +33,22 @@ pgfault(struct UTrapframe *utf)
 			&& (uvpt[PGNUM(addr)] & PTE_P) 
 			&& (uvpt[PGNUM(addr)] & PTE_COW)))
 		panic("not copy on write page fault");
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
+	// Allocate a new page, map it at a temporary location (PFTEMP,
+	// or the faulting thread's own version of it, since other threads
+	// sharing our page directory may be faulting too), copy the data
+	// from the old page to the new page, then move the new page to the
+	// old page's address.
 	// Hint:
 	//   You should make three system calls.
 
 	// LAB 4: Your code here.
 	addr = ROUNDDOWN(addr, PGSIZE);
-	if (sys_page_alloc(0, PFTEMP, PTE_W|PTE_U|PTE_P) < 0)
+	if (sys_page_alloc(0, tmp, PTE_W|PTE_U|PTE_P) < 0)
 		panic("sys_page_alloc");
-	memcpy(PFTEMP, addr, PGSIZE);
-	if (sys_page_map(0, PFTEMP, 0, addr, PTE_W|PTE_U|PTE_P) < 0)
+	memcpy(tmp, addr, PGSIZE);
+	if (sys_page_map(0, tmp, 0, addr, PTE_W|PTE_U|PTE_P) < 0)
 		panic("sys_page_map");
-	if (sys_page_unmap(0, PFTEMP) < 0)
+	if (sys_page_unmap(0, tmp) < 0)
 		panic("sys_page_unmap");
 	return;
 }
@@ -95,66 +98,121 @@ duppage(envid_t envid, unsigned pn)
 }
 
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Map our virtual page pn into the target envid at the same virtual
+// address, shared with the same permissions in both environments.
+// A page that is still copy-on-write from an earlier fork is first
+// replaced with a private writable copy; otherwise the first write by
+// either environment would silently unshare it again.
 //
-// Returns: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
+// Returns: 0 on success, < 0 on error.
+//
+static int
+sharepage(envid_t envid, unsigned pn)
+{
+	void *addr = (void *) (pn * PGSIZE);
+	int perm = uvpt[pn] & PTE_SYSCALL;
+	void *tmp = sthread_pftemp();
+	int r;
+
+	if (uvpt[pn] & PTE_COW) {
+		if ((r = sys_page_alloc(0, tmp, PTE_W|PTE_U|PTE_P)) < 0)
+			return r;
+		memcpy(tmp, addr, PGSIZE);
+		if ((r = sys_page_map(0, tmp, 0, addr, PTE_W|PTE_U|PTE_P)) < 0)
+			return r;
+		if ((r = sys_page_unmap(0, tmp)) < 0)
+			return r;
+		perm = PTE_W|PTE_U|PTE_P;
+	}
+	return sys_page_map(0, addr, envid, addr, perm);
+}
+
+static bool
+user_mapped(uintptr_t addr)
+{
+	return (uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P)
+		&& (uvpt[PGNUM(addr)] & PTE_U);
+}
+
 //
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
+// Common code for fork and sfork.
+// Pages at or above 'private_bottom' are duplicated copy-on-write,
+// pages below it are shared with the child.
 //
-envid_t
-fork(void)
+static envid_t
+fork_common(uintptr_t private_bottom)
 {
+	envid_t envid;
+	uintptr_t addr;
+	int r;
+
 	set_pgfault_handler(pgfault);
 
-	envid_t envid;
-	uint32_t addr;
 	envid = sys_exofork();
+	if (envid < 0)
+		panic("sys_exofork: %e", envid);
 	if (envid == 0) {
-		thisenv = &envs[ENVX(sys_getenvid())];
+		// thisenv is looked up through %gs, so it is already ours.
 		return 0;
 	}
-	// cprintf("sys_exofork: %x\n", envid);
-	if (envid < 0)
-		panic("sys_exofork: %e", envid);
-
-	for (addr = 0; addr < USTACKTOP; addr += PGSIZE)
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P)
-			&& (uvpt[PGNUM(addr)] & PTE_U)) {
-			// cprintf("envid: %x, PGNUM: %x, addr: %x\n", envid, PGNUM(addr), addr);
-			// if (addr!=0x802000) {
-			duppage(envid, PGNUM(addr));
-			// } else panic("user fork");
-			// cprintf("duppage done\n");
-			// cprintf("%x\n", uvpd[PDX(addr)]);
-			// cprintf("%x\n", uvpt[PGNUM(addr)]);
-		}
-	// panic("faint");
 
+	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
+		if (!user_mapped(addr))
+			continue;
+		if (addr >= private_bottom)
+			r = duppage(envid, PGNUM(addr));
+		else
+			r = sharepage(envid, PGNUM(addr));
+		if (r < 0)
+			panic("fork: map %08x: %e", addr, r);
+	}
 
-	if (sys_page_alloc(envid, (void *)(UXSTACKTOP-PGSIZE), PTE_U|PTE_W|PTE_P) < 0)
-		panic("1");
-	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
+	if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_U|PTE_W|PTE_P)) < 0)
+		panic("fork: exception stack: %e", r);
+	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+		panic("fork: pgfault upcall: %e", r);
 
-	if (sys_env_set_status(envid, ENV_RUNNABLE) < 0)
-		panic("sys_env_set_status");
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
 
 	return envid;
-	//panic("fork not implemented");
 }
 
-// Challenge!
+//
+// User-level fork with copy-on-write.
+// Set up our page fault handler appropriately.
+// Create a child.
+// Copy our address space and page fault handler setup to the child.
+// Then mark the child as runnable and return.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+// It is also OK to panic on error.
+//
+// Neither user exception stack is ever marked copy-on-write;
+// the child gets a freshly allocated one.
+//
+envid_t
+fork(void)
+{
+	return fork_common(0);
+}
+
+//
+// Shared-memory fork.
+// Like fork, except that every page below the user stack is shared
+// between parent and child rather than copied; only the stack (the run
+// of mapped pages just below USTACKTOP) and the exception stack are
+// private.  thisenv keeps working in both, since it is a %gs lookup.
+//
+// Sharing is fixed at sfork time: pages mapped later by either
+// environment (e.g. fresh malloc pages) are private to it.
+//
 envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	uintptr_t stack_bottom = USTACKTOP;
+
+	while (stack_bottom > UTEXT && user_mapped(stack_bottom - PGSIZE))
+		stack_bottom -= PGSIZE;
+	return fork_common(stack_bottom);
 }
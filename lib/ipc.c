@@ -2,6 +2,9 @@
 
 #include <inc/lib.h>
 
+static int32_t ipc_recv_result(int r, envid_t *from_env_store, void *pg,
+			       int *perm_store);
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -25,6 +28,25 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	// LAB 4: Your code here.
 	int r = sys_ipc_recv(pg ? pg : (void *)UTOP);
 
+	return ipc_recv_result(r, from_env_store, pg, perm_store);
+}
+
+// Like ipc_recv, but give up at time 'msec' (as returned by
+// sys_time_msec), returning -E_TIMEOUT.
+int32_t
+ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+	       unsigned int msec)
+{
+	int r = sys_ipc_recv_until(pg ? pg : (void *)UTOP, msec);
+
+	return ipc_recv_result(r, from_env_store, pg, perm_store);
+}
+
+// Common tail of ipc_recv and ipc_recv_until: r is the system call's
+// result.
+static int32_t
+ipc_recv_result(int r, envid_t *from_env_store, void *pg, int *perm_store)
+{
 	if (from_env_store) 
 		*from_env_store = (r == 0) ? thisenv->env_ipc_from : 0;
 
@@ -36,16 +58,6 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 		return r;
 
 	return thisenv->env_ipc_value;
-
-	if (perm_store) *perm_store = 0;
-	if (!pg) pg = (void*) -1;
-	int ret = sys_ipc_recv(pg);
-	if (ret) return ret;
-	if (from_env_store)
-		*from_env_store = thisenv->env_ipc_from;
-	if (perm_store)
-		*perm_store = thisenv->env_ipc_perm;
-	return thisenv->env_ipc_value;
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
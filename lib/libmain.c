@@ -5,19 +5,13 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
 libmain(int argc, char **argv)
 {
-	// set thisenv to point at our Env structure in envs[].
-	// LAB 3: Your code here.
-	
-	thisenv = envs+ENVX(sys_getenvid());
-	// cprintf("sys_getenvid(): %x\n", sys_getenvid());
-	// cprintf("envs: %x, thisenv: %x\n", envs, thisenv);
-	// cprintf("envs.env_id %x %x\n", envs[0].env_id, envs[1].env_id);
+	// thisenv needs no setup: it is looked up through %gs,
+	// which the kernel points at our Env structure in envs[].
 
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
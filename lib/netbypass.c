@@ -0,0 +1,177 @@
+// A user-level driver for one of the network card's queue pairs, for
+// the network server (see sys_net_bypass).  The kernel hands over the
+// pair's rings and tail registers; from then on frames are received by
+// polling the ring and sent by filling descriptors and writing the
+// tail register, with no system calls.
+
+#include <inc/lib.h>
+
+// Where the queue pair goes in our address space.
+#define REGS_VA		0x50000000
+#define RING_VA		(REGS_VA + 2 * PGSIZE)
+#define BUFS_VA		(REGS_VA + 3 * PGSIZE)
+
+// Each receive descriptor has a page, laid out as a struct jif_pkt;
+// each transmit descriptor has half of one of the pages after those.
+#define TX_BUFSIZE	NET_BYPASS_TXBUF
+
+// Hand the card this many refilled receive descriptors at a time.
+#define RX_REFILL	32
+
+// Keep the compiler from moving memory accesses across a tail
+// register write, or caching what the card writes.
+#define barrier()	__asm __volatile("" : : : "memory")
+
+static struct net_bypass nb;
+static bool attached;
+static uint32_t rx_next;		// Next receive descriptor to look at
+static int rx_refilled;			// Refilled since RDT was written
+static uint32_t tx_tail, tx_clean;	// Next to fill, oldest not reclaimed
+
+static struct jif_pkt *
+rx_buf(int i)
+{
+	return (struct jif_pkt *) (BUFS_VA + i * PGSIZE);
+}
+
+static void
+rx_refill(int i)
+{
+	nb.nb_rx[i].rd.rd_addr = nb.nb_pa[i] + offsetof(struct jif_pkt, jp_data);
+	nb.nb_rx[i].rd.rd_zero = 0;
+}
+
+static void
+rx_flush(void)
+{
+	if (rx_refilled) {
+		barrier();
+		*nb.nb_rdt = (rx_next + NET_BYPASS_RXDESC - 1) % NET_BYPASS_RXDESC;
+		rx_refilled = 0;
+	}
+}
+
+// Take queue pair qn over from the kernel.
+// Returns 0 on success, < 0 on error (see sys_net_bypass).
+int
+netbypass_attach(int qn)
+{
+	int i, r;
+
+	static_assert(TX_BUFSIZE * 2 == PGSIZE);
+	for (i = 0; i < NET_BYPASS_NBUFS; i++)
+		if ((r = sys_page_alloc(0, (void *) (BUFS_VA + i * PGSIZE),
+					PTE_P | PTE_U | PTE_W)) < 0)
+			goto fail;
+	nb.nb_regs = (void *) REGS_VA;
+	nb.nb_ring = (void *) RING_VA;
+	nb.nb_bufs = (void *) BUFS_VA;
+	if ((r = sys_net_bypass(qn, &nb)) < 0)
+		goto fail;
+
+	for (i = 0; i < NET_BYPASS_RXDESC; i++)
+		rx_refill(i);
+	rx_next = 0;
+	tx_tail = tx_clean = 0;
+	attached = 1;
+	// Give the card every buffer but one; a full ring would look
+	// empty.
+	rx_refilled = 1;
+	rx_flush();
+	return 0;
+
+fail:
+	for (i = 0; i < NET_BYPASS_NBUFS; i++)
+		sys_page_unmap(0, (void *) (BUFS_VA + i * PGSIZE));
+	return r;
+}
+
+bool
+netbypass_attached(void)
+{
+	return attached;
+}
+
+// Return the next frame the card has received, or null if there is
+// none yet.  The frame is good until netbypass_recv_done.
+struct jif_pkt *
+netbypass_recv(void)
+{
+	volatile union net_rxdesc *d;
+	uint32_t status;
+	int len;
+
+	while (1) {
+		d = &nb.nb_rx[rx_next];
+		if (nb.nb_rx_extended) {
+			status = d->rx.rx_status;
+			len = d->rx.rx_len;
+		} else {
+			status = d->rl.rl_status;
+			len = d->rl.rl_len;
+		}
+		if (!(status & NET_RXD_DD)) {
+			rx_flush();
+			return NULL;
+		}
+		barrier();
+		if (status & NET_RXD_EOP)
+			break;
+		// Frames never span buffers; drop any that somehow do.
+		netbypass_recv_done();
+	}
+	rx_buf(rx_next)->jp_len = len;
+	return rx_buf(rx_next);
+}
+
+// Give the buffer of the frame netbypass_recv returned back to the
+// card.
+void
+netbypass_recv_done(void)
+{
+	rx_refill(rx_next);
+	rx_next = (rx_next + 1) % NET_BYPASS_RXDESC;
+	if (++rx_refilled >= RX_REFILL)
+		rx_flush();
+}
+
+// Return a buffer of NET_BYPASS_TXBUF bytes to build the next frame
+// in, or null if the transmit ring is full.  netbypass_send queues it.
+void *
+netbypass_tx_buf(void)
+{
+	volatile struct net_txdesc *d;
+
+	while (tx_clean != tx_tail) {
+		d = &nb.nb_tx[tx_clean];
+		if (!(d->td_status & NET_TXD_DD))
+			break;
+		tx_clean = (tx_clean + 1) % NET_BYPASS_TXDESC;
+	}
+	if ((tx_tail + 1) % NET_BYPASS_TXDESC == tx_clean)
+		return NULL;
+	return (void *) (BUFS_VA + (NET_BYPASS_RXDESC + tx_tail / 2) * PGSIZE
+			 + (tx_tail % 2) * TX_BUFSIZE);
+}
+
+// Queue the len-byte frame in the buffer netbypass_tx_buf returned.
+// The card doesn't see it until netbypass_flush.
+void
+netbypass_send(int len)
+{
+	struct net_txdesc *d = &nb.nb_tx[tx_tail];
+
+	d->td_addr = nb.nb_pa[NET_BYPASS_RXDESC + tx_tail / 2]
+		+ (tx_tail % 2) * TX_BUFSIZE;
+	d->td_cmd = len | NET_TXD_EOP | NET_TXD_RS;
+	d->td_status = 0;
+	tx_tail = (tx_tail + 1) % NET_BYPASS_TXDESC;
+}
+
+// Tell the card about the frames queued since last time.
+void
+netbypass_flush(void)
+{
+	barrier();
+	*nb.nb_tdt = tx_tail;
+}
@@ -8,24 +8,54 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
-// The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
+// The network server runs an instance per queue pair of the card, each
+// with its own TCP/IP stack (see net/serv.c); nsenvs[q] drives pair q.
+// Socket ids say which instance has the socket (NSSOCK).
+static envid_t nsenvs[NET_MAXQUEUES];
+static int nsinst;
+
+static void
+ns_find(void)
+{
+	int i, q;
+
+	if (nsinst)
+		return;
+	for (i = 0; i < NENV; i++) {
+		q = envs[i].env_net_queue;
+		if (envs[i].env_type == ENV_TYPE_NS
+		    && envs[i].env_status != ENV_FREE
+		    && q >= 0 && q < NET_MAXQUEUES) {
+			nsenvs[q] = envs[i].env_id;
+			nsinst = MAX(nsinst, q + 1);
+		}
+	}
+}
+
+// Returns the number of network server instances.
+int
+nsipc_ninst(void)
+{
+	ns_find();
+	return nsinst;
+}
+
+// Send an IP request to network server instance inst, and wait for a
+// reply.  The request body should be in nsipcbuf, and parts of the
+// response may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc(int inst, unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
+	ns_find();
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
+		cprintf("[%08x] nsipc %d to %d\n", thisenv->env_id, type, inst);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsenvs[inst], type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
@@ -34,12 +64,13 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
 	int r;
 
-	nsipcbuf.accept.req_s = s;
+	nsipcbuf.accept.req_s = NSSOCK_NUM(s);
 	nsipcbuf.accept.req_addrlen = *addrlen;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0) {
+	if ((r = nsipc(NSSOCK_INST(s), NSREQ_ACCEPT)) >= 0) {
 		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
+		r = NSSOCK(NSSOCK_INST(s), r);
 	}
 	return r;
 }
@@ -47,42 +78,42 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 int
 nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.bind.req_s = s;
+	nsipcbuf.bind.req_s = NSSOCK_NUM(s);
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc(NSSOCK_INST(s), NSREQ_BIND);
 }
 
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
+	nsipcbuf.shutdown.req_s = NSSOCK_NUM(s);
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc(NSSOCK_INST(s), NSREQ_SHUTDOWN);
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	nsipcbuf.close.req_s = NSSOCK_NUM(s);
+	return nsipc(NSSOCK_INST(s), NSREQ_CLOSE);
 }
 
 int
 nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.connect.req_s = s;
+	nsipcbuf.connect.req_s = NSSOCK_NUM(s);
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc(NSSOCK_INST(s), NSREQ_CONNECT);
 }
 
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
+	nsipcbuf.listen.req_s = NSSOCK_NUM(s);
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	return nsipc(NSSOCK_INST(s), NSREQ_LISTEN);
 }
 
 int
@@ -90,11 +121,11 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
 	int r;
 
-	nsipcbuf.recv.req_s = s;
+	nsipcbuf.recv.req_s = NSSOCK_NUM(s);
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
+	if ((r = nsipc(NSSOCK_INST(s), NSREQ_RECV)) >= 0) {
 		assert(r < 1600 && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
@@ -105,19 +136,74 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
-	nsipcbuf.send.req_s = s;
+	nsipcbuf.send.req_s = NSSOCK_NUM(s);
 	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc(NSSOCK_INST(s), NSREQ_SEND);
 }
 
+// Open a socket on network server instance inst.
 int
-nsipc_socket(int domain, int type, int protocol)
+nsipc_socket(int inst, int domain, int type, int protocol)
 {
+	int r;
+
 	nsipcbuf.socket.req_domain = domain;
 	nsipcbuf.socket.req_type = type;
 	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	if ((r = nsipc(inst, NSREQ_SOCKET)) >= 0)
+		r = NSSOCK(inst, r);
+	return r;
+}
+
+// Share the page 'ring' with the network server as socket s's data
+// path.  Unlike the other requests, this sends 'ring' rather than
+// nsipcbuf.
+int
+nsipc_ring(int s, struct Nssock *ring)
+{
+	ns_find();
+	ring->ns_sockid = NSSOCK_NUM(s);
+	ipc_send(nsenvs[NSSOCK_INST(s)], NSREQ_RING, ring, PTE_P|PTE_W|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Send bytes [off, off + len) of page pg on socket s, which has the
+// shared page 'ring', without copying them.  pg may be read-only; the
+// server keeps it mapped until the peer has acknowledged the data.
+// Returns len, or < 0 on error.
+int
+nsipc_sendpage(int s, struct Nssock *ring, void *pg, int off, int len)
+{
+	ns_find();
+	ring->ns_sp_off = off;
+	ring->ns_sp_len = len;
+	ipc_send(nsenvs[NSSOCK_INST(s)], NSREQ_SENDPAGE_ON(NSSOCK_NUM(s)), pg,
+		 PTE_P|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Ring the doorbell of the network server instance with socket s, for
+// its socket rings.  There is no reply to wait for.
+void
+nsipc_kick(int s)
+{
+	ns_find();
+	ipc_send(nsenvs[NSSOCK_INST(s)], NSREQ_KICK_ON(NSSOCK_NUM(s)), 0, 0);
+}
+
+// Fetch the first network server instance's statistics into ret,
+// listing its TCP connections from the skip'th on.
+// Returns the number of connections listed, or < 0 on error.
+int
+nsipc_stats(int skip, union Nsipc *ret)
+{
+	int r;
+
+	nsipcbuf.stats.req_skip = skip;
+	if ((r = nsipc(0, NSREQ_STATS)) >= 0)
+		memmove(ret, &nsipcbuf, sizeof(*ret));
+	return r;
 }
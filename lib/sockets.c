@@ -1,10 +1,13 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 #include <lwip/sockets.h>
 
 static ssize_t devsock_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devsock_write(struct Fd *fd, const void *buf, size_t n);
 static int devsock_close(struct Fd *fd);
 static int devsock_stat(struct Fd *fd, struct Stat *stat);
+static int devsock_poll(struct Fd *fd, int events);
+static int devsock_notify(struct Fd *fd, int events, volatile uint32_t **flags);
 
 struct Dev devsock =
 {
@@ -14,6 +17,8 @@ struct Dev devsock =
 	.dev_write =	devsock_write,
 	.dev_close =	devsock_close,
 	.dev_stat =	devsock_stat,
+	.dev_poll =	devsock_poll,
+	.dev_notify =	devsock_notify,
 };
 
 static int
@@ -47,24 +52,117 @@ alloc_sockfd(int sockid)
 	return fd2num(sfd);
 }
 
+// Give connected socket fd a data page shared with the network server,
+// so reads and writes go through its rings instead of an IPC each.
+// If that fails, the socket keeps using NSREQ_RECV and NSREQ_SEND.
+// A listening socket's page only tells poll when to accept.
+static void
+ring_setup(struct Fd *sfd, bool listening)
+{
+	struct Nssock *ring = (struct Nssock *) fd2data(sfd);
+
+	static_assert(sizeof(struct Nssock) <= PGSIZE);
+
+	if (sys_page_alloc(0, ring, PTE_P|PTE_W|PTE_U|PTE_SHARE) < 0)
+		return;
+	ring->ns_listen = listening;
+	if (nsipc_ring(sfd->fd_sock.sockid, ring) < 0) {
+		sys_page_unmap(0, ring);
+		return;
+	}
+	sfd->fd_sock.has_ring = 1;
+}
+
+// Wait for the server to ring our doorbell on 'flag' in ring r: the
+// reader's flag if 'reading', else the writer's.
+static void
+ring_wait(struct nsring *r, volatile uint32_t *flag, bool reading)
+{
+	bool ready;
+
+	r->nr_waiter = thisenv->env_id;
+	xchg(flag, 1);
+	// The server may have moved before it could see the flag.
+	ready = r->nr_done || (reading ? nsring_used(r) : nsring_wspan(r));
+	if (ready && xchg(flag, 0))
+		return;
+	// Otherwise the server has taken the flag, or will, and rings us;
+	// if it already has, this returns at once.
+	sys_ipc_wait(&flag, 1, -1);
+}
+
+// Whether any server instance has a connection for listening socket
+// ring to accept.
+static bool
+listen_ready(struct Nssock *ring)
+{
+	int q;
+
+	for (q = 0; q < NET_MAXQUEUES; q++)
+		if (ring->ns_acceptable[q])
+			return 1;
+	return 0;
+}
+
+// Return the socket id of listening socket sfd's on the server instance
+// that has a connection to accept, waiting for one if need be.
+static int
+listen_pick(struct Fd *sfd)
+{
+	struct Nssock *ring = (struct Nssock *) fd2data(sfd);
+	struct nsring *r = &ring->ns_rx;
+	volatile uint32_t *flag = &r->nr_rwait;
+	int i, id;
+
+	while (1) {
+		for (i = 0; i <= sfd->fd_sock.ls_n; i++) {
+			id = i ? sfd->fd_sock.ls_ids[i - 1] : sfd->fd_sock.sockid;
+			if (ring->ns_acceptable[NSSOCK_INST(id)])
+				return id;
+		}
+		// As ring_wait does.
+		r->nr_waiter = thisenv->env_id;
+		xchg(flag, 1);
+		if (listen_ready(ring) && xchg(flag, 0))
+			continue;
+		sys_ipc_wait(&flag, 1, -1);
+	}
+}
+
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
 	int r;
-	if ((r = fd2sockid(s)) < 0)
+	struct Fd *sfd;
+
+	if ((r = fd_lookup(s, &sfd)) < 0)
 		return r;
+	if (sfd->fd_dev_id != devsock.dev_id)
+		return -E_NOT_SUPP;
+	r = sfd->fd_sock.ls_n ? listen_pick(sfd) : sfd->fd_sock.sockid;
 	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	if ((r = alloc_sockfd(r)) >= 0 && fd_lookup(r, &sfd) == 0)
+		ring_setup(sfd, 0);
+	return r;
 }
 
 int
 bind(int s, struct sockaddr *name, socklen_t namelen)
 {
 	int r;
+	struct Fd *sfd;
+
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_bind(r, name, namelen);
+	if ((r = nsipc_bind(r, name, namelen)) < 0)
+		return r;
+	// listen binds the socket's other instances the same way.
+	if (fd_lookup(s, &sfd) == 0 && namelen <= sizeof(sfd->fd_sock.bound)) {
+		memmove(sfd->fd_sock.bound, name, namelen);
+		sfd->fd_sock.boundlen = namelen;
+	}
+	return r;
 }
 
 int
@@ -79,40 +177,195 @@ shutdown(int s, int how)
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
-		return nsipc_close(fd->fd_sock.sockid);
-	else
-		return 0;
+	int i, r = 0;
+
+	// The server flushes the ring's pending output before it closes.
+	if (pageref(fd) == 1) {
+		r = nsipc_close(fd->fd_sock.sockid);
+		for (i = 0; i < fd->fd_sock.ls_n; i++)
+			nsipc_close(fd->fd_sock.ls_ids[i]);
+	}
+	if (fd->fd_sock.has_ring)
+		sys_page_unmap(0, fd2data(fd));
+	return r;
 }
 
 int
 connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
 	int r;
+	struct Fd *sfd;
+
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_connect(r, name, namelen);
+	if ((r = nsipc_connect(r, name, namelen)) < 0)
+		return r;
+	if (fd_lookup(s, &sfd) == 0 && !sfd->fd_sock.has_ring)
+		ring_setup(sfd, 0);
+	return r;
+}
+
+// Each server instance only sees the connections the card steers to its
+// queue pair, so a listening TCP socket listens on all of them, sharing
+// its ring page; accept takes a connection from whichever has one.
+// Without the ring it couldn't tell which, so it listens on just one.
+static int
+listen_others(struct Fd *sfd, int backlog)
+{
+	int q, id, r;
+	struct FdSock *fs = &sfd->fd_sock;
+
+	static_assert(NET_MAXQUEUES <= FDSOCK_MAXINST);
+	for (q = 0; q < nsipc_ninst(); q++) {
+		if (q == NSSOCK_INST(fs->sockid))
+			continue;
+		if ((id = nsipc_socket(q, AF_INET, SOCK_STREAM, 0)) < 0)
+			return id;
+		if ((fs->boundlen
+		     && (r = nsipc_bind(id, (struct sockaddr *) fs->bound,
+					fs->boundlen)) < 0)
+		    || (r = nsipc_listen(id, backlog)) < 0
+		    || (r = nsipc_ring(id, (struct Nssock *) fd2data(sfd))) < 0) {
+			nsipc_close(id);
+			return r;
+		}
+		fs->ls_ids[fs->ls_n++] = id;
+	}
+	return 0;
 }
 
 int
 listen(int s, int backlog)
 {
 	int r;
+	struct Fd *sfd;
+
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_listen(r, backlog);
+	if ((r = nsipc_listen(r, backlog)) < 0)
+		return r;
+	if (fd_lookup(s, &sfd) == 0 && !sfd->fd_sock.has_ring) {
+		ring_setup(sfd, 1);
+		if (sfd->fd_sock.has_ring
+		    && (r = listen_others(sfd, backlog)) < 0)
+			return r;
+	}
+	return r;
 }
 
+// Read what has arrived, up to n bytes, waiting if nothing has.
 static ssize_t
-devsock_read(struct Fd *fd, void *buf, size_t n)
+devsock_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	struct nsring *r = &((struct Nssock *) fd2data(fd))->ns_rx;
+	uint8_t *buf = vbuf;
+	size_t i, m;
+	int done;
+
+	if (!fd->fd_sock.has_ring)
+		return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+
+	while (1) {
+		// Check for EOF first: the server adds the last data before.
+		done = r->nr_done;
+		if (nsring_used(r))
+			break;
+		if (done)
+			return r->nr_err;
+		ring_wait(r, &r->nr_rwait, 1);
+	}
+
+	for (i = 0; i < n && (m = nsring_rspan(r)) > 0; i += m) {
+		m = MIN(m, n - i);
+		memmove(buf + i, &r->nr_buf[r->nr_rpos], m);
+		r->nr_rpos = (r->nr_rpos + m) % NSRING_BUFSIZ;
+	}
+	if (xchg(&r->nr_wwait, 0))
+		nsipc_kick(fd->fd_sock.sockid);
+	return i;
 }
 
+// Queue all n bytes for sending, waiting for room as needed.
 static ssize_t
-devsock_write(struct Fd *fd, const void *buf, size_t n)
+devsock_write(struct Fd *fd, const void *vbuf, size_t n)
+{
+	struct nsring *r = &((struct Nssock *) fd2data(fd))->ns_tx;
+	const uint8_t *buf = vbuf;
+	size_t i, m;
+
+	if (!fd->fd_sock.has_ring)
+		return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+
+	for (i = 0; i < n; i += m) {
+		if (r->nr_done)
+			return i ? i : r->nr_err;
+		if ((m = nsring_wspan(r)) == 0) {
+			ring_wait(r, &r->nr_wwait, 0);
+			continue;
+		}
+		m = MIN(m, n - i);
+		memmove(&r->nr_buf[r->nr_wpos], buf + i, m);
+		r->nr_wpos = (r->nr_wpos + m) % NSRING_BUFSIZ;
+		if (xchg(&r->nr_rwait, 0))
+			nsipc_kick(fd->fd_sock.sockid);
+	}
+	return n;
+}
+
+// Sockets without a ring block in the network server, so they always
+// look ready.
+static int
+devsock_poll(struct Fd *fd, int events)
+{
+	struct Nssock *ring = (struct Nssock *) fd2data(fd);
+	int revents = 0;
+
+	if (!fd->fd_sock.has_ring)
+		return events & (POLLIN | POLLOUT);
+	if (ring->ns_listen)
+		return listen_ready(ring) ? POLLIN : 0;
+
+	if (ring->ns_rx.nr_done)
+		revents |= POLLIN | (ring->ns_rx.nr_err < 0 ? POLLERR : POLLHUP);
+	else if (nsring_used(&ring->ns_rx))
+		revents |= POLLIN;
+	if (ring->ns_tx.nr_done)
+		revents |= POLLOUT | POLLERR;
+	else if (nsring_wspan(&ring->ns_tx))
+		revents |= POLLOUT;
+	return revents;
+}
+
+// Use the ring's wait flags, as devsock_read and devsock_write do.
+static int
+devsock_notify(struct Fd *fd, int events, volatile uint32_t **flags)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	struct Nssock *ring = (struct Nssock *) fd2data(fd);
+	int n = 0;
+
+	if (!fd->fd_sock.has_ring)
+		return -1;
+
+	if (flags) {
+		ring->ns_rx.nr_waiter = ring->ns_tx.nr_waiter = thisenv->env_id;
+		if (events & POLLIN) {
+			xchg(&ring->ns_rx.nr_rwait, 1);
+			flags[n++] = &ring->ns_rx.nr_rwait;
+		}
+		if ((events & POLLOUT) && !ring->ns_listen) {
+			xchg(&ring->ns_tx.nr_wwait, 1);
+			flags[n++] = &ring->ns_tx.nr_wwait;
+		}
+		return n;
+	}
+
+	// A flag the server has already cleared needs nothing more: it
+	// rang only if we were waiting.
+	if (events & POLLIN)
+		xchg(&ring->ns_rx.nr_rwait, 0);
+	if ((events & POLLOUT) && !ring->ns_listen)
+		xchg(&ring->ns_tx.nr_wwait, 0);
+	return 0;
 }
 
 static int
@@ -122,11 +375,65 @@ devsock_stat(struct Fd *fd, struct Stat *stat)
 	return 0;
 }
 
+// TCP sockets are spread over the network server instances by the CPU
+// we are on; the card sends everything else to the first (see
+// net/serv.c), so other sockets go there.
 int
 socket(int domain, int type, int protocol)
 {
-	int r;
-	if ((r = nsipc_socket(domain, type, protocol)) < 0)
+	int r, inst = 0;
+
+	if (type == SOCK_STREAM && (r = nsipc_ninst()) > 1)
+		inst = thisenv->env_cpunum % r;
+	if ((r = nsipc_socket(inst, domain, type, protocol)) < 0)
 		return r;
 	return alloc_sockfd(r);
 }
+
+// Page at which sendfile borrows the file server's cache pages.
+static uint8_t sendfile_page[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Send 'len' bytes of open file 'filefd', starting at 'offset', on
+// connected socket 'sockfd'.  The file server lends its block cache
+// pages, which go to the network server and into lwIP as they are, so
+// the data is never copied in user space.  Sockets without a shared
+// ring fall back to reading and writing.
+// Returns the number of bytes sent, which is less than len only at the
+// end of the file, or < 0 on error.
+ssize_t
+sendfile(int sockfd, int filefd, off_t offset, size_t len)
+{
+	struct Fd *sfd;
+	char buf[512];
+	size_t sent;
+	int n, off, r;
+
+	if ((r = fd_lookup(sockfd, &sfd)) < 0)
+		return r;
+	if (sfd->fd_dev_id != devsock.dev_id)
+		return -E_NOT_SUPP;
+
+	for (sent = 0; sent < len; sent += n) {
+		if (!sfd->fd_sock.has_ring) {
+			if ((r = seek(filefd, offset + sent)) < 0)
+				return sent ? sent : r;
+			if ((n = read(filefd, buf, MIN(sizeof(buf), len - sent))) <= 0)
+				return sent ? sent : n;
+			if ((r = write(sockfd, buf, n)) != n)
+				return sent ? sent : r;
+			continue;
+		}
+
+		if ((n = file_map_page(filefd, offset + sent, sendfile_page)) <= 0)
+			return sent ? sent : n;
+		off = (offset + sent) % PGSIZE;
+		n = MIN(n - off, len - sent);
+		r = nsipc_sendpage(sfd->fd_sock.sockid,
+				   (struct Nssock *) fd2data(sfd),
+				   sendfile_page, off, n);
+		sys_page_unmap(0, sendfile_page);
+		if (r < 0)
+			return sent ? sent : r;
+	}
+	return sent;
+}
@@ -0,0 +1,192 @@
+// Shared-memory threads.
+//
+// Each thread is a kernel thread: its own environment, scheduled on any
+// CPU, but sharing the creator's page directory (sys_thread_create), so
+// all memory -- including pages mapped after the thread was created --
+// is shared.  Each thread gets a private stack, exception stack and
+// temporary mapping page in one of the slots below STHREAD_STACKTOP.
+//
+// Per-thread state lives in sthreads[], indexed by the thread's ENVX.
+// Since thisenv is a per-environment %gs lookup, a thread finds its own
+// slot without any extra bookkeeping.
+//
+// The rest of the library (malloc, the fd layer) is not thread-safe;
+// callers must serialize it themselves.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Thread stack slots, growing down from STHREAD_STACKTOP (above the fd
+// table and file data, below the main user stack).  Each slot mirrors
+// the main stack layout:
+//	[top - STHREAD_STKSIZE, top)		stack
+//	one guard page
+//	[xstacktop - PGSIZE, xstacktop)		exception stack
+//	one guard page
+//	[pftemp, pftemp + PGSIZE)		the thread's PFTEMP
+#define STHREAD_STACKTOP	0xE0000000
+#define STHREAD_STKSIZE		(4 * PGSIZE)
+#define STHREAD_SLOTSIZE	(STHREAD_STKSIZE + 4 * PGSIZE)
+#define STHREAD_MAX		64
+
+#define SLOT2TOP(i)		(STHREAD_STACKTOP - (i) * STHREAD_SLOTSIZE)
+#define SLOT2XSTACKTOP(i)	(SLOT2TOP(i) - STHREAD_STKSIZE - PGSIZE)
+#define SLOT2PFTEMP(i)		(SLOT2XSTACKTOP(i) - 3 * PGSIZE)
+
+struct sthread {
+	volatile envid_t st_envid;	// Set by the thread when it exits
+	void *st_retval;		// Value passed to sthread_exit
+	int st_slot;			// Stack slot, set by the creator
+};
+
+static struct sthread sthreads[NENV];
+static bool slot_used[STHREAD_MAX];
+static struct smutex slot_lock;
+
+static int
+slot_alloc(void)
+{
+	int i;
+
+	smutex_lock(&slot_lock);
+	for (i = 0; i < STHREAD_MAX; i++)
+		if (!slot_used[i]) {
+			slot_used[i] = 1;
+			break;
+		}
+	smutex_unlock(&slot_lock);
+	return i < STHREAD_MAX ? i : -E_NO_FREE_ENV;
+}
+
+// Unmap slot i's stacks and make it available again.
+static void
+slot_free(int i)
+{
+	uintptr_t va;
+
+	for (va = SLOT2PFTEMP(i); va < SLOT2TOP(i); va += PGSIZE)
+		sys_page_unmap(0, (void *) va);
+	smutex_lock(&slot_lock);
+	slot_used[i] = 0;
+	smutex_unlock(&slot_lock);
+}
+
+// Return the page the calling thread should use for temporary
+// mappings, as fork's page fault handler does.  Threads sharing a page
+// directory can fault at the same time, so each needs its own; the
+// slot is found from the stack we are running on, which works on the
+// exception stack too.  The main thread uses PFTEMP.
+void *
+sthread_pftemp(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp >= STHREAD_STACKTOP || esp < SLOT2TOP(STHREAD_MAX))
+		return PFTEMP;
+	return (void *) SLOT2PFTEMP((STHREAD_STACKTOP - 1 - esp) / STHREAD_SLOTSIZE);
+}
+
+static void
+sthread_entry(void *(*fn)(void *), void *arg)
+{
+	sthread_exit(fn(arg));
+}
+
+// Run fn(arg) in a new thread sharing our address space.
+// Stores the new thread's id in *tid (if tid is nonnull).
+// Returns 0 on success, < 0 on error.
+int
+sthread_create(envid_t *tid, void *(*fn)(void *), void *arg)
+{
+	int i, r;
+	uintptr_t va;
+	uint32_t *esp;
+	envid_t envid;
+
+	if ((i = slot_alloc()) < 0)
+		return i;
+	for (va = SLOT2TOP(i) - STHREAD_STKSIZE; va < SLOT2TOP(i); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+	va = SLOT2XSTACKTOP(i) - PGSIZE;
+	if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+
+	// Build the initial frame for sthread_entry(fn, arg),
+	// with a zero return address to terminate backtraces.
+	esp = (uint32_t *) SLOT2TOP(i);
+	*--esp = (uint32_t) arg;
+	*--esp = (uint32_t) fn;
+	*--esp = 0;
+
+	envid = sys_thread_create(sthread_entry, esp,
+				  (void *) SLOT2XSTACKTOP(i));
+	if ((r = envid) < 0)
+		goto fail;
+	sthreads[ENVX(envid)].st_slot = i;
+	if (tid)
+		*tid = envid;
+	return 0;
+
+fail:
+	slot_free(i);
+	return r;
+}
+
+// Terminate the calling thread, making retval available to sthread_join.
+// Unlike exit, this leaves the shared file descriptors alone.
+void
+sthread_exit(void *retval)
+{
+	struct sthread *t = &sthreads[ENVX(thisenv->env_id)];
+
+	t->st_retval = retval;
+	// Publish the envid last; sthread_join waits for it.
+	t->st_envid = thisenv->env_id;
+	sys_env_destroy(0);
+	panic("sthread_exit: still running");
+}
+
+// Wait for thread tid to exit and store its return value in *retval
+// (if retval is nonnull).  Frees the thread's stacks.
+// Returns 0 on success, -E_BAD_ENV if tid exited without sthread_exit.
+int
+sthread_join(envid_t tid, void **retval)
+{
+	struct sthread *t = &sthreads[ENVX(tid)];
+	const volatile struct Env *e = &envs[ENVX(tid)];
+
+	while (t->st_envid != tid) {
+		if (e->env_id != tid || e->env_status == ENV_FREE) {
+			// Recheck: it may have exited just after our test.
+			if (t->st_envid != tid) {
+				slot_free(t->st_slot);
+				return -E_BAD_ENV;
+			}
+			break;
+		}
+		sys_yield();
+	}
+	// The thread may still be on its stack until the kernel frees it.
+	while (e->env_id == tid && e->env_status != ENV_FREE)
+		sys_yield();
+
+	if (retval)
+		*retval = t->st_retval;
+	t->st_envid = 0;
+	slot_free(t->st_slot);
+	return 0;
+}
+
+void
+smutex_lock(struct smutex *m)
+{
+	while (xchg(&m->sm_locked, 1) != 0)
+		sys_yield();
+}
+
+void
+smutex_unlock(struct smutex *m)
+{
+	xchg(&m->sm_locked, 0);
+}
@@ -135,4 +135,103 @@ sys_net_try_recv(char *data, int *len)
 	return syscall(SYS_net_try_recv, 1, (uint32_t) data, (uint32_t) len, 0, 0, 0); 
 }
 
+int
+sys_net_send_frags(const struct net_frag *frags, int nfrags, int *ndone)
+{
+	return syscall(SYS_net_send_frags, 0, (uint32_t) frags, nfrags,
+		       (uint32_t) ndone, 0, 0);
+}
+
+int
+sys_net_recv_batch(void *va, int npages)
+{
+	return syscall(SYS_net_recv_batch, 0, (uint32_t) va, npages, 0, 0, 0);
+}
+
+int
+sys_net_stats(struct net_hwstats *st)
+{
+	return syscall(SYS_net_stats, 0, (uint32_t) st, 0, 0, 0, 0);
+}
+
+int
+sys_net_set_queue(int q)
+{
+	return syscall(SYS_net_set_queue, 0, q, 0, 0, 0, 0);
+}
+
+int
+sys_net_bypass(int qn, struct net_bypass *nb)
+{
+	return syscall(SYS_net_bypass, 0, qn, (uint32_t) nb, 0, 0, 0);
+}
+
+int
+sys_net_wait_send(void)
+{
+	return syscall(SYS_net_wait_send, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_net_wait_recv(void)
+{
+	return syscall(SYS_net_wait_recv, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, void *xstacktop)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp, (uint32_t) xstacktop, 0, 0);
+}
 
+int
+sys_env_set_priority(envid_t envid, int sched_class, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, sched_class, priority, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 0, envid, cpumask, 0, 0, 0);
+}
+
+uint64_t
+sys_time_nsec(void)
+{
+	uint64_t nsec;
+
+	syscall(SYS_time_nsec, 1, (uint32_t) &nsec, 0, 0, 0, 0);
+	return nsec;
+}
+
+int
+sys_ncpu(void)
+{
+	return syscall(SYS_ncpu, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_until(void *dstva, unsigned int msec)
+{
+	return syscall(SYS_ipc_recv_until, 0, (uint32_t)dstva, msec, 0, 0, 0);
+}
+
+int
+sys_ipc_wait(volatile uint32_t *const *flags, int nflags, int timeout)
+{
+	return syscall(SYS_ipc_wait, 0, (uint32_t) flags, nflags, timeout,
+		       0, 0);
+}
+
+int
+sys_ipc_ring(envid_t envid, volatile uint32_t *flag)
+{
+	return syscall(SYS_ipc_ring, 0, envid, (uint32_t) flag, 0, 0, 0);
+}
@@ -1,11 +1,49 @@
+#include <netif/etharp.h>
+
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+// Frames, a page each, per sys_net_recv_batch.
+#define RX_BATCH	16
+
+static char rxbatch[RX_BATCH][PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// The network server instances on the card's other queue pairs.  Only
+// pair 0 gets ARP frames, so its pump passes them on to these as well,
+// which need them to reach hosts they open connections to.
+static envid_t arp_peers[NET_MAXQUEUES];
+static int narp_peers;
+
+static void
+find_arp_peers(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_NS
+		    && envs[i].env_status != ENV_FREE
+		    && envs[i].env_net_queue != 0
+		    && narp_peers < NET_MAXQUEUES)
+			arp_peers[narp_peers++] = envs[i].env_id;
+}
+
+static bool
+is_arp(void *pg)
+{
+	struct eth_hdr *eh = (struct eth_hdr *) ((struct jif_pkt *) pg)->jp_data;
 
+	return eh->type == htons(ETHTYPE_ARP);
+}
+
+// Pump the frames the card receives on its queue pair 'queue' to the
+// network server.  With RSS, one of these runs per queue pair.
 void
-input(envid_t ns_envid)
+input(envid_t ns_envid, int queue)
 {
+	int r;
+
 	binaryname = "ns_input";
+	if ((r = sys_net_set_queue(queue)) < 0)
+		panic("sys_net_set_queue %d: %e", queue, r);
 
 	// LAB 6: Your code here:
 	// 	- read a packet from the device driver
@@ -13,25 +51,55 @@ input(envid_t ns_envid)
 	// Hint: When you IPC a page to the network server, it will be
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
-#define RECV_BUF_SIZE 2048
-	char buf[RECV_BUF_SIZE+1];
-
-	int len = RECV_BUF_SIZE;
+	//
+	// Each sys_net_recv_batch swaps up to RX_BATCH of our pages
+	// for the card's filled receive pages, a frame each, and each
+	// page goes to the server as one NSREQ_INPUT.
 	int perm = PTE_U | PTE_P | PTE_W;
+	int i, j, n;
+
+	for (i = 0; i < RX_BATCH; i++)
+		while (sys_page_alloc(0, rxbatch[i], perm) < 0);
+	if (queue == 0)
+		find_arp_peers();
 
 	while (1) {
-		while ( sys_net_try_recv(buf, &len) < 0) {
-			sys_yield();
+		// Sleep until the card interrupts; fall back to polling
+		// if someone else is already waiting on it.
+		while ((n = sys_net_recv_batch(rxbatch, RX_BATCH)) < 0) {
+			if (n != -E_RCV_EMPTY)
+				panic("sys_net_recv_batch: %e", n);
+			if (sys_net_wait_recv() < 0)
+				sys_yield();
 		}
 
-		// Whenever a new page is allocated, old will be deallocated
-		// by page_insert automatically.
-		while (sys_page_alloc(0, &nsipcbuf, perm) < 0);
+		for (i = 0; i < n; i++) {
+			while (sys_ipc_try_send(ns_envid, NSREQ_INPUT, rxbatch[i], perm) < 0);
+			for (j = 0; j < narp_peers && is_arp(rxbatch[i]); j++)
+				while (sys_ipc_try_send(arp_peers[j], NSREQ_INPUT,
+							rxbatch[i], PTE_U | PTE_P) < 0);
+			// Whenever a new page is allocated, old will be
+			// deallocated by page_insert automatically.
+			while (sys_page_alloc(0, rxbatch[i], perm) < 0);
+		}
+	}
+}
+
+// With the network server driving queue pair 'queue' itself
+// (NS_BYPASS), just wake it whenever the card has received something,
+// so it needn't poll while idle.
+void
+input_wake(envid_t ns_envid, int queue)
+{
+	int r;
 
-		nsipcbuf.pkt.jp_len = len;
-		memmove(nsipcbuf.pkt.jp_data, buf, len);
+	binaryname = "ns_input";
+	if ((r = sys_net_set_queue(queue)) < 0)
+		panic("sys_net_set_queue %d: %e", queue, r);
 
-		while (sys_ipc_try_send(ns_envid, NSREQ_INPUT, &nsipcbuf, perm) < 0);
-		sys_page_unmap(0, &nsipcbuf);
+	while (1) {
+		if (sys_net_wait_recv() < 0)
+			sys_yield();
+		ipc_send(ns_envid, NSREQ_KICK, 0, 0);
 	}
 }
@@ -634,6 +634,56 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
   return (err==ERR_OK?size:-1);
 }
 
+/**
+ * Like lwip_send on a TCP socket, but queue the data without copying it.
+ * The caller must keep it unchanged until lwip_acked(s, *seqend) says
+ * the peer has it, since it may be retransmitted until then.
+ *
+ * @param seqend set to the sequence number just after the data
+ * @return size, or -1 on error
+ */
+int
+lwip_send_nocopy(int s, const void *data, int size, u32_t *seqend)
+{
+  struct lwip_socket *sock;
+  err_t err;
+
+  sock = get_socket(s);
+  if (!sock)
+    return -1;
+  if (sock->conn->type != NETCONN_TCP) {
+    sock_set_errno(sock, err_to_errno(ERR_ARG));
+    return -1;
+  }
+
+  err = netconn_write(sock->conn, data, size, NETCONN_NOCOPY);
+  if (err == ERR_OK && sock->conn->pcb.tcp != NULL)
+    *seqend = sock->conn->pcb.tcp->snd_lbb;
+  else if (err == ERR_OK)
+    err = ERR_CONN;
+
+  sock_set_errno(sock, err_to_errno(err));
+  return (err==ERR_OK?size:-1);
+}
+
+/**
+ * Return 1 if lwIP no longer needs the data before sequence number seq
+ * that lwip_send_nocopy queued on socket s: the peer has acknowledged
+ * it, or the connection is gone.  Otherwise return 0.
+ */
+int
+lwip_acked(int s, u32_t seq)
+{
+  struct lwip_socket *sock;
+  struct tcp_pcb *pcb;
+
+  sock = get_socket(s);
+  if (!sock || sock->conn->type != NETCONN_TCP)
+    return 1;
+  pcb = sock->conn->pcb.tcp;
+  return pcb == NULL || TCP_SEQ_GEQ(pcb->lastack, seq);
+}
+
 int
 lwip_sendto(int s, const void *data, int size, unsigned int flags,
        struct sockaddr *to, socklen_t tolen)
@@ -55,7 +55,7 @@
 
 #include "lwip/opt.h"
 
-#if !MEM_LIBC_MALLOC /* don't build if not configured for use in lwipopts.h */
+#if !MEM_LIBC_MALLOC && !MEM_JOS_SLAB /* don't build if not configured for use in lwipopts.h */
 
 #include "lwip/def.h"
 #include "lwip/mem.h"
@@ -628,4 +628,4 @@ void *mem_calloc(mem_size_t count, mem_size_t size)
   return p;
 }
 
-#endif /* !MEM_LIBC_MALLOC */
+#endif /* !MEM_LIBC_MALLOC && !MEM_JOS_SLAB */
@@ -73,6 +73,11 @@ struct tcp_pcb *tcp_tw_pcbs;
 
 struct tcp_pcb *tcp_tmp_pcb;
 
+/** Hash chains of active and TIME-WAIT PCBs, by 4-tuple */
+static struct tcp_pcb *tcp_conn_hash[TCP_HASH_SIZE];
+/** Hash chains of LISTEN PCBs, by local port */
+static struct tcp_pcb_listen *tcp_listen_hash[TCP_HASH_SIZE];
+
 static u8_t tcp_timer;
 static u16_t tcp_new_port(void);
 
@@ -391,9 +396,9 @@ tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
 void
 tcp_recved(struct tcp_pcb *pcb, u16_t len)
 {
-  if ((u32_t)pcb->rcv_wnd + len > TCP_WND) {
-    pcb->rcv_wnd = TCP_WND;
-    pcb->rcv_ann_wnd = TCP_WND;
+  if ((u32_t)pcb->rcv_wnd + len > TCP_WND_MAX(pcb)) {
+    pcb->rcv_wnd = TCP_WND_MAX(pcb);
+    pcb->rcv_ann_wnd = TCP_WND_MAX(pcb);
   } else {
     pcb->rcv_wnd += len;
     if (pcb->rcv_wnd >= pcb->mss) {
@@ -415,7 +420,7 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
      */
     tcp_ack(pcb);
   } 
-  else if (pcb->flags & TF_ACK_DELAY && pcb->rcv_wnd >= TCP_WND/2) {
+  else if (pcb->flags & TF_ACK_DELAY && pcb->rcv_wnd >= TCP_WND_MAX(pcb)/2) {
     /* If we can send a window update such that there is a full
      * segment available in the window, do so now.  This is sort of
      * nagle-like in its goals, and tries to hit a compromise between
@@ -485,7 +490,7 @@ err_t
 tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
       err_t (* connected)(void *arg, struct tcp_pcb *tpcb, err_t err))
 {
-  u32_t optdata;
+  u8_t optdata[40], optlen;
   err_t ret;
   u32_t iss;
 
@@ -499,7 +504,17 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
   }
   pcb->remote_port = port;
   if (pcb->local_port == 0) {
+#ifdef TCP_LOCAL_PORT_OK
+    u8_t tries;
+#endif /* TCP_LOCAL_PORT_OK */
     pcb->local_port = tcp_new_port();
+#ifdef TCP_LOCAL_PORT_OK
+    /* Let the port depend on the connection, e.g. so that the NIC
+       steers its replies where the port owner wants them. */
+    for (tries = 0; !TCP_LOCAL_PORT_OK(pcb) && tries < 64; tries++) {
+      pcb->local_port = tcp_new_port();
+    }
+#endif /* TCP_LOCAL_PORT_OK */
   }
   iss = tcp_next_iss();
   pcb->rcv_nxt = 0;
@@ -518,6 +533,8 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
   pcb->cwnd = 1;
   pcb->ssthresh = pcb->mss * 10;
   pcb->state = SYN_SENT;
+  /* Offer every option we support; the SYN|ACK says which to use. */
+  pcb->flags |= TF_SYN_OPTS;
 #if LWIP_CALLBACK_API  
   pcb->connected = connected;
 #endif /* LWIP_CALLBACK_API */
@@ -526,10 +543,10 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
 
   snmp_inc_tcpactiveopens();
   
-  /* Build an MSS option */
-  optdata = TCP_BUILD_MSS_OPTION();
+  /* Build the SYN options */
+  optlen = tcp_syn_opts(pcb, optdata);
 
-  ret = tcp_enqueue(pcb, NULL, 0, TCP_SYN, 0, (u8_t *)&optdata, 4);
+  ret = tcp_enqueue(pcb, NULL, 0, TCP_SYN, 0, optdata, optlen);
   if (ret == ERR_OK) { 
     tcp_output(pcb);
   }
@@ -547,7 +564,7 @@ void
 tcp_slowtmr(void)
 {
   struct tcp_pcb *pcb, *pcb2, *prev;
-  u16_t eff_wnd;
+  tcpwnd_size_t eff_wnd;
   u8_t pcb_remove;      /* flag if a PCB should be removed */
   err_t err;
 
@@ -709,6 +726,7 @@ tcp_slowtmr(void)
         LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_active_pcbs", tcp_active_pcbs == pcb);
         tcp_active_pcbs = pcb->next;
       }
+      tcp_hash_remove(pcb);
 
       TCP_EVENT_ERR(pcb->errf, pcb->callback_arg, ERR_ABRT);
 
@@ -760,6 +778,7 @@ tcp_slowtmr(void)
         LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_tw_pcbs", tcp_tw_pcbs == pcb);
         tcp_tw_pcbs = pcb->next;
       }
+      tcp_hash_remove(pcb);
       pcb2 = pcb->next;
       memp_free(MEMP_TCP_PCB, pcb);
       pcb = pcb2;
@@ -1179,6 +1198,117 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
   }
 }
 
+static u32_t
+tcp_conn_hashfn(struct ip_addr *remote_ip, u16_t remote_port, u16_t local_port)
+{
+  u32_t h = remote_ip->addr ^ (((u32_t)remote_port << 16) | local_port);
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return h & (TCP_HASH_SIZE - 1);
+}
+
+#define tcp_listen_hashfn(local_port) ((local_port) & (TCP_HASH_SIZE - 1))
+
+/**
+ * Adds a PCB that has just been put on the active, TIME-WAIT or listen
+ * list to the matching hash table.
+ *
+ * @param pcb the tcp_pcb (or tcp_pcb_listen) to add
+ */
+void
+tcp_hash_insert(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb_listen *lpcb;
+  struct tcp_pcb **head;
+
+  if (pcb->state == LISTEN) {
+    lpcb = (struct tcp_pcb_listen *)pcb;
+    lpcb->hash_next = tcp_listen_hash[tcp_listen_hashfn(lpcb->local_port)];
+    tcp_listen_hash[tcp_listen_hashfn(lpcb->local_port)] = lpcb;
+  } else {
+    head = &tcp_conn_hash[tcp_conn_hashfn(&pcb->remote_ip, pcb->remote_port,
+                                          pcb->local_port)];
+    pcb->hash_next = *head;
+    *head = pcb;
+  }
+}
+
+/**
+ * Removes a PCB from its hash table, if it is there.
+ *
+ * @param pcb the tcp_pcb (or tcp_pcb_listen) to remove
+ */
+void
+tcp_hash_remove(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb_listen **lp;
+  struct tcp_pcb **p;
+
+  if (pcb->state == LISTEN) {
+    for (lp = &tcp_listen_hash[tcp_listen_hashfn(pcb->local_port)];
+         *lp != NULL; lp = &(*lp)->hash_next) {
+      if (*lp == (struct tcp_pcb_listen *)pcb) {
+        *lp = (*lp)->hash_next;
+        break;
+      }
+    }
+  } else {
+    for (p = &tcp_conn_hash[tcp_conn_hashfn(&pcb->remote_ip, pcb->remote_port,
+                                            pcb->local_port)];
+         *p != NULL; p = &(*p)->hash_next) {
+      if (*p == pcb) {
+        *p = pcb->hash_next;
+        break;
+      }
+    }
+  }
+  pcb->hash_next = NULL;
+}
+
+/**
+ * Finds the active or TIME-WAIT PCB a segment belongs to.
+ *
+ * @return the PCB, or NULL if there is none
+ */
+struct tcp_pcb *
+tcp_hash_lookup(struct ip_addr *src, u16_t src_port,
+                struct ip_addr *dest, u16_t dest_port)
+{
+  struct tcp_pcb *pcb;
+
+  for (pcb = tcp_conn_hash[tcp_conn_hashfn(src, src_port, dest_port)];
+       pcb != NULL; pcb = pcb->hash_next) {
+    if (pcb->remote_port == src_port &&
+       pcb->local_port == dest_port &&
+       ip_addr_cmp(&(pcb->remote_ip), src) &&
+       ip_addr_cmp(&(pcb->local_ip), dest)) {
+      return pcb;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Finds the listening PCB a connection request is for.
+ *
+ * @return the PCB, or NULL if nobody listens on dest_port
+ */
+struct tcp_pcb_listen *
+tcp_hash_lookup_listen(struct ip_addr *dest, u16_t dest_port)
+{
+  struct tcp_pcb_listen *lpcb;
+
+  for (lpcb = tcp_listen_hash[tcp_listen_hashfn(dest_port)];
+       lpcb != NULL; lpcb = lpcb->hash_next) {
+    if ((ip_addr_isany(&(lpcb->local_ip)) ||
+        ip_addr_cmp(&(lpcb->local_ip), dest)) &&
+        lpcb->local_port == dest_port) {
+      return lpcb;
+    }
+  }
+  return NULL;
+}
+
 /**
  * Purges the PCB and removes it from a PCB list. Any delayed ACKs are sent first.
  *
@@ -70,12 +70,31 @@ static u16_t tcplen;
 static u8_t recv_flags;
 static struct pbuf *recv_data;
 
+/* The options of the incoming segment, as tcp_parseopt() found them. */
+static u16_t opt_mss;           /* 0 if there was none */
+static u16_t opt_flags;         /* TF_WND_SCALE, TF_TIMESTAMP, TF_SACK (permitted) */
+#if LWIP_WND_SCALE
+static u8_t opt_ws;
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_TIMESTAMPS
+static u32_t opt_tsval, opt_tsecr;
+#endif /* LWIP_TCP_TIMESTAMPS */
+#if LWIP_TCP_SACK
+static u8_t opt_nsack;
+static u32_t opt_sack_left[TCP_SACK_MAX], opt_sack_right[TCP_SACK_MAX];
+#endif /* LWIP_TCP_SACK */
+
 struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
 static err_t tcp_process(struct tcp_pcb *pcb);
 static u8_t tcp_receive(struct tcp_pcb *pcb);
-static void tcp_parseopt(struct tcp_pcb *pcb);
+static void tcp_parseopt(void);
+static void tcp_negotiate(struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+static void tcp_sack_mark(struct tcp_pcb *pcb);
+static void tcp_sack_rexmit(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
 
 static err_t tcp_listen_input(struct tcp_pcb_listen *pcb);
 static err_t tcp_timewait_input(struct tcp_pcb *pcb);
@@ -92,7 +111,7 @@ static err_t tcp_timewait_input(struct tcp_pcb *pcb);
 void
 tcp_input(struct pbuf *p, struct netif *inp)
 {
-  struct tcp_pcb *pcb, *prev;
+  struct tcp_pcb *pcb;
   struct tcp_pcb_listen *lpcb;
   u8_t hdrlen;
   err_t err;
@@ -131,8 +150,9 @@ tcp_input(struct pbuf *p, struct netif *inp)
   }
 
 #if CHECKSUM_CHECK_TCP
-  /* Verify TCP checksum. */
-  if (inet_chksum_pseudo(p, (struct ip_addr *)&(iphdr->src),
+  /* Verify TCP checksum, unless the netif already has. */
+  if (!(p->flags & PBUF_FLAG_CSUM_OK) &&
+      inet_chksum_pseudo(p, (struct ip_addr *)&(iphdr->src),
       (struct ip_addr *)&(iphdr->dest),
       IP_PROTO_TCP, p->tot_len) != 0) {
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packet discarded due to failing checksum 0x%04"X16_F"\n",
@@ -168,82 +188,34 @@ tcp_input(struct pbuf *p, struct netif *inp)
   seqno = tcphdr->seqno = ntohl(tcphdr->seqno);
   ackno = tcphdr->ackno = ntohl(tcphdr->ackno);
   tcphdr->wnd = ntohs(tcphdr->wnd);
+  tcp_parseopt();
 
   flags = TCPH_FLAGS(tcphdr) & TCP_FLAGS;
   tcplen = p->tot_len + ((flags & TCP_FIN || flags & TCP_SYN)? 1: 0);
 
   /* Demultiplex an incoming segment. First, we check if it is destined
-     for an active connection. */
-  prev = NULL;
-
-  
-  for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+     for an active connection, or one in TIME-WAIT; both are hashed by
+     their 4-tuple. */
+  pcb = tcp_hash_lookup(&(iphdr->src), tcphdr->src,
+                        &(iphdr->dest), tcphdr->dest);
+  if (pcb != NULL) {
     LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
-    LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
     LWIP_ASSERT("tcp_input: active pcb->state != LISTEN", pcb->state != LISTEN);
-    if (pcb->remote_port == tcphdr->src &&
-       pcb->local_port == tcphdr->dest &&
-       ip_addr_cmp(&(pcb->remote_ip), &(iphdr->src)) &&
-       ip_addr_cmp(&(pcb->local_ip), &(iphdr->dest))) {
-
-      /* Move this PCB to the front of the list so that subsequent
-         lookups will be faster (we exploit locality in TCP segment
-         arrivals). */
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
-      if (prev != NULL) {
-        prev->next = pcb->next;
-        pcb->next = tcp_active_pcbs;
-        tcp_active_pcbs = pcb;
-      }
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (after cache)", pcb->next != pcb);
-      break;
-    }
-    prev = pcb;
-  }
-
-  if (pcb == NULL) {
-    /* If it did not go to an active connection, we check the connections
-       in the TIME-WAIT state. */
-    for(pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
-      LWIP_ASSERT("tcp_input: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-      if (pcb->remote_port == tcphdr->src &&
-         pcb->local_port == tcphdr->dest &&
-         ip_addr_cmp(&(pcb->remote_ip), &(iphdr->src)) &&
-         ip_addr_cmp(&(pcb->local_ip), &(iphdr->dest))) {
-        /* We don't really care enough to move this PCB to the front
-           of the list since we are not very likely to receive that
-           many segments for connections in TIME-WAIT. */
-        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
-        tcp_timewait_input(pcb);
-        pbuf_free(p);
-        return;
-      }
+    if (pcb->state == TIME_WAIT) {
+      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+      tcp_timewait_input(pcb);
+      pbuf_free(p);
+      return;
     }
-
+  } else {
   /* Finally, if we still did not get a match, we check all PCBs that
      are LISTENing for incoming connections. */
-    prev = NULL;
-    for(lpcb = tcp_listen_pcbs.listen_pcbs; lpcb != NULL; lpcb = lpcb->next) {
-      if ((ip_addr_isany(&(lpcb->local_ip)) ||
-        ip_addr_cmp(&(lpcb->local_ip), &(iphdr->dest))) &&
-        lpcb->local_port == tcphdr->dest) {
-        /* Move this PCB to the front of the list so that subsequent
-           lookups will be faster (we exploit locality in TCP segment
-           arrivals). */
-        if (prev != NULL) {
-          ((struct tcp_pcb_listen *)prev)->next = lpcb->next;
-                /* our successor is the remainder of the listening list */
-          lpcb->next = tcp_listen_pcbs.listen_pcbs;
-                /* put this listening pcb at the head of the listening list */
-          tcp_listen_pcbs.listen_pcbs = lpcb;
-        }
-      
-        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
-        tcp_listen_input(lpcb);
-        pbuf_free(p);
-        return;
-      }
-      prev = (struct tcp_pcb *)lpcb;
+    lpcb = tcp_hash_lookup_listen(&(iphdr->dest), tcphdr->dest);
+    if (lpcb != NULL) {
+      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
+      tcp_listen_input(lpcb);
+      pbuf_free(p);
+      return;
     }
   }
 
@@ -289,6 +261,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
       }
     }
 
+    TCP_PCB_STATS_INC(pcb, segs_in);
     tcp_input_pcb = pcb;
     err = tcp_process(pcb);
     tcp_input_pcb = NULL;
@@ -323,6 +296,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
           }
 
           /* Notify application that data has been received. */
+          TCP_PCB_STATS_ADD(pcb, bytes_in, recv_data->tot_len);
           TCP_EVENT_RECV(pcb, recv_data, ERR_OK, err);
 
           /* If the upper layer can't receive this data, store it */
@@ -393,7 +367,7 @@ static err_t
 tcp_listen_input(struct tcp_pcb_listen *pcb)
 {
   struct tcp_pcb *npcb;
-  u32_t optdata;
+  u8_t optdata[40], optlen;
 
   /* In the LISTEN state, we check for incoming SYN segments,
      creates a new PCB, and responds with a SYN|ACK. */
@@ -431,7 +405,6 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
     npcb->state = SYN_RCVD;
     npcb->rcv_nxt = seqno + 1;
     npcb->snd_wnd = tcphdr->wnd;
-    npcb->ssthresh = npcb->snd_wnd;
     npcb->snd_wl1 = seqno - 1;/* initialise to seqno-1 to force window update */
     npcb->callback_arg = pcb->callback_arg;
 #if LWIP_CALLBACK_API
@@ -443,18 +416,20 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
        for it. */
     TCP_REG(&tcp_active_pcbs, npcb);
 
-    /* Parse any options in the SYN. */
-    tcp_parseopt(npcb);
+    /* Take up the options in the SYN that we support too. */
+    npcb->flags |= TF_SYN_OPTS;
+    tcp_negotiate(npcb);
 #if TCP_CALCULATE_EFF_SEND_MSS
     npcb->mss = tcp_eff_send_mss(npcb->mss, &(npcb->remote_ip));
 #endif /* TCP_CALCULATE_EFF_SEND_MSS */
+    /* Arbitrarily high (RFC 5681): the largest window the peer can offer. */
+    npcb->ssthresh = SND_WND_SCALE(npcb, 0xffff);
 
     snmp_inc_tcppassiveopens();
 
-    /* Build an MSS option. */
-    optdata = TCP_BUILD_MSS_OPTION();
-    /* Send a SYN|ACK together with the MSS option. */
-    tcp_enqueue(npcb, NULL, 0, TCP_SYN | TCP_ACK, 0, (u8_t *)&optdata, 4);
+    /* Send a SYN|ACK together with the MSS option and those agreed on. */
+    optlen = tcp_syn_opts(npcb, optdata);
+    tcp_enqueue(npcb, NULL, 0, TCP_SYN | TCP_ACK, 0, optdata, optlen);
     return tcp_output(npcb);
   }
   return ERR_OK;
@@ -531,6 +506,25 @@ tcp_process(struct tcp_pcb *pcb)
     }
   }
 
+#if LWIP_TCP_TIMESTAMPS
+  /* PAWS (RFC 1323): a segment stamped before the last one we took is
+     an old duplicate, and only gets an ACK. Otherwise, the stamp is the
+     one to echo if the segment starts at or before our last ACK. */
+  if (pcb->state != SYN_SENT && (pcb->flags & TF_TIMESTAMP) &&
+      (opt_flags & TF_TIMESTAMP)) {
+    if (TCP_SEQ_LT(opt_tsval, pcb->ts_recent)) {
+      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_process: PAWS drop tsval %"U32_F" ts_recent %"U32_F"\n",
+       opt_tsval, pcb->ts_recent));
+      pcb->acked = 0;
+      tcp_ack_now(pcb);
+      return ERR_OK;
+    }
+    if (TCP_SEQ_LEQ(seqno, pcb->ts_lastacksent)) {
+      pcb->ts_recent = opt_tsval;
+    }
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+
   /* Update the PCB (in)activity timer. */
   pcb->tmr = tcp_ticks;
   pcb->keep_cnt_sent = 0;
@@ -550,16 +544,17 @@ tcp_process(struct tcp_pcb *pcb)
       pcb->snd_wl1 = seqno - 1; /* initialise to seqno - 1 to force window update */
       pcb->state = ESTABLISHED;
 
-      /* Parse any options in the SYNACK before using pcb->mss since that
+      /* Take up the options in the SYNACK before using pcb->mss since that
        * can be changed by the received options! */
-      tcp_parseopt(pcb);
+      tcp_negotiate(pcb);
 #if TCP_CALCULATE_EFF_SEND_MSS
       pcb->mss = tcp_eff_send_mss(pcb->mss, &(pcb->remote_ip));
 #endif /* TCP_CALCULATE_EFF_SEND_MSS */
 
-      /* Set ssthresh again after changing pcb->mss (already set in tcp_connect
-       * but for the default value of pcb->mss) */
-      pcb->ssthresh = pcb->mss * 10;
+      /* Set ssthresh again now that the window scale is known (already set
+       * in tcp_connect): arbitrarily high (RFC 5681), the largest window
+       * the peer can offer. */
+      pcb->ssthresh = SND_WND_SCALE(pcb, 0xffff);
 
       pcb->cwnd = ((pcb->cwnd == 1) ? (pcb->mss * 2) : pcb->mss);
       LWIP_ASSERT("pcb->snd_queuelen > 0", (pcb->snd_queuelen > 0));
@@ -596,7 +591,7 @@ tcp_process(struct tcp_pcb *pcb)
        !(flags & TCP_RST)) {
       /* expected ACK number? */
       if (TCP_SEQ_BETWEEN(ackno, pcb->lastack+1, pcb->snd_nxt)) {
-        u16_t old_cwnd;
+        tcpwnd_size_t old_cwnd;
         pcb->state = ESTABLISHED;
         LWIP_DEBUGF(TCP_DEBUG, ("TCP connection established %"U16_F" -> %"U16_F".\n", inseg.tcphdr->src, inseg.tcphdr->dest));
 #if LWIP_CALLBACK_API
@@ -719,26 +714,37 @@ tcp_receive(struct tcp_pcb *pcb)
   s32_t off;
   s16_t m;
   u32_t right_wnd_edge;
+  tcpwnd_size_t wnd;
   u16_t new_tot_len;
   u8_t accepted_inseq = 0;
+#if LWIP_TCP_SACK
+  u8_t partial;
+#endif /* LWIP_TCP_SACK */
 
   if (flags & TCP_ACK) {
     right_wnd_edge = pcb->snd_wnd + pcb->snd_wl1;
+    /* The window of a SYN is never scaled. */
+    wnd = (flags & TCP_SYN) ? tcphdr->wnd : SND_WND_SCALE(pcb, tcphdr->wnd);
+#if LWIP_TCP_SACK
+    if (pcb->flags & TF_SACK) {
+      tcp_sack_mark(pcb);
+    }
+#endif /* LWIP_TCP_SACK */
 
     /* Update window. */
     if (TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
        (pcb->snd_wl1 == seqno && TCP_SEQ_LT(pcb->snd_wl2, ackno)) ||
-       (pcb->snd_wl2 == ackno && tcphdr->wnd > pcb->snd_wnd)) {
-      pcb->snd_wnd = tcphdr->wnd;
+       (pcb->snd_wl2 == ackno && wnd > pcb->snd_wnd)) {
+      pcb->snd_wnd = wnd;
       pcb->snd_wl1 = seqno;
       pcb->snd_wl2 = ackno;
       if (pcb->snd_wnd > 0 && pcb->persist_backoff > 0) {
           pcb->persist_backoff = 0;
       }
-      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"U16_F"\n", pcb->snd_wnd));
+      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"U32_F"\n", (u32_t)pcb->snd_wnd));
 #if TCP_WND_DEBUG
     } else {
-      if (pcb->snd_wnd != tcphdr->wnd) {
+      if (pcb->snd_wnd != wnd) {
         LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: no window update lastack %"U32_F" snd_max %"U32_F" ackno %"U32_F" wl1 %"U32_F" seqno %"U32_F" wl2 %"U32_F"\n",
                                pcb->lastack, pcb->snd_max, ackno, pcb->snd_wl1, seqno, pcb->snd_wl2));
       }
@@ -750,12 +756,22 @@ tcp_receive(struct tcp_pcb *pcb)
 
       if (pcb->snd_wl1 + pcb->snd_wnd == right_wnd_edge){
         ++pcb->dupacks;
-        if (pcb->dupacks >= 3 && pcb->unacked != NULL) {
+        TCP_PCB_STATS_INC(pcb, dupacks);
+        /* (dupacks wraps in a long recovery, hence TF_INFR) */
+        if ((pcb->dupacks >= 3 || (pcb->flags & TF_INFR)) && pcb->unacked != NULL) {
           if (!(pcb->flags & TF_INFR)) {
             /* This is fast retransmit. Retransmit the first unacked segment. */
             LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_receive: dupacks %"U16_F" (%"U32_F"), fast retransmit %"U32_F"\n",
                                        (u16_t)pcb->dupacks, pcb->lastack,
                                        ntohl(pcb->unacked->tcphdr->seqno)));
+#if LWIP_TCP_SACK
+            if (pcb->flags & TF_SACK) {
+              /* Recovery lasts until all sent so far is acked (RFC 6675);
+                 tcp_sack_rexmit() below starts with the first segment. */
+              pcb->recover = pcb->snd_max;
+              pcb->rexmit_hi = pcb->lastack;
+            } else
+#endif /* LWIP_TCP_SACK */
             tcp_rexmit(pcb);
             /* Set ssthresh to max (FlightSize / 2, 2*SMSS) */
             /*pcb->ssthresh = LWIP_MAX((pcb->snd_max -
@@ -775,13 +791,19 @@ tcp_receive(struct tcp_pcb *pcb)
 
             pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
             pcb->flags |= TF_INFR;
+            TCP_PCB_STATS_INC(pcb, fast_rexmit);
           } else {
             /* Inflate the congestion window, but not if it means that
                the value overflows. */
-            if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+            if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
               pcb->cwnd += pcb->mss;
             }
           }
+#if LWIP_TCP_SACK
+          if (pcb->flags & TF_SACK) {
+            tcp_sack_rexmit(pcb);
+          }
+#endif /* LWIP_TCP_SACK */
         }
       } else {
         LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_receive: dupack averted %"U32_F" %"U32_F"\n",
@@ -789,7 +811,17 @@ tcp_receive(struct tcp_pcb *pcb)
       }
     } else if (TCP_SEQ_BETWEEN(ackno, pcb->lastack+1, pcb->snd_max)){
       /* We come here when the ACK acknowledges new data. */
-      
+#if LWIP_TCP_SACK
+      /* With SACK, an ACK short of the recovery point is a partial one:
+         there are more holes to fill, so recovery goes on (RFC 6675).
+         Deflate cwnd by what was acked, leaving room for one segment. */
+      partial = (pcb->flags & TF_INFR) && (pcb->flags & TF_SACK) &&
+                TCP_SEQ_LT(ackno, pcb->recover);
+      if (partial) {
+        wnd = (tcpwnd_size_t)(ackno - pcb->lastack);
+        pcb->cwnd = (pcb->cwnd > wnd) ? pcb->cwnd - wnd + pcb->mss : pcb->mss;
+      } else
+#endif /* LWIP_TCP_SACK */
       /* Reset the "IN Fast Retransmit" flag, since we are no longer
          in fast retransmit. Also reset the congestion window to the
          slow start threshold. */
@@ -806,6 +838,7 @@ tcp_receive(struct tcp_pcb *pcb)
 
       /* Update the send buffer space. Diff between the two can never exceed 64K? */
       pcb->acked = (u16_t)(ackno - pcb->lastack);
+      TCP_PCB_STATS_ADD(pcb, bytes_acked, pcb->acked);
 
       pcb->snd_buf += pcb->acked;
 
@@ -814,19 +847,19 @@ tcp_receive(struct tcp_pcb *pcb)
       pcb->lastack = ackno;
 
       /* Update the congestion control variables (cwnd and
-         ssthresh). */
-      if (pcb->state >= ESTABLISHED) {
+         ssthresh). Not while still recovering. */
+      if (pcb->state >= ESTABLISHED && !(pcb->flags & TF_INFR)) {
         if (pcb->cwnd < pcb->ssthresh) {
-          if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+          if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
             pcb->cwnd += pcb->mss;
           }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"U16_F"\n", pcb->cwnd));
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"U32_F"\n", (u32_t)pcb->cwnd));
         } else {
-          u16_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+          tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
           if (new_cwnd > pcb->cwnd) {
             pcb->cwnd = new_cwnd;
           }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"U16_F"\n", pcb->cwnd));
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"U32_F"\n", (u32_t)pcb->cwnd));
         }
       }
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
@@ -869,6 +902,11 @@ tcp_receive(struct tcp_pcb *pcb)
         pcb->rtime = 0;
 
       pcb->polltmr = 0;
+#if LWIP_TCP_SACK
+      if (partial) {
+        tcp_sack_rexmit(pcb);
+      }
+#endif /* LWIP_TCP_SACK */
     } else {
       /* Fix bug bug #21582: out of sequence ACK, didn't really ack anything */
       pcb->acked = 0;
@@ -912,12 +950,21 @@ tcp_receive(struct tcp_pcb *pcb)
 
     /* RTT estimation calculations. This is done by checking if the
        incoming segment acknowledges the segment we use to take a
-       round-trip time measurement. */
-    if (pcb->rttest && TCP_SEQ_LT(pcb->rtseq, ackno)) {
+       round-trip time measurement, or, with timestamps, from the time
+       echoed by any ACK of new data (RFC 1323 RTTM). */
+    m = -1;
+#if LWIP_TCP_TIMESTAMPS
+    if (pcb->acked > 0 && (pcb->flags & TF_TIMESTAMP) &&
+        (opt_flags & TF_TIMESTAMP) && opt_tsecr != 0) {
+      m = (s16_t)((sys_now() - opt_tsecr) / TCP_SLOW_INTERVAL);
+    }
+#endif /* LWIP_TCP_TIMESTAMPS */
+    if (m < 0 && pcb->rttest && TCP_SEQ_LT(pcb->rtseq, ackno)) {
       /* diff between this shouldn't exceed 32K since this are tcp timer ticks
          and a round-trip shouldn't be that long... */
       m = (s16_t)(tcp_ticks - pcb->rttest);
-
+    }
+    if (m >= 0) {
       LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: experienced rtt %"U16_F" ticks (%"U16_F" msec).\n",
                                   m, m * TCP_SLOW_INTERVAL));
 
@@ -1159,6 +1206,11 @@ tcp_receive(struct tcp_pcb *pcb)
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
         tcp_ack_now(pcb);
+        TCP_PCB_STATS_INC(pcb, ooseq);
+#if LWIP_TCP_SACK
+        /* The ACK reports the run holding this segment first. */
+        pcb->sack_recent = seqno;
+#endif /* LWIP_TCP_SACK */
 #if TCP_QUEUE_OOSEQ
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
@@ -1297,54 +1349,206 @@ tcp_receive(struct tcp_pcb *pcb)
 }
 
 /**
- * Parses the options contained in the incoming segment. (Code taken
+ * Parses the options contained in the incoming segment into opt_mss,
+ * opt_flags and the values of the options flagged there. (Code taken
  * from uIP with only small changes.)
  *
- * Called from tcp_listen_input() and tcp_process().
- * Currently, only the MSS option is supported!
- *
- * @param pcb the tcp_pcb for which a segment arrived
+ * Called from tcp_input() for every segment.
  */
 static void
-tcp_parseopt(struct tcp_pcb *pcb)
+tcp_parseopt(void)
 {
-  u8_t c;
+  u8_t c, max_c, len;
   u8_t *opts, opt;
-  u16_t mss;
+#if LWIP_TCP_SACK
+  u8_t b;
+#endif /* LWIP_TCP_SACK */
+
+  opt_mss = 0;
+  opt_flags = 0;
+#if LWIP_TCP_SACK
+  opt_nsack = 0;
+#endif /* LWIP_TCP_SACK */
 
   opts = (u8_t *)tcphdr + TCP_HLEN;
 
-  /* Parse the TCP MSS option, if present. */
   if(TCPH_HDRLEN(tcphdr) > 0x5) {
-    for(c = 0; c < (TCPH_HDRLEN(tcphdr) - 5) << 2 ;) {
+    max_c = (TCPH_HDRLEN(tcphdr) - 5) << 2;
+    for(c = 0; c < max_c; c += len) {
       opt = opts[c];
       if (opt == 0x00) {
         /* End of options. */
         break;
-      } else if (opt == 0x01) {
-        ++c;
-        /* NOP option. */
-      } else if (opt == 0x02 &&
-        opts[c + 1] == 0x04) {
-        /* An MSS option with the right option length. */
-        mss = (opts[c + 2] << 8) | opts[c + 3];
-        /* Limit the mss to the configured TCP_MSS and prevent division by zero */
-        pcb->mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
-
-        /* And we are done processing options. */
+      } else if (opt == TCP_OPT_NOP) {
+        len = 1;
+        continue;
+      }
+      /* All other options have a length field, so that we easily
+         can skip past them. If it is short or runs past the header,
+         the options are malformed and we don't process them further. */
+      if (c + 1 >= max_c || (len = opts[c + 1]) < 2 || c + len > max_c) {
         break;
-      } else {
-        if (opts[c + 1] == 0) {
-          /* If the length field is zero, the options are malformed
-             and we don't process them further. */
+      }
+      switch (opt) {
+      case TCP_OPT_MSS:
+        if (len == TCP_OPTLEN_MSS) {
+          opt_mss = (opts[c + 2] << 8) | opts[c + 3];
+          /* Limit the mss to the configured TCP_MSS and prevent division by zero */
+          opt_mss = ((opt_mss > TCP_MSS) || (opt_mss == 0)) ? TCP_MSS : opt_mss;
+        }
+        break;
+#if LWIP_WND_SCALE
+      case TCP_OPT_WS:
+        if (len == 3) {
+          /* RFC 1323 caps the shift at 14. */
+          opt_ws = LWIP_MIN(opts[c + 2], 14);
+          opt_flags |= TF_WND_SCALE;
+        }
+        break;
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_TIMESTAMPS
+      case TCP_OPT_TS:
+        if (len == 10) {
+          opt_tsval = (opts[c + 2] << 24) | (opts[c + 3] << 16) |
+                      (opts[c + 4] << 8) | opts[c + 5];
+          opt_tsecr = (opts[c + 6] << 24) | (opts[c + 7] << 16) |
+                      (opts[c + 8] << 8) | opts[c + 9];
+          opt_flags |= TF_TIMESTAMP;
+        }
+        break;
+#endif /* LWIP_TCP_TIMESTAMPS */
+#if LWIP_TCP_SACK
+      case TCP_OPT_SACK_PERM:
+        if (len == 2) {
+          opt_flags |= TF_SACK;
+        }
+        break;
+      case TCP_OPT_SACK:
+        for (b = 2; b + 8 <= len && opt_nsack < TCP_SACK_MAX; b += 8) {
+          opt_sack_left[opt_nsack] =
+            (opts[c + b] << 24) | (opts[c + b + 1] << 16) |
+            (opts[c + b + 2] << 8) | opts[c + b + 3];
+          opt_sack_right[opt_nsack] =
+            (opts[c + b + 4] << 24) | (opts[c + b + 5] << 16) |
+            (opts[c + b + 6] << 8) | opts[c + b + 7];
+          opt_nsack++;
+        }
+        break;
+#endif /* LWIP_TCP_SACK */
+      default:
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * Takes up the options of a SYN or SYN|ACK: the peer's MSS, and those
+ * of window scaling, timestamps and SACK that both ends offered
+ * (the pcb's flags hold what we offered).
+ *
+ * Called from tcp_listen_input() and tcp_process().
+ *
+ * @param pcb the tcp_pcb for which a SYN arrived
+ */
+static void
+tcp_negotiate(struct tcp_pcb *pcb)
+{
+  if (opt_mss != 0) {
+    pcb->mss = opt_mss;
+  }
+  pcb->flags &= ~TF_SYN_OPTS | opt_flags;
+
+#if LWIP_WND_SCALE
+  if (pcb->flags & TF_WND_SCALE) {
+    pcb->snd_scale = opt_ws;
+    pcb->rcv_scale = TCP_RCV_SCALE;
+  } else {
+    /* What we can announce stays 16 bits. */
+    pcb->snd_scale = 0;
+    pcb->rcv_scale = 0;
+    pcb->rcv_wnd = LWIP_MIN(pcb->rcv_wnd, 0xffff);
+    pcb->rcv_ann_wnd = LWIP_MIN(pcb->rcv_ann_wnd, 0xffff);
+  }
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_TIMESTAMPS
+  if (pcb->flags & TF_TIMESTAMP) {
+    pcb->ts_recent = opt_tsval;
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+}
+
+#if LWIP_TCP_SACK
+/**
+ * Marks the segments on ->unacked that the SACK blocks of the incoming
+ * segment cover, so that recovery skips them. Blocks at or below the
+ * ACK, or beyond anything sent, are ignored.
+ *
+ * @param pcb the tcp_pcb for which an ACK arrived
+ */
+static void
+tcp_sack_mark(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  u32_t left, right, start;
+  u8_t i;
+
+  for (i = 0; i < opt_nsack; i++) {
+    left = opt_sack_left[i];
+    right = opt_sack_right[i];
+    if (TCP_SEQ_LEQ(left, ackno) || TCP_SEQ_LEQ(right, left) ||
+        TCP_SEQ_GT(right, pcb->snd_max)) {
+      continue;
+    }
+    for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+      start = ntohl(seg->tcphdr->seqno);
+      if (TCP_SEQ_GEQ(start, left) &&
+          TCP_SEQ_LEQ(start + TCP_TCPLEN(seg), right)) {
+        seg->flags |= TF_SEG_SACKED;
+      }
+    }
+  }
+}
+
+/**
+ * Retransmits one segment during SACK recovery, a simplified form of
+ * RFC 6675's NextSeg(): first the one at the ACK point, then each
+ * hole below data the peer holds, in order, one per ACK.
+ *
+ * @param pcb the tcp_pcb in fast recovery
+ */
+static void
+tcp_sack_rexmit(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, *hole = NULL;
+
+  if (TCP_SEQ_LT(pcb->rexmit_hi, pcb->lastack)) {
+    pcb->rexmit_hi = pcb->lastack;
+  }
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (hole == NULL) {
+      if (!(seg->flags & TF_SEG_SACKED) &&
+          TCP_SEQ_GT(ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg), pcb->rexmit_hi)) {
+        hole = seg;
+        if (pcb->rexmit_hi == pcb->lastack) {
+          /* The first hole needs no SACKed data above it: the
+             duplicate ACKs already say it is lost. */
           break;
         }
-        /* All other options have a length field, so that we easily
-           can skip past them. */
-        c += opts[c + 1];
       }
+    } else if (seg->flags & TF_SEG_SACKED) {
+      break;
     }
   }
+  if (hole == NULL || seg == NULL) {
+    return;
+  }
+
+  LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_sack_rexmit: %"U32_F" (lastack %"U32_F")\n",
+                             ntohl(hole->tcphdr->seqno), pcb->lastack));
+  pcb->rexmit_hi = ntohl(hole->tcphdr->seqno) + TCP_TCPLEN(hole);
+  tcp_rexmit_seg(pcb, hole);
 }
+#endif /* LWIP_TCP_SACK */
 
 #endif /* LWIP_TCP */
@@ -58,6 +58,12 @@
 
 /* Forward declarations.*/
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+static u8_t tcp_build_opts(struct tcp_pcb *pcb, u8_t *opts, u8_t sack);
+
+/** The window to put in an outgoing header: a SYN's is never scaled. */
+#define TCP_WND_OUT(pcb, syn) \
+  htons((syn) ? TCPWND16((pcb)->rcv_ann_wnd) : \
+                TCPWND16(RCV_WND_SCALE(pcb, (pcb)->rcv_ann_wnd)))
 
 /**
  * Called by tcp_close() to send a segment including flags but not data.
@@ -137,6 +143,9 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
   u16_t left, seglen;
   void *ptr;
   u16_t queuelen;
+  u8_t optflags = 0;
+  /* option room ahead of the data, for a timestamp */
+  u8_t extra = 0;
 
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_enqueue(pcb=%p, arg=%p, len=%"U16_F", flags=%"X16_F", apiflags=%"U16_F")\n",
     (void *)pcb, arg, len, (u16_t)flags, (u16_t)apiflags));
@@ -153,6 +162,17 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
   left = len;
   ptr = arg;
 
+#if LWIP_TCP_TIMESTAMPS
+  /* Once in use, timestamps go on every segment. A SYN's is already
+     part of optdata (tcp_syn_opts). */
+  if (pcb->flags & TF_TIMESTAMP) {
+    optflags = TF_SEG_OPTS_TS;
+    if (optdata == NULL) {
+      extra = TCP_OPTLEN_TS;
+    }
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+
   /* seqno will be the sequence number of the first segment enqueued
    * by the call to this function. */
   seqno = pcb->snd_lbb;
@@ -184,8 +204,8 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
   while (queue == NULL || left > 0) {
 
     /* The segment length should be the MSS if the data to be enqueued
-     * is larger than the MSS. */
-    seglen = left > pcb->mss? pcb->mss: left;
+     * is larger than the MSS. Options count against the MSS. */
+    seglen = left > pcb->mss - extra? pcb->mss - extra: left;
 
     /* Allocate memory for tcp_seg, and fill in fields. */
     seg = memp_malloc(MEMP_TCP_SEG);
@@ -195,6 +215,7 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
     }
     seg->next = NULL;
     seg->p = NULL;
+    seg->flags = optflags;
 
     /* first segment of to-be-queued data? */
     if (queue == NULL) {
@@ -226,17 +247,17 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
     }
     /* copy from volatile memory? */
     else if (apiflags & TCP_WRITE_FLAG_COPY) {
-      if ((seg->p = pbuf_alloc(PBUF_TRANSPORT, seglen, PBUF_RAM)) == NULL) {
+      if ((seg->p = pbuf_alloc(PBUF_TRANSPORT, extra + seglen, PBUF_RAM)) == NULL) {
         LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_enqueue : could not allocate memory for pbuf copy size %"U16_F"\n", seglen));
         goto memerr;
       }
       LWIP_ASSERT("check that first pbuf can hold the complete seglen",
-                  (seg->p->len >= seglen));
+                  (seg->p->len >= extra + seglen));
       queuelen += pbuf_clen(seg->p);
+      seg->dataptr = (u8_t *)seg->p->payload + extra;
       if (arg != NULL) {
-        MEMCPY(seg->p->payload, ptr, seglen);
+        MEMCPY(seg->dataptr, ptr, seglen);
       }
-      seg->dataptr = seg->p->payload;
     }
     /* do not copy data */
     else {
@@ -254,8 +275,8 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
       p->payload = ptr;
       seg->dataptr = ptr;
 
-      /* Second, allocate a pbuf for the headers. */
-      if ((seg->p = pbuf_alloc(PBUF_TRANSPORT, 0, PBUF_RAM)) == NULL) {
+      /* Second, allocate a pbuf for the headers and option room. */
+      if ((seg->p = pbuf_alloc(PBUF_TRANSPORT, extra, PBUF_RAM)) == NULL) {
         /* If allocation fails, we have to deallocate the data pbuf as
          * well. */
         pbuf_free(p);
@@ -294,7 +315,9 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
 
     /* Copy the options into the header, if they are present. */
     if (optdata == NULL) {
-      TCPH_HDRLEN_SET(seg->tcphdr, 5);
+      /* the option room (if any) follows the header: tcp_output_segment
+         fills it */
+      TCPH_HDRLEN_SET(seg->tcphdr, 5 + extra / 4);
     }
     else {
       TCPH_HDRLEN_SET(seg->tcphdr, (5 + optlen / 4));
@@ -331,9 +354,9 @@ tcp_enqueue(struct tcp_pcb *pcb, void *arg, u16_t len,
     !(TCPH_FLAGS(useg->tcphdr) & (TCP_SYN | TCP_FIN)) &&
     !(flags & (TCP_SYN | TCP_FIN)) &&
     /* fit within max seg size */
-    useg->len + queue->len <= pcb->mss) {
-    /* Remove TCP header from first segment of our to-be-queued list */
-    if(pbuf_header(queue->p, -TCP_HLEN)) {
+    useg->len + queue->len <= pcb->mss - extra) {
+    /* Remove TCP header and options from first segment of our to-be-queued list */
+    if(pbuf_header(queue->p, -(TCP_HLEN + extra))) {
       /* Can we cope with this failing?  Just assert for now */
       LWIP_ASSERT("pbuf_header failed\n", 0);
       TCP_STATS_INC(tcp.err);
@@ -414,6 +437,7 @@ tcp_output(struct tcp_pcb *pcb)
   struct tcp_hdr *tcphdr;
   struct tcp_seg *seg, *useg;
   u32_t wnd;
+  u8_t opts[40], optlen;
 #if TCP_CWND_DEBUG
   s16_t i = 0;
 #endif /* TCP_CWND_DEBUG */
@@ -445,7 +469,8 @@ tcp_output(struct tcp_pcb *pcb)
   if (pcb->flags & TF_ACK_NOW &&
      (seg == NULL ||
       ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd)) {
-    p = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
+    optlen = tcp_build_opts(pcb, opts, 1);
+    p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
     if (p == NULL) {
       LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: (ACK) could not allocate pbuf\n"));
       return ERR_BUF;
@@ -460,9 +485,10 @@ tcp_output(struct tcp_pcb *pcb)
     tcphdr->seqno = htonl(pcb->snd_nxt);
     tcphdr->ackno = htonl(pcb->rcv_nxt);
     TCPH_FLAGS_SET(tcphdr, TCP_ACK);
-    tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+    tcphdr->wnd = TCP_WND_OUT(pcb, 0);
     tcphdr->urgp = 0;
-    TCPH_HDRLEN_SET(tcphdr, 5);
+    TCPH_HDRLEN_SET(tcphdr, 5 + optlen / 4);
+    SMEMCPY(tcphdr + 1, opts, optlen);
 
     tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
@@ -484,6 +510,7 @@ tcp_output(struct tcp_pcb *pcb)
     ip_output(p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl, pcb->tos,
         IP_PROTO_TCP);
 #endif /* LWIP_NETIF_HWADDRHINT*/
+    TCP_PCB_STATS_INC(pcb, segs_out);
     pbuf_free(p);
 
     return ERR_OK;
@@ -607,7 +634,22 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   seg->tcphdr->ackno = htonl(pcb->rcv_nxt);
 
   /* advertise our receive window size in this TCP segment */
-  seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  seg->tcphdr->wnd = TCP_WND_OUT(pcb, TCPH_FLAGS(seg->tcphdr) & TCP_SYN);
+
+#if LWIP_TCP_TIMESTAMPS
+  /* Stamp the timestamp room at the end of the header afresh: this
+     may be a retransmission. */
+  if (seg->flags & TF_SEG_OPTS_TS) {
+    u8_t opts[TCP_OPTLEN_TS];
+
+    if (tcp_build_opts(pcb, opts, 0) != TCP_OPTLEN_TS) {
+      /* The other end turned timestamps down in its SYN|ACK. */
+      memset(opts, TCP_OPT_NOP, TCP_OPTLEN_TS);
+    }
+    SMEMCPY((u8_t *)seg->tcphdr + TCPH_HDRLEN(seg->tcphdr) * 4 - TCP_OPTLEN_TS,
+            opts, TCP_OPTLEN_TS);
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
 
   /* If we don't have a local IP address, we get one by
      calling ip_route(). */
@@ -648,6 +690,7 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
              IP_PROTO_TCP, seg->p->tot_len);
 #endif
   TCP_STATS_INC(tcp.xmit);
+  TCP_PCB_STATS_INC(pcb, segs_out);
 
 #if LWIP_NETIF_HWADDRHINT
   {
@@ -707,7 +750,7 @@ tcp_rst(u32_t seqno, u32_t ackno,
   tcphdr->seqno = htonl(seqno);
   tcphdr->ackno = htonl(ackno);
   TCPH_FLAGS_SET(tcphdr, TCP_RST | TCP_ACK);
-  tcphdr->wnd = htons(TCP_WND);
+  tcphdr->wnd = htons(TCPWND16(TCP_WND));
   tcphdr->urgp = 0;
   TCPH_HDRLEN_SET(tcphdr, 5);
 
@@ -740,6 +783,14 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
     return;
   }
 
+#if LWIP_TCP_SACK
+  /* The other end may have thrown away what it SACKed: resend it all. */
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    seg->flags &= ~TF_SEG_SACKED;
+  }
+  pcb->flags &= ~TF_INFR;
+#endif /* LWIP_TCP_SACK */
+
   /* Move all unacked segments to the head of the unsent queue */
   for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
   /* concatenate unsent queue after unacked queue */
@@ -755,6 +806,7 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
 
   /* Don't take any RTT measurements after retransmitting. */
   pcb->rttest = 0;
+  TCP_PCB_STATS_INC(pcb, rto);
 
   /* Do the actual retransmission */
   tcp_output(pcb);
@@ -791,9 +843,171 @@ tcp_rexmit(struct tcp_pcb *pcb)
 
   /* Do the actual retransmission. */
   snmp_inc_tcpretranssegs();
+  TCP_PCB_STATS_INC(pcb, rexmit);
   tcp_output(pcb);
 }
 
+/**
+ * Retransmit one segment where it sits on the unacked queue
+ *
+ * Called by tcp_receive() during SACK-based recovery, which resends the
+ * holes in the middle of the queue rather than its head.
+ *
+ * @param pcb the tcp_pcb the segment belongs to
+ * @param seg the segment to send again
+ */
+void
+tcp_rexmit_seg(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  u32_t rttest = pcb->rttest;
+
+  ++pcb->nrtx;
+  snmp_inc_tcpretranssegs();
+  TCP_PCB_STATS_INC(pcb, rexmit);
+  tcp_output_segment(seg, pcb);
+
+  /* Karn: don't time the retransmission, but keep any sample already
+     under way. */
+  pcb->rttest = rttest;
+}
+
+/**
+ * Build the options for a SYN or SYN|ACK: the MSS, then those
+ * flagged on the pcb (which a passive open only flags when the SYN
+ * carried them). A timestamp goes last and empty; tcp_output_segment
+ * fills it in.
+ *
+ * @param pcb the tcp_pcb sending the SYN
+ * @param opts room for up to 40 bytes of options
+ * @return the length of the options, a multiple of 4
+ */
+u8_t
+tcp_syn_opts(struct tcp_pcb *pcb, u8_t *opts)
+{
+  u8_t len = 0;
+
+  opts[len++] = TCP_OPT_MSS;
+  opts[len++] = 4;
+  opts[len++] = TCP_MSS / 256;
+  opts[len++] = TCP_MSS & 255;
+#if LWIP_TCP_SACK
+  if (pcb->flags & TF_SACK) {
+    opts[len++] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_SACK_PERM;
+    opts[len++] = 2;
+  }
+#endif /* LWIP_TCP_SACK */
+#if LWIP_WND_SCALE
+  if (pcb->flags & TF_WND_SCALE) {
+    opts[len++] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_WS;
+    opts[len++] = 3;
+    opts[len++] = TCP_RCV_SCALE;
+  }
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_TIMESTAMPS
+  if (pcb->flags & TF_TIMESTAMP) {
+    memset(opts + len, 0, TCP_OPTLEN_TS);
+    len += TCP_OPTLEN_TS;
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+  return len;
+}
+
+#if LWIP_TCP_SACK
+/**
+ * Build a SACK option reporting the runs of data on pcb->ooseq, the
+ * one holding the latest arrival first (RFC 2018).
+ *
+ * @return the length of the option, 0 if there is nothing to report
+ */
+static u8_t
+tcp_build_sack(struct tcp_pcb *pcb, u8_t *opts, u8_t maxblocks)
+{
+  u32_t left[TCP_SACK_MAX], right[TCP_SACK_MAX], edge;
+  struct tcp_seg *seg;
+  u8_t n = 0, i, b, first = 0, len;
+
+  for (seg = pcb->ooseq; seg != NULL; seg = seg->next) {
+    /* ooseq headers are in host byte order */
+    if (n > 0 && seg->tcphdr->seqno == right[n - 1]) {
+      right[n - 1] += TCP_TCPLEN(seg);
+    } else if (n < TCP_SACK_MAX) {
+      left[n] = seg->tcphdr->seqno;
+      right[n] = left[n] + TCP_TCPLEN(seg);
+      n++;
+    } else {
+      break;
+    }
+  }
+  if (n == 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (TCP_SEQ_GEQ(pcb->sack_recent, left[i]) && TCP_SEQ_LT(pcb->sack_recent, right[i])) {
+      first = i;
+    }
+  }
+
+  n = LWIP_MIN(n, maxblocks);
+  len = 0;
+  opts[len++] = TCP_OPT_NOP;
+  opts[len++] = TCP_OPT_NOP;
+  opts[len++] = TCP_OPT_SACK;
+  opts[len++] = 2 + 8 * n;
+  for (i = 0; i < n; i++) {
+    /* the first, then the others in order */
+    b = (i == 0) ? first : (i <= first ? i - 1 : i);
+    edge = htonl(left[b]);
+    SMEMCPY(opts + len, &edge, 4);
+    edge = htonl(right[b]);
+    SMEMCPY(opts + len + 4, &edge, 4);
+    len += 8;
+  }
+  return len;
+}
+#endif /* LWIP_TCP_SACK */
+
+/**
+ * Build the options for a segment on a synchronized connection: SACK
+ * blocks (if asked for and there are any), then a timestamp.
+ *
+ * @param pcb the tcp_pcb sending the segment
+ * @param opts room for 40 bytes of options
+ * @param sack nonzero to report out-of-order data
+ * @return the length of the options, a multiple of 4
+ */
+static u8_t
+tcp_build_opts(struct tcp_pcb *pcb, u8_t *opts, u8_t sack)
+{
+  u8_t len = 0;
+
+#if LWIP_TCP_SACK
+  if (sack && (pcb->flags & TF_SACK)) {
+    len = tcp_build_sack(pcb, opts, (pcb->flags & TF_TIMESTAMP) ? 3 : 4);
+  }
+#else
+  LWIP_UNUSED_ARG(sack);
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_TIMESTAMPS
+  if (pcb->flags & TF_TIMESTAMP) {
+    u32_t ts[2];
+
+    opts[len++] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_TS;
+    opts[len++] = 10;
+    ts[0] = htonl(sys_now());
+    ts[1] = htonl(pcb->ts_recent);
+    SMEMCPY(opts + len, ts, 8);
+    len += 8;
+    pcb->ts_lastacksent = pcb->rcv_nxt;
+  }
+#endif /* LWIP_TCP_TIMESTAMPS */
+  return len;
+}
+
 /**
  * Send keepalive packets to keep a connection active although
  * no data is sent over it.
@@ -807,6 +1021,7 @@ tcp_keepalive(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+  u8_t opts[TCP_OPTLEN_TS], optlen;
 
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_keepalive: sending KEEPALIVE probe to %"U16_F".%"U16_F".%"U16_F".%"U16_F"\n",
                           ip4_addr1(&pcb->remote_ip), ip4_addr2(&pcb->remote_ip),
@@ -815,7 +1030,8 @@ tcp_keepalive(struct tcp_pcb *pcb)
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_keepalive: tcp_ticks %"U32_F"   pcb->tmr %"U32_F" pcb->keep_cnt_sent %"U16_F"\n", 
                           tcp_ticks, pcb->tmr, pcb->keep_cnt_sent));
    
-  p = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
+  optlen = tcp_build_opts(pcb, opts, 0);
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
    
   if(p == NULL) {
     LWIP_DEBUGF(TCP_DEBUG, 
@@ -831,9 +1047,10 @@ tcp_keepalive(struct tcp_pcb *pcb)
   tcphdr->seqno = htonl(pcb->snd_nxt - 1);
   tcphdr->ackno = htonl(pcb->rcv_nxt);
   TCPH_FLAGS_SET(tcphdr, 0);
-  tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  tcphdr->wnd = TCP_WND_OUT(pcb, 0);
   tcphdr->urgp = 0;
-  TCPH_HDRLEN_SET(tcphdr, 5);
+  TCPH_HDRLEN_SET(tcphdr, 5 + optlen / 4);
+  SMEMCPY(tcphdr + 1, opts, optlen);
 
   tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
@@ -841,6 +1058,7 @@ tcp_keepalive(struct tcp_pcb *pcb)
                                       IP_PROTO_TCP, p->tot_len);
 #endif
   TCP_STATS_INC(tcp.xmit);
+  TCP_PCB_STATS_INC(pcb, segs_out);
 
   /* Send output to IP */
 #if LWIP_NETIF_HWADDRHINT
@@ -879,6 +1097,7 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
   struct tcp_seg *seg;
+  u8_t opts[TCP_OPTLEN_TS], optlen;
 
   LWIP_DEBUGF(TCP_DEBUG, 
               ("tcp_zero_window_probe: sending ZERO WINDOW probe to %"
@@ -899,7 +1118,8 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
   if(seg == NULL)
     return;
 
-  p = pbuf_alloc(PBUF_IP, TCP_HLEN + 1, PBUF_RAM);
+  optlen = tcp_build_opts(pcb, opts, 0);
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen + 1, PBUF_RAM);
    
   if(p == NULL) {
     LWIP_DEBUGF(TCP_DEBUG, ("tcp_zero_window_probe: no memory for pbuf\n"));
@@ -914,12 +1134,13 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
   tcphdr->seqno = seg->tcphdr->seqno;
   tcphdr->ackno = htonl(pcb->rcv_nxt);
   TCPH_FLAGS_SET(tcphdr, 0);
-  tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  tcphdr->wnd = TCP_WND_OUT(pcb, 0);
   tcphdr->urgp = 0;
-  TCPH_HDRLEN_SET(tcphdr, 5);
+  TCPH_HDRLEN_SET(tcphdr, 5 + optlen / 4);
+  SMEMCPY(tcphdr + 1, opts, optlen);
 
   /* Copy in one byte from the head of the unacked queue */
-  *((char *)p->payload + sizeof(struct tcp_hdr)) = *(char *)seg->dataptr;
+  *((char *)p->payload + sizeof(struct tcp_hdr) + optlen) = *(char *)seg->dataptr;
 
   tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
@@ -927,6 +1148,7 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
                                       IP_PROTO_TCP, p->tot_len);
 #endif
   TCP_STATS_INC(tcp.xmit);
+  TCP_PCB_STATS_INC(pcb, segs_out);
 
   /* Send output to IP */
 #if LWIP_NETIF_HWADDRHINT
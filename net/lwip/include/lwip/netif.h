@@ -167,6 +167,10 @@ struct netif {
 #if LWIP_NETIF_HWADDRHINT
   u8_t *addr_hint;
 #endif /* LWIP_NETIF_HWADDRHINT */
+#if LWIP_ARP
+  /** the ARP entry this netif resolved last */
+  u16_t arp_hint;
+#endif /* LWIP_ARP */
 #if ENABLE_LOOPBACK
   /* List of packets to be queued for ourselves. */
   struct pbuf *loop_first;
@@ -145,6 +145,15 @@
 #define MEM_USE_POOLS                   0
 #endif
 
+/**
+ * MEM_JOS_SLAB==1: Use the JOS port's size-class slabs (arch/mem_slab.c)
+ * instead of mem.c's heap. MEM_SIZE then limits how much memory the slabs
+ * may map.
+ */
+#ifndef MEM_JOS_SLAB
+#define MEM_JOS_SLAB                    0
+#endif
+
 /**
  * MEMP_USE_CUSTOM_POOLS==1: whether to include a user file lwippools.h
  * that defines additional pools beyond the "standard" ones required
@@ -664,6 +673,36 @@
 #define TCP_WND                         2048
 #endif 
 
+/**
+ * LWIP_WND_SCALE==1: Support the RFC 1323 window scale option, so that
+ * TCP_WND may exceed 0xffff. TCP_RCV_SCALE is the shift we announce and
+ * must be big enough that (0xffff << TCP_RCV_SCALE) >= TCP_WND.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  0
+#endif
+#ifndef TCP_RCV_SCALE
+#define TCP_RCV_SCALE                   0
+#endif
+
+/**
+ * LWIP_TCP_TIMESTAMPS==1: Support the RFC 1323 timestamp option, for an
+ * RTT sample with every ACK and protection against wrapped sequence
+ * numbers (PAWS).
+ */
+#ifndef LWIP_TCP_TIMESTAMPS
+#define LWIP_TCP_TIMESTAMPS             0
+#endif
+
+/**
+ * LWIP_TCP_SACK==1: Support RFC 2018 selective acknowledgements: report
+ * the segments queued out of order (needs TCP_QUEUE_OOSEQ), and
+ * retransmit only the holes the other end reports during fast recovery.
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   0
+#endif
+
 /**
  * TCP_MAXRTX: Maximum number of retransmissions of data segments.
  */
@@ -1239,6 +1278,14 @@
 
 #endif /* LWIP_STATS */
 
+/**
+ * TCP_PCB_STATS==1: Count segments, bytes, retransmissions and the like
+ * per connection, in each pcb's stats. Independent of LWIP_STATS.
+ */
+#ifndef TCP_PCB_STATS
+#define TCP_PCB_STATS                   0
+#endif
+
 /*
    ---------------------------------
    ---------- PPP options ----------
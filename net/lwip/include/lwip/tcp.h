@@ -144,6 +144,57 @@ void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
                                 (((u32_t)TCP_MSS / 256) << 8) | \
                                 (TCP_MSS & 255))
 
+/* Option kinds, and the room each takes in a header, padded with NOPs
+   to a multiple of 4 bytes. The timestamp option always goes last, so
+   it can be (re)filled at its fixed place at the end of the header. */
+#define TCP_OPT_NOP       1
+#define TCP_OPT_MSS       2
+#define TCP_OPT_WS        3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK      5
+#define TCP_OPT_TS        8
+#define TCP_OPTLEN_MSS        4
+#define TCP_OPTLEN_WS         4
+#define TCP_OPTLEN_SACK_PERM  4
+#define TCP_OPTLEN_TS        12
+#define TCP_SACK_MAX          4   /* blocks that fit beside nothing else */
+
+/* Window sizes: 32 bits when scaled. The header carries 16 bits, shifted
+   by the scale each end announced in its SYN (never applied to the
+   window of a SYN itself). */
+#if LWIP_WND_SCALE
+typedef u32_t tcpwnd_size_t;
+#define SND_WND_SCALE(pcb, wnd) ((tcpwnd_size_t)(wnd) << (pcb)->snd_scale)
+#define RCV_WND_SCALE(pcb, wnd) ((wnd) >> (pcb)->rcv_scale)
+#define TCP_WND_MAX(pcb)        (((pcb)->flags & TF_WND_SCALE) ? TCP_WND : LWIP_MIN(TCP_WND, 0xffff))
+#else
+typedef u16_t tcpwnd_size_t;
+#define SND_WND_SCALE(pcb, wnd) (wnd)
+#define RCV_WND_SCALE(pcb, wnd) (wnd)
+#define TCP_WND_MAX(pcb)        TCP_WND
+#endif
+#define TCPWND16(wnd)           ((u16_t)LWIP_MIN((wnd), 0xffff))
+
+#if TCP_PCB_STATS
+/* Counters of one connection (TCP_PCB_STATS). */
+struct tcp_pcb_stats {
+  u32_t segs_in;       /* segments received */
+  u32_t segs_out;      /* segments sent, retransmissions included */
+  u32_t bytes_in;      /* data bytes passed to the application */
+  u32_t bytes_acked;   /* data bytes the peer acknowledged */
+  u32_t rexmit;        /* segments retransmitted */
+  u32_t rto;           /* retransmission timeouts */
+  u32_t fast_rexmit;   /* fast retransmits (recoveries begun) */
+  u32_t dupacks;       /* duplicate ACKs received */
+  u32_t ooseq;         /* segments received out of order */
+};
+#define TCP_PCB_STATS_INC(pcb, x)    ((pcb)->stats.x++)
+#define TCP_PCB_STATS_ADD(pcb, x, n) ((pcb)->stats.x += (n))
+#else
+#define TCP_PCB_STATS_INC(pcb, x)
+#define TCP_PCB_STATS_ADD(pcb, x, n)
+#endif /* TCP_PCB_STATS */
+
 #define TCP_SEQ_LT(a,b)     ((s32_t)((a)-(b)) < 0)
 #define TCP_SEQ_LEQ(a,b)    ((s32_t)((a)-(b)) <= 0)
 #define TCP_SEQ_GT(a,b)     ((s32_t)((a)-(b)) > 0)
@@ -263,6 +314,7 @@ enum tcp_state {
  */
 #define TCP_PCB_COMMON(type) \
   type *next; /* for the linked list */ \
+  type *hash_next; /* for the demultiplexing hash chain */ \
   enum tcp_state state; /* TCP state */ \
   u8_t prio; \
   void *callback_arg; \
@@ -279,20 +331,40 @@ struct tcp_pcb {
   /* ports are in host byte order */
   u16_t remote_port;
   
-  u8_t flags;
+  u16_t flags;
 #define TF_ACK_DELAY   (u8_t)0x01U   /* Delayed ACK. */
 #define TF_ACK_NOW     (u8_t)0x02U   /* Immediate ACK. */
 #define TF_INFR        (u8_t)0x04U   /* In fast recovery. */
 #define TF_FIN         (u8_t)0x20U   /* Connection was closed locally (FIN segment enqueued). */
 #define TF_NODELAY     (u8_t)0x40U   /* Disable Nagle algorithm */
 #define TF_NAGLEMEMERR (u8_t)0x80U /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
+/* Options in use on this connection (offered, until the SYN|ACK arrives) */
+#define TF_WND_SCALE   (u16_t)0x0100U /* Window scale option */
+#define TF_TIMESTAMP   (u16_t)0x0200U /* Timestamp option */
+#define TF_SACK        (u16_t)0x0400U /* Selective acknowledgements */
+#define TF_SYN_OPTS    ((LWIP_WND_SCALE ? TF_WND_SCALE : 0) | \
+                        (LWIP_TCP_TIMESTAMPS ? TF_TIMESTAMP : 0) | \
+                        (LWIP_TCP_SACK ? TF_SACK : 0)) /* offered in a SYN */
 
   /* the rest of the fields are in host byte order
      as we have to do some math with them */
   /* receiver variables */
   u32_t rcv_nxt;   /* next seqno expected */
-  u16_t rcv_wnd;   /* receiver window */
-  u16_t rcv_ann_wnd; /* announced receive window */
+  tcpwnd_size_t rcv_wnd;   /* receiver window */
+  tcpwnd_size_t rcv_ann_wnd; /* announced receive window */
+#if LWIP_WND_SCALE
+  u8_t snd_scale;  /* shift of the windows the other end announces */
+  u8_t rcv_scale;  /* shift of the windows we announce */
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_TIMESTAMPS
+  u32_t ts_recent;      /* timestamp to echo back */
+  u32_t ts_lastacksent; /* rcv_nxt in the last segment we sent */
+#endif /* LWIP_TCP_TIMESTAMPS */
+#if LWIP_TCP_SACK
+  u32_t sack_recent;    /* seqno of the latest out-of-order arrival */
+  u32_t recover;        /* snd_max when fast recovery began */
+  u32_t rexmit_hi;      /* end of what recovery has retransmitted */
+#endif /* LWIP_TCP_SACK */
 
   /* Timers */
   u32_t tmr;
@@ -316,13 +388,13 @@ struct tcp_pcb {
   u8_t dupacks;
   
   /* congestion avoidance/control variables */
-  u16_t cwnd;  
-  u16_t ssthresh;
+  tcpwnd_size_t cwnd;
+  tcpwnd_size_t ssthresh;
 
   /* sender variables */
   u32_t snd_nxt,   /* next seqno to be sent */
     snd_max;       /* Highest seqno sent. */
-  u16_t snd_wnd;   /* sender window */
+  tcpwnd_size_t snd_wnd;   /* sender window */
   u32_t snd_wl1, snd_wl2, /* Sequence and acknowledgement numbers of last
                              window update. */
     snd_lbb;       /* Sequence number of next byte to be buffered. */
@@ -343,6 +415,10 @@ struct tcp_pcb {
 
   struct pbuf *refused_data; /* Data previously received but not yet taken by upper layer */
 
+#if TCP_PCB_STATS
+  struct tcp_pcb_stats stats;
+#endif /* TCP_PCB_STATS */
+
 #if LWIP_CALLBACK_API
   /* Function to be called when more send buffer space is available.
    * @param arg user-supplied argument (tcp_pcb.callback_arg)
@@ -494,6 +570,9 @@ struct tcp_seg {
   struct pbuf *p;          /* buffer containing data + TCP header */
   void *dataptr;           /* pointer to the TCP data in the pbuf */
   u16_t len;               /* the TCP length of this segment */
+  u8_t flags;
+#define TF_SEG_OPTS_TS  (u8_t)0x01U  /* header ends in a timestamp option */
+#define TF_SEG_SACKED   (u8_t)0x02U  /* the other end holds it (SACK) */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
@@ -523,6 +602,7 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *dataptr, u16_t len,
                 u8_t *optdata, u8_t optlen);
 
 void tcp_rexmit_seg(struct tcp_pcb *pcb, struct tcp_seg *seg);
+u8_t tcp_syn_opts(struct tcp_pcb *pcb, u8_t *opts);
 
 void tcp_rst(u32_t seqno, u32_t ackno,
        struct ip_addr *local_ip, struct ip_addr *remote_ip,
@@ -570,6 +650,8 @@ extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
               state in which they accept or send
               data. */
 extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+extern struct tcp_pcb *tcp_bound_pcbs;   /* List of all TCP PCBs bound but not
+              yet connected or listening. */
 
 extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
@@ -580,6 +662,22 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
    4) All PCBs in the tcp_tw_pcbs list is in TIME-WAIT state.
 */
 
+/* tcp_input finds PCBs through hash tables rather than the lists: one
+   keyed by the 4-tuple for active and TIME-WAIT PCBs, one keyed by the
+   local port for listeners.  TCP_REG and TCP_RMV keep them in sync with
+   every list but tcp_bound_pcbs. */
+#ifndef TCP_HASH_SIZE
+#define TCP_HASH_SIZE 64  /* must be a power of two */
+#endif
+
+void             tcp_hash_insert(struct tcp_pcb *pcb);
+void             tcp_hash_remove(struct tcp_pcb *pcb);
+struct tcp_pcb  *tcp_hash_lookup(struct ip_addr *src, u16_t src_port,
+                                 struct ip_addr *dest, u16_t dest_port);
+struct tcp_pcb_listen *tcp_hash_lookup_listen(struct ip_addr *dest, u16_t dest_port);
+
+#define TCP_HASHED(pcbs) ((void *)(pcbs) != (void *)&tcp_bound_pcbs)
+
 /* Define two macros, TCP_REG and TCP_RMV that registers a TCP PCB
    with a PCB list or removes a PCB from a list, respectively. */
 #if 0
@@ -594,6 +692,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                             npcb->next = *pcbs; \
                             LWIP_ASSERT("TCP_REG: npcb->next != npcb", npcb->next != npcb); \
                             *(pcbs) = npcb; \
+                            if (TCP_HASHED(pcbs)) tcp_hash_insert((struct tcp_pcb *)npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
               tcp_timer_needed(); \
                             } while(0)
@@ -609,6 +708,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                                } \
                             } \
                             npcb->next = NULL; \
+                            if (TCP_HASHED(pcbs)) tcp_hash_remove((struct tcp_pcb *)npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removed %p from %p\n", npcb, *pcbs)); \
                             } while(0)
@@ -617,6 +717,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 #define TCP_REG(pcbs, npcb) do { \
                             npcb->next = *pcbs; \
                             *(pcbs) = npcb; \
+                            if (TCP_HASHED(pcbs)) tcp_hash_insert((struct tcp_pcb *)npcb); \
               tcp_timer_needed(); \
                             } while(0)
 #define TCP_RMV(pcbs, npcb) do { \
@@ -629,6 +730,7 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                                } \
                             } \
                             npcb->next = NULL; \
+                            if (TCP_HASHED(pcbs)) tcp_hash_remove((struct tcp_pcb *)npcb); \
                             } while(0)
 #endif /* LWIP_DEBUG */
 
@@ -0,0 +1,162 @@
+/*
+ * Internet checksum for lwIP (LWIP_CHKSUM, see arch/cc.h).
+ *
+ * lwIP's own versions add up 16 bits at a time.  These add 32-bit words
+ * into a 64-bit accumulator, eight to a loop iteration, which the
+ * compiler turns into add/adc pairs, and fold the carries once at the
+ * end.  Like lwIP's, they return the non-inverted sum in network order.
+ *
+ * jos_chksum_copy sums while it copies, and jif's receive path is its
+ * only user: that is the one copy whose sum lwIP still needs.  The
+ * other copies get nothing from it.  pbuf_copy (ARP queueing, ICMP
+ * echo replies) and the netbuf copies out to sockets
+ * (netbuf_copy_partial from lwip_recv) move data whose checksums were
+ * verified on the way in, or are filled in by the card on the way out
+ * (CHECKSUM_GEN_* are off); ICMP patches its sum incrementally.
+ *
+ * The kernel doesn't save FPU, MMX or SSE registers across context
+ * switches, so vector registers are off limits here.
+ */
+
+#include <lwip/opt.h>
+#include <lwip/def.h>
+
+#define SWAP_BYTES_IN_WORD(w)	((((w) & 0xff) << 8) | (((w) & 0xff00) >> 8))
+
+// Fold acc to 16 bits and account for an odd start address.
+static u16_t
+chksum_fold(u64_t acc, u16_t t, int odd)
+{
+    u32_t sum;
+
+    acc = (acc >> 32) + (acc & 0xffffffffUL);
+    acc = (acc >> 32) + (acc & 0xffffffffUL);
+    sum = (u32_t) acc;
+    sum = (sum >> 16) + (sum & 0xffff) + t;
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+
+    // A sum started at an odd address has its bytes in the wrong lanes.
+    if (odd)
+	sum = SWAP_BYTES_IN_WORD(sum);
+    return sum;
+}
+
+/**
+ * Sum len bytes at dataptr, which may be at any alignment.
+ */
+u16_t
+jos_chksum(void *dataptr, int len)
+{
+    const u8_t *pb = dataptr;
+    const u32_t *pl;
+    u64_t acc = 0;
+    u16_t t = 0;
+    int odd;
+
+    // Align to a halfword, then to a word.
+    if ((odd = ((mem_ptr_t) pb & 1)) && len > 0) {
+	((u8_t *) &t)[1] = *pb++;
+	len--;
+    }
+    if (((mem_ptr_t) pb & 2) && len >= 2) {
+	acc += *(const u16_t *) pb;
+	pb += 2;
+	len -= 2;
+    }
+
+    pl = (const u32_t *) pb;
+    while (len >= 32) {
+	acc += pl[0];
+	acc += pl[1];
+	acc += pl[2];
+	acc += pl[3];
+	acc += pl[4];
+	acc += pl[5];
+	acc += pl[6];
+	acc += pl[7];
+	pl += 8;
+	len -= 32;
+    }
+    while (len >= 4) {
+	acc += *pl++;
+	len -= 4;
+    }
+
+    pb = (const u8_t *) pl;
+    if (len >= 2) {
+	acc += *(const u16_t *) pb;
+	pb += 2;
+	len -= 2;
+    }
+    if (len > 0)
+	((u8_t *) &t)[0] = *pb;
+
+    return chksum_fold(acc, t, odd);
+}
+
+/**
+ * Copy len bytes from src to dst and return their sum, in one pass.
+ * The sum is aligned on src; dst may be at any alignment (x86 allows
+ * unaligned stores).
+ */
+u16_t
+jos_chksum_copy(void *dst, const void *src, int len)
+{
+    const u8_t *pb = src;
+    u8_t *pd = dst;
+    const u32_t *pl;
+    u32_t *pdl;
+    u32_t w0, w1, w2, w3;
+    u64_t acc = 0;
+    u16_t t = 0;
+    int odd;
+
+    if ((odd = ((mem_ptr_t) pb & 1)) && len > 0) {
+	((u8_t *) &t)[1] = *pd++ = *pb++;
+	len--;
+    }
+    if (((mem_ptr_t) pb & 2) && len >= 2) {
+	acc += *(u16_t *) pd = *(const u16_t *) pb;
+	pd += 2;
+	pb += 2;
+	len -= 2;
+    }
+
+    pl = (const u32_t *) pb;
+    pdl = (u32_t *) pd;
+    while (len >= 16) {
+	w0 = pl[0];
+	w1 = pl[1];
+	w2 = pl[2];
+	w3 = pl[3];
+	pdl[0] = w0;
+	pdl[1] = w1;
+	pdl[2] = w2;
+	pdl[3] = w3;
+	acc += w0;
+	acc += w1;
+	acc += w2;
+	acc += w3;
+	pl += 4;
+	pdl += 4;
+	len -= 16;
+    }
+    while (len >= 4) {
+	acc += *pdl++ = *pl++;
+	len -= 4;
+    }
+
+    pb = (const u8_t *) pl;
+    pd = (u8_t *) pdl;
+    if (len >= 2) {
+	acc += *(u16_t *) pd = *(const u16_t *) pb;
+	pd += 2;
+	pb += 2;
+	len -= 2;
+    }
+    if (len > 0)
+	((u8_t *) &t)[0] = *pd = *pb;
+
+    return chksum_fold(acc, t, odd);
+}
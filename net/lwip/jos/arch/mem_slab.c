@@ -0,0 +1,241 @@
+/*
+ * lwIP heap (mem_malloc and friends) as size-class slabs, in place of
+ * mem.c's first-fit heap (MEM_JOS_SLAB in lwipopts.h).
+ *
+ * Each slab is one page of same-sized objects, mapped with
+ * sys_page_alloc when its class runs out of room and unmapped again
+ * once it's empty, so the heap only holds as much memory as lwIP is
+ * using.  A class keeps one empty slab in reserve, so a class that
+ * keeps emptying and refilling doesn't map and unmap a page each time.
+ * MEM_SIZE caps how much the slabs may hold.
+ *
+ * Page metadata lives in slab_pages[], outside the pages, so objects
+ * fill a page exactly and mem_free finds an object's slab by its
+ * address.  Allocation and free are O(1).  Requests too big for the
+ * largest class are rare and go to the C library's malloc.
+ */
+
+#include <inc/lib.h>
+
+#include <arch/mem_slab.h>
+#include "lwip/opt.h"
+#include "lwip/mem.h"
+#include "lwip/def.h"
+#include "lwip/stats.h"
+
+#if MEM_JOS_SLAB
+
+#define SLAB_MAXPAGES	(MEM_SIZE / PGSIZE)
+
+#define SLAB_NCLASSES	8
+static const u16_t slab_size[SLAB_NCLASSES] = {
+    16, 32, 64, 128, 256, 512, 1024, 2048
+};
+
+struct slab_page {
+    u8_t sp_class;
+    u8_t sp_mapped;
+    u16_t sp_inuse;		// Objects handed out
+    u16_t sp_carve;		// Objects never handed out start here
+    void *sp_free;		// Objects freed since
+    s16_t sp_next;		// Partial list of the class, or free pages
+    s16_t sp_prev;
+};
+
+static struct slab_page slab_pages[SLAB_NPAGES];
+
+// Per class: slabs with room, and one spare empty slab.
+static s16_t slab_partial[SLAB_NCLASSES];
+static s16_t slab_spare[SLAB_NCLASSES];
+
+static s16_t slab_free_pages;	// Unmapped pages, linked through sp_next
+static int slab_nmapped;
+static u8_t slab_ready;
+
+#define SLAB_VA(i)	((u8_t *) SLAB_BASE + (i) * PGSIZE)
+#define SLAB_INDEX(p)	((s16_t) (((u32_t) (p) - SLAB_BASE) / PGSIZE))
+#define SLAB_OWNS(p)	((u32_t) (p) - SLAB_BASE < SLAB_NPAGES * PGSIZE)
+
+void
+mem_init(void)
+{
+    int i;
+
+    for (i = 0; i < SLAB_NCLASSES; i++)
+	slab_partial[i] = slab_spare[i] = -1;
+    for (i = 0; i < SLAB_NPAGES; i++)
+	slab_pages[i].sp_next = i + 1 < SLAB_NPAGES ? i + 1 : -1;
+    slab_free_pages = 0;
+    slab_ready = 1;
+    MEM_STATS_AVAIL(avail, SLAB_MAXPAGES * PGSIZE);
+}
+
+static void
+partial_push(int c, s16_t i)
+{
+    slab_pages[i].sp_prev = -1;
+    slab_pages[i].sp_next = slab_partial[c];
+    if (slab_partial[c] >= 0)
+	slab_pages[slab_partial[c]].sp_prev = i;
+    slab_partial[c] = i;
+}
+
+static void
+partial_remove(int c, s16_t i)
+{
+    struct slab_page *sp = &slab_pages[i];
+
+    if (sp->sp_prev >= 0)
+	slab_pages[sp->sp_prev].sp_next = sp->sp_next;
+    else
+	slab_partial[c] = sp->sp_next;
+    if (sp->sp_next >= 0)
+	slab_pages[sp->sp_next].sp_prev = sp->sp_prev;
+}
+
+// Map a fresh slab for class c and put it on the partial list.
+static s16_t
+slab_grow(int c)
+{
+    struct slab_page *sp;
+    s16_t i;
+
+    if ((i = slab_spare[c]) >= 0) {
+	slab_spare[c] = -1;
+    } else {
+	if ((i = slab_free_pages) < 0 || slab_nmapped >= SLAB_MAXPAGES)
+	    return -1;
+	if (sys_page_alloc(0, SLAB_VA(i), PTE_P|PTE_U|PTE_W) < 0)
+	    return -1;
+	slab_free_pages = slab_pages[i].sp_next;
+	slab_nmapped++;
+    }
+
+    sp = &slab_pages[i];
+    sp->sp_class = c;
+    sp->sp_mapped = 1;
+    sp->sp_inuse = 0;
+    sp->sp_carve = 0;
+    sp->sp_free = NULL;
+    partial_push(c, i);
+    return i;
+}
+
+// Slab i of class c just became empty: keep it as the spare, or give
+// its page back.
+static void
+slab_shrink(int c, s16_t i)
+{
+    partial_remove(c, i);
+    if (slab_spare[c] < 0) {
+	slab_spare[c] = i;
+	return;
+    }
+    sys_page_unmap(0, SLAB_VA(i));
+    slab_pages[i].sp_mapped = 0;
+    slab_pages[i].sp_next = slab_free_pages;
+    slab_free_pages = i;
+    slab_nmapped--;
+}
+
+void *
+mem_malloc(mem_size_t size)
+{
+    struct slab_page *sp;
+    void *mem;
+    s16_t i;
+    int c;
+
+    if (!slab_ready)
+	mem_init();
+    if (size == 0)
+	return NULL;
+
+    for (c = 0; c < SLAB_NCLASSES && slab_size[c] < size; c++)
+	;
+    if (c == SLAB_NCLASSES) {
+	// Room for the size in front, for mem_free's stats.
+	if (!(mem = malloc(size + MEM_ALIGNMENT))) {
+	    MEM_STATS_INC(err);
+	    return NULL;
+	}
+	*(mem_size_t *) mem = size;
+	MEM_STATS_INC_USED(used, size);
+	return (u8_t *) mem + MEM_ALIGNMENT;
+    }
+
+    if ((i = slab_partial[c]) < 0 && (i = slab_grow(c)) < 0) {
+	MEM_STATS_INC(err);
+	return NULL;
+    }
+    sp = &slab_pages[i];
+    if (sp->sp_free) {
+	mem = sp->sp_free;
+	sp->sp_free = *(void **) mem;
+    } else {
+	mem = SLAB_VA(i) + sp->sp_carve * slab_size[c];
+	sp->sp_carve++;
+    }
+    sp->sp_inuse++;
+    if (sp->sp_inuse == PGSIZE / slab_size[c])
+	partial_remove(c, i);
+    MEM_STATS_INC_USED(used, slab_size[c]);
+    return mem;
+}
+
+void
+mem_free(void *rmem)
+{
+    struct slab_page *sp;
+    s16_t i;
+    int c;
+
+    if (rmem == NULL)
+	return;
+    if (!SLAB_OWNS(rmem)) {
+	rmem = (u8_t *) rmem - MEM_ALIGNMENT;
+	MEM_STATS_DEC_USED(used, *(mem_size_t *) rmem);
+	free(rmem);
+	return;
+    }
+
+    i = SLAB_INDEX(rmem);
+    sp = &slab_pages[i];
+    c = sp->sp_class;
+    LWIP_ASSERT("mem_free: slab not mapped", sp->sp_mapped);
+    LWIP_ASSERT("mem_free: not an object start",
+	    ((u8_t *) rmem - SLAB_VA(i)) % slab_size[c] == 0);
+
+    *(void **) rmem = sp->sp_free;
+    sp->sp_free = rmem;
+    if (sp->sp_inuse-- == PGSIZE / slab_size[c])
+	partial_push(c, i);
+    MEM_STATS_DEC_USED(used, slab_size[c]);
+    if (sp->sp_inuse == 0)
+	slab_shrink(c, i);
+}
+
+/**
+ * lwIP only shrinks (pbuf_realloc), which an object can always do in
+ * place.
+ */
+void *
+mem_realloc(void *rmem, mem_size_t newsize)
+{
+    LWIP_ASSERT("mem_realloc: can only shrink",
+	    !SLAB_OWNS(rmem)
+	    || newsize <= slab_size[slab_pages[SLAB_INDEX(rmem)].sp_class]);
+    return rmem;
+}
+
+void *
+mem_calloc(mem_size_t count, mem_size_t size)
+{
+    void *p;
+
+    if ((p = mem_malloc(count * size)) != NULL)
+	memset(p, 0, count * size);
+    return p;
+}
+
+#endif /* MEM_JOS_SLAB */
@@ -0,0 +1,9 @@
+#ifndef LWIP_ARCH_MEM_SLAB_H
+#define LWIP_ARCH_MEM_SLAB_H
+
+// The address range the slab heap (arch/mem_slab.c) maps its pages in,
+// away from malloc's and the network server's request pages.
+#define SLAB_BASE	0x40000000
+#define SLAB_NPAGES	4096
+
+#endif /* !LWIP_ARCH_MEM_SLAB_H */
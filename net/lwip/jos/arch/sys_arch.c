@@ -311,6 +311,13 @@ out:
     return &t->tmo;
 }
 
+// The clock behind TCP timestamps.
+unsigned long
+sys_now(void)
+{
+    return sys_time_msec();
+}
+
 void
 lwip_core_lock(void)
 {
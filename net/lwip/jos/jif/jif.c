@@ -41,6 +41,10 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include <lwip/stats.h>
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
+#include "lwip/inet_chksum.h"
 
 #include <netif/etharp.h>
 
@@ -51,6 +55,114 @@ struct jif {
     envid_t envid;
 };
 
+/* Pbufs of frames handed to the card without copying, oldest first:
+ * those in [tx_head, tx_sent) are on the card's ring, and those in
+ * [tx_sent, tx_tail) wait in tx_batch for the next jif_flush.  A frame
+ * may use several pbufs (see tx_merge); tx_frame_end marks its last.
+ * Each holds a reference until sys_net_send_frags reports the frame
+ * sent.  Room for a full ring (64 descriptors) plus a full batch. */
+#define TX_INFLIGHT	128
+
+static struct pbuf *tx_inflight[TX_INFLIGHT];
+static bool tx_frame_end[TX_INFLIGHT];
+static int tx_head, tx_sent, tx_tail;
+
+static struct net_frag tx_batch[NET_BATCH_FRAGS];
+static int tx_nfrags;
+
+/* The last frame in tx_batch, if it is a TCP segment that following
+ * segments may be merged into for the card to split up again. */
+static struct {
+    int first;			/* Its first piece, or -1 if none */
+    struct ip_hdr *iph;
+    struct tcp_hdr *tcph;
+    u32_t nextseq;		/* Sequence number after its payload */
+    u16_t mss;			/* Payload of each segment */
+    u16_t len;			/* Frame length so far */
+} tx_tso = { -1 };
+
+/* The interface, and how many queue pairs the card spreads TCP
+ * connections over (see jif_port_ok). */
+static struct netif *jif_netif;
+static int jif_nqueues;
+
+/* lwIP keeps a TCP segment's pbuf to retransmit, so a frame that may
+ * have segments merged into it goes out with a private copy of its
+ * headers, which tx_merge can rewrite.  The copy for the frame in
+ * tx_inflight[i] is tx_hdrs[i], free again once the frame is sent. */
+#define TX_HDR_MAX	(sizeof(struct eth_hdr) + IP_HLEN + 60)
+
+static u8_t tx_hdrs[TX_INFLIGHT][TX_HDR_MAX];
+
+static void
+tx_reap(int n)
+{
+    while (n > 0 && tx_head != tx_sent) {
+	pbuf_free(tx_inflight[tx_head]);
+	if (tx_frame_end[tx_head])
+	    n--;
+	tx_head = (tx_head + 1) % TX_INFLIGHT;
+    }
+}
+
+/*
+ * tx_drop():
+ *
+ * The card refused the batched frames: drop them all, as a full card
+ * would, and let TCP retransmit.
+ *
+ */
+static void
+tx_drop(void)
+{
+    while (tx_sent != tx_tail) {
+	tx_tail = (tx_tail + TX_INFLIGHT - 1) % TX_INFLIGHT;
+	if (tx_frame_end[tx_tail])
+	    LINK_STATS_INC(link.drop);
+	pbuf_free(tx_inflight[tx_tail]);
+    }
+}
+
+/*
+ * jif_flush():
+ *
+ * Hand the frames batched up by low_level_output to the card, with as
+ * few system calls as the ring allows.  The network server calls this
+ * before it blocks.
+ *
+ */
+void
+jif_flush(void)
+{
+    int i = 0, n, r, done;
+
+    if (netbypass_attached()) {
+	netbypass_flush();
+	return;
+    }
+    tx_tso.first = -1;
+    while (i < tx_nfrags) {
+	r = sys_net_send_frags(&tx_batch[i], tx_nfrags - i, &done);
+	if (r == -E_TX_FULL) {
+	    if (sys_net_wait_send() < 0)
+		sys_yield();
+	    continue;
+	}
+	if (r < 0) {
+	    tx_drop();
+	    break;
+	}
+	for (n = r; n > 0; i++)
+	    if (tx_batch[i].nf_flags & NET_FRAG_EOP)
+		n--;
+	for (n = r; n > 0; tx_sent = (tx_sent + 1) % TX_INFLIGHT)
+	    if (tx_frame_end[tx_sent])
+		n--;
+	tx_reap(done);
+    }
+    tx_nfrags = 0;
+}
+
 static void
 low_level_init(struct netif *netif)
 {
@@ -67,18 +179,205 @@ low_level_init(struct netif *netif)
     netif->hwaddr[3] = 0x12;
     netif->hwaddr[4] = 0x34;
     netif->hwaddr[5] = 0x56;
+
+    jif_netif = netif;
+    if ((r = sys_net_set_queue(thisenv->env_net_queue)) > 0)
+	jif_nqueues = r;
 }
 
 /*
- * low_level_output():
+ * tx_pseudo_sum():
  *
- * Should do the actual transmission of the packet. The packet is
- * contained in the pbuf that is passed to the function. This pbuf
- * might be chained.
+ * The ones' complement sum of the TCP/UDP pseudo-header, which is what
+ * the card expects to find in the checksum field.
+ *
+ */
+static u16_t
+tx_pseudo_sum(struct ip_hdr *iph, u8_t proto, u16_t len)
+{
+    u32_t sum;
+
+    sum = (iph->src.addr & 0xffff) + (iph->src.addr >> 16)
+	+ (iph->dest.addr & 0xffff) + (iph->dest.addr >> 16)
+	+ htons(proto) + htons(len);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/*
+ * tx_checksum():
+ *
+ * lwIP leaves outgoing checksums to us (see lwipopts.h).  If the card
+ * can fill them in, seed the TCP or UDP checksum with the pseudo-header
+ * sum and return NET_FRAG_CSUM.  Otherwise (sw is set) compute them
+ * here and return 0.  lwIP always builds all headers in the first pbuf.
+ *
+ */
+static int
+tx_checksum(struct pbuf *p, int sw)
+{
+    struct eth_hdr *ethhdr = p->payload;
+    struct ip_hdr *iph;
+    u16_t *sum = NULL;
+    u16_t ihl, len;
+    u8_t proto;
+
+    if (p->len < sizeof(struct eth_hdr) + IP_HLEN || ethhdr->type != htons(ETHTYPE_IP))
+	return 0;
+    iph = (struct ip_hdr *) ((u8_t *) p->payload + sizeof(struct eth_hdr));
+    ihl = IPH_HL(iph) * 4;
+    proto = IPH_PROTO(iph);
+    len = ntohs(IPH_LEN(iph)) - ihl;
+    if (p->len < sizeof(struct eth_hdr) + ihl)
+	return 0;
+
+    /* Fragments after the first have no transport header, and the
+     * first's checksum would have to cover all of them. */
+    if ((IPH_OFFSET(iph) & htons(IP_MF | IP_OFFMASK)) == 0) {
+	if (proto == IP_PROTO_TCP
+	    && p->len >= sizeof(struct eth_hdr) + ihl + TCP_HLEN)
+	    sum = &((struct tcp_hdr *) ((u8_t *) iph + ihl))->chksum;
+	else if (proto == IP_PROTO_UDP
+		 && p->len >= sizeof(struct eth_hdr) + ihl + UDP_HLEN)
+	    sum = &((struct udp_hdr *) ((u8_t *) iph + ihl))->chksum;
+    }
+
+    IPH_CHKSUM_SET(iph, 0);
+    if (!sw) {
+	if (sum)
+	    *sum = tx_pseudo_sum(iph, proto, len);
+	return NET_FRAG_CSUM;
+    }
+
+    IPH_CHKSUM_SET(iph, inet_chksum(iph, ihl));
+    if (sum) {
+	*sum = 0;
+	pbuf_header(p, -(s16_t) (sizeof(struct eth_hdr) + ihl));
+	*sum = inet_chksum_pseudo(p, &iph->src, &iph->dest, proto, len);
+	if (proto == IP_PROTO_UDP && *sum == 0)
+	    *sum = 0xffff;
+	pbuf_header(p, sizeof(struct eth_hdr) + ihl);
+    }
+    return 0;
+}
+
+/*
+ * tx_tcp_segment():
+ *
+ * If p is a plain TCP data segment that could be merged with its
+ * neighbours for segmentation offload, return its TCP header and set
+ * *hlen and *plen to the length of its headers and of its payload.
+ *
+ */
+static struct tcp_hdr *
+tx_tcp_segment(struct pbuf *p, int *hlen, int *plen)
+{
+    struct ip_hdr *iph = (struct ip_hdr *) ((u8_t *) p->payload + sizeof(struct eth_hdr));
+    struct tcp_hdr *tcph = (struct tcp_hdr *) (iph + 1);
+
+    if (IPH_PROTO(iph) != IP_PROTO_TCP || IPH_HL(iph) != IP_HLEN / 4
+	|| (IPH_OFFSET(iph) & htons(IP_MF | IP_OFFMASK))
+	|| p->len < sizeof(struct eth_hdr) + IP_HLEN + TCP_HLEN)
+	return NULL;
+    *hlen = sizeof(struct eth_hdr) + IP_HLEN + TCPH_HDRLEN(tcph) * 4;
+    *plen = p->tot_len - *hlen;
+    if (p->len < *hlen || *plen <= 0
+	|| (TCPH_FLAGS(tcph) & ~(TCP_ACK | TCP_PSH)))
+	return NULL;
+    return tcph;
+}
+
+/*
+ * tx_merge():
+ *
+ * Try to append TCP segment p (with n pbufs, and the given header and
+ * payload lengths) to the frame in tx_tso, turning that frame into one
+ * the card segments back into the same packets.  This is segmentation
+ * offload without changing lwIP: it still builds MSS-sized segments,
+ * but a burst of them costs the card one set of headers to process.
+ * Only the frame's private header copy (tx_hdrs) is rewritten, and
+ * only segments whose TCP options match that frame's are merged, since
+ * the card copies the first segment's headers into every packet.
+ * Returns 1 if p was merged, 0 if the caller should queue it as is.
+ *
+ */
+static int
+tx_merge(struct pbuf *p, int n, struct tcp_hdr *tcph, int hlen, int plen)
+{
+    struct ip_hdr *iph = (struct ip_hdr *) ((u8_t *) p->payload + sizeof(struct eth_hdr));
+    struct tcp_hdr *t = tx_tso.tcph;
+    struct net_frag *f;
+    struct pbuf *q;
+
+    if (tx_tso.first < 0)
+	return 0;
+    if (tx_tso.iph->src.addr != iph->src.addr
+	|| tx_tso.iph->dest.addr != iph->dest.addr
+	|| t->src != tcph->src || t->dest != tcph->dest
+	|| TCPH_HDRLEN(t) != TCPH_HDRLEN(tcph)
+	|| t->ackno != tcph->ackno || t->wnd != tcph->wnd
+	/* The card repeats the first header's options (timestamps,
+	 * say) in every segment, so they must be the same. */
+	|| memcmp(t + 1, tcph + 1, TCPH_HDRLEN(t) * 4 - TCP_HLEN) != 0
+	|| ntohl(tcph->seqno) != tx_tso.nextseq
+	|| plen > tx_tso.mss || tx_tso.len + plen > NET_TSO_MAX)
+	return 0;
+    if (p->len == hlen)
+	n--;
+    if (tx_nfrags + n > NET_BATCH_FRAGS
+	|| tx_nfrags - tx_tso.first + n > NET_MAX_FRAGS)
+	return 0;
+
+    /* On the first merge, the checksum seed loses the length, which the
+     * card adds for each segment. */
+    f = &tx_batch[tx_tso.first];
+    if (!(f->nf_flags & NET_FRAG_TSO)) {
+	f->nf_flags |= NET_FRAG_TSO | NET_FRAG_MSS(tx_tso.mss);
+	t->chksum = tx_pseudo_sum(tx_tso.iph, IP_PROTO_TCP, 0);
+    }
+    /* The card clears PSH on all but the last segment. */
+    if (TCPH_FLAGS(tcph) & TCP_PSH)
+	TCPH_SET_FLAG(t, TCP_PSH);
+
+    tx_batch[tx_nfrags - 1].nf_flags &= ~NET_FRAG_EOP;
+    for (q = p; q != NULL; q = q->next) {
+	f = &tx_batch[tx_nfrags];
+	f->nf_data = q->payload;
+	f->nf_len = q->len;
+	f->nf_flags = 0;
+	if (q == p) {
+	    if (q->len == hlen)
+		continue;
+	    f->nf_data = (u8_t *) q->payload + hlen;
+	    f->nf_len = q->len - hlen;
+	}
+	tx_nfrags++;
+    }
+    tx_batch[tx_nfrags - 1].nf_flags |= NET_FRAG_EOP;
+
+    tx_tso.nextseq += plen;
+    tx_tso.len += plen;
+    if ((TCPH_FLAGS(tcph) & TCP_PSH) || plen < tx_tso.mss)
+	tx_tso.first = -1;
+
+    pbuf_ref(p);
+    tx_frame_end[(tx_tail + TX_INFLIGHT - 1) % TX_INFLIGHT] = 0;
+    tx_inflight[tx_tail] = p;
+    tx_frame_end[tx_tail] = 1;
+    tx_tail = (tx_tail + 1) % TX_INFLIGHT;
+    return 1;
+}
+
+/*
+ * low_level_output_copy():
+ *
+ * Flatten the packet into a page and pass it to the output
+ * environment.  Used for pbuf chains too long to gather.
  *
  */
 static err_t
-low_level_output(struct netif *netif, struct pbuf *p)
+low_level_output_copy(struct netif *netif, struct pbuf *p)
 {
     int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
     if (r < 0)
@@ -110,23 +409,195 @@ low_level_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+/*
+ * low_level_output_bypass():
+ *
+ * With the network server driving the card's queue pair itself
+ * (netbypass_attach), copy the frame into a transmit buffer.  The
+ * driver has no context descriptors, so checksums are done here.
+ * jif_flush tells the card.
+ *
+ */
+static err_t
+low_level_output_bypass(struct pbuf *p)
+{
+    struct pbuf *q;
+    u8_t *buf;
+    int len = 0;
+
+    if (p->tot_len > NET_BYPASS_TXBUF)
+	return ERR_BUF;
+    tx_checksum(p, 1);
+    while (!(buf = netbypass_tx_buf())) {
+	netbypass_flush();
+	sys_yield();
+    }
+    for (q = p; q != NULL; q = q->next) {
+	memcpy(buf + len, q->payload, q->len);
+	len += q->len;
+    }
+    netbypass_send(len);
+    return ERR_OK;
+}
+
+/*
+ * low_level_output():
+ *
+ * Should do the actual transmission of the packet. The packet is
+ * contained in the pbuf that is passed to the function. This pbuf
+ * might be chained.
+ *
+ * The card gathers the frame straight out of the pbufs, so we keep a
+ * reference to the chain until it has been sent.  Frames are only
+ * queued here; jif_flush sends them in batches.  lwIP must not
+ * rewrite the payload meanwhile; the only case that could is a TCP
+ * retransmission, which waits far longer than the card does.
+ *
+ */
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+    struct tcp_hdr *tcph = NULL;
+    struct pbuf *q;
+    u8_t *hdr = NULL;
+    int n = 0, nfrags, first, csum, hlen = 0, plen = 0;
+
+    if (netbypass_attached())
+	return low_level_output_bypass(p);
+    for (q = p; q != NULL; q = q->next)
+	n++;
+    if (n > NET_MAX_FRAGS) {
+	jif_flush();
+	tx_checksum(p, 1);
+	return low_level_output_copy(netif, p);
+    }
+
+    csum = tx_checksum(p, 0);
+    if (csum)
+	tcph = tx_tcp_segment(p, &hlen, &plen);
+    if (tcph && tx_merge(p, n, tcph, hlen, plen))
+	return ERR_OK;
+
+    /* A full segment without PSH may have more following it, so it
+     * goes out with its headers copied (tx_hdrs), which may take one
+     * more piece. */
+    if (tcph && ((TCPH_FLAGS(tcph) & TCP_PSH) || hlen > TX_HDR_MAX
+		 || (p->len > hlen && n + 1 > NET_MAX_FRAGS)))
+	tcph = NULL;
+    nfrags = n + (tcph && p->len > hlen);
+
+    if (tx_nfrags + nfrags > NET_BATCH_FRAGS)
+	jif_flush();
+    first = tx_nfrags;
+    for (q = p; q != NULL; q = q->next) {
+	tx_batch[tx_nfrags].nf_data = q->payload;
+	tx_batch[tx_nfrags].nf_len = q->len;
+	tx_batch[tx_nfrags].nf_flags = 0;
+	if (q == p && tcph) {
+	    hdr = tx_hdrs[tx_tail];
+	    memcpy(hdr, p->payload, hlen);
+	    tx_batch[tx_nfrags].nf_data = hdr;
+	    tx_batch[tx_nfrags].nf_len = hlen;
+	    if (p->len > hlen) {
+		tx_nfrags++;
+		tx_batch[tx_nfrags].nf_data = (u8_t *) p->payload + hlen;
+		tx_batch[tx_nfrags].nf_len = p->len - hlen;
+		tx_batch[tx_nfrags].nf_flags = 0;
+	    }
+	}
+	tx_nfrags++;
+    }
+    tx_batch[tx_nfrags - 1].nf_flags |= NET_FRAG_EOP;
+    tx_batch[first].nf_flags |= csum;
+
+    pbuf_ref(p);
+    tx_inflight[tx_tail] = p;
+    tx_frame_end[tx_tail] = 1;
+    tx_tail = (tx_tail + 1) % TX_INFLIGHT;
+
+    tx_tso.first = -1;
+    if (tcph) {
+	tx_tso.first = first;
+	tx_tso.iph = (struct ip_hdr *) (hdr + sizeof(struct eth_hdr));
+	tx_tso.tcph = (struct tcp_hdr *) (hdr + ((u8_t *) tcph - (u8_t *) p->payload));
+	tx_tso.nextseq = ntohl(tcph->seqno) + plen;
+	tx_tso.mss = plen;
+	tx_tso.len = p->tot_len;
+    }
+
+    return ERR_OK;
+}
+
+/*
+ * rx_l4_offset():
+ *
+ * If the frame of len bytes at data is an unfragmented TCP or UDP
+ * packet, return where its TCP or UDP header starts and set *sum to its
+ * pseudo-header sum.  Otherwise return 0.
+ *
+ */
+static int
+rx_l4_offset(const u8_t *data, int len, u16_t *sum)
+{
+    const struct eth_hdr *ethhdr = (const struct eth_hdr *) data;
+    struct ip_hdr *iph;
+    int ihl, tot;
+
+    if (len < (int) sizeof(struct eth_hdr) + IP_HLEN
+	|| ethhdr->type != htons(ETHTYPE_IP))
+	return 0;
+    iph = (struct ip_hdr *) (data + sizeof(struct eth_hdr));
+    ihl = IPH_HL(iph) * 4;
+    tot = ntohs(IPH_LEN(iph));
+    if (IPH_V(iph) != 4 || ihl < IP_HLEN || tot < ihl
+	|| tot > len - (int) sizeof(struct eth_hdr)
+	|| (IPH_OFFSET(iph) & htons(IP_MF | IP_OFFMASK))
+	|| (IPH_PROTO(iph) != IP_PROTO_TCP && IPH_PROTO(iph) != IP_PROTO_UDP))
+	return 0;
+    *sum = tx_pseudo_sum(iph, IPH_PROTO(iph), tot - ihl);
+    return sizeof(struct eth_hdr) + ihl;
+}
+
 /*
  * low_level_input():
  *
  * Should allocate a pbuf and transfer the bytes of the incoming
  * packet from the interface into the pbuf.
  *
+ * A frame that fits one pbuf has its TCP or UDP checksum verified while
+ * it's copied, so lwIP needn't read the payload a second time.  Frames
+ * that fail are left for lwIP to drop and count.
+ *
  */
 static struct pbuf *
 low_level_input(void *va)
 {
     struct jif_pkt *pkt = (struct jif_pkt *)va;
     s16_t len = pkt->jp_len;
+    u16_t psum;
+    u32_t sum;
+    int l4, l4len;
 
     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (p == 0)
 	return 0;
 
+    if (p->next == NULL
+	&& (l4 = rx_l4_offset((u8_t *) pkt->jp_data, len, &psum))) {
+	u8_t *src = (u8_t *) pkt->jp_data, *dst = p->payload;
+	struct ip_hdr *iph = (struct ip_hdr *) (src + sizeof(struct eth_hdr));
+
+	l4len = sizeof(struct eth_hdr) + ntohs(IPH_LEN(iph)) - l4;
+	memcpy(dst, src, l4);
+	sum = jos_chksum_copy(dst + l4, src + l4, l4len);
+	memcpy(dst + l4 + l4len, src + l4 + l4len, len - l4 - l4len);
+	sum += psum;
+	sum = (sum & 0xffff) + (sum >> 16);
+	if (sum == 0xffff)
+	    p->flags |= PBUF_FLAG_CSUM_OK;
+	return p;
+    }
+
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
     void *rxbuf = (void *) pkt->jp_data;
@@ -209,6 +680,30 @@ jif_input(struct netif *netif, void *va)
     }
 }
 
+/*
+ * jif_port_ok():
+ *
+ * Whether the card steers the segments that pcb's peer sends to the
+ * queue pair this network server instance drives.  Each instance has a
+ * stack of its own, so an active open picks a local port that passes
+ * (see TCP_LOCAL_PORT_OK); another instance would reset the connection.
+ *
+ */
+int
+jif_port_ok(struct tcp_pcb *pcb)
+{
+    struct ip_addr local = pcb->local_ip;
+    u32_t hash;
+
+    if (jif_nqueues <= 1)
+	return 1;
+    if (ip_addr_isany(&local))
+	local = jif_netif->ip_addr;
+    hash = net_rss_hash(pcb->remote_ip.addr, local.addr,
+			htons(pcb->remote_port), htons(pcb->local_port));
+    return net_rss_queue(hash, jif_nqueues) == thisenv->env_net_queue;
+}
+
 /*
  * jif_init():
  *
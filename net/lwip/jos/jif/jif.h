@@ -2,3 +2,7 @@
 
 void	jif_input(struct netif *netif, void *va);
 err_t	jif_init(struct netif *netif);
+void	jif_flush(void);
+
+struct tcp_pcb;
+int	jif_port_ok(struct tcp_pcb *pcb);
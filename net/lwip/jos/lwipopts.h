@@ -10,8 +10,12 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 //#define NO_SYS 1
 
-#define LWIP_STATS		0
+// Stack, pool and per-connection counters, for NSREQ_STATS (netstat).
+#define LWIP_STATS		1
+#define LWIP_STATS_LARGE	1
 #define LWIP_STATS_DISPLAY	0
+#define SYS_STATS		0
+#define TCP_PCB_STATS		1
 #define LWIP_DHCP		1
 #define LWIP_COMPAT_SOCKETS	0
 //#define SYS_LIGHTWEIGHT_PROT	1
@@ -24,22 +28,47 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 #define MEMP_NUM_PBUF		64
 #define MEMP_NUM_UDP_PCB	8
-#define MEMP_NUM_TCP_PCB	32
+#define MEMP_NUM_TCP_PCB	256
 #define MEMP_NUM_TCP_PCB_LISTEN	16
 #define MEMP_NUM_TCP_SEG	TCP_SND_QUEUELEN// at least as big as TCP_SND_QUEUELEN
 #define MEMP_NUM_NETBUF		128
 #define MEMP_NUM_NETCONN	32
 #define MEMP_NUM_SYS_TIMEOUT    6
 
+// Room for every host on a flat /24; etharp.c hashes the entries.
+#define ARP_TABLE_SIZE		256
+
 #define PER_TCP_PCB_BUFFER	(16 * 4096)
 #define MEM_SIZE		(PER_TCP_PCB_BUFFER*MEMP_NUM_TCP_SEG + 4096*MEMP_NUM_TCP_SEG)
+// mem_malloc from page-sized slabs mapped on demand, up to MEM_SIZE.
+#define MEM_JOS_SLAB		1
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
 
+// jif fills in outgoing checksums, or has the card do it.  Incoming ones
+// are still checked here: QEMU's e1000 doesn't report receive checksums.
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_UDP	0
+#define CHECKSUM_GEN_TCP	0
+
 #define TCP_MSS			1460
-#define TCP_WND			24000
-#define TCP_SND_BUF		(16 * TCP_MSS)
+// Each network server instance owns the TCP connections the card steers
+// to its queue pair, so active opens pick a local port to match.
+struct tcp_pcb;
+int jif_port_ok(struct tcp_pcb *pcb);
+#define TCP_LOCAL_PORT_OK(pcb)	jif_port_ok(pcb)
+// A quarter of the pbuf pool may sit in one connection's receive
+// window, which window scaling lets run past 64 KB.  The send buffer
+// stays under 64 KB (snd_buf is 16 bits).
+#define LWIP_WND_SCALE		1
+#define TCP_RCV_SCALE		2
+#define TCP_WND			(PBUF_POOL_SIZE / 4 * TCP_MSS)
+#define TCP_SND_BUF		(44 * TCP_MSS)
+// RTT samples from every ACK, and recovery of several losses per
+// window.
+#define LWIP_TCP_TIMESTAMPS	1
+#define LWIP_TCP_SACK		1
 // lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS), 
 // but 16 is faster.. 
 #define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
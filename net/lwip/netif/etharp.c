@@ -101,16 +101,34 @@ struct etharp_entry {
   struct eth_addr ethaddr;
   enum etharp_state state;
   u8_t ctime;
+  /** an ARP request went out since the last etharp_tmr */
+  u8_t requested;
   struct netif *netif;
+  /** next entry on the same hash chain */
+  s16_t hash_next;
+  /** neighbours on the live list, or next on the free list */
+  s16_t live_next, live_prev;
 };
 
 const struct eth_addr ethbroadcast = {{0xff,0xff,0xff,0xff,0xff,0xff}};
 const struct eth_addr ethzero = {{0,0,0,0,0,0}};
 static struct etharp_entry arp_table[ARP_TABLE_SIZE];
-#if !LWIP_NETIF_HWADDRHINT
-static u8_t etharp_cached_entry;
+
+/** Number of hash chains; a power of two. */
+#ifndef ARP_HASH_SIZE
+#define ARP_HASH_SIZE 128
 #endif
 
+/**
+ * Entries with an IP address (pending or stable) are on a hash chain,
+ * found by their address, and on the live list, which etharp_tmr walks.
+ * The rest are on the free list.  -1 ends all of these lists.
+ */
+static s16_t arp_hash[ARP_HASH_SIZE];
+static s16_t arp_live;
+static s16_t arp_free;
+static u8_t arp_lists_ready;
+
 /**
  * Try hard to create a new entry - we want the IP address to appear in
  * the cache (even if this means removing an active entry or so). */
@@ -120,17 +138,20 @@ static u8_t etharp_cached_entry;
 #if LWIP_NETIF_HWADDRHINT
 #define NETIF_SET_HINT(netif, hint)  if (((netif) != NULL) && ((netif)->addr_hint != NULL))  \
                                       *((netif)->addr_hint) = (hint);
-static s8_t find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif);
 #else /* LWIP_NETIF_HWADDRHINT */
-static s8_t find_entry(struct ip_addr *ipaddr, u8_t flags);
+#define NETIF_SET_HINT(netif, hint)
 #endif /* LWIP_NETIF_HWADDRHINT */
+static s16_t find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif);
 
 static err_t update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *ethaddr, u8_t flags);
 
 
 /* Some checks, instead of etharp_init(): */
-#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7f))
-  #error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s8_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7fff))
+  #error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s16_t, so, you have to reduce it in your lwipopts.h"
+#endif
+#if (LWIP_ARP && LWIP_NETIF_HWADDRHINT && (ARP_TABLE_SIZE > 0x100))
+  #error "LWIP_NETIF_HWADDRHINT keeps ARP entry indices in a u8_t, so ARP_TABLE_SIZE must not exceed 256"
 #endif
 
 
@@ -156,6 +177,73 @@ free_etharp_q(struct etharp_q_entry *q)
 }
 #endif
 
+/** The hash chain for ipaddr. Mixes all four octets, since on a flat
+ *  segment only the last one differs. */
+static s16_t *
+arp_chain(struct ip_addr *ipaddr)
+{
+  u32_t h = ipaddr->addr;
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return &arp_hash[h & (ARP_HASH_SIZE - 1)];
+}
+
+/** Put every entry on the free list; done on first use. */
+static void
+arp_lists_init(void)
+{
+  s16_t i;
+
+  for (i = 0; i < ARP_HASH_SIZE; ++i) {
+    arp_hash[i] = -1;
+  }
+  for (i = 0; i < ARP_TABLE_SIZE; ++i) {
+    arp_table[i].live_next = (i + 1 < ARP_TABLE_SIZE) ? i + 1 : -1;
+  }
+  arp_free = 0;
+  arp_live = -1;
+  arp_lists_ready = 1;
+}
+
+/** Give entry i, which is on no list, the address ipaddr. */
+static void
+arp_link(s16_t i, struct ip_addr *ipaddr)
+{
+  s16_t *chain = arp_chain(ipaddr);
+
+  ip_addr_set(&arp_table[i].ipaddr, ipaddr);
+  arp_table[i].hash_next = *chain;
+  *chain = i;
+  arp_table[i].live_prev = -1;
+  arp_table[i].live_next = arp_live;
+  if (arp_live >= 0) {
+    arp_table[arp_live].live_prev = i;
+  }
+  arp_live = i;
+}
+
+/** Take entry i off its hash chain and the live list. */
+static void
+arp_unlink(s16_t i)
+{
+  s16_t *p;
+
+  for (p = arp_chain(&arp_table[i].ipaddr); *p >= 0; p = &arp_table[*p].hash_next) {
+    if (*p == i) {
+      *p = arp_table[i].hash_next;
+      break;
+    }
+  }
+  if (arp_table[i].live_prev >= 0) {
+    arp_table[arp_table[i].live_prev].live_next = arp_table[i].live_next;
+  } else {
+    arp_live = arp_table[i].live_next;
+  }
+  if (arp_table[i].live_next >= 0) {
+    arp_table[arp_table[i].live_next].live_prev = arp_table[i].live_prev;
+  }
+}
+
 /**
  * Clears expired entries in the ARP table.
  *
@@ -165,12 +253,17 @@ free_etharp_q(struct etharp_q_entry *q)
 void
 etharp_tmr(void)
 {
-  u8_t i;
+  s16_t i, next;
 
   LWIP_DEBUGF(ETHARP_DEBUG, ("etharp_timer\n"));
-  /* remove expired entries from the ARP table */
-  for (i = 0; i < ARP_TABLE_SIZE; ++i) {
+  if (!arp_lists_ready) {
+    return;
+  }
+  /* remove expired entries from the ARP table; empty ones need no ageing */
+  for (i = arp_live; i >= 0; i = next) {
+    next = arp_table[i].live_next;
     arp_table[i].ctime++;
+    arp_table[i].requested = 0;
     if (((arp_table[i].state == ETHARP_STATE_STABLE) &&
          (arp_table[i].ctime >= ARP_MAXAGE)) ||
         ((arp_table[i].state == ETHARP_STATE_PENDING)  &&
@@ -192,13 +285,10 @@ etharp_tmr(void)
 #endif
       /* recycle entry for re-use */      
       arp_table[i].state = ETHARP_STATE_EMPTY;
+      arp_unlink(i);
+      arp_table[i].live_next = arp_free;
+      arp_free = i;
     }
-#if ARP_QUEUEING
-    /* still pending entry? (not expired) */
-    if (arp_table[i].state == ETHARP_STATE_PENDING) {
-        /* resend an ARP query here? */
-    }
-#endif
   }
 }
 
@@ -210,143 +300,82 @@ etharp_tmr(void)
  * but in state ETHARP_EMPTY. The caller must check and possibly change the
  * state of the returned entry.
  * 
- * If ipaddr is NULL, return a initialized new entry in state ETHARP_EMPTY.
- * 
- * In all cases, attempt to create new entries from an empty entry. If no
- * empty entries are available and ETHARP_TRY_HARD flag is set, recycle
- * old entries. Heuristic choose the least important entry for recycling.
+ * Matches are found through the address hash, after checking the entry
+ * that netif resolved last.  New entries come from the free list.  If
+ * it is empty and ETHARP_TRY_HARD flag is set, recycle old entries.
+ * Heuristic choose the least important entry for recycling.
  *
  * @param ipaddr IP address to find in ARP cache, or to add if not found.
  * @param flags
  * - ETHARP_TRY_HARD: Try hard to create a entry by allowing recycling of
  * active (stable or pending) entries.
+ * @param netif the netif looking up ipaddr, or NULL
  *  
  * @return The ARP entry index that matched or is created, ERR_MEM if no
  * entry is found or could be recycled.
  */
-static s8_t
-#if LWIP_NETIF_HWADDRHINT
+static s16_t
 find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif)
-#else /* LWIP_NETIF_HWADDRHINT */
-find_entry(struct ip_addr *ipaddr, u8_t flags)
-#endif /* LWIP_NETIF_HWADDRHINT */
 {
-  s8_t old_pending = ARP_TABLE_SIZE, old_stable = ARP_TABLE_SIZE;
-  s8_t empty = ARP_TABLE_SIZE;
-  u8_t i = 0, age_pending = 0, age_stable = 0;
+  s16_t old_pending = -1, old_stable = -1;
+  s16_t i;
+  u8_t age_pending = 0, age_stable = 0;
 #if ARP_QUEUEING
   /* oldest entry with packets on queue */
-  s8_t old_queue = ARP_TABLE_SIZE;
+  s16_t old_queue = -1;
   /* its age */
   u8_t age_queue = 0;
 #endif
 
-  /* First, test if the last call to this function asked for the
+  LWIP_ASSERT("find_entry: ipaddr != NULL", ipaddr != NULL);
+  if (!arp_lists_ready) {
+    arp_lists_init();
+  }
+
+  /* First, test if the last lookup on this netif asked for the
    * same address. If so, we're really fast! */
-  if (ipaddr) {
-    /* ipaddr to search for was given */
 #if LWIP_NETIF_HWADDRHINT
-    if ((netif != NULL) && (netif->addr_hint != NULL)) {
-      /* per-pcb cached entry was given */
-      u8_t per_pcb_cache = *(netif->addr_hint);
-      if ((per_pcb_cache < ARP_TABLE_SIZE) && arp_table[per_pcb_cache].state == ETHARP_STATE_STABLE) {
-        /* the per-pcb-cached entry is stable */
-        if (ip_addr_cmp(ipaddr, &arp_table[per_pcb_cache].ipaddr)) {
-          /* per-pcb cached entry was the right one! */
-          ETHARP_STATS_INC(etharp.cachehit);
-          return per_pcb_cache;
-        }
-      }
-    }
-#else /* #if LWIP_NETIF_HWADDRHINT */
-    if (arp_table[etharp_cached_entry].state == ETHARP_STATE_STABLE) {
-      /* the cached entry is stable */
-      if (ip_addr_cmp(ipaddr, &arp_table[etharp_cached_entry].ipaddr)) {
-        /* cached entry was the right one! */
+  if ((netif != NULL) && (netif->addr_hint != NULL)) {
+    /* per-pcb cached entry was given */
+    u8_t per_pcb_cache = *(netif->addr_hint);
+    if ((per_pcb_cache < ARP_TABLE_SIZE) && arp_table[per_pcb_cache].state == ETHARP_STATE_STABLE) {
+      /* the per-pcb-cached entry is stable */
+      if (ip_addr_cmp(ipaddr, &arp_table[per_pcb_cache].ipaddr)) {
+        /* per-pcb cached entry was the right one! */
         ETHARP_STATS_INC(etharp.cachehit);
-        return etharp_cached_entry;
+        return per_pcb_cache;
       }
     }
+  }
 #endif /* #if LWIP_NETIF_HWADDRHINT */
+  if ((netif != NULL) && (netif->arp_hint < ARP_TABLE_SIZE) &&
+      arp_table[netif->arp_hint].state == ETHARP_STATE_STABLE &&
+      ip_addr_cmp(ipaddr, &arp_table[netif->arp_hint].ipaddr)) {
+    /* cached entry was the right one! */
+    ETHARP_STATS_INC(etharp.cachehit);
+    return netif->arp_hint;
   }
 
-  /**
-   * a) do a search through the cache, remember candidates
-   * b) select candidate entry
-   * c) create new entry
-   */
-
-  /* a) in a single search sweep, do all of this
-   * 1) remember the first empty entry (if any)
-   * 2) remember the oldest stable entry (if any)
-   * 3) remember the oldest pending entry without queued packets (if any)
-   * 4) remember the oldest pending entry with queued packets (if any)
-   * 5) search for a matching IP entry, either pending or stable
-   *    until 5 matches, or all entries are searched for.
-   */
-
-  for (i = 0; i < ARP_TABLE_SIZE; ++i) {
-    /* no empty entry found yet and now we do find one? */
-    if ((empty == ARP_TABLE_SIZE) && (arp_table[i].state == ETHARP_STATE_EMPTY)) {
-      LWIP_DEBUGF(ETHARP_DEBUG, ("find_entry: found empty entry %"U16_F"\n", (u16_t)i));
-      /* remember first empty entry */
-      empty = i;
-    }
-    /* pending entry? */
-    else if (arp_table[i].state == ETHARP_STATE_PENDING) {
-      /* if given, does IP address match IP address in ARP entry? */
-      if (ipaddr && ip_addr_cmp(ipaddr, &arp_table[i].ipaddr)) {
-        LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: found matching pending entry %"U16_F"\n", (u16_t)i));
-        /* found exact IP address match, simply bail out */
-#if LWIP_NETIF_HWADDRHINT
-        NETIF_SET_HINT(netif, i);
-#else /* #if LWIP_NETIF_HWADDRHINT */
-        etharp_cached_entry = i;
-#endif /* #if LWIP_NETIF_HWADDRHINT */
-        return i;
-#if ARP_QUEUEING
-      /* pending with queued packets? */
-      } else if (arp_table[i].q != NULL) {
-        if (arp_table[i].ctime >= age_queue) {
-          old_queue = i;
-          age_queue = arp_table[i].ctime;
-        }
-#endif
-      /* pending without queued packets? */
-      } else {
-        if (arp_table[i].ctime >= age_pending) {
-          old_pending = i;
-          age_pending = arp_table[i].ctime;
-        }
-      }        
-    }
-    /* stable entry? */
-    else if (arp_table[i].state == ETHARP_STATE_STABLE) {
-      /* if given, does IP address match IP address in ARP entry? */
-      if (ipaddr && ip_addr_cmp(ipaddr, &arp_table[i].ipaddr)) {
-        LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: found matching stable entry %"U16_F"\n", (u16_t)i));
-        /* found exact IP address match, simply bail out */
-#if LWIP_NETIF_HWADDRHINT
-        NETIF_SET_HINT(netif, i);
-#else /* #if LWIP_NETIF_HWADDRHINT */
-        etharp_cached_entry = i;
-#endif /* #if LWIP_NETIF_HWADDRHINT */
-        return i;
-      /* remember entry with oldest stable entry in oldest, its age in maxtime */
-      } else if (arp_table[i].ctime >= age_stable) {
-        old_stable = i;
-        age_stable = arp_table[i].ctime;
+  /* a) search the address's hash chain for a pending or stable entry */
+  for (i = *arp_chain(ipaddr); i >= 0; i = arp_table[i].hash_next) {
+    if (ip_addr_cmp(ipaddr, &arp_table[i].ipaddr)) {
+      LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: found matching entry %"U16_F"\n", (u16_t)i));
+      /* found exact IP address match, simply bail out */
+      NETIF_SET_HINT(netif, i);
+      if (netif != NULL) {
+        netif->arp_hint = i;
       }
+      return i;
     }
   }
   /* { we have no match } => try to create a new entry */
    
   /* no empty entry found and not allowed to recycle? */
-  if (((empty == ARP_TABLE_SIZE) && ((flags & ETHARP_TRY_HARD) == 0))
+  if (((arp_free < 0) && ((flags & ETHARP_TRY_HARD) == 0))
       /* or don't create new entry, only search? */
       || ((flags & ETHARP_FIND_ONLY) != 0)) {
     LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: no empty entry found and not allowed to recycle\n"));
-    return (s8_t)ERR_MEM;
+    return (s16_t)ERR_MEM;
   }
   
   /* b) choose the least destructive entry to recycle:
@@ -359,60 +388,79 @@ find_entry(struct ip_addr *ipaddr, u8_t flags)
    */ 
 
   /* 1) empty entry available? */
-  if (empty < ARP_TABLE_SIZE) {
-    i = empty;
+  if (arp_free >= 0) {
+    i = arp_free;
+    arp_free = arp_table[i].live_next;
     LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting empty entry %"U16_F"\n", (u16_t)i));
-  }
-  /* 2) found recyclable stable entry? */
-  else if (old_stable < ARP_TABLE_SIZE) {
-    /* recycle oldest stable*/
-    i = old_stable;
-    LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest stable entry %"U16_F"\n", (u16_t)i));
+  } else {
+    /* the table is full, which should be rare: look for the oldest
+       entries of each kind */
+    for (i = arp_live; i >= 0; i = arp_table[i].live_next) {
+      if (arp_table[i].state == ETHARP_STATE_STABLE) {
+        if (arp_table[i].ctime >= age_stable) {
+          old_stable = i;
+          age_stable = arp_table[i].ctime;
+        }
 #if ARP_QUEUEING
-    /* no queued packets should exist on stable entries */
-    LWIP_ASSERT("arp_table[i].q == NULL", arp_table[i].q == NULL);
+      /* pending with queued packets? */
+      } else if (arp_table[i].q != NULL) {
+        if (arp_table[i].ctime >= age_queue) {
+          old_queue = i;
+          age_queue = arp_table[i].ctime;
+        }
 #endif
-  /* 3) found recyclable pending entry without queued packets? */
-  } else if (old_pending < ARP_TABLE_SIZE) {
-    /* recycle oldest pending */
-    i = old_pending;
-    LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest pending entry %"U16_F" (without queue)\n", (u16_t)i));
+      /* pending without queued packets? */
+      } else if (arp_table[i].ctime >= age_pending) {
+        old_pending = i;
+        age_pending = arp_table[i].ctime;
+      }
+    }
+
+    /* 2) found recyclable stable entry? */
+    if (old_stable >= 0) {
+      /* recycle oldest stable*/
+      i = old_stable;
+      LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest stable entry %"U16_F"\n", (u16_t)i));
 #if ARP_QUEUEING
-  /* 4) found recyclable pending entry with queued packets? */
-  } else if (old_queue < ARP_TABLE_SIZE) {
-    /* recycle oldest pending */
-    i = old_queue;
-    LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest pending entry %"U16_F", freeing packet queue %p\n", (u16_t)i, (void *)(arp_table[i].q)));
-    free_etharp_q(arp_table[i].q);
-    arp_table[i].q = NULL;
+      /* no queued packets should exist on stable entries */
+      LWIP_ASSERT("arp_table[i].q == NULL", arp_table[i].q == NULL);
 #endif
-    /* no empty or recyclable entries found */
-  } else {
-    return (s8_t)ERR_MEM;
+    /* 3) found recyclable pending entry without queued packets? */
+    } else if (old_pending >= 0) {
+      /* recycle oldest pending */
+      i = old_pending;
+      LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest pending entry %"U16_F" (without queue)\n", (u16_t)i));
+#if ARP_QUEUEING
+    /* 4) found recyclable pending entry with queued packets? */
+    } else if (old_queue >= 0) {
+      /* recycle oldest pending */
+      i = old_queue;
+      LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest pending entry %"U16_F", freeing packet queue %p\n", (u16_t)i, (void *)(arp_table[i].q)));
+      free_etharp_q(arp_table[i].q);
+      arp_table[i].q = NULL;
+#endif
+      /* no empty or recyclable entries found */
+    } else {
+      return (s16_t)ERR_MEM;
+    }
+
+    snmp_delete_arpidx_tree(arp_table[i].netif, &arp_table[i].ipaddr);
+    arp_unlink(i);
   }
 
   /* { empty or recyclable entry found } */
   LWIP_ASSERT("i < ARP_TABLE_SIZE", i < ARP_TABLE_SIZE);
 
-  if (arp_table[i].state != ETHARP_STATE_EMPTY)
-  {
-    snmp_delete_arpidx_tree(arp_table[i].netif, &arp_table[i].ipaddr);
-  }
   /* recycle entry (no-op for an already empty entry) */
   arp_table[i].state = ETHARP_STATE_EMPTY;
-
-  /* IP address given? */
-  if (ipaddr != NULL) {
-    /* set IP address */
-    ip_addr_set(&arp_table[i].ipaddr, ipaddr);
-  }
   arp_table[i].ctime = 0;
-#if LWIP_NETIF_HWADDRHINT
+  arp_table[i].requested = 0;
+  arp_link(i, ipaddr);
   NETIF_SET_HINT(netif, i);
-#else /* #if LWIP_NETIF_HWADDRHINT */
-  etharp_cached_entry = i;
-#endif /* #if LWIP_NETIF_HWADDRHINT */
-  return (err_t)i;
+  if (netif != NULL) {
+    netif->arp_hint = i;
+  }
+  return i;
 }
 
 /**
@@ -467,7 +515,7 @@ etharp_send_ip(struct netif *netif, struct pbuf *p, struct eth_addr *src, struct
 static err_t
 update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *ethaddr, u8_t flags)
 {
-  s8_t i;
+  s16_t i;
   u8_t k;
   LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE | 3, ("update_arp_entry()\n"));
   LWIP_ASSERT("netif->hwaddr_len == ETHARP_HWADDR_LEN", netif->hwaddr_len == ETHARP_HWADDR_LEN);
@@ -483,11 +531,7 @@ update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *e
     return ERR_ARG;
   }
   /* find or create ARP entry */
-#if LWIP_NETIF_HWADDRHINT
   i = find_entry(ipaddr, flags, netif);
-#else /* LWIP_NETIF_HWADDRHINT */
-  i = find_entry(ipaddr, flags);
-#endif /* LWIP_NETIF_HWADDRHINT */
   /* bail out if no entry could be found */
   if (i < 0)
     return (err_t)i;
@@ -541,19 +585,15 @@ update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *e
  * @param ip_ret points to return pointer
  * @return table index if found, -1 otherwise
  */
-s8_t
+s16_t
 etharp_find_addr(struct netif *netif, struct ip_addr *ipaddr,
          struct eth_addr **eth_ret, struct ip_addr **ip_ret)
 {
-  s8_t i;
+  s16_t i;
 
   LWIP_UNUSED_ARG(netif);
 
-#if LWIP_NETIF_HWADDRHINT
   i = find_entry(ipaddr, ETHARP_FIND_ONLY, NULL);
-#else /* LWIP_NETIF_HWADDRHINT */
-  i = find_entry(ipaddr, ETHARP_FIND_ONLY);
-#endif /* LWIP_NETIF_HWADDRHINT */
   if((i >= 0) && arp_table[i].state == ETHARP_STATE_STABLE) {
       *eth_ret = &arp_table[i].ethaddr;
       *ip_ret = &arp_table[i].ipaddr;
@@ -876,7 +916,7 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
 {
   struct eth_addr * srcaddr = (struct eth_addr *)netif->hwaddr;
   err_t result = ERR_MEM;
-  s8_t i; /* ARP entry index */
+  s16_t i; /* ARP entry index */
 
   /* non-unicast address? */
   if (ip_addr_isbroadcast(ipaddr, netif) ||
@@ -887,11 +927,7 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
   }
 
   /* find entry in ARP cache, ask to create entry if queueing packet */
-#if LWIP_NETIF_HWADDRHINT
   i = find_entry(ipaddr, ETHARP_TRY_HARD, netif);
-#else /* LWIP_NETIF_HWADDRHINT */
-  i = find_entry(ipaddr, ETHARP_TRY_HARD);
-#endif /* LWIP_NETIF_HWADDRHINT */
 
   /* could not find or create entry? */
   if (i < 0) {
@@ -913,10 +949,15 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
   ((arp_table[i].state == ETHARP_STATE_PENDING) ||
    (arp_table[i].state == ETHARP_STATE_STABLE)));
 
-  /* do we have a pending entry? or an implicit query request? */
-  if ((arp_table[i].state == ETHARP_STATE_PENDING) || (q == NULL)) {
+  /* do we have a pending entry? or an implicit query request?  Packets
+     queued on a pending entry share one request per etharp_tmr period. */
+  if ((arp_table[i].state == ETHARP_STATE_PENDING && !arp_table[i].requested) ||
+      (q == NULL)) {
     /* try to resolve it; send out ARP request */
     result = etharp_request(netif, ipaddr);
+    if (result == ERR_OK && arp_table[i].state == ETHARP_STATE_PENDING) {
+      arp_table[i].requested = 1;
+    }
     if (result != ERR_OK) {
       /* ARP request couldn't be sent */
       /* We don't re-send arp request in etharp_tmr, but we still queue packets,
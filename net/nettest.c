@@ -0,0 +1,42 @@
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#include "nettest.h"
+
+// lwIP's library sets errno, which the network server defines.
+int errno;
+
+static uint32_t seed = 1;
+static uint64_t start_tsc;
+
+void
+nettest_srand(uint32_t s)
+{
+	seed = s;
+}
+
+// The C standard's example generator; the high bits are the random ones.
+uint32_t
+nettest_rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+void
+nettest_start(void)
+{
+	start_tsc = read_tsc();
+}
+
+unsigned int
+nettest_cycles(int n)
+{
+	return (unsigned int) ((read_tsc() - start_tsc) / n);
+}
+
+void
+nettest_pass(void)
+{
+	cprintf("%s: ok\n", binaryname);
+}
@@ -0,0 +1,21 @@
+// Helpers shared by the stand-alone tests of network server parts
+// (net/test*.c), which run without the network server.
+
+#ifndef JOS_NET_NETTEST_H
+#define JOS_NET_NETTEST_H
+
+#include <inc/types.h>
+
+// Deterministic pseudo-random numbers, so a failing run repeats.
+void nettest_srand(uint32_t seed);
+uint32_t nettest_rand(void);
+
+// Time a stretch of work: nettest_cycles returns the average cycles for
+// each of the n operations done since nettest_start.
+void nettest_start(void);
+unsigned int nettest_cycles(int n);
+
+// Report that the program's checks all passed.
+void nettest_pass(void);
+
+#endif	// !JOS_NET_NETTEST_H
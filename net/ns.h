@@ -15,8 +15,9 @@
 void timer(envid_t ns_envid, uint32_t initial_to);
 
 /* input.c */
-void input(envid_t ns_envid);
+void input(envid_t ns_envid, int queue);
+void input_wake(envid_t ns_envid, int queue);
 
 /* output.c */
-void output(envid_t ns_envid);
+void output(envid_t ns_envid, int queue);
 
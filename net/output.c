@@ -2,14 +2,28 @@
 
 extern union Nsipc nsipcbuf;
 
+// Send the frames the network server hands us on the card's queue pair
+// 'queue'.
 void
-output(envid_t ns_envid)
+output(envid_t ns_envid, int queue)
 {
+	int r;
+
 	binaryname = "ns_output";
+	if ((r = sys_net_set_queue(queue)) < 0)
+		panic("sys_net_set_queue %d: %e", queue, r);
 
 	// LAB 6: Your code here:
 	// 	- read a packet from the network server
 	//	- send the packet to the device driver
+	//
+	// The card reads the packet straight out of the IPC page, which
+	// stays pinned until sent even after the next ipc_recv replaces
+	// our mapping of it.
+	struct net_frag frags[NET_BATCH_FRAGS];
+	struct jif_pkt *pkt;
+	int i, n;
+
 	while (1) {
 		sys_ipc_recv(&nsipcbuf);
 
@@ -18,7 +32,26 @@ output(envid_t ns_envid)
 			continue;
 		}
 
-		while (sys_net_try_send(nsipcbuf.pkt.jp_data, 
-					     nsipcbuf.pkt.jp_len) != 0);
+		// The page may hold several frames; send them in
+		// batches of up to NET_BATCH_FRAGS.
+		pkt = &nsipcbuf.pkt;
+		while (pkt) {
+			for (n = 0; pkt && n < NET_BATCH_FRAGS; n++) {
+				frags[n].nf_data = pkt->jp_data;
+				frags[n].nf_len = pkt->jp_len;
+				frags[n].nf_flags = NET_FRAG_EOP;
+				pkt = jif_pkt_next(&nsipcbuf, pkt);
+			}
+			for (i = 0; i < n; i += r) {
+				while ((r = sys_net_send_frags(&frags[i], n - i, 0))
+				       == -E_TX_FULL)
+					if (sys_net_wait_send() < 0)
+						sys_yield();
+				if (r < 0) {
+					cprintf("ns_output: dropped packet: %e\n", r);
+					r = 1;
+				}
+			}
+		}
 	}
 }
@@ -13,6 +13,7 @@
 #include <arch/thread.h>
 #include <lwip/sockets.h>
 #include <lwip/netif.h>
+#include <lwip/memp.h>
 #include <lwip/stats.h>
 #include <lwip/sys.h>
 #include <lwip/tcp.h>
@@ -47,33 +48,330 @@ static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
 
-static bool buse[QUEUE_SIZE];
-static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
-static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
+// The card's queue pair this instance of the server drives (see umain).
+static int ns_queue;
 
-static void *
-get_buffer(void) {
-	void *va;
+// Counters for NSREQ_STATS.
+static uint32_t ns_requests, ns_shed, ns_queued_max;
+static uint32_t hwstats_msec;	// When the card's counters were last read
 
+#define HWSTATS_INTERVAL	1000
+
+// Request buffers: page slots at REQVA, each holding one request from
+// ipc_recv until it's answered.  Free slots are kept on a stack.
+static int buf_free[QUEUE_SIZE];
+static int buf_nfree;
+
+static void
+buffer_init(void)
+{
 	int i;
+
 	for (i = 0; i < QUEUE_SIZE; i++)
-		if (!buse[i]) break;
+		buf_free[buf_nfree++] = QUEUE_SIZE - 1 - i;
+}
 
-	if (i == QUEUE_SIZE) {
-		panic("NS: buffer overflow");
+// Returns a free buffer, or 0 if all are in use.
+static void *
+get_buffer(void) {
+	if (!buf_nfree)
 		return 0;
+	return (void *)(REQVA + buf_free[--buf_nfree] * PGSIZE);
+}
+
+static void
+put_buffer(void *va) {
+	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	buf_free[buf_nfree++] = i;
+}
+
+/*
+ * Socket rings: the data path of a connected socket, a page shared
+ * with the client (see struct Nssock).  Each ring has a thread that
+ * hands the client's output to lwip_send, while serve() moves input
+ * that lwIP has received into the rings without blocking (ring_poll).
+ *
+ * Pages lent by sendfile go to lwIP without a copy, so each stays
+ * mapped until the peer acknowledges its data (ring_reap).
+ */
+
+// Where socket s's ring is mapped, just below the request buffers,
+// and below those, its sendfile pages.
+#define RINGVA(s)	((struct Nssock *) (REQVA - (MEMP_NUM_NETCONN - (s)) * PGSIZE))
+#define RING_SPAGES	8
+#define SPAGEVA(s, i)	((char *) RINGVA(0) - ((s) * RING_SPAGES + (i) + 1) * PGSIZE)
+
+struct sockring {
+	struct Nssock *sr_ring;		// Null if s has no ring
+	volatile uint32_t sr_kicks;	// Bumped to wake the ring's threads
+	bool sr_closing;		// Close waits for the output to drain
+	bool sr_txdone;			// The output thread has exited
+	bool sr_busy;			// ring_poll is in lwip_recv
+	int sr_nspages;			// Sendfile pages lwIP still needs
+	bool sr_spage_used[RING_SPAGES];
+	uint32_t sr_spage_end[RING_SPAGES];	// ... up to this seqno
+};
+
+static struct sockring rings[MEMP_NUM_NETCONN];
+
+static void
+ring_wakeup(struct sockring *sr)
+{
+	sr->sr_kicks++;
+	thread_wakeup(&sr->sr_kicks);
+}
+
+// Ring the client's doorbell, if it waits on 'flag'.  If the client
+// hasn't blocked yet the ring is dropped; it sees the cleared flag and
+// looks at the ring again.
+static void
+ring_doorbell(struct nsring *r, volatile uint32_t *flag)
+{
+	if (*flag)
+		sys_ipc_ring(r->nr_waiter, flag);
+}
+
+// Send what the client writes to socket s's ring, until it's closed.
+static void
+ring_tx_thread(uint32_t s)
+{
+	struct sockring *sr = &rings[s];
+	struct nsring *r = &sr->sr_ring->ns_tx;
+	uint32_t kicks, n;
+	int sent;
+
+	while (1) {
+		kicks = sr->sr_kicks;
+		if ((n = nsring_rspan(r)) == 0) {
+			if (sr->sr_closing)
+				break;
+			xchg(&r->nr_rwait, 1);
+			if (nsring_rspan(r) == 0)
+				thread_wait(&sr->sr_kicks, kicks, (uint32_t)~0);
+			r->nr_rwait = 0;
+			continue;
+		}
+
+		// After an error, drop the rest; the client's writes fail.
+		sent = n;
+		if (!r->nr_done
+		    && (sent = lwip_send(s, &r->nr_buf[r->nr_rpos], n, 0)) < 0) {
+			r->nr_err = sent;
+			r->nr_done = 1;
+			sent = n;
+		}
+		r->nr_rpos = (r->nr_rpos + sent) % NSRING_BUFSIZ;
+		ring_doorbell(r, &r->nr_wwait);
+		ring_wakeup(sr);
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
-	buse[i] = 1;
+	sr->sr_txdone = 1;
+	ring_wakeup(sr);
+}
 
-	return va;
+// Map the client's ring page 'req' for its socket.
+static int
+ring_setup(struct Nssock *req)
+{
+	int s = req->ns_sockid, r, type;
+	socklen_t len = sizeof(type);
+	struct sockring *sr;
+
+	// A byte ring would lose datagram boundaries.
+	if (s < 0 || s >= MEMP_NUM_NETCONN || rings[s].sr_ring
+	    || lwip_getsockopt(s, SOL_SOCKET, SO_TYPE, &type, &len) < 0
+	    || type != SOCK_STREAM)
+		return -E_INVAL;
+	sr = &rings[s];
+	if ((r = sys_page_map(0, req, 0, RINGVA(s), PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memset(sr, 0, sizeof(*sr));
+	sr->sr_ring = RINGVA(s);
+	if (sr->sr_ring->ns_listen) {
+		// Nothing to send; ring_poll just watches for connections.
+		sr->sr_txdone = 1;
+		return 0;
+	}
+	if ((r = thread_create(0, "ring tx", ring_tx_thread, s)) < 0) {
+		sys_page_unmap(0, RINGVA(s));
+		sr->sr_ring = 0;
+	}
+	return r;
 }
 
+// Flush socket s's ring and unmap it, before lwIP closes s.
 static void
-put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
-	buse[i] = 0;
+ring_close(int s)
+{
+	struct sockring *sr;
+
+	if (s < 0 || s >= MEMP_NUM_NETCONN || !rings[s].sr_ring)
+		return;
+	sr = &rings[s];
+	sr->sr_closing = 1;
+	ring_wakeup(sr);
+	while (!sr->sr_txdone || sr->sr_busy || sr->sr_nspages)
+		thread_wait(&sr->sr_kicks, sr->sr_kicks, (uint32_t)~0);
+
+	// After a shutdown, reads see EOF and writes fail, as lwIP's
+	// would on the closed socket.
+	if (!sr->sr_ring->ns_rx.nr_done) {
+		sr->sr_ring->ns_rx.nr_err = 0;
+		sr->sr_ring->ns_rx.nr_done = 1;
+	}
+	if (!sr->sr_ring->ns_tx.nr_done) {
+		sr->sr_ring->ns_tx.nr_err = -1;
+		sr->sr_ring->ns_tx.nr_done = 1;
+	}
+	sys_page_unmap(0, sr->sr_ring);
+	sr->sr_ring = 0;
+}
+
+// Tell the client whether listening socket s has a connection to accept.
+static void
+ring_listen_update(int s)
+{
+	struct Nssock *ring;
+	struct timeval tv = { 0, 0 };
+	fd_set rset;
+
+	if (s < 0 || s >= MEMP_NUM_NETCONN || !(ring = rings[s].sr_ring)
+	    || !ring->ns_listen)
+		return;
+	FD_ZERO(&rset);
+	FD_SET(s, &rset);
+	ring->ns_acceptable[ns_queue] = lwip_select(s + 1, &rset, 0, 0, &tv) > 0;
+	if (ring->ns_acceptable[ns_queue])
+		ring_doorbell(&ring->ns_rx, &ring->ns_rx.nr_rwait);
+}
+
+// Move whatever lwIP has received for each ring's socket into the
+// ring, as far as it has room, and wake clients waiting for it.
+static void
+ring_poll(void)
+{
+	struct sockring *sr;
+	struct nsring *r;
+	uint32_t n;
+	int s, got, moved;
+
+	for (s = 0; s < MEMP_NUM_NETCONN; s++) {
+		sr = &rings[s];
+		if (!sr->sr_ring || sr->sr_closing)
+			continue;
+		if (sr->sr_ring->ns_listen) {
+			ring_listen_update(s);
+			continue;
+		}
+		r = &sr->sr_ring->ns_rx;
+		if (r->nr_done)
+			continue;
+
+		moved = 0;
+		sr->sr_busy = 1;
+		while (1) {
+			if ((n = nsring_wspan(r)) == 0) {
+				// The client kicks us once it makes room.
+				xchg(&r->nr_wwait, 1);
+				if (nsring_wspan(r) == 0)
+					break;
+				r->nr_wwait = 0;
+				continue;
+			}
+			got = lwip_recv(s, &r->nr_buf[r->nr_wpos], n,
+					MSG_DONTWAIT);
+			if (got < 0 && errno == EWOULDBLOCK)
+				break;
+			moved = 1;
+			if (got <= 0) {
+				r->nr_err = got;
+				r->nr_done = 1;
+				break;
+			}
+			r->nr_wpos = (r->nr_wpos + got) % NSRING_BUFSIZ;
+		}
+		sr->sr_busy = 0;
+		if (sr->sr_closing)
+			ring_wakeup(sr);
+		if (moved)
+			ring_doorbell(r, &r->nr_rwait);
+	}
+}
+
+// Send part of the page 'req' on socket s, as sendfile asked.
+static int
+ring_sendpage(int s, void *req)
+{
+	struct sockring *sr;
+	struct Nssock *ring;
+	uint32_t kicks, end;
+	int i, off, len, r;
+
+	if (s < 0 || s >= MEMP_NUM_NETCONN || !rings[s].sr_ring)
+		return -E_INVAL;
+	sr = &rings[s];
+	ring = sr->sr_ring;
+	off = ring->ns_sp_off;
+	len = ring->ns_sp_len;
+	if (off < 0 || len <= 0 || off + len > PGSIZE)
+		return -E_INVAL;
+
+	// Keep the stream in order behind what the client wrote before,
+	// and wait for a free slot.
+	while (1) {
+		kicks = sr->sr_kicks;
+		for (i = 0; i < RING_SPAGES && sr->sr_spage_used[i]; i++)
+			;
+		if (!nsring_used(&ring->ns_tx) && i < RING_SPAGES)
+			break;
+		thread_wait(&sr->sr_kicks, kicks, (uint32_t)~0);
+	}
+
+	if ((r = sys_page_map(0, req, 0, SPAGEVA(s, i), PTE_P|PTE_U)) < 0)
+		return r;
+	if ((r = lwip_send_nocopy(s, SPAGEVA(s, i) + off, len, &end)) < 0) {
+		sys_page_unmap(0, SPAGEVA(s, i));
+		return r;
+	}
+	sr->sr_spage_used[i] = 1;
+	sr->sr_spage_end[i] = end;
+	sr->sr_nspages++;
+	return len;
+}
+
+// Unmap the sendfile pages whose data the peers have acknowledged.
+// Only called with no frames batched in jif, which might point into
+// them; the kernel pins pages the card is still sending.
+static void
+ring_reap(void)
+{
+	struct sockring *sr;
+	int s, i, n;
+
+	for (s = 0; s < MEMP_NUM_NETCONN; s++) {
+		sr = &rings[s];
+		if (!sr->sr_nspages)
+			continue;
+		n = sr->sr_nspages;
+		for (i = 0; i < RING_SPAGES; i++)
+			if (sr->sr_spage_used[i]
+			    && lwip_acked(s, sr->sr_spage_end[i])) {
+				sys_page_unmap(0, SPAGEVA(s, i));
+				sr->sr_spage_used[i] = 0;
+				sr->sr_nspages--;
+			}
+		if (sr->sr_nspages != n)
+			ring_wakeup(sr);
+	}
+}
+
+// A client has written to or read from socket s's ring, which we wait
+// on.  s is -1 for a kick that names no socket.
+static void
+ring_kick(int s)
+{
+	if (s >= 0 && s < MEMP_NUM_NETCONN && rings[s].sr_ring)
+		ring_wakeup(&rings[s]);
 }
 
 static void
@@ -157,6 +455,13 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 
 	lwip_core_unlock();
 
+#ifdef NS_BYPASS
+	// Drive our queue pair ourselves from here on.
+	if ((r = netbypass_attach(ns_queue)) < 0)
+		panic("netbypass_attach: %e", r);
+	cprintf("ns: driving queue pair %d from user level\n", ns_queue);
+#endif
+
 	cprintf("NS: TCP/IP initialized.\n");
 }
 
@@ -170,6 +475,13 @@ process_timer(envid_t envid) {
 	}
 
 	start = sys_time_msec();
+	// Read the card's counters before they can saturate.
+	if (start - hwstats_msec >= HWSTATS_INTERVAL) {
+		struct net_hwstats hw;
+
+		sys_net_stats(&hw);
+		hwstats_msec = start;
+	}
 	thread_yield();
 	now = sys_time_msec();
 
@@ -183,19 +495,219 @@ struct st_args {
 	union Nsipc *req;
 };
 
+/*
+ * Requests that may block in lwIP run on a pool of worker threads, so
+ * the server keeps taking requests meanwhile.  Workers live as long as
+ * the server and take requests from a FIFO; the pool starts with
+ * NS_WORKERS and grows, up to one per request buffer, whenever a
+ * request would otherwise have to wait for a busy worker.
+ */
+#define NS_WORKERS	4
+
+static struct st_args jobs[QUEUE_SIZE];	// Indexed like the buffers
+static int work_queue[QUEUE_SIZE];
+static uint32_t work_head, work_tail;
+static volatile uint32_t work_kicks;
+static int nworkers, nidle;
+
+static void serve_req(struct st_args *args);
+
+static void
+serve_worker(uint32_t unused) {
+	struct st_args *args;
+
+	while (1) {
+		while (work_head == work_tail) {
+			nidle++;
+			thread_wait(&work_kicks, work_kicks, (uint32_t)~0);
+			nidle--;
+		}
+		args = &jobs[work_queue[work_head++ % QUEUE_SIZE]];
+		serve_req(args);
+	}
+}
+
+static int
+worker_create(void)
+{
+	int r;
+
+	if ((r = thread_create(0, "serve_worker", serve_worker, 0)) < 0)
+		return r;
+	nworkers++;
+	return 0;
+}
+
+// Queue the request in buffer va for a worker.
 static void
-serve_thread(uint32_t a) {
-	struct st_args *args = (struct st_args *)a;
+dispatch(int32_t reqno, uint32_t whom, void *va)
+{
+	int i = ((uint32_t)va - REQVA) / PGSIZE;
+
+	jobs[i].reqno = reqno;
+	jobs[i].whom = whom;
+	jobs[i].req = va;
+	work_queue[work_tail++ % QUEUE_SIZE] = i;
+	if (work_tail - work_head > ns_queued_max)
+		ns_queued_max = work_tail - work_head;
+
+	// Every queued request owns a buffer, so QUEUE_SIZE workers can
+	// never all be busy with one still waiting.
+	if (work_tail - work_head > nidle && nworkers < QUEUE_SIZE
+	    && worker_create() < 0 && !nworkers)
+		panic("could not create a worker thread");
+	work_kicks++;
+	thread_wakeup(&work_kicks);
+}
+
+// Whether a request finishes without waiting on the network, so the
+// server thread can answer it without handing it to a worker.
+static bool
+serve_inline(int32_t reqno)
+{
+	switch (NSREQ_TYPE(reqno)) {
+	case NSREQ_BIND:
+	case NSREQ_LISTEN:
+	case NSREQ_SOCKET:
+	case NSREQ_RING:
+	case NSREQ_STATS:
+	case NSREQ_INPUT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * NSREQ_STATS
+ */
+
+static const char *const pool_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc) desc,
+#include <lwip/memp_std.h>
+};
+
+#if LWIP_STATS
+static void
+stats_proto(struct Nsstat_proto *ps, const struct stats_proto *p)
+{
+	ps->ps_xmit = p->xmit;
+	ps->ps_recv = p->recv;
+	ps->ps_drop = p->drop;
+	ps->ps_chkerr = p->chkerr;
+	ps->ps_lenerr = p->lenerr;
+	ps->ps_memerr = p->memerr;
+	ps->ps_rterr = p->rterr;
+	ps->ps_proterr = p->proterr;
+	ps->ps_err = p->err;
+}
+#endif
+
+static void
+stats_conn(struct Nsstat_conn *c, struct tcp_pcb *pcb)
+{
+	struct tcp_seg *seg;
+
+	c->nc_laddr = pcb->local_ip.addr;
+	c->nc_raddr = pcb->remote_ip.addr;
+	c->nc_lport = pcb->local_port;
+	c->nc_rport = pcb->remote_port;
+	c->nc_state = pcb->state;
+	c->nc_snd_queuelen = pcb->snd_queuelen;
+	c->nc_unacked = pcb->snd_max - pcb->lastack;
+	for (seg = pcb->ooseq; seg; seg = seg->next)
+		c->nc_ooseq++;
+	c->nc_snd_wnd = pcb->snd_wnd;
+	c->nc_rcv_wnd = pcb->rcv_wnd;
+	c->nc_cwnd = pcb->cwnd;
+	c->nc_ssthresh = pcb->ssthresh;
+	c->nc_srtt_ms = (pcb->sa >> 3) * TCP_SLOW_INTERVAL;
+	c->nc_rto_ms = pcb->rto * TCP_SLOW_INTERVAL;
+#if TCP_PCB_STATS
+	c->nc_segs_in = pcb->stats.segs_in;
+	c->nc_segs_out = pcb->stats.segs_out;
+	c->nc_bytes_in = pcb->stats.bytes_in;
+	c->nc_bytes_acked = pcb->stats.bytes_acked;
+	c->nc_rexmit = pcb->stats.rexmit;
+	c->nc_rto = pcb->stats.rto;
+	c->nc_fast_rexmit = pcb->stats.fast_rexmit;
+	c->nc_dupacks = pcb->stats.dupacks;
+	c->nc_ooseq_in = pcb->stats.ooseq;
+#endif
+}
+
+// Fill in req's reply; returns the number of connections listed.
+static int
+stats_fill(union Nsipc *req)
+{
+	struct Nsret_stats *ret = &req->statsRet;
+	struct tcp_pcb *lists[2] = { tcp_active_pcbs, tcp_tw_pcbs };
+	struct tcp_pcb_listen *lpcb;
+	struct tcp_pcb *pcb;
+	struct Nsstat_conn *c;
+	int skip = req->stats.req_skip, i, n;
+
+	memset(ret, 0, PGSIZE);
+	ret->ret_requests = ns_requests;
+	ret->ret_shed = ns_shed;
+	ret->ret_queued = work_tail - work_head;
+	ret->ret_queued_max = ns_queued_max;
+	ret->ret_workers = nworkers;
+	sys_net_stats(&ret->ret_hw);
+
+#if LWIP_STATS
+	stats_proto(&ret->ret_proto[0], &lwip_stats.link);
+	stats_proto(&ret->ret_proto[1], &lwip_stats.etharp);
+	stats_proto(&ret->ret_proto[2], &lwip_stats.ip);
+	stats_proto(&ret->ret_proto[3], &lwip_stats.icmp);
+	stats_proto(&ret->ret_proto[4], &lwip_stats.udp);
+	stats_proto(&ret->ret_proto[5], &lwip_stats.tcp);
+	ret->ret_heap_used = lwip_stats.mem.used;
+	ret->ret_heap_max = lwip_stats.mem.max;
+	ret->ret_heap_err = lwip_stats.mem.err;
+	for (i = 0; i < MEMP_MAX && i < NSSTAT_POOLS; i++) {
+		strncpy(ret->ret_pool[i].np_name, pool_names[i],
+			sizeof(ret->ret_pool[i].np_name) - 1);
+		ret->ret_pool[i].np_avail = lwip_stats.memp[i].avail;
+		ret->ret_pool[i].np_used = lwip_stats.memp[i].used;
+		ret->ret_pool[i].np_max = lwip_stats.memp[i].max;
+		ret->ret_pool[i].np_err = lwip_stats.memp[i].err;
+	}
+	ret->ret_npools = i;
+#endif
+
+	// Listeners, then connections, then those in TIME-WAIT.
+	n = 0;
+	for (lpcb = tcp_listen_pcbs.listen_pcbs; lpcb; lpcb = lpcb->next, n++)
+		if (n >= skip && n - skip < NSSTAT_MAXCONN) {
+			c = &ret->ret_conn[n - skip];
+			c->nc_laddr = lpcb->local_ip.addr;
+			c->nc_lport = lpcb->local_port;
+			c->nc_state = LISTEN;
+		}
+	for (i = 0; i < 2; i++)
+		for (pcb = lists[i]; pcb; pcb = pcb->next, n++)
+			if (n >= skip && n - skip < NSSTAT_MAXCONN)
+				stats_conn(&ret->ret_conn[n - skip], pcb);
+	ret->ret_nconn = n;
+	ret->ret_nfilled = MAX(0, MIN(n - skip, (int) NSSTAT_MAXCONN));
+	return ret->ret_nfilled;
+}
+
+static void
+serve_req(struct st_args *args) {
 	union Nsipc *req = args->req;
+	struct jif_pkt *pkt;
 	int r;
 
-	switch (args->reqno) {
+	switch (NSREQ_TYPE(args->reqno)) {
 	case NSREQ_ACCEPT:
 	{
 		struct Nsret_accept ret;
 		ret.ret_addrlen = req->accept.req_addrlen;
 		r = lwip_accept(req->accept.req_s, &ret.ret_addr,
 				&ret.ret_addrlen);
+		ring_listen_update(req->accept.req_s);
 		memmove(req, &ret, sizeof ret);
 		break;
 	}
@@ -204,9 +716,12 @@ serve_thread(uint32_t a) {
 			      req->bind.req_namelen);
 		break;
 	case NSREQ_SHUTDOWN:
+		// lwip_shutdown closes the socket.
+		ring_close(req->shutdown.req_s);
 		r = lwip_shutdown(req->shutdown.req_s, req->shutdown.req_how);
 		break;
 	case NSREQ_CLOSE:
+		ring_close(req->close.req_s);
 		r = lwip_close(req->close.req_s);
 		break;
 	case NSREQ_CONNECT:
@@ -230,8 +745,18 @@ serve_thread(uint32_t a) {
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
+	case NSREQ_RING:
+		r = ring_setup((struct Nssock *) req);
+		break;
+	case NSREQ_SENDPAGE:
+		r = ring_sendpage(args->reqno >> 8, req);
+		break;
+	case NSREQ_STATS:
+		r = stats_fill(req);
+		break;
 	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
+		for (pkt = &req->pkt; pkt; pkt = jif_pkt_next(req, pkt))
+			jif_input(&nif, pkt);
 		r = 0;
 		break;
 	default:
@@ -249,11 +774,26 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
 	sys_page_unmap(0, (void*) args->req);
-	free(args);
+	put_buffer(args->req);
 }
 
+#ifdef NS_BYPASS
+// Hand lwIP what the card has received on the queue pair we drive,
+// up to a ringful at a time.
+static void
+bypass_input(void)
+{
+	struct jif_pkt *pkt;
+	int n;
+
+	for (n = 0; n < NET_BYPASS_RXDESC && (pkt = netbypass_recv()); n++) {
+		jif_input(&nif, pkt);
+		netbypass_recv_done();
+	}
+}
+#endif
+
 void
 serve(void) {
 	int32_t reqno;
@@ -261,16 +801,33 @@ serve(void) {
 	int i, perm;
 	void *va;
 
+	buffer_init();
+	for (i = 0; i < NS_WORKERS; i++)
+		if (worker_create() < 0)
+			panic("could not create a worker thread");
+
 	while (1) {
 		// ipc_recv will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
+#ifdef NS_BYPASS
+		bypass_input();
+#endif
+		// Hand sockets' new input to their rings.
+		ring_poll();
+		// Send whatever output that work queued up.
+		jif_flush();
+		ring_reap();
+
+		// With every buffer taken, let the workers finish some.
+		for (i = 0; !(va = get_buffer()) && i < 32; ++i)
+			thread_yield();
 
 		perm = 0;
-		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		// Without a buffer, take the request but not its page.
+		reqno = ipc_recv((int32_t *) &whom, va, &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -278,28 +835,45 @@ serve(void) {
 		// first take care of requests that do not contain an argument page
 		if (reqno == NSREQ_TIMER) {
 			process_timer(whom);
-			put_buffer(va);
+			if (va)
+				put_buffer(va);
+			continue;
+		}
+		if (NSREQ_TYPE(reqno) == NSREQ_KICK) {
+			ring_kick((reqno >> 8) - 1);
+			if (va)
+				put_buffer(va);
+			continue;
+		}
+		ns_requests++;
+
+		// Still out of buffers: shed the load instead of queueing
+		// it.  Packets are dropped, as a full NIC would, and
+		// clients see an error.
+		if (!va) {
+			ns_shed++;
+			if (NSREQ_TYPE(reqno) != NSREQ_INPUT)
+				ipc_send(whom, -E_NO_MEM, 0, 0);
 			continue;
 		}
 
 		// All remaining requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
+			put_buffer(va);
 			continue; // just leave it hanging...
 		}
 
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
+		if (serve_inline(reqno)) {
+			struct st_args args = { reqno, whom, va };
+			serve_req(&args);
+			continue;
+		}
 
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		// Since some lwIP socket calls will block, hand the rest of
+		// the request to a worker thread.
+		dispatch(reqno, whom, va);
+		thread_yield(); // let the worker run
 	}
 }
 
@@ -315,9 +889,20 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int r;
 
 	binaryname = "ns";
 
+	// The kernel starts an instance of the server per queue pair of
+	// the card, each with a whole lwIP stack of its own (its globals
+	// are per environment) on its own CPU.  The card steers each TCP
+	// connection to one pair, and the instance driving that pair owns
+	// it; pair 0's instance also gets everything that isn't TCP.  See
+	// lib/nsipc.c for which instance a client's sockets go to.
+	ns_queue = thisenv->env_net_queue;
+	if ((r = sys_net_set_queue(ns_queue)) < 0)
+		panic("no network card: %e", r);
+
 	// fork off the timer thread which will send us periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
@@ -327,13 +912,19 @@ umain(int argc, char **argv)
 		return;
 	}
 
-	// fork off the input thread which will poll the NIC driver for input
-	// packets
+	// fork off the input thread which will poll the NIC driver for
+	// input packets on our queue pair
 	input_envid = fork();
 	if (input_envid < 0)
 		panic("error forking");
 	else if (input_envid == 0) {
-		input(ns_envid);
+#ifdef NS_BYPASS
+		// We poll the queue pair ourselves; the helper only
+		// wakes us.
+		input_wake(ns_envid, ns_queue);
+#else
+		input(ns_envid, ns_queue);
+#endif
 		return;
 	}
 
@@ -343,10 +934,20 @@ umain(int argc, char **argv)
 	if (output_envid < 0)
 		panic("error forking");
 	else if (output_envid == 0) {
-		output(ns_envid);
+		output(ns_envid, ns_queue);
 		return;
 	}
 
+	// Give the server and its input pump a CPU each, away from CPU 0
+	// where user environments start out, so each keeps its caches warm
+	// and the input poller doesn't compete with the server.  The
+	// instances take consecutive pairs of CPUs; whatever doesn't fit on
+	// a smaller machine is left unpinned.  The output helper, which only
+	// carries lwIP's rare copied frames, stays with the server.
+	sys_env_set_affinity(ns_envid, 1 << (1 + 2 * ns_queue));
+	sys_env_set_affinity(output_envid, 1 << (1 + 2 * ns_queue));
+	sys_env_set_affinity(input_envid, 1 << (2 + 2 * ns_queue));
+
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
 	thread_init();
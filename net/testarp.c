@@ -0,0 +1,235 @@
+// Check the ARP cache through etharp's entry points, on a netif whose
+// link output only records what would have gone out: replies fill the
+// table, lookups find them, a full table gives up its oldest stable
+// entry, and packets waiting on one address share an ARP request per
+// etharp_tmr period.
+
+#include <lwip/init.h>
+#include <lwip/inet.h>
+#include <lwip/netif.h>
+#include <netif/etharp.h>
+
+#include "ns.h"
+#include "nettest.h"
+
+static struct netif nif;
+
+// What the link output saw.
+static int nrequests;		// ARP requests sent
+static struct ip_addr asked;	// ... and the address the last one asked for
+static int nsent;		// IP packets sent
+static struct eth_addr sent_to;	// ... and where the last one went
+static err_t link_err;		// What the link output returns
+
+static err_t
+link_output(struct netif *netif, struct pbuf *p)
+{
+	struct etharp_hdr *arp = p->payload;
+	struct eth_hdr *eth = p->payload;
+
+	if (link_err != ERR_OK)
+		return link_err;
+	if (eth->type == htons(ETHTYPE_ARP)) {
+		if (arp->opcode == htons(ARP_REQUEST)) {
+			nrequests++;
+			memcpy(&asked, &arp->dipaddr, sizeof(asked));
+		}
+	} else {
+		nsent++;
+		sent_to = eth->dest;
+	}
+	return ERR_OK;
+}
+
+static err_t
+link_init(struct netif *netif)
+{
+	netif->hwaddr_len = ETHARP_HWADDR_LEN;
+	netif->mtu = 1500;
+	netif->flags = NETIF_FLAG_BROADCAST;
+	memset(netif->hwaddr, 0x52, ETHARP_HWADDR_LEN);
+	netif->linkoutput = link_output;
+	netif->output = etharp_output;
+	return ERR_OK;
+}
+
+// Host i of the test's /16, and the Ethernet address it answers with.
+static struct ip_addr
+host(int i)
+{
+	struct ip_addr a;
+
+	IP4_ADDR(&a, 10, 0, 3 + i / 200, 1 + i % 200);
+	return a;
+}
+
+static struct eth_addr
+host_mac(int i)
+{
+	struct eth_addr m = {{ 0x02, 0, 0, 0, i >> 8, i }};
+
+	return m;
+}
+
+// Host i answers an ARP request of ours.
+static void
+reply(int i)
+{
+	struct pbuf *p;
+	struct etharp_hdr *hdr;
+	struct ip_addr sip = host(i);
+
+	if (!(p = pbuf_alloc(PBUF_RAW, sizeof(*hdr), PBUF_RAM)))
+		panic("pbuf_alloc failed");
+	hdr = p->payload;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->ethhdr.dest = *(struct eth_addr *) nif.hwaddr;
+	hdr->ethhdr.src = host_mac(i);
+	hdr->ethhdr.type = htons(ETHTYPE_ARP);
+	hdr->hwtype = htons(1);
+	hdr->proto = htons(ETHTYPE_IP);
+	hdr->_hwlen_protolen = htons((ETHARP_HWADDR_LEN << 8)
+				     | sizeof(struct ip_addr));
+	hdr->opcode = htons(ARP_REPLY);
+	hdr->shwaddr = host_mac(i);
+	memcpy(&hdr->sipaddr, &sip, sizeof(sip));
+	hdr->dhwaddr = *(struct eth_addr *) nif.hwaddr;
+	memcpy(&hdr->dipaddr, &nif.ip_addr, sizeof(nif.ip_addr));
+	etharp_arp_input(&nif, (struct eth_addr *) nif.hwaddr, p);
+}
+
+// The table index of host i, or -1 if it isn't there, checking the
+// Ethernet address it maps to.
+static int
+lookup(int i)
+{
+	struct ip_addr a = host(i);
+	struct eth_addr *eth, want = host_mac(i);
+	struct ip_addr *ip;
+	s16_t k;
+
+	if ((k = etharp_find_addr(&nif, &a, &eth, &ip)) < 0)
+		return -1;
+	if (!ip_addr_cmp(ip, &a) || !eth_addr_cmp(eth, &want))
+		panic("entry %d for host %d has the wrong addresses", k, i);
+	return k;
+}
+
+// Send an IP packet to host i, as etharp_output would.
+static err_t
+send_to(int i)
+{
+	struct ip_addr a = host(i);
+	struct pbuf *p;
+	err_t r;
+
+	if (!(p = pbuf_alloc(PBUF_RAW, sizeof(struct eth_hdr) + 20, PBUF_RAM)))
+		panic("pbuf_alloc failed");
+	r = etharp_query(&nif, &a, p);
+	pbuf_free(p);
+	return r;
+}
+
+static void
+check_insert(void)
+{
+	struct eth_addr want = host_mac(7);
+	int i, k;
+
+	for (i = 0; i < 10; i++)
+		reply(i);
+	for (i = 0; i < 10; i++)
+		if (lookup(i) < 0)
+			panic("host %d missing after its reply", i);
+	if (lookup(10) >= 0)
+		panic("host 10 found without a reply");
+
+	// Sending resolves through the table and leaves the hint behind.
+	k = lookup(7);
+	nsent = nrequests = 0;
+	if (send_to(7) != ERR_OK || nsent != 1 || nrequests != 0
+	    || !eth_addr_cmp(&sent_to, &want))
+		panic("packet to a known host not sent to it");
+	if (nif.arp_hint != k)
+		panic("arp_hint %d, want %d", nif.arp_hint, k);
+	if (send_to(7) != ERR_OK || nsent != 2 || nrequests != 0)
+		panic("packet to the hinted host not sent");
+	cprintf("testarp: insert and lookup ok\n");
+}
+
+static void
+check_evict(void)
+{
+	int i;
+
+	// Fill the table, with host 0 a timer tick older than the rest.
+	etharp_tmr();
+	for (i = 10; i < ARP_TABLE_SIZE; i++)
+		reply(i);
+	for (i = 1; i < 10; i++)
+		reply(i);
+	for (i = 0; i < ARP_TABLE_SIZE; i++)
+		if (lookup(i) < 0)
+			panic("host %d missing before the table filled", i);
+
+	// One more: host 0 makes way, and nobody else does.
+	reply(ARP_TABLE_SIZE);
+	if (lookup(0) >= 0)
+		panic("oldest entry kept in a full table");
+	for (i = 1; i <= ARP_TABLE_SIZE; i++)
+		if (lookup(i) < 0)
+			panic("host %d missing after the table filled", i);
+	cprintf("testarp: eviction ok\n");
+}
+
+static void
+check_throttle(void)
+{
+	struct ip_addr a = host(0);
+	int i;
+
+	// Host 0 was just evicted, so packets to it wait for a reply.
+	nsent = nrequests = 0;
+	for (i = 0; i < 5; i++)
+		if (send_to(0) != ERR_OK)
+			panic("packet to an unresolved host not queued");
+	if (nrequests != 1 || !ip_addr_cmp(&asked, &a) || nsent != 0)
+		panic("%d ARP requests for 5 queued packets, want 1", nrequests);
+
+	// A request that doesn't go out is tried again by the next packet.
+	etharp_tmr();
+	link_err = ERR_MEM;
+	send_to(0);
+	link_err = ERR_OK;
+	send_to(0);
+	send_to(0);
+	if (nrequests != 2)
+		panic("%d ARP requests after a failed one, want 2", nrequests);
+
+	// The reply sends everything that waited.
+	reply(0);
+	if (nsent != 8 || lookup(0) < 0)
+		panic("%d queued packets sent on the reply, want 8", nsent);
+	cprintf("testarp: request throttle ok\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct ip_addr ip, mask, gw;
+
+	binaryname = "testarp";
+
+	lwip_init();
+	ip.addr = inet_addr(IP);
+	mask.addr = inet_addr("255.255.0.0");
+	gw.addr = inet_addr("10.0.2.2");
+	if (!netif_add(&nif, &ip, &mask, &gw, NULL, link_init, ethernet_input))
+		panic("netif_add failed");
+	// Not netif_set_up: its gratuitous ARP would take a table entry.
+
+	check_insert();
+	check_evict();
+	check_throttle();
+	nettest_pass();
+}
@@ -0,0 +1,90 @@
+// Check the word-at-a-time checksums against a plain byte-pair sum, at
+// every alignment, then compare their throughput.
+
+#include "ns.h"
+#include "nettest.h"
+#include <lwip/def.h>
+
+#define BUFSZ		2048
+#define BENCH_LEN	1460	// One full TCP segment
+#define BENCH_ITERS	20000
+
+static uint8_t src[BUFSZ + 8], dst[BUFSZ + 8];
+
+// The reference sum, as lwIP's first algorithm computes it.
+static u16_t
+ref_chksum(void *dataptr, int len)
+{
+	uint8_t *p = dataptr;
+	uint32_t acc = 0;
+
+	for (; len > 1; len -= 2, p += 2)
+		acc += (p[0] << 8) | p[1];
+	if (len > 0)
+		acc += p[0] << 8;
+	acc = (acc >> 16) + (acc & 0xffff);
+	acc = (acc >> 16) + (acc & 0xffff);
+	return htons(acc);
+}
+
+static void
+check(void)
+{
+	int i, soff, doff, len;
+	u16_t want, got;
+
+	for (i = 0; i < (int) sizeof(src); i++)
+		src[i] = nettest_rand();
+	// Sums of all-ones data are where carries pile up.
+	memset(src + BUFSZ / 2, 0xff, BUFSZ / 4);
+
+	for (soff = 0; soff < 4; soff++)
+		for (doff = 0; doff < 4; doff++)
+			for (len = 0; len <= BUFSZ; len += (len < 80 ? 1 : 37)) {
+				want = ref_chksum(src + soff, len);
+				if ((got = jos_chksum(src + soff, len)) != want)
+					panic("jos_chksum(+%d, %d) = %04x, want %04x",
+					      soff, len, got, want);
+				memset(dst, 0, sizeof(dst));
+				got = jos_chksum_copy(dst + doff, src + soff, len);
+				if (got != want)
+					panic("jos_chksum_copy(+%d, +%d, %d) = %04x, want %04x",
+					      doff, soff, len, got, want);
+				if (memcmp(dst + doff, src + soff, len) != 0)
+					panic("jos_chksum_copy(+%d, +%d, %d): bad copy",
+					      doff, soff, len);
+			}
+	nettest_pass();
+}
+
+// Print the cycles one way of summing takes per full segment.
+static void
+bench(const char *name, int which)
+{
+	volatile u16_t sink = 0;
+	int i;
+
+	nettest_start();
+	for (i = 0; i < BENCH_ITERS; i++)
+		switch (which) {
+		case 0: sink += ref_chksum(src, BENCH_LEN); break;
+		case 1: sink += jos_chksum(src, BENCH_LEN); break;
+		case 2: sink += jos_chksum_copy(dst, src, BENCH_LEN); break;
+		case 3: memcpy(dst, src, BENCH_LEN);
+			sink += jos_chksum(dst, BENCH_LEN); break;
+		}
+	cprintf("testchksum: %s %u cycles/segment\n", name,
+		nettest_cycles(BENCH_ITERS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	binaryname = "testchksum";
+
+	check();
+	bench("byte pairs", 0);
+	bench("words", 1);
+	bench("copy+sum", 2);
+	bench("copy, then sum", 3);
+}
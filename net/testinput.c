@@ -76,7 +76,7 @@ umain(int argc, char **argv)
 	if (output_envid < 0)
 		panic("error forking");
 	else if (output_envid == 0) {
-		output(ns_envid);
+		output(ns_envid, 0);
 		return;
 	}
 
@@ -84,7 +84,7 @@ umain(int argc, char **argv)
 	if (input_envid < 0)
 		panic("error forking");
 	else if (input_envid == 0) {
-		input(ns_envid);
+		input(ns_envid, 0);
 		return;
 	}
 
@@ -94,6 +94,7 @@ umain(int argc, char **argv)
 	while (1) {
 		envid_t whom;
 		int perm;
+		struct jif_pkt *p;
 
 		int32_t req = ipc_recv((int32_t *)&whom, pkt, &perm);
 		if (req < 0)
@@ -103,8 +104,10 @@ umain(int argc, char **argv)
 		if (req != NSREQ_INPUT)
 			panic("Unexpected IPC %d", req);
 
-		hexdump("input: ", pkt->jp_data, pkt->jp_len);
-		cprintf("\n");
+		for (p = pkt; p; p = jif_pkt_next(pkt, p)) {
+			hexdump("input: ", p->jp_data, p->jp_len);
+			cprintf("\n");
+		}
 
 		// Only indicate that we're waiting for packets once
 		// we've received the ARP reply
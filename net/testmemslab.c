@@ -0,0 +1,98 @@
+// Check the slab mem_malloc under random allocations and frees, that it
+// gives its pages back once idle, and time it.
+
+#include <lwip/mem.h>
+#include <arch/mem_slab.h>
+
+#include "ns.h"
+#include "nettest.h"
+
+#define NOBJ		2000
+#define ROUNDS		50000
+
+static void *objs[NOBJ];
+static uint16_t lens[NOBJ];
+
+// Pages the slabs have mapped right now.
+static int
+slab_pages(void)
+{
+	uintptr_t va;
+	int n = 0;
+
+	for (va = SLAB_BASE; va < SLAB_BASE + SLAB_NPAGES * PGSIZE; va += PGSIZE)
+		if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+			n++;
+	return n;
+}
+
+static void
+check(void)
+{
+	uint32_t r;
+	uint8_t *p;
+	int i, j, k, busy;
+
+	for (k = 0; k < ROUNDS; k++) {
+		i = nettest_rand() % NOBJ;
+		if ((p = objs[i])) {
+			for (j = 0; j < lens[i]; j++)
+				if (p[j] != (uint8_t) i)
+					panic("object %d (%d bytes) overwritten", i, lens[i]);
+			mem_free(p);
+			objs[i] = NULL;
+		} else {
+			// Mostly small, the way pbufs and segments are.
+			r = nettest_rand();
+			lens[i] = 1 + (r >> 1) % ((r & 1) ? 3000 : 200);
+			if (!(objs[i] = mem_malloc(lens[i])))
+				panic("mem_malloc(%d) failed", lens[i]);
+			memset(objs[i], i, lens[i]);
+		}
+	}
+	busy = slab_pages();
+
+	for (i = 0; i < NOBJ; i++)
+		if (objs[i]) {
+			mem_free(objs[i]);
+			objs[i] = NULL;
+		}
+	// One spare slab per size class may stay.
+	if (slab_pages() > 8)
+		panic("%d slab pages still mapped when idle", slab_pages());
+	cprintf("testmemslab: %d pages busy, %d idle\n", busy, slab_pages());
+	nettest_pass();
+}
+
+// Cycles for a mem_malloc/mem_free pair of size bytes, with n objects
+// of that size live.
+static void
+bench(int size, int n)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++)
+		objs[i] = mem_malloc(size);
+	nettest_start();
+	for (k = 0; k < ROUNDS; k++) {
+		i = k % n;
+		mem_free(objs[i]);
+		objs[i] = mem_malloc(size);
+	}
+	cprintf("testmemslab: %d bytes, %d live: %u cycles\n",
+		size, n, nettest_cycles(ROUNDS));
+	for (i = 0; i < n; i++)
+		mem_free(objs[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	binaryname = "testmemslab";
+
+	mem_init();
+	check();
+	bench(64, 16);
+	bench(1500, 16);
+	bench(1500, NOBJ);
+}
@@ -0,0 +1,142 @@
+// Check tcp_input's PCB hash tables, then time lookups against the
+// list walk they replaced, with up to a few hundred connections.
+
+#include <lwip/tcp.h>
+
+#include "ns.h"
+#include "nettest.h"
+
+#define MAXCONN		512
+#define LOOKUPS		20000
+
+static struct tcp_pcb pcbs[MAXCONN];
+static struct tcp_pcb_listen lpcbs[2];
+static struct tcp_pcb *list;	// All of pcbs[0..n), as tcp_active_pcbs was
+
+static struct ip_addr local;
+
+// Connection i comes from one of a few hosts, from its own port.
+static void
+conn_init(struct tcp_pcb *pcb, int i)
+{
+	memset(pcb, 0, sizeof(*pcb));
+	pcb->state = ESTABLISHED;
+	pcb->local_ip = local;
+	pcb->local_port = 80;
+	IP4_ADDR(&pcb->remote_ip, 10, 0, 2, 2 + i % 7);
+	pcb->remote_port = 1024 + i * 3;
+}
+
+static struct tcp_pcb *
+list_lookup(struct ip_addr *src, u16_t src_port,
+	    struct ip_addr *dest, u16_t dest_port)
+{
+	struct tcp_pcb *pcb;
+
+	for (pcb = list; pcb != NULL; pcb = pcb->next)
+		if (pcb->remote_port == src_port
+		    && pcb->local_port == dest_port
+		    && ip_addr_cmp(&pcb->remote_ip, src)
+		    && ip_addr_cmp(&pcb->local_ip, dest))
+			return pcb;
+	return NULL;
+}
+
+static void
+check(void)
+{
+	struct ip_addr other;
+	int i;
+
+	for (i = 0; i < MAXCONN; i++) {
+		conn_init(&pcbs[i], i);
+		tcp_hash_insert(&pcbs[i]);
+	}
+	for (i = 0; i < MAXCONN; i++)
+		if (tcp_hash_lookup(&pcbs[i].remote_ip, pcbs[i].remote_port,
+				    &local, 80) != &pcbs[i])
+			panic("lookup of connection %d failed", i);
+
+	// TIME-WAIT PCBs share the table; removed ones must be gone.
+	pcbs[5].state = TIME_WAIT;
+	for (i = 0; i < MAXCONN; i += 2)
+		tcp_hash_remove(&pcbs[i]);
+	for (i = 0; i < MAXCONN; i++)
+		if (tcp_hash_lookup(&pcbs[i].remote_ip, pcbs[i].remote_port,
+				    &local, 80) != (i % 2 ? &pcbs[i] : NULL))
+			panic("lookup of connection %d after removal", i);
+	for (i = 1; i < MAXCONN; i += 2)
+		tcp_hash_remove(&pcbs[i]);
+
+	// Listeners: a specific address, and any address on another port.
+	IP4_ADDR(&other, 10, 0, 2, 99);
+	memset(lpcbs, 0, sizeof(lpcbs));
+	lpcbs[0].state = lpcbs[1].state = LISTEN;
+	lpcbs[0].local_port = 80;
+	lpcbs[0].local_ip = local;
+	lpcbs[1].local_port = 80 + TCP_HASH_SIZE;	// Same chain
+	tcp_hash_insert((struct tcp_pcb *) &lpcbs[0]);
+	tcp_hash_insert((struct tcp_pcb *) &lpcbs[1]);
+	if (tcp_hash_lookup_listen(&local, 80) != &lpcbs[0]
+	    || tcp_hash_lookup_listen(&other, 80) != NULL
+	    || tcp_hash_lookup_listen(&other, 80 + TCP_HASH_SIZE) != &lpcbs[1]
+	    || tcp_hash_lookup_listen(&local, 81) != NULL)
+		panic("listener lookup failed");
+	tcp_hash_remove((struct tcp_pcb *) &lpcbs[0]);
+	tcp_hash_remove((struct tcp_pcb *) &lpcbs[1]);
+	if (tcp_hash_lookup_listen(&local, 80) != NULL)
+		panic("listener still found after removal");
+
+	nettest_pass();
+}
+
+// Time LOOKUPS lookups among n connections, with and without the hash.
+static void
+bench(int n)
+{
+	struct tcp_pcb *(*fn[2])(struct ip_addr *, u16_t,
+				 struct ip_addr *, u16_t) =
+		{ list_lookup, tcp_hash_lookup };
+	unsigned int cycles[2];
+	int i, k;
+	struct tcp_pcb *pcb;
+
+	list = NULL;
+	for (i = 0; i < n; i++) {
+		conn_init(&pcbs[i], i);
+		pcbs[i].next = list;
+		list = &pcbs[i];
+		tcp_hash_insert(&pcbs[i]);
+	}
+
+	// Both ways look up the same connections, in the same order.
+	for (k = 0; k < 2; k++) {
+		nettest_srand(n);
+		nettest_start();
+		for (i = 0; i < LOOKUPS; i++) {
+			pcb = &pcbs[nettest_rand() % n];
+			if (fn[k](&pcb->remote_ip, pcb->remote_port,
+				  &local, 80) != pcb)
+				panic("bench lookup failed");
+		}
+		cycles[k] = nettest_cycles(LOOKUPS);
+	}
+	cprintf("testtcphash: %d connections: list %u cycles, hash %u cycles\n",
+		n, cycles[0], cycles[1]);
+
+	for (i = 0; i < n; i++)
+		tcp_hash_remove(&pcbs[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	binaryname = "testtcphash";
+
+	local.addr = inet_addr(IP);
+	check();
+	bench(16);
+	bench(64);
+	bench(256);
+	bench(MAXCONN);
+}
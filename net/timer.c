@@ -9,7 +9,7 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 
 	while (1) {
 		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
+			sys_sleep_until(stop);
 		}
 		if (r < 0)
 			panic("sys_time_msec: %e", r);
@@ -0,0 +1,24 @@
+// Flood the console past this environment's output budget, then wait
+// for the budget to come back and check the kernel said what it
+// dropped.
+
+#include <inc/lib.h>
+
+#define LINES	2000	// 100 bytes each: well over CONS_BURST
+
+void
+umain(int argc, char **argv)
+{
+	char line[101];
+	int i;
+
+	binaryname = "conslimit";
+	memset(line, '.', sizeof(line) - 2);
+	line[sizeof(line) - 2] = '\n';
+	line[sizeof(line) - 1] = 0;
+	for (i = 0; i < LINES; i++)
+		sys_cputs(line, sizeof(line) - 1);
+
+	sys_sleep_until(sys_time_msec() + 1000);
+	cprintf("conslimit: done\n");
+}
@@ -10,11 +10,13 @@
 
 #define BUFFSIZE 512
 #define MAXPENDING 5	// Max connection requests
+#define MAXCONN 16	// Max connections the event loop serves at once
 
 struct http_request {
 	int sock;
 	char *url;
 	char *version;
+	bool keepalive;	// Leave the connection open after the response
 };
 
 struct responce_header {
@@ -66,9 +68,8 @@ send_header(struct http_request *req, int code)
 		return -1;
 
 	int len = strlen(h->header);
-	if (write(req->sock, h->header, len) != len) {
-		die("Failed to send bytes to client");
-	}
+	if (write(req->sock, h->header, len) != len)
+		return -1;
 
 	return 0;
 }
@@ -78,22 +79,15 @@ send_data(struct http_request *req, int fd)
 {
 	// LAB 6: Your code here.
 	//panic("send_data not implemented");
-	char buf[1024];
 	struct Stat stat;
 	int r;
 
 	if ((r = fstat(fd, &stat)) < 0) {
 		die("send_data failed: fstat failed");
 	}
-	if (stat.st_size > 1024) {
-		die("send_data failed: size larger than 1024");
-	}
-	if ((r = readn(fd, buf, stat.st_size)) != stat.st_size) {
-		die("send_data failed: couldn't read entire data");
-	}
-	if ((r = write(req->sock, buf, stat.st_size)) != stat.st_size) {
-		die("send_data failed: couldn't write all data to sock");
-	}
+	// The file server's cache pages go straight to the network server.
+	if ((r = sendfile(req->sock, fd, 0, stat.st_size)) != stat.st_size)
+		return -1;
 	return 0;
 }
 
@@ -141,6 +135,19 @@ send_content_type(struct http_request *req)
 	return 0;
 }
 
+static int
+send_connection(struct http_request *req)
+{
+	const char *hdr = req->keepalive ? "Connection: keep-alive\r\n"
+					 : "Connection: close\r\n";
+	int len = strlen(hdr);
+
+	if (write(req->sock, hdr, len) != len)
+		return -1;
+
+	return 0;
+}
+
 static int
 send_header_fin(struct http_request *req)
 {
@@ -192,6 +199,18 @@ http_request_parse(struct http_request *req, char *request)
 	memmove(req->version, version, version_len);
 	req->version[version_len] = '\0';
 
+	// HTTP/1.1 keeps the connection by default, 1.0 only if asked.
+	req->keepalive = strncmp(version, "HTTP/1.1", 8) == 0;
+	while (*request) {
+		request++;
+		if (strncmp(request, "Connection: close", 17) == 0)
+			req->keepalive = 0;
+		else if (strncmp(request, "Connection: keep-alive", 22) == 0)
+			req->keepalive = 1;
+		while (*request && *request != '\n')
+			request++;
+	}
+
 	// no entity parsing
 
 	return 0;
@@ -213,9 +232,10 @@ send_error(struct http_request *req, int code)
 	if (e->code == 0)
 		return -1;
 
+	req->keepalive = 0;
 	r = snprintf(buf, 512, "HTTP/" HTTP_VERSION" %d %s\r\n"
 			       "Server: jhttpd/" VERSION "\r\n"
-			       "Connection: close"
+			       "Connection: close\r\n"
 			       "Content-type: text/html\r\n"
 			       "\r\n"
 			       "<html><body><p>%d - %s</p></body></html>\r\n",
@@ -243,7 +263,11 @@ send_file(struct http_request *req)
 	//panic("send_file not implemented");
 	char path[MAXPATHLEN];                                                 
 	struct Stat stat;
-	memmove(path, req->url, strlen(req->url));  
+	if (strlen(req->url) >= MAXPATHLEN) {
+		send_error(req, 404);
+		return -1;
+	}
+	memmove(path, req->url, strlen(req->url) + 1);
 
 	if ((fd = open(path, O_RDONLY)) < 0) {
 		send_error(req, 404);  // HTTP page not found
@@ -272,6 +296,9 @@ send_file(struct http_request *req)
 	if ((r = send_content_type(req)) < 0)
 		goto end;
 
+	if ((r = send_connection(req)) < 0)
+		goto end;
+
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
@@ -302,6 +329,7 @@ handle_client(int sock)
 		req->sock = sock;
 
 		r = http_request_parse(req, buffer);
+		req->keepalive = 0;
 		if (r == -E_BAD_REQ)
 			send_error(req, 400);
 		else if (r < 0)
@@ -318,14 +346,143 @@ handle_client(int sock)
 	close(sock);
 }
 
+// The event loop's connections, each with the request read so far.
+struct conn {
+	int sock;	// -1 if the slot is free
+	int len;
+	char buf[BUFFSIZE];
+};
+
+static struct conn conns[MAXCONN];
+
+static void
+conn_close(struct conn *c)
+{
+	close(c->sock);
+	c->sock = -1;
+}
+
+// Answer each complete request in c's buffer.
+// Returns 0 to keep the connection, < 0 to close it.
+static int
+conn_serve(struct conn *c)
+{
+	struct http_request con_d, *req = &con_d;
+	char *end;
+	int r, n;
+
+	while (1) {
+		c->buf[c->len] = '\0';
+		for (end = c->buf; *end && strncmp(end, "\r\n\r\n", 4); end++)
+			;
+		if (!*end)
+			// Wait for the rest, unless it can never fit.
+			return c->len < BUFFSIZE - 1 ? 0 : -1;
+		*end = '\0';
+		n = end + 4 - c->buf;
+
+		memset(req, 0, sizeof(*req));
+		req->sock = c->sock;
+		r = http_request_parse(req, c->buf);
+		if (r == -E_BAD_REQ)
+			r = send_error(req, 400);
+		else if (r == 0)
+			r = send_file(req);
+		if (r < 0)
+			req->keepalive = 0;
+		req_free(req);
+		if (!req->keepalive)
+			return -1;
+
+		// Keep any pipelined request that followed.
+		memmove(c->buf, c->buf + n, c->len - n);
+		c->len -= n;
+	}
+}
+
+// Serve all connections from one environment, waiting in poll.
+static void
+serve_events(int serversock)
+{
+	struct pollfd fds[MAXCONN + 1];
+	struct conn *slot[MAXCONN + 1];
+	struct conn *c;
+	struct sockaddr_in client;
+	unsigned int clientlen;
+	int i, n, nfds, nconn, sock, r;
+
+	for (i = 0; i < MAXCONN; i++)
+		conns[i].sock = -1;
+
+	while (1) {
+		// Stop accepting while every slot is taken.
+		nfds = nconn = 0;
+		for (i = 0; i < MAXCONN; i++)
+			if (conns[i].sock >= 0) {
+				slot[nfds] = &conns[i];
+				fds[nfds].fd = conns[i].sock;
+				fds[nfds++].events = POLLIN;
+				nconn++;
+			}
+		if (nconn < MAXCONN) {
+			slot[nfds] = 0;
+			fds[nfds].fd = serversock;
+			fds[nfds++].events = POLLIN;
+		}
+
+		if ((r = poll(fds, nfds, -1)) < 0)
+			die("Failed to poll");
+
+		for (i = 0; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			if (!(c = slot[i])) {
+				clientlen = sizeof(client);
+				if ((sock = accept(serversock,
+						   (struct sockaddr *) &client,
+						   &clientlen)) < 0)
+					die("Failed to accept client connection");
+				for (n = 0; conns[n].sock >= 0; n++)
+					;
+				conns[n].sock = sock;
+				conns[n].len = 0;
+				continue;
+			}
+			n = read(c->sock, c->buf + c->len,
+				 BUFFSIZE - 1 - c->len);
+			if (n <= 0) {
+				conn_close(c);
+				continue;
+			}
+			c->len += n;
+			if (conn_serve(c) < 0)
+				conn_close(c);
+		}
+	}
+}
+
 void
 umain(int argc, char **argv)
 {
 	int serversock, clientsock;
 	struct sockaddr_in server, client;
+	struct Argstate args;
+	bool sequential = 0;
+	int i;
 
 	binaryname = "jhttpd";
 
+	// -s serves one connection at a time, without poll.
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 's':
+			sequential = 1;
+			break;
+		default:
+			die("usage: httpd [-s]");
+		}
+
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 		die("Failed to create socket");
@@ -349,6 +506,9 @@ umain(int argc, char **argv)
 
 	cprintf("Waiting for http connections...\n");
 
+	if (!sequential)
+		serve_events(serversock);
+
 	while (1) {
 		unsigned int clientlen = sizeof(client);
 		// Wait for client connection
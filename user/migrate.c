@@ -0,0 +1,71 @@
+// Measure how often environments migrate between CPUs.
+//
+// Forks NWORKER CPU-bound workers that yield often, first placed by
+// the scheduler alone (soft affinity: prefer the last CPU), then pinned
+// one per CPU with sys_env_set_affinity, and reports how many of their
+// runs started on a different CPU than the previous one.
+// Run with CPUS=4.
+
+#include <inc/lib.h>
+
+#define NWORKER		4
+#define NROUND		200
+
+static void
+worker(envid_t parent, uint32_t cpumask)
+{
+	uint32_t runs, migrations;
+	volatile int x;
+	int i, j;
+
+	sys_env_set_affinity(0, cpumask);
+	sys_yield();
+	runs = thisenv->env_runs;
+	migrations = thisenv->env_migrations;
+	for (i = 0; i < NROUND; i++) {
+		for (j = 0; j < 20000; j++)
+			x++;
+		sys_yield();
+	}
+	// Report both counts in one message, since the workers' messages
+	// may interleave.
+	runs = thisenv->env_runs - runs;
+	migrations = thisenv->env_migrations - migrations;
+	ipc_send(parent, (runs << 16) | migrations, 0, 0);
+}
+
+static void
+run(const char *name, int ncpu, bool pinned)
+{
+	envid_t parent = thisenv->env_id, who;
+	uint32_t runs = 0, migrations = 0, v;
+	unsigned int start;
+	int i, r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NWORKER; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			worker(parent, pinned ? 1 << (i % ncpu) : ~0);
+			exit();
+		}
+	}
+	for (i = 0; i < NWORKER; i++) {
+		v = ipc_recv(&who, 0, 0);
+		runs += v >> 16;
+		migrations += v & 0xFFFF;
+	}
+	cprintf("migrate: %s: %d migrations in %d runs (%d msec)\n",
+		name, migrations, runs, sys_time_msec() - start);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int ncpu = sys_ncpu();
+
+	cprintf("migrate: %d workers on %d CPUs\n", NWORKER, ncpu);
+	run("soft affinity", ncpu, 0);
+	run("pinned", ncpu, 1);
+}
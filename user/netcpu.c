@@ -0,0 +1,59 @@
+// Measure how much CPU the network server and its helpers use, first
+// on an idle link and then while the grading script floods us with UDP
+// packets.  The input helper sleeps in sys_net_wait_recv, so an idle
+// network should cost next to nothing.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Total CPU time of the network server and its children, in TSC cycles.
+static uint64_t
+ns_cputime(envid_t ns)
+{
+	uint64_t t = 0;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE
+		    && (envs[i].env_id == ns || envs[i].env_parent_id == ns))
+			t += envs[i].env_cputime;
+	return t;
+}
+
+// Percentage of one CPU the network server used over the next msec.
+static unsigned int
+ns_usage(envid_t ns, unsigned int msec)
+{
+	uint64_t cpu0, tsc0, cpu1, tsc1;
+
+	cpu0 = ns_cputime(ns);
+	tsc0 = read_tsc();
+	sys_sleep_until(sys_time_msec() + msec);
+	cpu1 = ns_cputime(ns);
+	tsc1 = read_tsc();
+	return (unsigned int) ((cpu1 - cpu0) * 100 / (tsc1 - tsc0));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ns;
+	unsigned int idle, load;
+
+	binaryname = "netcpu";
+	if ((ns = ipc_find_env(ENV_TYPE_NS)) == 0)
+		panic("no network server");
+
+	// Let the server finish starting up.
+	sys_sleep_until(sys_time_msec() + 500);
+
+	idle = ns_usage(ns, 1000);
+	cprintf("netcpu: idle %u%%\n", idle);
+	if (idle >= 5)
+		panic("network server busy on an idle link");
+	cprintf("netcpu: idle ok\n");
+
+	cprintf("netcpu: start load\n");
+	load = ns_usage(ns, 1000);
+	cprintf("netcpu: load %u%%\n", load);
+}
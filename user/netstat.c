@@ -0,0 +1,105 @@
+// Print the network server's counters: the card's, lwIP's protocols
+// and pools, and each TCP connection's.
+
+#include <inc/lib.h>
+#include <lwip/inet.h>
+
+static union Nsipc stats __attribute__((aligned(PGSIZE)));
+
+static const char *const proto_names[NSSTAT_PROTOS] = {
+	"link", "arp", "ip", "icmp", "udp", "tcp"
+};
+
+// lwIP's enum tcp_state
+static const char *const state_names[] = {
+	"CLOSED", "LISTEN", "SYN_SENT", "SYN_RCVD", "ESTABLISHED",
+	"FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK",
+	"TIME_WAIT"
+};
+#define NSTATES	(sizeof(state_names) / sizeof(state_names[0]))
+
+static void
+print_addr(uint32_t addr, uint16_t port)
+{
+	struct in_addr in;
+	char buf[24];
+
+	in.s_addr = addr;
+	snprintf(buf, sizeof(buf), "%s:%d", inet_ntoa(in), port);
+	cprintf("%-21s ", buf);
+}
+
+static void
+print_conn(struct Nsstat_conn *c)
+{
+	print_addr(c->nc_laddr, c->nc_lport);
+	print_addr(c->nc_raddr, c->nc_rport);
+	cprintf("%s\n", c->nc_state < NSTATES ? state_names[c->nc_state] : "?");
+	if (c->nc_state <= 1)
+		return;
+	cprintf("    queued %u unacked %u ooseq %u wnd %u/%u cwnd %u "
+		"ssthresh %u srtt %ums rto %ums\n",
+		c->nc_snd_queuelen, c->nc_unacked, c->nc_ooseq,
+		c->nc_snd_wnd, c->nc_rcv_wnd, c->nc_cwnd, c->nc_ssthresh,
+		c->nc_srtt_ms, c->nc_rto_ms);
+	cprintf("    segs %u/%u bytes %u/%u rexmit %u rto %u fast %u "
+		"dupack %u ooseq %u\n",
+		c->nc_segs_in, c->nc_segs_out, c->nc_bytes_in,
+		c->nc_bytes_acked, c->nc_rexmit, c->nc_rto,
+		c->nc_fast_rexmit, c->nc_dupacks, c->nc_ooseq_in);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Nsret_stats *st = &stats.statsRet;
+	struct net_hwstats *hw = &st->ret_hw;
+	struct Nsstat_proto *ps;
+	int r, i, skip;
+
+	binaryname = "netstat";
+	if ((r = nsipc_stats(0, &stats)) < 0)
+		panic("nsipc_stats: %e", r);
+
+	cprintf("nic: rx %llu packets %llu octets, tx %llu packets %llu octets\n",
+		hw->hw_rx_packets, hw->hw_rx_octets,
+		hw->hw_tx_packets, hw->hw_tx_octets);
+	cprintf("nic: missed %llu nobuf %llu crcerr %llu errors %llu\n",
+		hw->hw_rx_missed, hw->hw_rx_nobuf, hw->hw_rx_crcerr,
+		hw->hw_rx_errors);
+	cprintf("ns: %u requests, %u shed, %u queued (max %u), %u workers\n",
+		st->ret_requests, st->ret_shed, st->ret_queued,
+		st->ret_queued_max, st->ret_workers);
+
+	cprintf("\n%-6s %10s %10s %8s %8s %8s %8s %8s\n", "proto", "xmit",
+		"recv", "drop", "chkerr", "lenerr", "memerr", "err");
+	for (i = 0; i < NSSTAT_PROTOS; i++) {
+		ps = &st->ret_proto[i];
+		cprintf("%-6s %10u %10u %8u %8u %8u %8u %8u\n", proto_names[i],
+			ps->ps_xmit, ps->ps_recv, ps->ps_drop, ps->ps_chkerr,
+			ps->ps_lenerr, ps->ps_memerr,
+			ps->ps_rterr + ps->ps_proterr + ps->ps_err);
+	}
+	cprintf("heap: used %u max %u err %u\n",
+		st->ret_heap_used, st->ret_heap_max, st->ret_heap_err);
+
+	cprintf("\n%-16s %8s %8s %8s %8s\n", "pool", "avail", "used",
+		"max", "err");
+	for (i = 0; i < st->ret_npools; i++)
+		cprintf("%-16s %8u %8u %8u %8u\n", st->ret_pool[i].np_name,
+			st->ret_pool[i].np_avail, st->ret_pool[i].np_used,
+			st->ret_pool[i].np_max, st->ret_pool[i].np_err);
+
+	// Connections come a page at a time.
+	cprintf("\n%-21s %-21s %s\n", "local", "remote", "state");
+	for (skip = 0; ; ) {
+		for (i = 0; i < st->ret_nfilled; i++)
+			print_conn(&st->ret_conn[i]);
+		skip += st->ret_nfilled;
+		if (st->ret_nfilled == 0 || skip >= st->ret_nconn)
+			break;
+		if ((r = nsipc_stats(skip, &stats)) < 0)
+			panic("nsipc_stats: %e", r);
+	}
+	cprintf("netstat: %d connections\n", skip);
+}
@@ -0,0 +1,78 @@
+// Check that the scheduler shares the CPU fairly.  Three CPU-bound
+// children, two at nice 0 and one at nice 5, should get CPU time in
+// proportion to their weights (1024 : 1024 : 335).  While they spin,
+// file system requests should still be served promptly, since the file
+// system server runs in the real-time class.  Only real-time callers
+// may hand out negative nice values.
+// Run this with one CPU.
+
+#include <inc/lib.h>
+
+#define NSPIN	3
+
+static int nice[NSPIN] = { 0, 0, 5 };
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NSPIN];
+	uint64_t used[NSPIN], total;
+	unsigned int start, elapsed;
+	struct Stat st;
+	int i, r;
+
+	for (i = 0; i < NSPIN; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			while (1)
+				asm volatile("pause");
+		sys_env_set_priority(r, SCHED_FAIR, nice[i]);
+		kids[i] = r;
+	}
+
+	if (sys_env_set_priority(0, SCHED_FAIR, ENV_NICE_MIN) != -E_INVAL
+	    || sys_env_set_priority(kids[0], SCHED_FAIR, -1) != -E_INVAL)
+		panic("negative nice value granted to a fair-share caller");
+	if (sys_env_set_priority(kids[2], SCHED_FAIR, nice[2]) < 0)
+		panic("could not keep a nice value");
+	cprintf("schedclass: nice limits OK\n");
+
+	// Measure each child's CPU time over one second.
+	for (i = 0; i < NSPIN; i++)
+		used[i] = envs[ENVX(kids[i])].env_cputime;
+	sys_sleep_until(sys_time_msec() + 1000);
+	total = 0;
+	for (i = 0; i < NSPIN; i++) {
+		used[i] = envs[ENVX(kids[i])].env_cputime - used[i];
+		total += used[i];
+	}
+	if (total == 0)
+		panic("no CPU time accounted");
+	cprintf("schedclass: nice %d, %d, %d got %d%%, %d%%, %d%% of the CPU\n",
+		nice[0], nice[1], nice[2], (int) (used[0] * 100 / total),
+		(int) (used[1] * 100 / total), (int) (used[2] * 100 / total));
+	// Equal nice values get equal shares; nice 5 gets about a third
+	// of what nice 0 gets.
+	if (used[0] * 4 < used[1] * 3 || used[1] * 4 < used[0] * 3)
+		panic("nice 0 children got unequal shares");
+	if ((used[0] + used[1]) < used[2] * 4
+	    || (used[0] + used[1]) > used[2] * 9)
+		panic("nice 5 child got the wrong share");
+	cprintf("schedclass: shares OK\n");
+
+	// Time file system requests against the spinning children.  If
+	// the server waited its turn behind them, each request would take
+	// several time slices.
+	start = sys_time_msec();
+	for (i = 0; i < 20; i++)
+		if ((r = stat("/newmotd", &st)) < 0)
+			panic("stat /newmotd: %e", r);
+	elapsed = sys_time_msec() - start;
+	if (elapsed > 200)
+		panic("20 file system requests took %u msec", elapsed);
+	cprintf("schedclass: fs latency OK\n");
+
+	for (i = 0; i < NSPIN; i++)
+		sys_env_destroy(kids[i]);
+}
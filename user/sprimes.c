@@ -0,0 +1,66 @@
+// Count the primes below LIMIT with one shared-memory thread per CPU.
+// The threads are kernel threads (sthread_create), so they share
+// 'total' and its lock but are scheduled independently on any CPU.
+
+#include <inc/lib.h>
+
+#define NTHREAD	4
+#define LIMIT	200000
+
+static struct smutex lock;
+static int total;
+
+static bool
+isprime(int n)
+{
+	int d;
+
+	for (d = 2; d * d <= n; d++)
+		if (n % d == 0)
+			return 0;
+	return 1;
+}
+
+static void *
+count(void *arg)
+{
+	int id = (int) arg;
+	int n, c = 0;
+
+	// Interleave the candidates so every thread gets a similar mix
+	// of cheap and expensive numbers.
+	for (n = 2 + id; n < LIMIT; n += NTHREAD)
+		if (isprime(n))
+			c++;
+
+	smutex_lock(&lock);
+	total += c;
+	smutex_unlock(&lock);
+
+	cprintf("thread %d on CPU %d: %d primes\n", id, thisenv->env_cpunum, c);
+	return (void *) c;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t tids[NTHREAD];
+	unsigned start;
+	void *ret;
+	int i, r, sum = 0;
+
+	start = sys_time_msec();
+	for (i = 0; i < NTHREAD; i++)
+		if ((r = sthread_create(&tids[i], count, (void *) i)) < 0)
+			panic("sthread_create: %e", r);
+	for (i = 0; i < NTHREAD; i++) {
+		if ((r = sthread_join(tids[i], &ret)) < 0)
+			panic("sthread_join: %e", r);
+		sum += (int) ret;
+	}
+
+	if (sum != total)
+		panic("threads returned %d primes but counted %d", sum, total);
+	cprintf("sprimes: %d primes below %d in %d msec\n",
+		total, LIMIT, sys_time_msec() - start);
+}
@@ -1,15 +1,18 @@
 #include <inc/lib.h>
 
 volatile int counter;
+unsigned int start;
 
 void
 umain(int argc, char **argv)
 {
 	int i, j;
 	int seen;
+	uint64_t cputime;
 	envid_t parent = sys_getenvid();
 
 	// Fork several environments
+	start = sys_time_msec();
 	for (i = 0; i < 20; i++)
 		if (fork() == 0)
 			break;
@@ -23,6 +26,7 @@ umain(int argc, char **argv)
 		asm volatile("pause");
 
 	// Check that one environment doesn't run on two CPUs at once
+	cputime = thisenv->env_cputime;
 	for (i = 0; i < 10; i++) {
 		sys_yield();
 		for (j = 0; j < 10000; j++)
@@ -32,8 +36,14 @@ umain(int argc, char **argv)
 	if (counter != 10*10000)
 		panic("ran on two CPUs at once (counter is %d)", counter);
 
-	// Check that we see environments running on different CPUs
-	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
+	// Each sys_yield above charged us for the CPU time we used
+	if (thisenv->env_cputime <= cputime)
+		panic("no CPU time accounted");
+
+	// Check that we see environments running on different CPUs.
+	// The latest finishing time is the run's completion time.
+	cprintf("[%08x] stresssched on CPU %d, done after %u msec\n",
+		thisenv->env_id, thisenv->env_cpunum, sys_time_msec() - start);
 
 }
 
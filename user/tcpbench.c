@@ -0,0 +1,89 @@
+// Measure bulk TCP throughput in both directions: take one connection,
+// count what the client sends until it shuts down its side, then send
+// back the count and TX_BYTES of data.  The grading script checks both.
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define PORT		7
+#define BUFFSIZE	1024
+#define TX_BYTES	(4 * 1024 * 1024)
+
+static char buffer[BUFFSIZE];
+
+static void
+die(char *m)
+{
+	cprintf("%s\n", m);
+	exit();
+}
+
+// KB/s for n bytes over the msec since start.
+static unsigned int
+rate(unsigned int n, unsigned int start)
+{
+	unsigned int msec = sys_time_msec() - start;
+
+	return (unsigned int) ((uint64_t) n * 1000 / 1024 / (msec ? msec : 1));
+}
+
+static void
+handle_client(int sock)
+{
+	unsigned int start, total, n;
+	int r, i;
+
+	total = 0;
+	start = sys_time_msec();
+	while ((r = read(sock, buffer, BUFFSIZE)) > 0)
+		total += r;
+	if (r < 0)
+		die("Failed to receive bytes from client");
+	cprintf("tcpbench: rx %u bytes, %u KB/s\n", total, rate(total, start));
+
+	n = snprintf(buffer, BUFFSIZE, "%u\n", total);
+	if (write(sock, buffer, n) != n)
+		die("Failed to send count to client");
+
+	for (i = 0; i < BUFFSIZE; i++)
+		buffer[i] = 'a' + i % 26;
+	start = sys_time_msec();
+	for (total = 0; total < TX_BYTES; total += n) {
+		n = MIN(BUFFSIZE, TX_BYTES - total);
+		if (write(sock, buffer, n) != n)
+			die("Failed to send bytes to client");
+	}
+	close(sock);
+	cprintf("tcpbench: tx %u bytes, %u KB/s\n", total, rate(total, start));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int serversock, clientsock;
+	struct sockaddr_in server, client;
+	unsigned int clientlen;
+
+	binaryname = "tcpbench";
+	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		die("Failed to create socket");
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port = htons(PORT);
+	if (bind(serversock, (struct sockaddr *) &server, sizeof(server)) < 0)
+		die("Failed to bind the server socket");
+	if (listen(serversock, 1) < 0)
+		die("Failed to listen on server socket");
+	cprintf("bound\n");
+
+	clientlen = sizeof(client);
+	if ((clientsock = accept(serversock, (struct sockaddr *) &client,
+				 &clientlen)) < 0)
+		die("Failed to accept client connection");
+	handle_client(clientsock);
+	close(serversock);
+	cprintf("tcpbench: done\n");
+}
@@ -0,0 +1,89 @@
+// Test sys_sleep_until, ipc_recv_until and sys_time_nsec.
+
+#include <inc/lib.h>
+
+#define NSLEEPER	4
+
+// Deadlines for the sleepers, relative to a common start time.  Some
+// are far enough out to go through the timer wheel's higher levels.
+static unsigned int delay[NSLEEPER] = { 900, 300, 1500, 100 };
+
+void
+umain(int argc, char **argv)
+{
+	unsigned int start, now;
+	uint64_t ns0, ns1;
+	envid_t parent = thisenv->env_id, who;
+	int i, r, last;
+
+	// Plain sleep: never early, and not much late.
+	start = sys_time_msec();
+	sys_sleep_until(start + 500);
+	now = sys_time_msec();
+	if (now < start + 500 || now > start + 500 + 100)
+		panic("slept from %u to %u, wanted %u", start, now, start + 500);
+	cprintf("testsleep: sleep ok\n");
+
+	// Short sleeps are not rounded up to a scheduler tick, and the
+	// nanosecond clock agrees with the millisecond one.
+	ns0 = sys_time_nsec();
+	start = sys_time_msec();
+	sys_sleep_until(start + 3);
+	ns1 = sys_time_nsec();
+	now = sys_time_msec();
+	if (now < start + 3 || ns1 - ns0 < 2000000 || ns1 - ns0 > 8000000)
+		panic("3 msec sleep took %u msec (%u usec)", now - start,
+		      (uint32_t) ((ns1 - ns0) / 1000));
+	cprintf("testsleep: nsec ok\n");
+
+	// Receive with nobody sending: must time out at the deadline.
+	start = sys_time_msec();
+	r = ipc_recv_until(&who, 0, 0, start + 300);
+	now = sys_time_msec();
+	if (r != -E_TIMEOUT)
+		panic("ipc_recv_until returned %e, wanted timeout", r);
+	if (now < start + 300)
+		panic("ipc_recv_until timed out early, after %u msec",
+		      now - start);
+	cprintf("testsleep: recv timeout ok\n");
+
+	// Receive with a sender: must return the value long before the
+	// deadline, and the cancelled timer must not disturb later waits.
+	start = sys_time_msec();
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		sys_sleep_until(start + 100);
+		ipc_send(parent, 42, 0, 0);
+		return;
+	}
+	r = ipc_recv_until(&who, 0, 0, start + 5000);
+	now = sys_time_msec();
+	if (r != 42 || now - start > 1000)
+		panic("ipc_recv_until returned %e after %u msec", r,
+		      now - start);
+	cprintf("testsleep: recv ok\n");
+
+	// Several sleepers must wake in deadline order.
+	start = sys_time_msec();
+	for (i = 0; i < NSLEEPER; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			sys_sleep_until(start + delay[i]);
+			ipc_send(parent, i, 0, 0);
+			return;
+		}
+	}
+	last = 0;
+	for (i = 0; i < NSLEEPER; i++) {
+		r = ipc_recv_until(&who, 0, 0, start + 5000);
+		if (r < 0)
+			panic("waiting for sleepers: %e", r);
+		if (delay[r] < last)
+			panic("sleeper %d (%u msec) woke after one at %u msec",
+			      r, delay[r], last);
+		last = delay[r];
+	}
+	cprintf("testsleep: wakeup order ok\n");
+}